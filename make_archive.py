@@ -4,17 +4,73 @@ import os
 import subprocess
 import hashlib
 import struct
+import zlib
 
 
 def bin_padding(bin, size):
     size = ((len(bin) -1) // size + 1) * size
     return struct.pack(f"<{size}s", bin)
 
-def do_make_archive():
+# partition header flags; see updater_t in src/mz_update.h
+PARTITION_FLAG_DEFLATE = 1
+PARTITION_FLAG_DELTA = 2
+PARTITION_FLAG_SAME = 4
+
+# the updater inflates with a 4KiB window
+DEFLATE_WBITS = 12
+
+def deflate(bin):
+    c = zlib.compressobj(9, zlib.DEFLATED, -DEFLATE_WBITS)
+    return c.compress(bin) + c.flush()
+
+def inflate(bin):
+    return zlib.decompress(bin, -DEFLATE_WBITS)
+
+def read_archive_images(filename, sector_size):
+    """ returns {label: padded image} of an archive made before """
+    data = open(filename, "rb").read()
+    if not data.startswith(b"MZ5 firmware archive 1."):
+        print(f"{filename} is not an OTA archive.\n")
+        exit(3)
+    images = {}
+    pos = sector_size
+    while pos < len(data):
+        if data[pos:pos+16] != b"-file boundary--":
+            print(f"{filename}: broken partition header.\n")
+            exit(3)
+        label, org_len, arc_len = struct.unpack_from("<8sLL", data, pos + 16)
+        flags, stored_len = struct.unpack_from("<LL", data, pos + 48)
+        label = label.rstrip(b"\0").decode('utf-8')
+        pos += sector_size
+        if flags & (PARTITION_FLAG_DELTA | PARTITION_FLAG_SAME):
+            print(f"{filename}: '{label}' is not a full image; use an archive made without --base.\n")
+            exit(3)
+        if flags & PARTITION_FLAG_DEFLATE:
+            images[label] = inflate(data[pos:pos+stored_len])
+            pos += len(bin_padding(b"\0" * stored_len, sector_size))
+        else:
+            images[label] = data[pos:pos+arc_len]
+            pos += arc_len
+    return images
+
+def make_delta(content, base, sector_size):
+    """ sector map (1 byte per sector; 0 = same as base, 1 = data follows) and changed sectors """
+    sector_map = bytearray()
+    data = bytearray()
+    for i in range(0, len(content), sector_size):
+        sector = content[i:i+sector_size]
+        if i + sector_size <= len(base) and base[i:i+sector_size] == sector:
+            sector_map.append(0)
+        else:
+            sector_map.append(1)
+            data += sector
+    return bytes(sector_map + data), len(data) // sector_size
+
+def do_make_archive(compress = False, base_archive = None, inputs = None, outfn = None):
     pio_env_name = "esp32dev"
     pio_build_dir = f".pio/build/{pio_env_name}"
 
-    files = [
+    files = inputs or [
         ["src/fonts/TakaoPGothicC.ttf", "font"],
         [f"{pio_build_dir}/spiffs.bin", "spiffs"],
         [f"{pio_build_dir}/firmware.bin", "app"] # the firmware must be the last
@@ -23,17 +79,16 @@ def do_make_archive():
     sector_size = 4096
 
     # execute spiffs binary generation (TODO: proper scons execution)
-    res = subprocess.call(f"pio run --target buildfs --environment {pio_env_name}", shell=True)
-    if(res != 0):
-        print("Could not run pio command. Check the pio installation.\n")
-        exit(3)
+    if not inputs:
+        res = subprocess.call(f"pio run --target buildfs --environment {pio_env_name}", shell=True)
+        if(res != 0):
+            print("Could not run pio command. Check the pio installation.\n")
+            exit(3)
 
-    # open the target file
-    outfn = f".pio/build/{pio_env_name}/mz5_firm.bin"
-    out = open(outfn, "wb")
+    # images installed on the device, which delta entries are made against
+    base_images = read_archive_images(base_archive, sector_size) if base_archive else {}
 
-    # write archive header
-    out.write(bin_padding(b"MZ5 firmware archive 1.0\r\n\n\x1a    ", sector_size))
+    entries = []
 
     # iterate into file list
     for file in files:
@@ -52,17 +107,89 @@ def do_make_archive():
         # get hash
         hash_bin = hashlib.md5(content).digest()
 
-        # write archive file header
+        # the same as, or the difference from the installed image
+        flags = 0
+        comp_len = 0
+        base = base_images.get(label)
+        base_hash_bin = b"\0" * 16
+        base_len = 0
+        if base is not None:
+            base_hash_bin = hashlib.md5(base).digest()
+            base_len = len(base)
+            if base == content:
+                print(f"{label}: same as the base")
+                flags = PARTITION_FLAG_SAME
+                content = b""
+            else:
+                delta, changed = make_delta(content, base, sector_size)
+                if changed < content_arc_len // sector_size:
+                    print(f"{label}: {changed} of {content_arc_len // sector_size} sectors changed")
+                    flags = PARTITION_FLAG_DELTA
+                    comp_len = len(delta)
+                    content = delta
+
+        # compress, unless it does not save any sector
+        if compress and content:
+            comp = deflate(content)
+            if len(bin_padding(comp, sector_size)) < len(bin_padding(content, sector_size)):
+                print(f"{label}: {len(content)} -> {len(comp)} bytes")
+                flags |= PARTITION_FLAG_DEFLATE
+                comp_len = len(comp)
+                content = comp
+
         header = (b"-file boundary--" +
             struct.pack("<8sLL", label.encode('utf-8'), content_org_len, content_arc_len) +
-            hash_bin)
+            hash_bin +
+            struct.pack("<LL", flags, comp_len) +
+            base_hash_bin +
+            struct.pack("<L", base_len))
+        entries.append((header, content))
+
+    # open the target file
+    outfn = outfn or f".pio/build/{pio_env_name}/mz5_firm.bin"
+    out = open(outfn, "wb")
+
+    # write archive header
+    # version 1.1 is needed for compressed partitions, and 1.2 for delta
+    # partitions. firmwares older than that can not read them
+    all_flags = 0
+    for header, content in entries:
+        all_flags |= struct.unpack_from("<L", header, 48)[0]
+    version = (b"1.2" if all_flags & (PARTITION_FLAG_DELTA | PARTITION_FLAG_SAME) else
+        b"1.1" if all_flags & PARTITION_FLAG_DEFLATE else b"1.0")
+    out.write(bin_padding(b"MZ5 firmware archive " + version + b"\r\n\n\x1a    ", sector_size))
+
+    for header, content in entries:
+        # write archive file header
         out.write(bin_padding(header, sector_size))
 
         # write content
-        out.write(bin_padding(content, sector_size))
+        if content:
+            out.write(bin_padding(content, sector_size))
 
     # done
     print(F"Made OTA archive at {outfn}\n")
 
 if __name__ == '__main__':
-    do_make_archive()
+    import argparse
+    parser = argparse.ArgumentParser(description="Make OTA archive")
+    parser.add_argument("--compress", action="store_true",
+        help="compress partitions (needs firmware reading archive version 1.1)")
+    parser.add_argument("--base", metavar="ARCHIVE",
+        help="archive installed on the device; partitions are stored as the difference from it "
+            "(needs firmware reading archive version 1.2)")
+    parser.add_argument("--input", metavar="LABEL=FILE", action="append",
+        help="archive the file as the partition of the label, instead of the build output; "
+            "can be given more than once, in the order of the archive ('app' must be the last)")
+    parser.add_argument("--output", metavar="FILE",
+        help="archive file to make (default: .pio/build/esp32dev/mz5_firm.bin)")
+    args = parser.parse_args()
+    inputs = None
+    if args.input:
+        inputs = []
+        for i in args.input:
+            label, sep, filename = i.partition("=")
+            if not sep or not label or not filename:
+                parser.error(f"--input {i}: LABEL=FILE expected")
+            inputs.append([filename, label])
+    do_make_archive(args.compress, args.base, inputs, args.output)
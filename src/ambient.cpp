@@ -49,11 +49,7 @@ static constexpr int16_t DEFAULT_BRIGHTNESS = LED_CURRENT_GAIN_MAX / 2;
 static constexpr int16_t INVALID_AMBIENT = -1;
 static constexpr int16_t AMBIENT_MARGIN = 64;
 
-struct setpoint_t
-{
-    int16_t ambient;
-    int16_t brightness;
-};
+typedef ambient_setpoint_t setpoint_t;
 
 static int compare_setpoint_t(const void *a, const void *b)
 {
@@ -61,7 +57,7 @@ static int compare_setpoint_t(const void *a, const void *b)
 }
 
 
-static constexpr int MAX_SETPOINTS = 16;
+static constexpr int MAX_SETPOINTS = AMBIENT_MAX_SETPOINTS;
 
 static setpoint_t setpoints[MAX_SETPOINTS];
 
@@ -186,34 +182,37 @@ void ambient_dump()
     }
 }
 
+//! schema version of the "ambient" setting; bump when setpoint_t changes
+static constexpr uint16_t AMBIENT_SETTINGS_VERSION = 1;
+
 // write settings to the settings store
 static void write_ambient_settings()
 {
-	// make string vector representing the array
-	string_vector vec;
-	for(int i = 0; i < MAX_SETPOINTS; ++i)
-		vec.push_back(String((int)setpoints[i].ambient) + "," + String((int)setpoints[i].brightness));
+	settings_put(F("ambient"), setpoints, AMBIENT_SETTINGS_VERSION);
+}
 
-	// write
-	settings_write_vector("ambient", vec, SETTINGS_OVERWRITE);
+// check a setpoint read from the settings store
+static bool validate_setpoint(int amb, int bri)
+{
+	return !(amb < INVALID_AMBIENT || amb > AMBIENT_MAX ||
+		bri < 0 || bri > BRIGHTNESS_MAX);
 }
 
-// load settings from the setgins store
-static void read_ambient_settings()
+// read settings of the old format, a string vector of "ambient,brightness"
+static bool read_ambient_settings_vector(setpoint_t (&ar)[MAX_SETPOINTS])
 {
 	string_vector vec;
 	if(!settings_read_vector("ambient", vec))
 	{
 		printf("ambient: ambient settings not found\n");
-		return; // not yet stored
+		return false; // not yet stored
 	}
 	if(vec.size() != MAX_SETPOINTS)
 	{
 		// invalid data
 		printf("ambient: corrupted data: data number mismatch\n");
-		return;
+		return false;
 	}
-	setpoint_t ar[MAX_SETPOINTS];
 	for(int i = 0; i < MAX_SETPOINTS; ++i)
 	{
 		String s = vec[i];
@@ -221,19 +220,48 @@ static void read_ambient_settings()
 		if(2 != sscanf(s.c_str(), "%d,%d", &amb, &bri))
 		{
 			printf("ambient: corrupted data: %s is not parsable\n", s.c_str());
-			return;
+			return false;
 		}
-		if(amb < INVALID_AMBIENT || amb > AMBIENT_MAX ||
-			bri < 0 || bri > BRIGHTNESS_MAX)
+		if(!validate_setpoint(amb, bri))
 		{
 			printf("ambient: corrupted data: %s: value out of range\n", s.c_str());
-			return; // data out of range
+			return false; // data out of range
 		}
 		ar[i] = {(int16_t)amb, (int16_t)bri};
 	}
+	return true;
+}
+
+// load settings from the setgins store
+static void read_ambient_settings()
+{
+	setpoint_t ar[MAX_SETPOINTS];
+	bool migrated = false;
+	if(settings_get(F("ambient"), ar, AMBIENT_SETTINGS_VERSION))
+	{
+		for(auto && n : ar)
+		{
+			if(!validate_setpoint(n.ambient, n.brightness))
+			{
+				printf("ambient: corrupted data: value out of range\n");
+				return;
+			}
+		}
+	}
+	else
+	{
+		// maybe stored by older firmware; convert it to the binary form
+		if(!read_ambient_settings_vector(ar)) return;
+		migrated = true;
+	}
 
 	// all read.
 	memcpy(setpoints, ar, sizeof(ar));
+	if(migrated)
+	{
+		write_ambient_settings();
+		puts("ambient: settings migrated to the binary form");
+	}
 }
 
 
@@ -406,13 +434,41 @@ void sensors_set_contrast_always_max(bool b)
 void sensors_change_current_contrast(int amount)
 {
 	freeze_ambient();
-	int16_t ambient = read_ambient();
-	int index = ambient_to_brightness(ambient);
-	index += amount;
+	sensors_set_current_contrast(ambient_to_brightness(read_ambient()) + amount);
+}
+
+void sensors_set_current_contrast(int index)
+{
+	freeze_ambient();
+	int16_t ambient = read_ambient(); // the same reading while frozen
 	if(index < 0) index = 0;
 	else if(index > LED_CURRENT_GAIN_MAX) index = LED_CURRENT_GAIN_MAX;
 	printf("ambient: New current gain %d at brightness %d\n", index, (int)ambient);
 	ambient_insert_setpoint(ambient, index);
 	ambient_dump();
 	matrix_drive_set_current_gain(index);
-}
\ No newline at end of file
+}
+
+int ambient_get_setpoints(ambient_setpoint_t (&points)[AMBIENT_MAX_SETPOINTS])
+{
+	int n = 0;
+	for(auto && sp : setpoints)
+		if(sp.ambient != INVALID_AMBIENT) points[n++] = sp;
+	return n;
+}
+
+bool ambient_set_setpoints(const ambient_setpoint_t * points, int count)
+{
+	if(count < 1 || count > MAX_SETPOINTS) return false;
+	for(int i = 0; i < count; ++i)
+	{
+		if(points[i].ambient < 0 || points[i].ambient > AMBIENT_MAX ||
+			points[i].brightness < 0 || points[i].brightness > LED_CURRENT_GAIN_MAX)
+			return false;
+	}
+
+	init_setpoints();
+	for(int i = 0; i < count; ++i) _insert_setpoint(points[i]);
+	write_ambient_settings();
+	return true;
+}
@@ -6,3 +6,28 @@ int16_t get_ambient();
 
 void sensors_set_contrast_always_max(bool b);
 void sensors_change_current_contrast(int amount);
+
+/**
+ * set the current gain (0 .. LED_CURRENT_GAIN_MAX) at the current ambient
+ * reading, as a set point of the curve, as the contrast buttons do
+ * */
+void sensors_set_current_contrast(int index);
+
+//! a set point of the ambient-to-brightness curve
+struct ambient_setpoint_t
+{
+    int16_t ambient; //!< 0 .. AMBIENT_MAX
+    int16_t brightness; //!< current gain; 0 .. LED_CURRENT_GAIN_MAX
+};
+
+static constexpr int AMBIENT_MAX_SETPOINTS = 16;
+
+//! get the set points of the curve, in ambient order. returns their count
+int ambient_get_setpoints(ambient_setpoint_t (&points)[AMBIENT_MAX_SETPOINTS]);
+
+/**
+ * replace the curve by the given set points, and save it. points are
+ * inserted in order, so non-monotonic or too close ones are dropped as
+ * by the contrast buttons. returns false if any value is out of range.
+ * */
+bool ambient_set_setpoints(const ambient_setpoint_t * points, int count);
@@ -3,8 +3,12 @@
 #include <esp_partition.h>
 #include <string.h>
 #include <esp_system.h>
+#include <esp_timer.h>
+#include <new>
 #include "frame_buffer.h"
+#include "matrix_drive.h"
 #include "ambient.h"
+#include "bad_apple.h"
 
 static spi_flash_mmap_handle_t mmap_handle = 0; // mmap handle
 static uint32_t start_address_in_flash = 0; // data start address in flash
@@ -49,53 +53,172 @@ static const uint8_t * ensure_access(uint32_t address)
     return mapped_address_head - mapped_start_address_in_data + address;
 }
 
+/*
+    Playback: the decode task decodes frames ahead into a small ring, and
+    the present task shows each frame at its presentation time,
+    start_us + frame number * frame_interval_us, on the monotonic clock.
+    Frames whose time has already passed are skipped by the decoder, or
+    dropped by the presenter. The presenter flips the frame buffer at the
+    beginning of a refresh cycle, so that a frame does not tear.
+*/
+static constexpr int RING_FRAMES = 4; // decoded frames kept ahead
+static constexpr uint32_t DEFAULT_FRAME_INTERVAL_US = 33333; // "BADAPPLE" movies are 30fps
+
+//! a decoded frame in the ring
+struct decoded_frame_t
+{
+    uint32_t number; // frame number since the start of the playback
+    frame_buffer_t::array_t pixels;
+};
+
+static decoded_frame_t * ring; // RING_FRAMES frames
+static QueueHandle_t free_queue; // decoded_frame_t * to decode into
+static QueueHandle_t filled_queue; // decoded_frame_t * to present, in order
+static uint32_t data_start = 12; // movie data offset; after the header
+static uint32_t frame_interval_us = DEFAULT_FRAME_INTERVAL_US;
+static int64_t start_us; // presentation time of the frame 0
+
+// statistics
+static uint32_t decoded_count;
+static uint32_t skipped_count; // not decoded as already late
+static uint32_t presented_count;
+static uint32_t dropped_count; // decoded but too late to present
+static uint32_t late_count; // presented later than a quarter of the interval
+static uint32_t refresh_timeout_count; // flipped without waiting for the refresh cycle
+static uint64_t total_decode_us;
+static uint32_t max_decode_us;
+static uint32_t max_late_us;
+
+/**
+ * decode a frame at the address into out, or just skip it if out is nullptr.
+ * returns the address of the next frame.
+ * */
+static uint32_t decode_frame(uint32_t addr, uint8_t * out)
+{
+    const uint8_t * ptr, *start_ptr;
+    ptr = start_ptr = ensure_access(addr);
+
+    int out_pos = 0;
+    while(out_pos < 64*48)
+    {
+        if(*ptr & 0x80)
+        {
+            // running
+            uint8_t len = *ptr & 0x7f;
+            ++ptr;
+            uint8_t val = *ptr;
+            ++ptr;
+            if(out) memset(out + out_pos, val, len);
+            out_pos += len;
+        }
+        else
+        {
+            // non-running
+            uint8_t len = *ptr;
+            ++ptr;
+            if(out) memcpy(out + out_pos, ptr, len);
+            ptr += len;
+            out_pos += len;
+        }
+    }
+
+    return addr + (ptr - start_ptr);
+}
+
 /**
  * decode thread
  * */
 static void decode_task(void *arg)
 {
+    uint32_t number = 0;
     for(;;)
     {
-        uint32_t addr = 12; // skip signatures
+        uint32_t addr = data_start; // skip signatures
 
         while(addr < movie_size)
         {
-            const uint8_t * ptr, *start_ptr;
-            ptr = start_ptr = ensure_access(addr);
-
-            // expand the buffer
-            uint8_t * exp_buf = (uint8_t*) get_bg_frame_buffer().array();
-            int out_pos = 0;
-            while(out_pos < 64*48)
+            // skip the frame if its time has already passed
+            int64_t due = start_us + (int64_t)number * frame_interval_us;
+            if(esp_timer_get_time() >= due + frame_interval_us)
             {
-                if(*ptr & 0x80)
-                {
-                    // running
-                    uint8_t len = *ptr & 0x7f;
-                    ++ptr;
-                    uint8_t val = *ptr;
-                    ++ptr;
-                    while(len--)
-                        exp_buf[out_pos++] = val;
-                }
-                else
-                {
-                    // non-running
-                    uint8_t len = *ptr;
-                    ++ptr;
-                    while(len--)
-                        exp_buf[out_pos++] = *(ptr++);
-                }
+                addr = decode_frame(addr, nullptr);
+                ++ number;
+                ++ skipped_count;
+                continue;
             }
 
-            addr += ptr - start_ptr;
+            decoded_frame_t * frame;
+            xQueueReceive(free_queue, &frame, portMAX_DELAY);
+
+            int64_t t0 = esp_timer_get_time();
+            addr = decode_frame(addr, &frame->pixels[0][0]);
+            uint32_t us = (uint32_t)(esp_timer_get_time() - t0);
+            total_decode_us += us;
+            if(us > max_decode_us) max_decode_us = us;
+            ++ decoded_count;
 
-            frame_buffer_flip();
-            delay(33); // TODO: precious timing control
+            frame->number = number ++;
+            xQueueSend(filled_queue, &frame, portMAX_DELAY);
         }
     }
 }
 
+/**
+ * present thread
+ * */
+static void present_task(void *arg)
+{
+    for(;;)
+    {
+        decoded_frame_t * frame;
+        xQueueReceive(filled_queue, &frame, portMAX_DELAY);
+
+        int64_t due = start_us + (int64_t)frame->number * frame_interval_us;
+        int64_t now = esp_timer_get_time();
+        if(now >= due + frame_interval_us)
+        {
+            // the next frame is already due; drop this one
+            ++ dropped_count;
+            xQueueSend(free_queue, &frame, portMAX_DELAY);
+            continue;
+        }
+        if(now < due) vTaskDelay(pdMS_TO_TICKS((uint32_t)(due - now) / 1000));
+
+        memcpy(get_bg_frame_buffer().array(), frame->pixels, sizeof(frame->pixels));
+        xQueueSend(free_queue, &frame, portMAX_DELAY);
+
+        if(!matrix_drive_wait_refresh()) ++ refresh_timeout_count;
+        frame_buffer_flip();
+
+        now = esp_timer_get_time();
+        uint32_t late = now > due ? (uint32_t)(now - due) : 0;
+        if(late > max_late_us) max_late_us = late;
+        if(late > frame_interval_us / 4) ++ late_count;
+        ++ presented_count;
+    }
+}
+
+void bad_apple_dump_stats()
+{
+    if(!ring)
+    {
+        printf("No movie is playing.\n");
+        return;
+    }
+    printf("--- video playback ---\n");
+    printf("Frame interval    : %lu us\n", (unsigned long)frame_interval_us);
+    printf("Decoded           : %lu\n", (unsigned long)decoded_count);
+    printf("Skipped by decoder: %lu\n", (unsigned long)skipped_count);
+    printf("Presented         : %lu\n", (unsigned long)presented_count);
+    printf("Dropped           : %lu\n", (unsigned long)dropped_count);
+    printf("Late              : %lu\n", (unsigned long)late_count);
+    printf("Refresh timeouts  : %lu\n", (unsigned long)refresh_timeout_count);
+    if(decoded_count)
+        printf("Avg decode time   : %lu us\n", (unsigned long)(total_decode_us / decoded_count));
+    printf("Max decode time   : %lu us\n", (unsigned long)max_decode_us);
+    printf("Max lateness      : %lu us\n", (unsigned long)max_late_us);
+}
+
 
 static bool running = false;
 bool bad_apple()
@@ -113,14 +236,29 @@ bool bad_apple()
         return false;
     }
 
-    // read signature
+    // read signature. "BADAPPLE" movies have no frame interval and are 30fps;
+    // "MZVIDEO\0" movies have the frame interval in us after the size.
     struct sig_t
     {
         uint8_t sig[8];
         uint32_t size;
+        uint32_t frame_interval_us;
     } sig;
     if(ESP_OK != spi_flash_read(part->address, &sig, sizeof(sig))) return false;
-    if(memcmp(sig.sig, "BADAPPLE\0", 8)) return false; // singnature mismatch
+    if(!memcmp(sig.sig, "BADAPPLE", 8))
+    {
+        data_start = 12;
+        frame_interval_us = DEFAULT_FRAME_INTERVAL_US;
+    }
+    else if(!memcmp(sig.sig, "MZVIDEO\0", 8) && sig.frame_interval_us > 0)
+    {
+        data_start = 16;
+        frame_interval_us = sig.frame_interval_us;
+    }
+    else
+    {
+        return false; // singnature mismatch
+    }
 
     printf("\n\nBAD APPLE: signature found at 0x%lx, length %d\n", (long)part->address, sig.size);
     start_address_in_flash = part->address;
@@ -143,10 +281,31 @@ bool bad_apple()
     }
     printf("BAD APPLE: flash sanity check passed\n");
 
-    // spawn decode thread
+    // allocate the ring
+    ring = new (std::nothrow) decoded_frame_t[RING_FRAMES];
+    free_queue = xQueueCreate(RING_FRAMES, sizeof(decoded_frame_t *));
+    filled_queue = xQueueCreate(RING_FRAMES, sizeof(decoded_frame_t *));
+    if(!ring || !free_queue || !filled_queue)
+    {
+        printf("BAD APPLE: no memory for the frame ring\n");
+        delete [] ring, ring = nullptr;
+        if(free_queue) vQueueDelete(free_queue), free_queue = nullptr;
+        if(filled_queue) vQueueDelete(filled_queue), filled_queue = nullptr;
+        return false;
+    }
+    for(int i = 0; i < RING_FRAMES; ++i)
+    {
+        decoded_frame_t * frame = &ring[i];
+        xQueueSend(free_queue, &frame, 0);
+    }
+
+    // spawn decode and present threads.
+    // give the decoder time to fill the ring before the first frame.
     running = true;
+    start_us = esp_timer_get_time() + (int64_t)frame_interval_us * RING_FRAMES;
 
     xTaskCreatePinnedToCore(decode_task, "BadApple decoder", 4096, NULL, 1, NULL, 0);
+    xTaskCreatePinnedToCore(present_task, "BadApple present", 2048, NULL, 2, NULL, 0);
 
 	sensors_set_contrast_always_max(false);
 
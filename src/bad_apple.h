@@ -1,3 +1,6 @@
 #pragma once
 
-bool bad_apple();
\ No newline at end of file
+bool bad_apple();
+
+//! show decode time, dropped and late frames of the playback
+void bad_apple_dump_stats();
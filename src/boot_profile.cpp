@@ -0,0 +1,131 @@
+#include <Arduino.h>
+#include <esp_attr.h>
+#include <esp_timer.h>
+#include <rom/rtc.h>
+#include "boot_profile.h"
+
+static constexpr uint32_t BOOT_PROFILE_MAGIC = 0x504f4242; // "BBOP"
+static constexpr int MAX_PROFILES = 4; //!< boot profiles kept
+static constexpr int MAX_STAGES = 24; //!< stages per boot profile
+static constexpr size_t MAX_STAGE_NAME = 15; //!< stage name length in bytes
+
+struct boot_stage_t
+{
+	char name[MAX_STAGE_NAME + 1];
+	uint32_t end_us; //!< time since boot at the end of the stage
+	uint32_t heap; //!< free heap at the end of the stage
+};
+
+struct boot_profile_t
+{
+	uint32_t boot_count; //!< boot sequence number
+	uint32_t start_us; //!< time since boot at boot_profile_begin()
+	uint32_t start_heap; //!< free heap at boot_profile_begin()
+	uint8_t reset_reason; //!< rtc_get_reset_reason() of CPU 0
+	uint8_t stage_count;
+	bool complete; //!< whether boot_profile_end() was reached
+	boot_stage_t stages[MAX_STAGES];
+};
+
+struct boot_profile_history_t
+{
+	uint32_t magic; //!< BOOT_PROFILE_MAGIC if the content is valid
+	uint32_t boot_count; //!< boots profiled so far
+	uint32_t next; //!< profiles[] index for the next boot
+	boot_profile_t profiles[MAX_PROFILES];
+};
+
+// not initialized on reset; contains garbage after power-on, hence the magic
+static RTC_NOINIT_ATTR boot_profile_history_t history;
+static boot_profile_t * current;
+
+static bool history_valid()
+{
+	if(history.magic != BOOT_PROFILE_MAGIC || history.next >= MAX_PROFILES) return false;
+	for(auto && p : history.profiles) if(p.stage_count > MAX_STAGES) return false;
+	return true;
+}
+
+void boot_profile_begin()
+{
+	uint32_t now = (uint32_t)esp_timer_get_time();
+	if(!history_valid())
+	{
+		memset(&history, 0, sizeof(history));
+		history.magic = BOOT_PROFILE_MAGIC;
+	}
+
+	current = &history.profiles[history.next];
+	history.next = (history.next + 1) % MAX_PROFILES;
+	memset(current, 0, sizeof(*current));
+	current->boot_count = ++ history.boot_count;
+	current->start_us = now;
+	current->start_heap = ESP.getFreeHeap();
+	current->reset_reason = (uint8_t)rtc_get_reset_reason(0);
+}
+
+void boot_profile_mark(const char * name)
+{
+	uint32_t now = (uint32_t)esp_timer_get_time();
+	if(!current || current->stage_count >= MAX_STAGES) return;
+	boot_stage_t & stage = current->stages[current->stage_count];
+	strncpy(stage.name, name, MAX_STAGE_NAME);
+	stage.name[MAX_STAGE_NAME] = 0;
+	stage.end_us = now;
+	stage.heap = ESP.getFreeHeap();
+	++ current->stage_count;
+}
+
+void boot_profile_end()
+{
+	if(!current) return;
+	current->complete = true;
+	uint32_t end_us = current->stage_count ?
+		current->stages[current->stage_count - 1].end_us : current->start_us;
+	printf("Boot: setup() took %lu ms; %lu ms since reset.\n",
+		(unsigned long)((end_us - current->start_us) / 1000),
+		(unsigned long)(end_us / 1000));
+}
+
+static void dump_profile(const boot_profile_t & p)
+{
+	printf("--- boot #%lu (reset reason %d)%s%s ---\n", (unsigned long)p.boot_count,
+		(int)p.reset_reason, &p == current ? " current" : "",
+		p.complete ? "" : " INCOMPLETE");
+	printf("Stage            Start(ms) Time(ms)  Heap before   Heap after\n");
+	uint32_t start = p.start_us;
+	uint32_t heap = p.start_heap;
+	for(int i = 0; i < p.stage_count; ++i)
+	{
+		const boot_stage_t & s = p.stages[i];
+		printf("%-16s %9lu %8lu %12lu %12lu\n", s.name,
+			(unsigned long)(start / 1000), (unsigned long)((s.end_us - start) / 1000),
+			(unsigned long)heap, (unsigned long)s.heap);
+		start = s.end_us;
+		heap = s.heap;
+	}
+	printf("Total            %9lu %8lu\n", (unsigned long)(p.start_us / 1000),
+		(unsigned long)((start - p.start_us) / 1000));
+}
+
+void boot_profile_dump()
+{
+	if(!history_valid())
+	{
+		puts("No boot profiles.");
+		return;
+	}
+	for(int i = 1; i <= MAX_PROFILES; ++i)
+	{
+		const boot_profile_t & p =
+			history.profiles[(history.next + MAX_PROFILES - i) % MAX_PROFILES];
+		if(p.boot_count == 0) continue; // unused
+		dump_profile(p);
+	}
+}
+
+void boot_profile_clear()
+{
+	if(!history_valid()) return;
+	for(auto && p : history.profiles) if(&p != current) memset(&p, 0, sizeof(p));
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <Arduino.h>
+
+/**
+ * Boot-time profiler.
+ * setup() calls boot_profile_mark() at the end of each stage. Each mark
+ * records the time since boot and the free heap. The last few boot
+ * profiles are kept in RTC memory, which survives software resets and
+ * crashes, so slow or failed boots can be inspected after the fact.
+ * */
+
+//! start a new boot profile; call first in setup()
+void boot_profile_begin();
+
+//! mark the end of a boot stage. name is copied, and truncated if too long
+void boot_profile_mark(const char * name);
+
+//! finish the current boot profile and print a summary
+void boot_profile_end();
+
+//! print the kept boot profiles, newest first
+void boot_profile_dump();
+
+//! forget all kept boot profiles except the current one
+void boot_profile_clear();
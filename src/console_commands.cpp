@@ -12,6 +12,12 @@
 #include "buttons.h"
 #include "mz_update.h"
 #include "mz_version.h"
+#include "ui.h"
+#include "boot_profile.h"
+#include "fonts/font_ft.h"
+#include "web_server.h"
+#include "remote_fb.h"
+#include "bad_apple.h"
 
 
 // wait for maximum 20ms, checking key type, returning
@@ -270,11 +276,11 @@ namespace cmd_wifi_scan
                 }
                 max = num->ival[0];
             }
-            run_in_main_thread([] () -> int {
-                // initiate scan
+            // initiate scan; the queue keeps order, so the polls below
+            // see it started
+            run_in_main_thread_async([] () {
                 WiFi.scanNetworks(true, hidden->count > 0, active->count > 0);
-                return 0;
-            }) ;
+            });
             // scan is running ... wait it done
             printf("Scanning ");
             fflush(stdout);
@@ -353,10 +359,7 @@ namespace cmd_wifi_wps
             // start WPS
             printf("WPS initializing...\n");
 
-            run_in_main_thread([] () -> int {
-                wifi_wps();
-                return 0;
-            }) ;       
+            run_in_main_thread_async([] () { wifi_wps(); });
 
             printf("WPS started. Type any key to stop WPS now.\n");
 
@@ -369,7 +372,7 @@ namespace cmd_wifi_wps
                 if(any_key_pressed() != -1)
                 {
                     printf("Stopping WPS.\n");
-                    run_in_main_thread([] () -> int { wifi_stop_wps(); return 0; });
+                    run_in_main_thread_async([] () { wifi_stop_wps(); });
                     goto quit;
                 }
             }
@@ -525,9 +528,12 @@ namespace cmd_rmt
                     if(any_key_pressed() != -1) break;
                     if(!run_in_main_thread([] () -> int { return rmt_in_progress(); })) break;
                 }
-                rmt_result_t result = (rmt_result_t)run_in_main_thread([] () -> int {
-                    return rmt_get_status();
-                });
+                // take the status and clear rmt state, waiting once for both
+                main_thread_future_t futures[2];
+                futures[0] = post_to_main_thread([] () -> int { return rmt_get_status(); });
+                futures[1] = post_to_main_thread([] () -> int { rmt_clear(); return 0; });
+                wait_main_thread_futures(futures, 2);
+                rmt_result_t result = (rmt_result_t)futures[0].get();
                 switch(result)
                 {
                 case rmt_notfound:
@@ -539,11 +545,6 @@ namespace cmd_rmt
                 default:
                     break; // unknown state ...?
                 }
-                // clear rmt state
-                run_in_main_thread([] () -> int {
-                    rmt_clear();
-                    return 0;
-                });
                 return 0;
             }
             else
@@ -825,6 +826,256 @@ namespace cmd_ver
     };
 }
 
+namespace cmd_queue_stat
+{
+    struct arg_lit *help = arg_litn(NULL, "help", 0, 1, "Display help and exit");
+    struct arg_end *end = arg_end(5);
+    void * argtable[] = { help, end };
+
+    class _cmd : public cmd_base_t
+    {
+
+    public:
+        _cmd() : cmd_base_t("queue-stat", "Show main thread queue statistics", argtable) {}
+
+    private:
+        int func(int argc, char **argv)
+        {
+            return run_in_main_thread([] () -> int {
+                dump_main_thread_queue_stats();
+                return 0;
+            }) ;       
+        }
+    };
+}
+
+namespace cmd_web_stat
+{
+    struct arg_lit *help = arg_litn(NULL, "help", 0, 1, "Display help and exit");
+    struct arg_end *end = arg_end(5);
+    void * argtable[] = { help, end };
+
+    class _cmd : public cmd_base_t
+    {
+
+    public:
+        _cmd() : cmd_base_t("web-stat", "Show web server request and frame stream statistics", argtable) {}
+
+    private:
+        int func(int argc, char **argv)
+        {
+            // the counters belong to the web server task; just read them
+            web_server_dump_stats();
+            return 0;
+        }
+    };
+}
+
+namespace cmd_video_stat
+{
+    struct arg_lit *help = arg_litn(NULL, "help", 0, 1, "Display help and exit");
+    struct arg_end *end = arg_end(5);
+    void * argtable[] = { help, end };
+
+    class _cmd : public cmd_base_t
+    {
+
+    public:
+        _cmd() : cmd_base_t("video-stat", "Show movie playback statistics", argtable) {}
+
+    private:
+        int func(int argc, char **argv)
+        {
+            // the counters belong to the playback tasks; just read them
+            bad_apple_dump_stats();
+            return 0;
+        }
+    };
+}
+
+namespace cmd_remote_fb
+{
+    struct arg_lit *help = arg_litn(NULL, "help", 0, 1, "Display help and exit");
+    struct arg_int *port = arg_intn("p", "port", "<port>", 0, 1, "UDP port to receive frames at; 0 disables");
+    struct arg_end *end = arg_end(5);
+    void * argtable[] = { help, port, end };
+
+    class _cmd : public cmd_base_t
+    {
+
+    public:
+        _cmd() : cmd_base_t("remote-fb", "Set remote frame buffer port and show its statistics", argtable) {}
+
+    private:
+        int func(int argc, char **argv)
+        {
+            if(port->count && (port->ival[0] < 0 || port->ival[0] > 65535))
+            {
+                printf("Invalid port number.\n");
+                return 1;
+            }
+            return run_in_main_thread([] () -> int {
+                if(port->count) remote_fb_set_port(port->ival[0]);
+                remote_fb_dump_stats();
+                return 0;
+            }) ;
+        }
+    };
+}
+
+namespace cmd_settings_stat
+{
+    struct arg_lit *help = arg_litn(NULL, "help", 0, 1, "Display help and exit");
+    struct arg_lit *flush = arg_litn(NULL, "flush", 0, 1, "Write pending settings to the flash now");
+    struct arg_end *end = arg_end(5);
+    void * argtable[] = { help, flush, end };
+
+    class _cmd : public cmd_base_t
+    {
+
+    public:
+        _cmd() : cmd_base_t("settings-stat", "Show settings cache statistics", argtable) {}
+
+    private:
+        int func(int argc, char **argv)
+        {
+            return run_in_main_thread([] () -> int {
+                if(flush->count) settings_flush();
+                settings_dump_stats();
+                return 0;
+            }) ;       
+        }
+    };
+}
+
+namespace cmd_boot_prof
+{
+    struct arg_lit *help = arg_litn(NULL, "help", 0, 1, "Display help and exit");
+    struct arg_lit *clear = arg_litn(NULL, "clear", 0, 1, "Forget boot profiles of previous boots");
+    struct arg_end *end = arg_end(5);
+    void * argtable[] = { help, clear, end };
+
+    class _cmd : public cmd_base_t
+    {
+
+    public:
+        _cmd() : cmd_base_t("boot-prof", "Show time and heap of each boot stage of last boots", argtable) {}
+
+    private:
+        int func(int argc, char **argv)
+        {
+            return run_in_main_thread([] () -> int {
+                if(clear->count) boot_profile_clear();
+                boot_profile_dump();
+                return 0;
+            }) ;       
+        }
+    };
+}
+
+namespace cmd_font_stat
+{
+    struct arg_lit *help = arg_litn(NULL, "help", 0, 1, "Display help and exit");
+    struct arg_lit *unload = arg_litn(NULL, "unload", 0, 1, "Unload the TrueType font; it is loaded again on demand");
+    struct arg_end *end = arg_end(5);
+    void * argtable[] = { help, unload, end };
+
+    class _cmd : public cmd_base_t
+    {
+
+    public:
+        _cmd() : cmd_base_t("font-stat", "Show TrueType font load statistics", argtable) {}
+
+    private:
+        int func(int argc, char **argv)
+        {
+            return run_in_main_thread([] () -> int {
+                if(unload->count) font_ft.unload();
+                font_ft.dump_stats();
+                return 0;
+            }) ;       
+        }
+    };
+}
+
+namespace cmd_ui
+{
+    struct arg_lit *help, *stat, *reset_stat, *dump;
+    struct arg_str *push;
+    struct arg_end *end;
+    void * argtable[] = {
+            help =       arg_litn(nullptr, "help", 0, 1, "Display help and exit"),
+            stat =       arg_litn("s", "stat", 0, 1, "Show per-screen draw time statistics"),
+            reset_stat = arg_litn(nullptr, "reset-stat", 0, 1, "Reset draw time statistics"),
+            push =       arg_strn("p", "push", "<keys>", 0, 1,
+                            "Push buttons in sequence; w/a/s/d = up/left/down/right, o = OK, b = CANCEL"),
+            dump =       arg_litn("d", "dump", 0, 1, "Dump the displayed frame as PGM (after each push if --push is given)"),
+            end =        arg_end(5)
+            };
+
+    static uint32_t key_to_button(char ch)
+    {
+        switch(ch)
+        {
+        case 'W': case 'w': return BUTTON_UP;
+        case 'A': case 'a': return BUTTON_LEFT;
+        case 'S': case 's': return BUTTON_DOWN;
+        case 'D': case 'd': return BUTTON_RIGHT;
+        case 'O': case 'o': return BUTTON_OK;
+        case 'B': case 'b': return BUTTON_CANCEL;
+        default:            return 0;
+        }
+    }
+
+    static void dump_frame()
+    {
+        run_in_main_thread([] () -> int {
+            ui_dump_frame();
+            return 0;
+        });
+    }
+
+    class _cmd : public cmd_base_t
+    {
+
+    public:
+        _cmd() : cmd_base_t("ui", "Drive the UI and show its frames and draw statistics", argtable) {}
+
+    private:
+        int func(int argc, char **argv)
+        {
+            if(push->count)
+            {
+                for(const char *p = push->sval[0]; *p; ++p)
+                {
+                    uint32_t button = key_to_button(*p);
+                    if(!button)
+                    {
+                        printf("Unknown key '%c'\n", *p);
+                        return 1;
+                    }
+                    run_in_main_thread([button] () -> int {
+                        button_push(button);
+                        return 0;
+                    });
+                    vTaskDelay(100); // wait for the button to be processed and the screen redrawn
+                    if(dump->count) dump_frame();
+                }
+            }
+            else if(dump->count)
+            {
+                dump_frame();
+            }
+
+            return run_in_main_thread([] () -> int {
+                if(stat->count) ui_dump_draw_stats();
+                if(reset_stat->count) ui_reset_draw_stats();
+                return 0;
+            }) ;
+        }
+    };
+}
+
 namespace cmd_t
 {
     struct arg_lit *help = arg_litn(NULL, "help", 0, 1, "Display help and exit");
@@ -865,5 +1116,13 @@ void init_console_commands()
     static cmd_reboot::_cmd reboot_cmd;
     static cmd_keys::_cmd keys_cmd;
     static cmd_ver::_cmd ver_cmd;
+    static cmd_queue_stat::_cmd queue_stat_cmd;
+    static cmd_web_stat::_cmd web_stat_cmd;
+    static cmd_video_stat::_cmd video_stat_cmd;
+    static cmd_remote_fb::_cmd remote_fb_cmd;
+    static cmd_settings_stat::_cmd settings_stat_cmd;
+    static cmd_boot_prof::_cmd boot_prof_cmd;
+    static cmd_font_stat::_cmd font_stat_cmd;
+    static cmd_ui::_cmd ui_cmd;
     static cmd_t::_cmd t_cmd;
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include "font_ft.h"
 #include <esp_partition.h>
+#include <esp_timer.h>
 #include "mz_update.h"
 #include "frame_buffer.h"
 #include "freetype/internal/ftdebug.h"
@@ -92,25 +93,36 @@ public:
 
 
 
-ft_font_t::ft_font_t() : face(nullptr), cache(new metrics_cache_t)
+ft_font_t::ft_font_t() : face(nullptr), map_handle(0), cache(new metrics_cache_t),
+    load_failed(false), load_count(0), unload_count(0), last_load_us(0),
+    last_load_heap(0), load_start_us(0), first_glyph_us(0)
 {
 }
 
 
-void ft_font_t::begin()
+bool ft_font_t::begin() const
 {
-    unsigned long fre = xPortGetFreeHeapSize();
-    printf("Memory free area before FreeType font load: %ld\n", fre);
+    if(face) return true;
+    if(load_failed) return false;
+
+    long fre = xPortGetFreeHeapSize();
+    load_start_us = (uint32_t)esp_timer_get_time();
+    first_glyph_us = 0;
 //    FT_Trace_Enable();
 //    setenv("FT2_DEBUG", "any:7", 1);
-    _begin();
+    bool ok = _begin();
 //    unsetenv("FT2_DEBUG");
 //    FT_Trace_Disable();
-    unsigned long fre_a = xPortGetFreeHeapSize();
-    printf("Memory free area after FreeType font load: %ld, %ld bytes consumed.\n", fre_a, fre - fre_a);;
+    last_load_us = (uint32_t)esp_timer_get_time() - load_start_us;
+    last_load_heap = fre - (long)xPortGetFreeHeapSize();
+    if(!ok) { load_failed = true; return false; }
+    ++ load_count;
+    printf("font_ft: loaded in %lu ms, %ld bytes of heap consumed.\n",
+        (unsigned long)(last_load_us / 1000), (long)last_load_heap);
+    return true;
 }
 
-void ft_font_t::_begin()
+bool ft_font_t::_begin() const
 {
     init_freetype();
 
@@ -123,18 +135,17 @@ void ft_font_t::_begin()
     {
         // TODO: panic
         printf("font_ft: No TrueType font partitions found!\n");
-        return;
+        return false;
     }
 
     printf("TrueType font partition start: 0x%08x, mapped to: ", part->address);
 
     const void *map_ptr;
-    spi_flash_mmap_handle_t map_handle;
     if(ESP_OK != esp_partition_mmap(part, 0, part->size, SPI_FLASH_MMAP_DATA, &map_ptr, &map_handle))
     {
         // TODO: panic
         printf("font_ft: TrueType mmap() failed.\n");
-        return;
+        return false;
     }
 
     const uint8_t * ptr = static_cast<const uint8_t *>(map_ptr);
@@ -149,7 +160,8 @@ void ft_font_t::_begin()
     {
         printf("TrueType open failed: %d\n", (int)error);
         spi_flash_munmap(map_handle);
-        return;
+        face = nullptr;
+        return false;
     }
 
     printf("font_ft: TrueType font file opened successfully:");
@@ -165,19 +177,64 @@ void ft_font_t::_begin()
         FT_Done_Face(face);
         spi_flash_munmap(map_handle);
         face = nullptr;
+        return false;
     }
 
     cache->set_face(face);
+    return true;
+}
+
+void ft_font_t::unload()
+{
+    if(face)
+    {
+        FT_Done_Face(face);
+        face = nullptr;
+        spi_flash_munmap(map_handle);
+        ++ unload_count;
+    }
+    load_failed = false; // may be retried
+
+    // the metrics cache refers the face; drop it with the cached metrics
+    delete cache;
+    cache = new metrics_cache_t;
+
+    // the library itself holds memory too
+    if(library)
+    {
+        FT_Done_FreeType(library);
+        library = nullptr;
+    }
+}
+
+void ft_font_t::dump_stats() const
+{
+    printf("--- FreeType font ---\n");
+    printf("State                : %s\n",
+        face ? "loaded" : load_failed ? "load failed" : "not loaded");
+    printf("Loads / unloads      : %lu / %lu\n",
+        (unsigned long)load_count, (unsigned long)unload_count);
+    if(!load_count && !load_failed) return;
+    printf("Last load started at : %lu ms since boot\n", (unsigned long)(load_start_us / 1000));
+    printf("Last load took       : %lu ms, %ld bytes of heap\n",
+        (unsigned long)(last_load_us / 1000), (long)last_load_heap);
+    if(first_glyph_us)
+        printf("Time to first glyph  : %lu ms from the load start, at %lu ms since boot\n",
+            (unsigned long)((first_glyph_us - load_start_us) / 1000),
+            (unsigned long)(first_glyph_us / 1000));
+    else
+        printf("Time to first glyph  : no glyph drawn yet\n");
 }
 
 ft_font_t::~ft_font_t() // will not called
 {
-    FT_Done_Face(face); // will not called
+    if(face) FT_Done_Face(face); // will not called
 }
 
 
 ft_font_t::metrics_t ft_font_t::get_metrics(int32_t chr) const
 {
+    if(!begin()) return {0, 0, false};
     auto metrics = cache->get_metrics(chr);
     return {metrics.adv_x, metrics.adv_y, metrics.exist};
 }
@@ -185,6 +242,7 @@ ft_font_t::metrics_t ft_font_t::get_metrics(int32_t chr) const
 
 void ft_font_t::put(int32_t chr, int level, int x, int y, frame_buffer_t & fb) const
 {
+    if(!begin()) return;
 	auto metrics = cache->get_metrics(chr);
     if(!metrics.exist) return; // non-existent character
 
@@ -218,6 +276,7 @@ void ft_font_t::put(int32_t chr, int level, int x, int y, frame_buffer_t & fb) c
    
     error = FT_Render_Glyph(face->glyph, FT_RENDER_FLAGS);
     if(error) return; // error exist on rendering glyph
+    if(!first_glyph_us) first_glyph_us = (uint32_t)esp_timer_get_time();
 
     int pitch = face->glyph->bitmap.pitch;
 
@@ -247,9 +306,3 @@ void ft_font_t::put(int32_t chr, int level, int x, int y, frame_buffer_t & fb) c
 
 }
 
-
-
-void init_font_ft()
-{
-    font_ft.begin();
-}
\ No newline at end of file
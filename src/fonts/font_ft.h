@@ -3,36 +3,64 @@
 #include "fonts/font.h"
 #include <ft2build.h>
 #include FT_FREETYPE_H
+#include <esp_spi_flash.h>
 
 class frame_buffer_t;
 class metrics_cache_t;
 
+/**
+ * TrueType font in the font partition, rendered by FreeType.
+ * The partition is mapped and the face is opened lazily, on the first
+ * get_metrics() or put(), and can be released again by unload().
+ * */
 class ft_font_t : public font_base_t
 {
     static constexpr int GLYPH_HEIGHT_PX = 15; // pixel height. At this point this is fixed value.
 
-    FT_Face face;
-    metrics_cache_t *cache;
+    // these are loaded on demand by const accessors, hence mutable
+    mutable FT_Face face;
+    mutable spi_flash_mmap_handle_t map_handle;
+    mutable metrics_cache_t *cache;
+    mutable bool load_failed; //!< loading failed; not retried until unload()
+
+    // statistics
+    mutable uint32_t load_count; //!< times the face was loaded
+    mutable uint32_t unload_count; //!< times the face was unloaded
+    mutable uint32_t last_load_us; //!< time taken by the last load
+    mutable int32_t last_load_heap; //!< heap consumed by the last load
+    mutable uint32_t load_start_us; //!< time since boot when the last load started
+    mutable uint32_t first_glyph_us; //!< time since boot of the first glyph after the last load; 0 = none yet
+
 public:
     ft_font_t();
     ~ft_font_t();
 
-    void begin();
+    //! load the face now, if not yet. returns whether the face is available
+    bool begin() const;
+
+    //! release the face, the partition mapping and the caches
+    void unload();
 
 	virtual metrics_t get_metrics(int32_t chr) const;
 
 	virtual void put(int32_t chr, int level, int x, int y, frame_buffer_t & fb) const;
 
-	bool get_available() const { return face != nullptr; }
+	//! whether the font can be used. this loads the face if not yet, as
+	//! drawing with it would; a failed load is not retried until unload()
+	bool get_available() const { return begin(); }
+
+	//! whether the face is loaded at this moment
+	bool get_loaded() const { return face != nullptr; }
 
 	virtual int get_height() const { return GLYPH_HEIGHT_PX; }
 
+	//! show load/unload and time-to-first-glyph statistics
+	void dump_stats() const;
+
 private:
-   void _begin();
+   bool _begin() const;
 
 };
 
 extern ft_font_t font_ft;
 
-void init_font_ft();
-
@@ -215,6 +215,23 @@ void frame_buffer_t::fill(int x, int y, int w, int h, int level)
 	}
 }
 
+void frame_buffer_t::composite(const frame_buffer_t & src)
+{
+	// layers are mostly transparent, so check four pixels at once
+	// and skip them quickly if all are zero.
+	const uint32_t *s = reinterpret_cast<const uint32_t *>(&src.buffer[0][0]);
+	uint32_t *d = reinterpret_cast<uint32_t *>(&buffer[0][0]);
+	for(int i = 0; i < LED_MAX_LOGICAL_ROW * LED_MAX_LOGICAL_COL / 4; ++i)
+	{
+		uint32_t w = s[i];
+		if(!w) continue;
+		const uint8_t *sb = reinterpret_cast<const uint8_t *>(s + i);
+		uint8_t *db = reinterpret_cast<uint8_t *>(d + i);
+		for(int j = 0; j < 4; ++j)
+			if(sb[j]) db[j] = sb[j];
+	}
+}
+
 void frame_buffer_flip()
 {
 	if(current_frame_buffer == &buffer_two)
@@ -12,7 +12,7 @@ public:
 	typedef unsigned char array_t[LED_MAX_LOGICAL_ROW][LED_MAX_LOGICAL_COL];
 
 protected:
-	array_t buffer;
+	alignas(4) array_t buffer; // aligned for word-wise access in composite()
 
 public:
 	//! returns width
@@ -66,6 +66,9 @@ public:
 
 	//! fill specified region with specified value
 	void fill(int x, int y, int w, int h, int level);
+
+	//! Overlay another frame buffer; zero pixels in src are transparent
+	void composite(const frame_buffer_t & src);
 };
 
 
@@ -0,0 +1,169 @@
+#include <Arduino.h>
+#include <atomic>
+#include <new>
+#include "threadsync.h"
+#include "frame_stream.h"
+
+static constexpr size_t FRAME_SIZE = sizeof(frame_buffer_t::array_t);
+static constexpr size_t FRAME_HEADER_SIZE = 8;
+static constexpr uint32_t FRAME_STREAM_STACK_SIZE = 4096;
+
+//! state of a stream; allocated for each client
+struct frame_stream_t
+{
+	WiFiClient client;
+	uint32_t interval_ms; //!< minimum interval between frames
+	uint16_t seq; //!< sequence number of the next message
+	frame_buffer_t::array_t prev; //!< last frame sent
+	frame_buffer_t::array_t cur; //!< frame being sent
+	uint8_t out[FRAME_HEADER_SIZE + FRAME_SIZE * 2]; //!< message; delta may exceed raw
+};
+
+static std::atomic<int> active_streams(0);
+
+// statistics
+static uint32_t stream_count; //!< streams started
+static uint32_t rejected_count; //!< streams rejected
+static uint32_t frames_sent;
+static uint32_t delta_frames_sent;
+static uint32_t unchanged_count; //!< frames not sent as unchanged
+static uint64_t stream_bytes_sent;
+
+void frame_snapshot(frame_buffer_t::array_t & dst)
+{
+	// the frame buffers are flipped by the main thread; copy there
+	run_in_main_thread([&dst] () -> int {
+		memcpy(dst, get_current_frame_buffer().array(), sizeof(dst));
+		return 0;
+	});
+}
+
+//! run-length encode XOR of cur and prev into out. returns the encoded size
+static size_t encode_delta(const uint8_t * cur, const uint8_t * prev, uint8_t * out)
+{
+	uint8_t * p = out;
+	size_t i = 0;
+	while(i < FRAME_SIZE)
+	{
+		uint8_t v = cur[i] ^ prev[i];
+		size_t n = 1;
+		while(i + n < FRAME_SIZE && n < 255 && (uint8_t)(cur[i + n] ^ prev[i + n]) == v) ++ n;
+		*p++ = (uint8_t)n;
+		*p++ = v;
+		i += n;
+	}
+	return p - out;
+}
+
+//! make the message of the current frame in s->out. returns its size
+static size_t encode_frame(frame_stream_t * s, bool first)
+{
+	const uint8_t * cur = &s->cur[0][0];
+	uint8_t * payload = s->out + FRAME_HEADER_SIZE;
+	uint8_t type = FRAME_RAW;
+	size_t len = FRAME_SIZE;
+	if(!first)
+	{
+		len = encode_delta(cur, &s->prev[0][0], payload);
+		if(len < FRAME_SIZE) type = FRAME_DELTA;
+	}
+	if(type == FRAME_RAW)
+	{
+		len = FRAME_SIZE;
+		memcpy(payload, cur, FRAME_SIZE);
+	}
+
+	uint8_t * h = s->out;
+	h[0] = 'F';
+	h[1] = type;
+	h[2] = LED_MAX_LOGICAL_COL;
+	h[3] = LED_MAX_LOGICAL_ROW;
+	h[4] = (uint8_t)s->seq;
+	h[5] = (uint8_t)(s->seq >> 8);
+	h[6] = (uint8_t)len;
+	h[7] = (uint8_t)(len >> 8);
+	++ s->seq;
+	if(type == FRAME_DELTA) ++ delta_frames_sent;
+	return FRAME_HEADER_SIZE + len;
+}
+
+static void frame_stream_task(void * arg)
+{
+	frame_stream_t * s = static_cast<frame_stream_t *>(arg);
+	s->client.print(F("HTTP/1.1 200 OK\r\n"
+		"Content-Type: application/octet-stream\r\n"
+		"Cache-Control: no-cache\r\n"
+		"Connection: close\r\n\r\n"));
+
+	bool first = true;
+	TickType_t last_wake = xTaskGetTickCount();
+	while(s->client.connected())
+	{
+		frame_snapshot(s->cur);
+		if(first || memcmp(s->cur, s->prev, FRAME_SIZE))
+		{
+			size_t len = encode_frame(s, first);
+			if(s->client.write(s->out, len) != len) break; // client has gone
+			memcpy(s->prev, s->cur, FRAME_SIZE);
+			first = false;
+			++ frames_sent;
+			stream_bytes_sent += len;
+		}
+		else
+		{
+			++ unchanged_count;
+		}
+		vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(s->interval_ms));
+	}
+
+	s->client.stop();
+	delete s;
+	-- active_streams;
+	vTaskDelete(nullptr);
+}
+
+bool frame_stream_begin(WiFiClient & client, int rate)
+{
+	if(++ active_streams > FRAME_STREAM_MAX_CLIENTS)
+	{
+		-- active_streams;
+		++ rejected_count;
+		return false;
+	}
+
+	frame_stream_t * s = new (std::nothrow) frame_stream_t;
+	if(!s)
+	{
+		-- active_streams;
+		++ rejected_count;
+		return false;
+	}
+	if(rate < 1) rate = 1;
+	if(rate > FRAME_STREAM_MAX_RATE) rate = FRAME_STREAM_MAX_RATE;
+	s->client = client;
+	s->interval_ms = 1000 / rate;
+	s->seq = 0;
+
+	if(pdPASS != xTaskCreateUniversal(frame_stream_task, "frame_stream", FRAME_STREAM_STACK_SIZE,
+		s, 1, nullptr, CONFIG_ARDUINO_RUNNING_CORE))
+	{
+		delete s;
+		-- active_streams;
+		++ rejected_count;
+		return false;
+	}
+	++ stream_count;
+	return true;
+}
+
+void frame_stream_dump_stats()
+{
+	printf("--- frame stream ---\n");
+	printf("Active streams : %d\n", active_streams.load());
+	printf("Streams        : %lu\n", (unsigned long)stream_count);
+	printf("Rejected       : %lu\n", (unsigned long)rejected_count);
+	printf("Frames sent    : %lu (delta: %lu)\n", (unsigned long)frames_sent,
+		(unsigned long)delta_frames_sent);
+	printf("Unchanged      : %lu\n", (unsigned long)unchanged_count);
+	printf("Bytes sent     : %llu\n", (unsigned long long)stream_bytes_sent);
+}
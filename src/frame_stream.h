@@ -0,0 +1,52 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFiClient.h>
+#include "frame_buffer.h"
+
+/**
+ * Remote monitoring of the display.
+ *
+ * frame_snapshot() copies the frame currently on the display.
+ * frame_stream_begin() takes over an HTTP client and streams frames to it
+ * from its own task, only when the frame has changed and at most at the
+ * given rate. The frame is copied on the main thread between UI steps,
+ * so the stream does not disturb the refresh ISR or the UI timing.
+ *
+ * The response body is a sequence of messages; each consists of an
+ * 8-byte header followed by the payload:
+ *
+ *   u8  'F'
+ *   u8  type; FRAME_RAW or FRAME_DELTA
+ *   u8  width
+ *   u8  height
+ *   u16 sequence number, little endian; incremented by each message
+ *   u16 payload length in bytes, little endian
+ *
+ * FRAME_RAW payload is width * height levels, row by row.
+ * FRAME_DELTA payload is (count, value) byte pairs: the run-length encoded
+ * XOR of the levels with the previous frame. The first frame of a stream
+ * is always FRAME_RAW.
+ * */
+
+static constexpr uint8_t FRAME_RAW = 0;
+static constexpr uint8_t FRAME_DELTA = 1;
+
+static constexpr int FRAME_STREAM_DEFAULT_RATE = 5; //!< frames per second, by default
+static constexpr int FRAME_STREAM_MAX_RATE = 25; //!< maximum frames per second
+static constexpr int FRAME_STREAM_MAX_CLIENTS = 2; //!< maximum streams at once
+
+//! copy the frame on the display. may be called from any thread
+void frame_snapshot(frame_buffer_t::array_t & dst);
+
+/**
+ * start streaming frames to the client, at most rate frames per second.
+ * the stream task writes the HTTP response header by itself, and closes
+ * the connection when the client has gone. returns false if too many
+ * streams are running or resources are not available; the caller should
+ * respond to the client then.
+ * */
+bool frame_stream_begin(WiFiClient & client, int rate);
+
+//! show stream statistics
+void frame_stream_dump_stats();
@@ -1,6 +1,7 @@
 #include <Arduino.h>
 #include <driver/rmt.h>
 #include "ir_rmt.h"
+#include "settings.h"
 
 #define RMT_RX_PIN 36
 #define RMT_TX_PIN 12
@@ -11,7 +12,7 @@
 #define RMT_FILTER_THRESH 50
 #define RMT_FILTER_TIMEOUT 65000 // some remote controller needs longer timeout like this
 
-const char rmt_save_prefix[] = "/settings/rmt/";
+const char rmt_save_prefix[] = "rmt/"; // settings key prefix
 
 
 
@@ -154,11 +155,8 @@ void rmt_wait()
 
 void rmt_save(const String & filename)
 {
-    // TODO: check available conf space 
     if(result != rmt_done) return; // nothing to save
-    FILE * f = fopen((rmt_save_prefix + filename).c_str(), "wb");
-    fwrite(items, sizeof(items[0]), item_count, f); // TODO: error handling
-    fclose(f);
+    settings_write(rmt_save_prefix + filename, items, sizeof(items[0]) * item_count); // TODO: error handling
     rmt_clear();
 }
 
@@ -205,15 +203,20 @@ void rmt_start_send(const String & filename)
 {
     if(result != rmt_idle) return; // other rmt function is runnnig
 
-    // open the file and read content
-    FILE *f = fopen((rmt_save_prefix + filename).c_str(), "rb");
-    if(!f)
+    // read content
+    String key = rmt_save_prefix + filename;
+    int size = settings_get_size(key);
+    if(size < 0)
     {
         result = rmt_notfound;
         return;
     }
-    size_t n = fread(items, sizeof(items[0]), RAW_BUF_LENGTH, f);
-    fclose(f);
+    if(size > (int)sizeof(items) || !settings_read(key, items, size))
+    {
+        result = rmt_broken;
+        return;
+    }
+    size_t n = size / sizeof(items[0]);
 
     // check the last item has "0" duration
     if(n == 0) return; // nothing to send
@@ -0,0 +1,102 @@
+#include <Arduino.h>
+#include "json_writer.h"
+
+void json_writer_t::flush()
+{
+	if(pos) out.write(reinterpret_cast<const uint8_t *>(buf), pos);
+	pos = 0;
+}
+
+void json_writer_t::begin_item()
+{
+	if(after_key)
+	{
+		after_key = false; // the value of a member
+		return;
+	}
+	if(depth > 0 && depth <= MAX_DEPTH)
+	{
+		uint32_t bit = 1u << (depth - 1);
+		if(has_items & bit) put(',');
+		has_items |= bit;
+	}
+}
+
+void json_writer_t::begin_container(char c)
+{
+	begin_item();
+	put(c);
+	++ depth;
+	if(depth <= MAX_DEPTH) has_items &= ~(1u << (depth - 1));
+}
+
+void json_writer_t::end_container(char c)
+{
+	put(c);
+	if(depth > 0) -- depth;
+}
+
+void json_writer_t::put_string(const char * s)
+{
+	static const char hex[] = "0123456789abcdef";
+	put('"');
+	for(; *s; ++s)
+	{
+		char c = *s;
+		switch(c)
+		{
+		case '"':  put("\\\""); break;
+		case '\\': put("\\\\"); break;
+		case '\n': put("\\n"); break;
+		case '\r': put("\\r"); break;
+		case '\t': put("\\t"); break;
+		default:
+			if((unsigned char)c < 0x20)
+			{
+				// other control characters
+				put("\\u00");
+				put(hex[c >> 4]);
+				put(hex[c & 15]);
+			}
+			else
+			{
+				put(c); // including UTF-8 sequences as is
+			}
+		}
+	}
+	put('"');
+}
+
+void json_writer_t::key(const char * k)
+{
+	begin_item();
+	put_string(k);
+	put(':');
+	after_key = true;
+}
+
+void json_writer_t::value(const char * s)
+{
+	begin_item();
+	put_string(s);
+}
+
+void json_writer_t::value(long v)
+{
+	begin_item();
+	char num[24];
+	snprintf(num, sizeof(num), "%ld", v);
+	put(num);
+}
+
+void json_writer_t::value(bool v)
+{
+	begin_item();
+	put(v ? "true" : "false");
+}
+
+void json_writer_t::null_value()
+{
+	begin_item();
+	put("null");
+}
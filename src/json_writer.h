@@ -0,0 +1,59 @@
+#pragma once
+
+#include <Arduino.h>
+
+/**
+ * Streaming JSON writer.
+ * Tokens are written into a small fixed buffer and passed to the Print
+ * when it fills up, so a document of any size is written without heap
+ * allocation. Commas between members and elements are put automatically.
+ * The writer does not check the document structure; begin and end calls
+ * must be paired, and key() must precede each value in an object.
+ * */
+class json_writer_t
+{
+public:
+	static constexpr size_t BUFFER_SIZE = 256;
+	static constexpr int MAX_DEPTH = 32; //!< maximum nesting level
+
+private:
+	Print & out;
+	char buf[BUFFER_SIZE];
+	size_t pos = 0;
+	int depth = 0;
+	uint32_t has_items = 0; //!< bit n is set when level n has an item already
+	bool after_key = false; //!< whether a key has just been written
+
+	void put(char c) { if(pos == BUFFER_SIZE) flush(); buf[pos++] = c; }
+	void put(const char * s) { while(*s) put(*s++); }
+	void put_string(const char * s);
+	void begin_item(); //!< put a comma if needed
+	void begin_container(char c);
+	void end_container(char c);
+
+public:
+	json_writer_t(Print & _out) : out(_out) {}
+	~json_writer_t() { flush(); }
+
+	void begin_object() { begin_container('{'); }
+	void end_object() { end_container('}'); }
+	void begin_array() { begin_container('['); }
+	void end_array() { end_container(']'); }
+
+	//! write a member name in an object
+	void key(const char * k);
+
+	void value(const char * s);
+	void value(const String & s) { value(s.c_str()); }
+	void value(int v) { value((long)v); }
+	void value(long v);
+	void value(bool v);
+	void null_value();
+
+	//! write a member of an object
+	template <typename T>
+	void member(const char * k, const T & v) { key(k); value(v); }
+
+	//! pass the buffered text to the Print
+	void flush();
+};
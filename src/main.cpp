@@ -16,12 +16,67 @@
 #include "ui.h"
 #include "mz_version.h"
 #include "pendulum.h"
-#include "fonts/font_ft.h"
+#include "boot_profile.h"
+#include "remote_fb.h"
 
 #define MY_CONFIG_ARDUINO_LOOP_STACK_SIZE 16384U
 extern TaskHandle_t loopTaskHandle; // defined in main.cpp of Arduino core
 extern void loopTask(void *pvParameters); // defined in main.cpp of Arduino core 
 
+// Fast boot: stages which do not depend on the LED hardware run in their
+// own tasks while the main thread waits for the LED drivers, and the
+// clock face is shown before the web server is set up.
+// Build with -DMZ_FAST_BOOT=0 to run all stages one by one.
+#ifndef MZ_FAST_BOOT
+#define MZ_FAST_BOOT 1
+#endif
+
+#if MZ_FAST_BOOT
+#include <freertos/event_groups.h>
+
+static EventGroupHandle_t boot_events;
+static constexpr EventBits_t BOOT_FS_READY    = 1 << 0; //!< main SPIFFS mounted
+static constexpr EventBits_t BOOT_RADIO_READY = 1 << 1; //!< WiFi radio started
+
+//! a boot stage run in its own task
+struct boot_task_t
+{
+  const char * name;
+  void (*func)();
+  EventBits_t depends; //!< bits to wait for before running
+  EventBits_t done; //!< bit to set after running
+};
+
+static const boot_task_t boot_tasks[] = {
+  { "boot_fs",    init_fs,          0, BOOT_FS_READY },
+  { "boot_radio", wifi_early_setup, 0, BOOT_RADIO_READY },
+};
+
+static void boot_task(void * arg)
+{
+  const boot_task_t * t = static_cast<const boot_task_t *>(arg);
+  if(t->depends) xEventGroupWaitBits(boot_events, t->depends, pdFALSE, pdTRUE, portMAX_DELAY);
+  t->func();
+  xEventGroupSetBits(boot_events, t->done);
+  vTaskDelete(nullptr);
+}
+
+static void start_boot_tasks()
+{
+  boot_events = xEventGroupCreate();
+  for(auto && t : boot_tasks)
+    xTaskCreateUniversal(boot_task, t.name, 8192, const_cast<boot_task_t *>(&t),
+      1, nullptr, CONFIG_ARDUINO_RUNNING_CORE);
+}
+
+//! wait for boot tasks; the wait is recorded in the boot profile
+static void wait_boot_tasks(EventBits_t bits, const char * stage_name)
+{
+  xEventGroupWaitBits(boot_events, bits, pdFALSE, pdTRUE, portMAX_DELAY);
+  boot_profile_mark(stage_name);
+}
+#endif
+
 void setup() {
   // AARRRRRRRRRRGGGGHHHHHHHHHHHHHHHHHHHHHHH!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
   // I have no idea about properly increase the arduino user task's stack size.
@@ -43,18 +98,34 @@ void setup() {
   }
 
   // put your setup code here, to run once:
+  boot_profile_begin();
+#if MZ_FAST_BOOT
+  start_boot_tasks();
+#endif
   status_led_early_setup();
   matrix_drive_early_setup(); // blank all leds
+  boot_profile_mark("early_setup");
 
+#if !MZ_FAST_BOOT
   delay(1000);
+  boot_profile_mark("early_delay");
+#endif
 
   init_console(); // this also initializes the serial output and stdio
   printf("\n\nGreetings. This is MZ5 firmware.\n");
   printf("%s\n", version_get_info_string().c_str());
   show_ota_status();
+  boot_profile_mark("console");
   status_led_setup();
+  boot_profile_mark("status_led");
   matrix_drive_setup();
+  boot_profile_mark("matrix_drive");
+#if MZ_FAST_BOOT
+  wait_boot_tasks(BOOT_FS_READY, "wait_fs");
+#else
   init_fs();
+  boot_profile_mark("fs");
+#endif
 
   // before init_settings, check cancel buttion be pressed over 1sec
   delay(100); // wait for matrix row drive cycles several times
@@ -79,6 +150,7 @@ void setup() {
     }
     puts("");
   }
+  boot_profile_mark("buttons");
 
   // or, if /spiffs/.clear exist, clear all settings
   if(FILE *f = fopen(CLEAR_SETTINGS_INDICATOR_FILE, "r"))
@@ -92,16 +164,42 @@ void setup() {
 
 
   init_settings();
+  boot_profile_mark("settings");
+#if MZ_FAST_BOOT
+  wait_boot_tasks(BOOT_RADIO_READY, "wait_radio");
+#endif
   wifi_setup();
+  boot_profile_mark("wifi_setup");
   init_calendar(); // sntp initialization needs to be located after network stack initialization
+  boot_profile_mark("calendar");
   init_i2c();
   init_bme280();
+  boot_profile_mark("i2c_bme280");
   init_ambient();
-  init_font_ft();
+  boot_profile_mark("ambient");
+  // the FreeType font is not loaded here, but on the first glyph drawn
+#if MZ_FAST_BOOT
+  // show the clock face first
+  ui_setup();
+  boot_profile_mark("ui");
+  web_server_setup();
+  boot_profile_mark("web_server");
+#else
   web_server_setup();
+  boot_profile_mark("web_server");
   ui_setup();
+  boot_profile_mark("ui");
+#endif
+  remote_fb_setup();
+  boot_profile_mark("remote_fb");
   begin_console();
   wifi_start();
+  boot_profile_mark("wifi_start");
+  boot_profile_end();
+#if MZ_FAST_BOOT
+  vEventGroupDelete(boot_events);
+  boot_events = nullptr;
+#endif
 }
 
 void loop() {
@@ -112,7 +210,6 @@ void loop() {
   status_led_loop();
   poll_ambient();
   poll_bme280();
-  web_server_handle_client();
   poll_pendulum();
   ui_process();
 }
\ No newline at end of file
@@ -645,6 +645,19 @@ static void IRAM_ATTR scan_button()
 }
 
 
+static TaskHandle_t volatile refresh_waiter = nullptr; //!< task in matrix_drive_wait_refresh()
+
+// wake the task waiting for the refresh cycle to begin
+static void IRAM_ATTR notify_refresh()
+{
+	TaskHandle_t waiter = refresh_waiter;
+	if(!waiter) return;
+	refresh_waiter = nullptr;
+	BaseType_t woken = pdFALSE;
+	vTaskNotifyGiveFromISR(waiter, &woken);
+	if(woken) portYIELD_FROM_ISR();
+}
+
 // interrupt routine invoked by DMA eof signal
 static void IRAM_ATTR matrix_drive_fill_buffer()
 {
@@ -659,7 +672,7 @@ static void IRAM_ATTR matrix_drive_fill_buffer()
 		dmaDesc[3].owner = 1;
 		build_second_half();
 		++r;
-		if(r >= 24) r = 0;
+		if(r >= 24) { r = 0; notify_refresh(); }
 	}
 }
 
@@ -682,6 +695,15 @@ void matrix_drive_loop() {
 	/* nothing */
 }
 
+bool matrix_drive_wait_refresh()
+{
+	ulTaskNotifyTake(pdTRUE, 0); // clear a notification left by an earlier timeout
+	refresh_waiter = xTaskGetCurrentTaskHandle();
+	bool ok = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(20)) != 0;
+	refresh_waiter = nullptr;
+	return ok;
+}
+
 
 //static void refresh_task(void* arg);
 
@@ -6,6 +6,9 @@ extern uint8_t matrix_button_scan_bits; //!< holds currently pushed button bit-m
 void matrix_drive_early_setup(); // first initialization to blank all leds
 void matrix_drive_setup();
 void matrix_drive_loop();
+//! wait until the refresh of the next frame begins, so that flipping the frame
+//! buffer just after this does not tear. returns false on timeout
+bool matrix_drive_wait_refresh();
 #define LED_CURRENT_GAIN_MAX 103 // current gain value maximum
 void matrix_drive_set_current_gain(int gain);
 int matrix_drive_get_current_gain();
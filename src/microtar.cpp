@@ -29,7 +29,8 @@
 
 #include "microtar.h"
 
-extern FS SPIFFS; // main FS
+#include <unordered_map>
+#include "spiffs_fs.h" // main FS
 
 typedef struct {
   char name[100];
@@ -79,13 +80,15 @@ static int twrite(mtar_t *tar, const void *data, unsigned size) {
 
 
 static int write_null_bytes(mtar_t *tar, int n) {
-  int i, err;
-  char nul = '\0';
-  for (i = 0; i < n; i++) {
-    err = twrite(tar, &nul, 1);
+  static const char nul[64] = { 0 };
+  int one, err;
+  while (n > 0) {
+    one = n < (int)sizeof(nul) ? n : (int)sizeof(nul);
+    err = twrite(tar, nul, one);
     if (err) {
       return err;
     }
+    n -= one;
   }
   return MTAR_ESUCCESS;
 }
@@ -119,6 +122,11 @@ static int raw_to_header(mtar_header_t *h, const mtar_raw_header_t *rh) {
 }
 
 
+int mtar_parse_header(const void *raw, mtar_header_t *h) {
+  return raw_to_header(h, (const mtar_raw_header_t*) raw);
+}
+
+
 static int header_to_raw(mtar_raw_header_t *rh, const mtar_header_t *h) {
   unsigned chksum;
 
@@ -128,7 +136,7 @@ static int header_to_raw(mtar_raw_header_t *rh, const mtar_header_t *h) {
   sprintf(rh->owner, "%o", h->owner);
   sprintf(rh->size, "%o", h->size);
   sprintf(rh->mtime, "%o", h->mtime);
-  rh->type = h->type ? h->type : MTAR_TREG;
+  rh->type = h->type ? h->type : (unsigned) MTAR_TREG;
   strcpy(rh->name, h->name);
   strcpy(rh->linkname, h->linkname);
 
@@ -158,23 +166,199 @@ const char* mtar_strerror(int err) {
 #endif
 
 
-static int file_write(mtar_t *tar, const void *data, unsigned size) {
-  unsigned res = tar->stream.write(reinterpret_cast<const uint8_t *>(data), size);
-  return (res == size) ? MTAR_ESUCCESS : MTAR_EWRITEFAIL;
+/*
+ * Output buffering, shared by streams and files. Writes are gathered into
+ * blocks of MTAR_BLOCK_SIZE bytes. Archives are written sequentially from
+ * the start, so the blocks are aligned to the archive.
+ */
+static int flush_output(mtar_t *tar) {
+  unsigned n = tar->io_buf_pos;
+  tar->io_buf_pos = 0;
+  if (!n) {
+    return MTAR_ESUCCESS;
+  }
+  if ((tar->io ? tar->io->write(tar->io_buf, n) : tar->stream.write(tar->io_buf, n)) != n) {
+    return MTAR_EWRITEFAIL;
+  }
+  tar->io_pos += n;
+  return MTAR_ESUCCESS;
 }
 
+static int buffered_write(mtar_t *tar, const void *data, unsigned size) {
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+  while (size) {
+    unsigned one = MTAR_BLOCK_SIZE - tar->io_buf_pos;
+    if (one > size) one = size;
+    memcpy(tar->io_buf + tar->io_buf_pos, p, one);
+    tar->io_buf_pos += one;
+    p += one;
+    size -= one;
+    if (tar->io_buf_pos == MTAR_BLOCK_SIZE) {
+      int err = flush_output(tar);
+      if (err) {
+        return err;
+      }
+    }
+  }
+  return MTAR_ESUCCESS;
+}
+
+static void free_index(mtar_t *tar);
+
+
+/*
+ * File functions. Reads are served from a cached MTAR_BLOCK_SIZE block
+ * aligned to the file, so header reads and the seeks around them do not
+ * reach the filesystem each time.
+ */
 static int file_read(mtar_t *tar, void *data, unsigned size) {
-  unsigned res = tar->stream.read(reinterpret_cast<uint8_t*>(data), size);
-  return (res == size) ? MTAR_ESUCCESS : MTAR_EREADFAIL;
+  unsigned char *p = reinterpret_cast<unsigned char *>(data);
+  unsigned pos = tar->pos;
+  while (size) {
+    if (pos < tar->io_buf_pos || pos >= tar->io_buf_pos + tar->io_buf_len) {
+      /* Load the block containing the position */
+      unsigned block = pos - pos % MTAR_BLOCK_SIZE;
+      tar->io_buf_len = 0;
+      if (!tar->stream.seek(block)) {
+        return MTAR_ESEEKFAIL;
+      }
+      tar->io_buf_pos = block;
+      tar->io_buf_len = tar->stream.read(tar->io_buf, MTAR_BLOCK_SIZE);
+      if (pos >= block + tar->io_buf_len) {
+        return MTAR_EREADFAIL;
+      }
+    }
+    unsigned offset = pos - tar->io_buf_pos;
+    unsigned one = tar->io_buf_len - offset;
+    if (one > size) one = size;
+    memcpy(p, tar->io_buf + offset, one);
+    p += one;
+    pos += one;
+    size -= one;
+  }
+  return MTAR_ESUCCESS;
 }
 
 static int file_seek(mtar_t *tar, unsigned offset) {
-  bool res = tar->stream.seek(offset);
-  return res ? MTAR_ESUCCESS : MTAR_ESEEKFAIL;
+  /* Reads locate the block by themselves */
+  if (!tar->write) {
+    return MTAR_ESUCCESS;
+  }
+  int err = flush_output(tar);
+  if (err) {
+    return err;
+  }
+  return tar->stream.seek(offset) ? MTAR_ESUCCESS : MTAR_ESEEKFAIL;
 }
 
 static int file_close(mtar_t *tar) {
+  int err = MTAR_ESUCCESS;
+  if (tar->write) {
+    err = flush_output(tar);
+  }
+  free(tar->io_buf);
+  tar->io_buf = NULL;
+  free_index(tar);
   tar->stream.close();
+  return err;
+}
+
+
+/*
+ * Stream functions. The stream cannot seek; seeking only moves the logical
+ * position. Reads skip forward as needed, and the last header read is kept
+ * so that microtar can read it again after seeking back to it.
+ */
+#define IO_NO_HEADER ((unsigned)-1)
+
+static int stream_read(mtar_t *tar, void *data, unsigned size) {
+  const unsigned hsize = sizeof(mtar_raw_header_t);
+  unsigned pos = tar->pos;
+
+  /* Read again from the last header */
+  if (tar->io_buf_pos != IO_NO_HEADER && pos >= tar->io_buf_pos &&
+      pos + size <= tar->io_buf_pos + hsize) {
+    memcpy(data, tar->io_buf + (pos - tar->io_buf_pos), size);
+    return MTAR_ESUCCESS;
+  }
+  if (pos < tar->io_pos) {
+    return MTAR_ESEEKFAIL;
+  }
+
+  /* Skip to the position */
+  while (tar->io_pos < pos) {
+    char skip[64];
+    unsigned one = pos - tar->io_pos;
+    if (one > sizeof(skip)) one = sizeof(skip);
+    if (tar->io->readBytes(skip, one) != one) {
+      return MTAR_EREADFAIL;
+    }
+    tar->io_pos += one;
+  }
+
+  unsigned res = tar->io->readBytes(reinterpret_cast<char *>(data), size);
+  tar->io_pos += res;
+  if (res != size) {
+    return MTAR_EREADFAIL;
+  }
+  if (size == hsize && pos == tar->last_header) {
+    /* A header read by mtar_read_header() */
+    memcpy(tar->io_buf, data, hsize);
+    tar->io_buf_pos = pos;
+  }
+  return MTAR_ESUCCESS;
+}
+
+static int stream_seek(mtar_t *tar, unsigned offset) {
+  /* Streams are read and written in order only */
+  (void) tar;
+  (void) offset;
+  return MTAR_ESUCCESS;
+}
+
+static int stream_close(mtar_t *tar) {
+  int err = MTAR_ESUCCESS;
+  if (tar->write) {
+    err = flush_output(tar);
+  }
+  free(tar->io_buf);
+  tar->io_buf = NULL;
+  return err;
+}
+
+
+int mtar_open_stream(mtar_t *tar, Stream *stream, const char *mode) {
+  int err;
+  mtar_header_t h;
+
+  /* Init tar struct and functions; not memset, for the File in it */
+  *tar = mtar_t();
+  tar->write = buffered_write;
+  tar->read = stream_read;
+  tar->seek = stream_seek;
+  tar->close = stream_close;
+  tar->io = stream;
+
+  if (*mode == 'r') {
+    tar->write = NULL;
+    tar->io_buf_pos = IO_NO_HEADER;
+    tar->io_buf = (unsigned char *)malloc(sizeof(mtar_raw_header_t));
+  } else {
+    tar->read = NULL;
+    tar->io_buf = (unsigned char *)malloc(MTAR_BLOCK_SIZE);
+  }
+  if (!tar->io_buf) {
+    return MTAR_EOPENFAIL;
+  }
+
+  /* Read first header to check it is valid if mode is `r` */
+  if (*mode == 'r') {
+    err = mtar_read_header(tar, &h);
+    if (err != MTAR_ESUCCESS) {
+      mtar_close(tar);
+      return err;
+    }
+  }
   return MTAR_ESUCCESS;
 }
 
@@ -183,12 +367,17 @@ int mtar_open(mtar_t *tar, const char *filename, const char *mode) {
   int err;
   mtar_header_t h;
 
-  /* Init tar struct and functions */
-  memset(tar, 0, sizeof(*tar));
-  tar->write = file_write;
+  /* Init tar struct and functions; not memset, for the File in it */
+  *tar = mtar_t();
+  tar->write = buffered_write;
   tar->read = file_read;
   tar->seek = file_seek;
   tar->close = file_close;
+  if (*mode == 'r') {
+    tar->write = NULL;
+  } else {
+    tar->read = NULL;
+  }
 
 #if 0
   /* Assure mode is always binary */
@@ -197,10 +386,15 @@ int mtar_open(mtar_t *tar, const char *filename, const char *mode) {
   if ( strchr(mode, 'a') ) mode = "ab";
 #endif
   /* Open file */
-  tar->stream = SPIFFS.open(filename, mode);
+  tar->stream = FS.open(filename, mode);
   if (!tar->stream) {
     return MTAR_EOPENFAIL;
   }
+  tar->io_buf = (unsigned char *)malloc(MTAR_BLOCK_SIZE);
+  if (!tar->io_buf) {
+    tar->stream.close();
+    return MTAR_EOPENFAIL;
+  }
   /* Read first header to check it is valid if mode is `r` */
   if (*mode == 'r') {
     err = mtar_read_header(tar, &h);
@@ -248,9 +442,74 @@ int mtar_next(mtar_t *tar) {
 }
 
 
+/*
+ * Header index of a seekable archive: name hash -> header position.
+ * Built by the first mtar_find(), and dropped when the archive is written.
+ */
+typedef std::unordered_multimap<uint32_t, unsigned> mtar_index_t;
+
+static uint32_t name_hash(const char *name) {
+  /* FNV-1a */
+  uint32_t hash = 2166136261u;
+  while (*name) {
+    hash = (hash ^ (unsigned char)*name++) * 16777619u;
+  }
+  return hash;
+}
+
+static void free_index(mtar_t *tar) {
+  delete static_cast<mtar_index_t *>(tar->index);
+  tar->index = NULL;
+}
+
+static int build_index(mtar_t *tar) {
+  int err;
+  mtar_header_t header;
+  mtar_index_t *index = new mtar_index_t;
+  err = mtar_rewind(tar);
+  while (!err && (err = mtar_read_header(tar, &header)) == MTAR_ESUCCESS) {
+    index->insert(std::make_pair(name_hash(header.name), tar->pos));
+    err = mtar_next(tar);
+  }
+  if (err != MTAR_ENULLRECORD) {
+    delete index;
+    return err;
+  }
+  tar->index = index;
+  return MTAR_ESUCCESS;
+}
+
 int mtar_find(mtar_t *tar, const char *name, mtar_header_t *h) {
   int err;
   mtar_header_t header;
+  /* Look up the index if the archive can seek */
+  if (tar->read == file_read) {
+    if (!tar->index) {
+      err = build_index(tar);
+      if (err) {
+        return err;
+      }
+    }
+    mtar_index_t *index = static_cast<mtar_index_t *>(tar->index);
+    auto range = index->equal_range(name_hash(name));
+    for (auto it = range.first; it != range.second; ++it) {
+      tar->remaining_data = 0;
+      err = mtar_seek(tar, it->second);
+      if (!err) {
+        err = mtar_read_header(tar, &header);
+      }
+      if (err) {
+        return err;
+      }
+      if ( !strcmp(header.name, name) ) {
+        if (h) {
+          *h = header;
+        }
+        return MTAR_ESUCCESS;
+      }
+    }
+    return MTAR_ENOTFOUND;
+  }
   /* Start at beginning */
   err = mtar_rewind(tar);
   if (err) {
@@ -331,6 +590,7 @@ int mtar_write_header(mtar_t *tar, const mtar_header_t *h) {
   mtar_raw_header_t rh;
   /* Build raw header and write */
   header_to_raw(&rh, h);
+  free_index(tar);
   tar->remaining_data = h->size;
   return twrite(tar, &rh, sizeof(rh));
 }
@@ -14,6 +14,12 @@
 
 #define MTAR_VERSION "0.1.0"
 
+/* Size of a header record; file data are padded to a multiple of it */
+#define MTAR_RECORD_SIZE 512
+
+/* I/O block size; a multiple of the record size */
+#define MTAR_BLOCK_SIZE 4096
+
 enum {
   MTAR_ESUCCESS     =  0,
   MTAR_EFAILURE     = -1,
@@ -55,6 +61,12 @@ struct mtar_t {
   int (*seek)(mtar_t *tar, unsigned pos);
   int (*close)(mtar_t *tar);
   File stream;
+  Stream *io;            /* stream given to mtar_open_stream(); NULL for files */
+  unsigned io_pos;       /* bytes actually read from / written to io */
+  unsigned char *io_buf; /* stream read: last header read; otherwise an I/O block */
+  unsigned io_buf_pos;   /* read: archive position of io_buf; write: bytes pending */
+  unsigned io_buf_len;   /* file read: valid bytes in io_buf */
+  void *index;           /* header index built by mtar_find() */
   unsigned pos;
   unsigned remaining_data;
   unsigned last_header;
@@ -64,6 +76,7 @@ struct mtar_t {
 const char* mtar_strerror(int err);
 
 int mtar_open(mtar_t *tar, const char *filename, const char *mode);
+int mtar_open_stream(mtar_t *tar, Stream *stream, const char *mode);
 int mtar_close(mtar_t *tar);
 
 int mtar_seek(mtar_t *tar, unsigned pos);
@@ -73,6 +86,10 @@ int mtar_find(mtar_t *tar, const char *name, mtar_header_t *h);
 int mtar_read_header(mtar_t *tar, mtar_header_t *h);
 int mtar_read_data(mtar_t *tar, void *ptr, unsigned size);
 
+/* Parse a raw header record of MTAR_RECORD_SIZE bytes, for archives
+ * arriving in pieces rather than read through mtar_t */
+int mtar_parse_header(const void *raw, mtar_header_t *h);
+
 int mtar_write_header(mtar_t *tar, const mtar_header_t *h);
 int mtar_write_file_header(mtar_t *tar, const char *name, unsigned size);
 int mtar_write_dir_header(mtar_t *tar, const char *name);
@@ -11,7 +11,7 @@
 #include "esp_vfs_fat.h"
 #include "threadsync.h"
 
-static const char * const history_file_name = "/settings/.history";
+static const char * const history_file_name = "/spiffs/.history";
 bool dumb_mode = true;
 
 #define DUMB_PROMPT  "MZ5> "
@@ -1,13 +1,63 @@
 #include "mz_update.h"
 #include "settings.h"
+#include "threadsync.h"
+#include "rom/miniz.h"
 
 
 
+ota_spi_flash_t ota_spi_flash;
+
+bool ota_spi_flash_t::read(uint32_t address, void *buf, size_t size)
+{
+    return ESP.flashRead(address, (uint32_t*)buf, size);
+}
+
+bool ota_spi_flash_t::write(uint32_t address, const void *buf, size_t size)
+{
+    return ESP.flashWrite(address, (uint32_t*)buf, size);
+}
+
+bool ota_spi_flash_t::erase_sector(uint32_t address)
+{
+    return ESP.flashEraseSector(address / SPI_FLASH_SEC_SIZE);
+}
+
+const esp_partition_t *ota_spi_flash_t::find_partition(esp_partition_type_t type,
+    esp_partition_subtype_t subtype, const char *label)
+{
+    return esp_partition_find_first(type, subtype, label);
+}
+
+const esp_partition_t *ota_spi_flash_t::get_running_partition()
+{
+    return esp_ota_get_running_partition();
+}
+
+bool ota_spi_flash_t::set_boot_partition(const esp_partition_t *partition)
+{
+    return esp_ota_set_boot_partition(partition) == ESP_OK;
+}
+
+
+/**
+ * returns partition number 0 or 1 of the app partition.
+ * */
+static int slot_of_app_partition(const esp_partition_t *partition)
+{
+    if(!strcmp(partition->label, "app0"))
+        return 0;
+    if(!strcmp(partition->label, "app1"))
+        return 1;
+    return -1; // TODO: PANIC
+}
+
+
 bool partition_updater_t::begin(update_type_t type, uint32_t size)
 {
     _type = type;
     _size = size;
     _progress = 0;
+    _skipped = 0;
     if(_size & (SPI_FLASH_SEC_SIZE - 1)) return false; // the size is not a multiple of SPI_FLASH_SEC_SIZE
     _partition = next_partition_from_type(_type);
     if(!_partition) return false; // partition not found
@@ -16,45 +66,45 @@ bool partition_updater_t::begin(update_type_t type, uint32_t size)
     return true;
 }
 
-bool partition_updater_t::write_sector(const uint8_t *buf)
+bool partition_updater_t::write_sector(uint8_t *buf)
 {
     if(_type == utUnknown) { printf("not begin\n"); return false; } // not begun
     if(_progress >= _size) { printf("already done %d %d\n", _progress, _size); return false; } // already done
-    uint8_t *bbuf = (uint8_t*)malloc(SPI_FLASH_SEC_SIZE);
-    if(!bbuf)
-    {
-        printf("OTA: Error: Memory exhausted.\n");
-        return false; // memory exhausted
-    }
-
-    memcpy(bbuf, buf, SPI_FLASH_SEC_SIZE);
 
     if(_progress == 0)
     {
         // the first sector
         // save first byte (this byte will be overritten at the completion) 
-        _first_byte = bbuf[0];
-        bbuf[0] = 0xff; // we use 0xff here because flash device can clear bit easily
+        _first_byte = buf[0];
+        buf[0] = 0xff; // we use 0xff here because flash device can clear bit easily
         // but set bit with difficulty (only erase operation can set the bits)
     }
 
-    if(!ESP.flashEraseSector((_partition->address + _progress)/SPI_FLASH_SEC_SIZE)){
-        printf("OTA: Error: Failed to erase a sector at %08lx.\n", (long)(_partition->address + _progress));
-        goto fail;
+    // the first sector is always written, because its first byte is written at last
+    if(_progress != 0 && same_as_flash(buf))
+    {
+        ++ _skipped; // already there; save erasing
     }
-    if (!ESP.flashWrite(_partition->address + _progress, (uint32_t*)bbuf, SPI_FLASH_SEC_SIZE)) {
-        printf("OTA: Error: Failed to write a sector at %08lx.\n", (long)(_partition->address + _progress));
-        goto fail;
+    else
+    {
+        if(!_flash.erase_sector(_partition->address + _progress)){
+            printf("OTA: Error: Failed to erase a sector at %08lx.\n", (long)(_partition->address + _progress));
+            goto fail;
+        }
+        if (!_flash.write(_partition->address + _progress, buf, SPI_FLASH_SEC_SIZE)) {
+            printf("OTA: Error: Failed to write a sector at %08lx.\n", (long)(_partition->address + _progress));
+            goto fail;
+        }
     }
 
     if(_progress == 0)
     {
         // the first sector
         // write back the first byte to calculate md5
-        bbuf[0] = _first_byte;
+        buf[0] = _first_byte;
     }
 
-    _md5.add(bbuf, (uint16_t)SPI_FLASH_SEC_SIZE); //  !?!?!? why the first argument is not const 
+    _md5.add(buf, (uint16_t)SPI_FLASH_SEC_SIZE);
 
     _progress += SPI_FLASH_SEC_SIZE;
     if(_progress >= _size)
@@ -65,27 +115,77 @@ bool partition_updater_t::write_sector(const uint8_t *buf)
         // write back the first sector's first byte to the correct value
         uint8_t buf[4];
 
-        if(!ESP.flashRead(_partition->address, (uint32_t*)buf, 4)) {
+        if(!_flash.read(_partition->address, buf, 4)) {
             printf("OTA: Error: Failed to read a sector from %08lx.\n", (long)(_partition->address));
             goto fail;
         }
         buf[0] = _first_byte;
 
-        if(!ESP.flashWrite(_partition->address, (uint32_t*)buf, 4)) {
+        if(!_flash.write(_partition->address, buf, 4)) {
             printf("OTA: Error: Failed to write a sector at %08lx.\n", (long)(_partition->address));
             goto fail;
         }
     }
 
-    free(bbuf);
     return true;
 
 fail:
-    free(bbuf);
     _type = utUnknown;
     return false;
 }
 
+bool partition_updater_t::same_as_flash(const uint8_t *buf)
+{
+    uint32_t tmp[64];
+    for(uint32_t i = 0; i < SPI_FLASH_SEC_SIZE; i += sizeof(tmp))
+    {
+        if(!_flash.read(_partition->address + _progress + i, tmp, sizeof(tmp))) return false;
+        if(memcmp(tmp, buf + i, sizeof(tmp))) return false;
+    }
+    return true;
+}
+
+bool partition_updater_t::load_existing(uint8_t *buf)
+{
+    if(_type == utUnknown) return false; // not begun
+    if(_progress != 0) return false; // already writing
+
+    for(uint32_t pos = 0; pos < _size; pos += SPI_FLASH_SEC_SIZE)
+    {
+        if(!_flash.read(_partition->address + pos, buf, SPI_FLASH_SEC_SIZE)) {
+            printf("OTA: Error: Failed to read a sector from %08lx.\n", (long)(_partition->address + pos));
+            _md5.begin();
+            return false;
+        }
+        _md5.add(buf, (uint16_t)SPI_FLASH_SEC_SIZE);
+    }
+    _md5.calculate();
+    _progress = _size;
+    _skipped = _size / SPI_FLASH_SEC_SIZE;
+    return true;
+}
+
+bool partition_updater_t::resume(update_type_t type, uint32_t size, uint32_t progress, uint8_t first_byte, uint8_t *buf)
+{
+    if(!begin(type, size)) return false;
+    if(progress > _size || (progress & (SPI_FLASH_SEC_SIZE - 1))) return false;
+
+    // the md5 state is not saved; calculate it again from the written sectors
+    for(uint32_t pos = 0; pos < progress; pos += SPI_FLASH_SEC_SIZE)
+    {
+        if(!_flash.read(_partition->address + pos, buf, SPI_FLASH_SEC_SIZE)) {
+            printf("OTA: Error: Failed to read a sector from %08lx.\n", (long)(_partition->address + pos));
+            _type = utUnknown;
+            return false;
+        }
+        if(pos == 0) buf[0] = first_byte; // not yet written back
+        _md5.add(buf, (uint16_t)SPI_FLASH_SEC_SIZE);
+    }
+    _first_byte = first_byte;
+    _progress = progress;
+    return true;
+}
+
 bool partition_updater_t::match_md5(const uint8_t *md5)
 {
     if(_type == utUnknown) return false; // not begun
@@ -95,7 +195,7 @@ bool partition_updater_t::match_md5(const uint8_t *md5)
     uint8_t buf[16];
     _md5.getBytes(buf);
     printf("OTA: Received MD5: ");
-    for(int i = 0; i < sizeof(buf); ++i) printf("%02x", buf[i]);
+    for(size_t i = 0; i < sizeof(buf); ++i) printf("%02x", buf[i]);
     printf("\n");
     return !memcmp(md5, buf, sizeof(buf));
 }
@@ -104,25 +204,39 @@ bool partition_updater_t::activate_new_code()
 {
     if(_type != utCode) return false;
      if(_progress != _size) return false; // incomplete
-    if(esp_ota_set_boot_partition(_partition) != ESP_OK) return false;
+    if(!_flash.set_boot_partition(_partition)) return false;
     return true;
 }
 
 
 const esp_partition_t* partition_updater_t::next_partition_from_type(update_type_t _type)
 {
-    int active = get_current_active_partition_number();
+    return partition_from_type(_type, (get_active_slot() == 1) ? 0 : 1);
+}
+
+const esp_partition_t* partition_updater_t::current_partition_from_type(update_type_t _type)
+{
+    return partition_from_type(_type, (get_active_slot() == 1) ? 1 : 0);
+}
+
+int partition_updater_t::get_active_slot()
+{
+    return slot_of_app_partition(_flash.get_running_partition());
+}
+
+const esp_partition_t* partition_updater_t::partition_from_type(update_type_t _type, int slot)
+{
     switch(_type)
     {
     case utCode:
-        return esp_partition_find_first(ESP_PARTITION_TYPE_APP, 
-            (active == 1) ? ESP_PARTITION_SUBTYPE_APP_OTA_0 : ESP_PARTITION_SUBTYPE_APP_OTA_1, nullptr);
+        return _flash.find_partition(ESP_PARTITION_TYPE_APP, 
+            (slot == 0) ? ESP_PARTITION_SUBTYPE_APP_OTA_0 : ESP_PARTITION_SUBTYPE_APP_OTA_1, nullptr);
     case utSPIFFS:
-        return esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS,
-            (active == 1) ? "spiffs0" : "spiffs1");
+        return _flash.find_partition(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS,
+            (slot == 0) ? "spiffs0" : "spiffs1");
     case utFont:
-        return esp_partition_find_first((esp_partition_type_t)0x40,
-            (esp_partition_subtype_t)((active == 1) ? 0 : 1), nullptr); // see custom.csv for partition table
+        return _flash.find_partition((esp_partition_type_t)0x40,
+            (esp_partition_subtype_t)slot, nullptr); // see custom.csv for partition table
     case utUnknown:
         return nullptr;
     }
@@ -135,39 +249,508 @@ const esp_partition_t* partition_updater_t::next_partition_from_type(update_type
  * */
 int get_current_active_partition_number()
 {
-    if(!strcmp(esp_ota_get_running_partition()->label, "app0"))
-        return 0;
-    if(!strcmp(esp_ota_get_running_partition()->label, "app1"))
-        return 1;
-    return -1; // TODO: PANIC
+    return slot_of_app_partition(esp_ota_get_running_partition());
+}
+
+
+static constexpr uint16_t OTA_CHECKPOINT_VERSION = 1;
+static const char OTA_CHECKPOINT_KEY[] = "ota_resume";
+
+// the updater may be driven from a thread other than the main thread
+// (the web server task), so the checkpoint in the settings is accessed
+// via the main thread.
+
+static void remove_checkpoint()
+{
+    run_in_main_thread([] () -> int { return settings_remove(OTA_CHECKPOINT_KEY); });
 }
 
+template <typename T>
+static bool load_checkpoint(T & cp)
+{
+    return run_in_main_thread([&cp] () -> int {
+        return settings_get(OTA_CHECKPOINT_KEY, cp, OTA_CHECKPOINT_VERSION); });
+}
+
+template <typename T>
+static void store_checkpoint(const T & cp)
+{
+    run_in_main_thread([&cp] () -> int {
+        settings_put(OTA_CHECKPOINT_KEY, cp, OTA_CHECKPOINT_VERSION);
+        return 0; });
+}
 
-void updater_t::begin()
+void updater_t::reset()
 {
-    if(!buffer) buffer = (uint8_t*)malloc(SPI_FLASH_SEC_SIZE);
-    if(!buffer) { /* TODO: PANIC */ }
+    stop_pipeline(); // in case the previous update was not finished
 
     remaining_count = 0;
     buffer_pos = 0;
+    archive_pos = 0;
     phase = phBegin;
     status = stNoError;
+    write_failed = false;
+
+    start_us = micros();
+    received_bytes = 0;
+    stall_us = 0;
+    sectors_written = 0;
+    flash_busy_us = 0;
+    max_sector_us = 0;
+    skipped_sectors = 0;
+
+    if(!start_pipeline())
+    {
+        printf("OTA: Error: Could not start the flash writer.\n");
+        stop_pipeline();
+        status = stNoResource;
+    }
+}
+
+void updater_t::begin(const String &id)
+{
+    reset();
+    archive_id = id;
+    remove_checkpoint();
+}
+
+bool updater_t::resume(const String &id, uint32_t offset)
+{
+    reset();
+    archive_id = id;
+    if(status != stNoError) return false;
+
+    checkpoint_t cp;
+    if(id.length() == 0 || !load_checkpoint(cp) ||
+        strncmp(cp.id, id.c_str(), sizeof(cp.id) - 1) || cp.offset != offset || cp.done ||
+        cp.slot != partition_updater.get_active_slot())
+    {
+        printf("OTA: Error: No progress to resume at %u.\n", (unsigned)offset);
+        status = stCorrupted;
+        return false;
+    }
+
+    // the checkpoint is restored only when consistent
+    cp.header.label[sizeof(cp.header.label) - 1] = 0;
+    bool valid = offset % SPI_FLASH_SEC_SIZE == 0;
+    if(cp.phase == phContent)
+        valid = valid && cp.header.flags == 0 &&
+            type_from_label(cp.header.label) != partition_updater_t::utUnknown &&
+            cp.header.arc_len % SPI_FLASH_SEC_SIZE == 0 &&
+            cp.remaining_count > 0 && cp.remaining_count <= cp.header.arc_len / SPI_FLASH_SEC_SIZE &&
+            cp.progress == cp.header.arc_len - cp.remaining_count * SPI_FLASH_SEC_SIZE;
+    else
+        valid = valid && cp.phase == phHeader;
+    if(!valid)
+    {
+        printf("OTA: Error: Broken checkpoint.\n");
+        remove_checkpoint();
+        status = stCorrupted;
+        return false;
+    }
+
+    printf("OTA: Resuming at %u ...\n", (unsigned)offset);
+    header = cp.header;
+    phase = (phase_t)cp.phase;
+    remaining_count = cp.remaining_count;
+    archive_pos = offset;
+    if(phase == phContent &&
+        !partition_updater.resume(type_from_label(header.label), header.arc_len,
+            cp.progress, cp.first_byte, buffer))
+    {
+        printf("OTA: Error: Could not resume the partition.\n");
+        status = stCorrupted;
+        return false;
+    }
+    return true;
+}
+
+uint32_t updater_t::get_resume_offset(const String &id)
+{
+    checkpoint_t cp;
+    if(id.length() == 0 || !load_checkpoint(cp)) return 0;
+    if(strncmp(cp.id, id.c_str(), sizeof(cp.id) - 1)) return 0;
+    if(cp.done) return cp.offset; // the whole archive
+    if(cp.slot != partition_updater.get_active_slot()) return 0; // rebooted into another slot
+    return cp.offset;
+}
+
+void updater_t::save_checkpoint(bool done)
+{
+    if(archive_id.length() == 0) return; // not resumable
+
+    checkpoint_t cp;
+    memset(&cp, 0, sizeof(cp));
+    strncpy(cp.id, archive_id.c_str(), sizeof(cp.id) - 1);
+    cp.offset = archive_pos;
+    cp.slot = partition_updater.get_active_slot();
+    cp.phase = phase;
+    cp.first_byte = partition_updater.get_first_byte();
+    cp.done = done;
+    cp.remaining_count = remaining_count;
+    cp.progress = partition_updater.get_progress();
+    cp.header = header;
+    store_checkpoint(cp);
+}
+
+partition_updater_t::update_type_t updater_t::type_from_label(const char *label)
+{
+    if(!strcmp(label, "font"))
+        return partition_updater_t::utFont;
+    if(!strcmp(label, "spiffs"))
+        return partition_updater_t::utSPIFFS;
+    if(!strcmp(label, "app"))
+        return partition_updater_t::utCode;
+    return partition_updater_t::utUnknown;
 }
 
 void updater_t::end()
 {
-    if(buffer) free(buffer), buffer = nullptr;
+    stop_pipeline();
+}
+
+bool updater_t::start_pipeline()
+{
+    for(int i = 0; i < POOL_SIZE; ++i)
+    {
+        pool[i] = (uint8_t*)malloc(SPI_FLASH_SEC_SIZE);
+        if(!pool[i]) return false;
+    }
+    free_queue = xQueueCreate(POOL_SIZE, sizeof(uint8_t *));
+    filled_queue = xQueueCreate(POOL_SIZE, sizeof(uint8_t *));
+    if(!free_queue || !filled_queue) return false;
+
+    // the first buffer is for the receiver; others are free
+    buffer = pool[0];
+    for(int i = 1; i < POOL_SIZE; ++i)
+        xQueueSend(free_queue, &pool[i], 0);
+
+    // the web server runs on CONFIG_ARDUINO_RUNNING_CORE; use the other core
+    if(pdPASS != xTaskCreatePinnedToCore(writer_task_entry, "OTA writer", 4096, this,
+        1, &writer_task, CONFIG_ARDUINO_RUNNING_CORE ? 0 : 1))
+    {
+        writer_task = nullptr;
+        return false;
+    }
+    return true;
+}
+
+void updater_t::stop_pipeline()
+{
+    end_payload(); // this returns the buffer being assembled to the pool
+    if(writer_task)
+    {
+        drain();
+        // ask the writer task to exit, and wait for it
+        uint8_t *stop = nullptr;
+        stopper_task = xTaskGetCurrentTaskHandle();
+        xQueueSend(filled_queue, &stop, portMAX_DELAY);
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        writer_task = nullptr;
+    }
+    if(free_queue) vQueueDelete(free_queue), free_queue = nullptr;
+    if(filled_queue) vQueueDelete(filled_queue), filled_queue = nullptr;
+    for(int i = 0; i < POOL_SIZE; ++i)
+        if(pool[i]) free(pool[i]), pool[i] = nullptr;
+    buffer = nullptr;
+}
+
+void updater_t::writer_task_entry(void *arg)
+{
+    updater_t *self = (updater_t *)arg;
+    uint8_t *buf;
+    for(;;)
+    {
+        xQueueReceive(self->filled_queue, &buf, portMAX_DELAY);
+        if(!buf) break; // stop request
+
+        if(!self->write_failed)
+        {
+            uint32_t start = micros();
+            if(!self->partition_updater.write_sector(buf))
+                self->write_failed = true;
+            uint32_t elapsed = micros() - start;
+            self->flash_busy_us += elapsed;
+            if(elapsed > self->max_sector_us) self->max_sector_us = elapsed;
+            ++ self->sectors_written;
+        }
+        xQueueSend(self->free_queue, &buf, portMAX_DELAY);
+    }
+    xTaskNotifyGive(self->stopper_task);
+    vTaskDelete(nullptr);
+}
+
+void updater_t::queue_sector(uint8_t *&buf)
+{
+    xQueueSend(filled_queue, &buf, portMAX_DELAY); // never blocks; the queue can hold the whole pool
+
+    // take a free buffer; this waits only when the writer task is behind
+    uint32_t start = micros();
+    xQueueReceive(free_queue, &buf, portMAX_DELAY);
+    stall_us += micros() - start;
+}
+
+void updater_t::drain()
+{
+    // all sectors are written when the writer task has returned all buffers
+    // except the one held by the receiver
+    uint32_t start = micros();
+    uint8_t *bufs[POOL_SIZE - 1];
+    for(int i = 0; i < POOL_SIZE - 1; ++i)
+        xQueueReceive(free_queue, &bufs[i], portMAX_DELAY);
+    for(int i = 0; i < POOL_SIZE - 1; ++i)
+        xQueueSend(free_queue, &bufs[i], 0);
+    stall_us += micros() - start;
+}
+
+bool updater_t::begin_payload(partition_updater_t::update_type_t type)
+{
+    stored_remaining = header.comp_len;
+    sector_count = header.arc_len / SPI_FLASH_SEC_SIZE;
+    out_sector = 0;
+    out_pos = 0;
+
+    // the receiver holds one more buffer to assemble sectors
+    uint32_t start = micros();
+    xQueueReceive(free_queue, &out_buffer, portMAX_DELAY);
+    stall_us += micros() - start;
+
+    if(header.flags & (PARTITION_FLAG_DELTA | PARTITION_FLAG_SAME))
+    {
+        if(!verify_base(type)) return false;
+    }
+    if(header.flags & PARTITION_FLAG_DELTA)
+    {
+        delta_map = (uint8_t *)malloc(sector_count);
+        if(!delta_map) { printf("OTA: Error: Memory exhausted.\n"); return false; }
+        delta_map_pos = 0;
+    }
+    if(header.flags & PARTITION_FLAG_DEFLATE)
+    {
+        inflator = (tinfl_decompressor *)malloc(sizeof(tinfl_decompressor));
+        inflate_dict = (uint8_t *)malloc(INFLATE_DICT_SIZE);
+        if(!inflator || !inflate_dict) { printf("OTA: Error: Memory exhausted.\n"); return false; }
+        tinfl_init(inflator);
+        inflate_dict_pos = 0;
+        inflate_done = false;
+    }
+    return true;
+}
+
+void updater_t::end_payload()
+{
+    if(out_buffer) xQueueSend(free_queue, &out_buffer, 0), out_buffer = nullptr;
+    if(inflator) free(inflator), inflator = nullptr;
+    if(inflate_dict) free(inflate_dict), inflate_dict = nullptr;
+    if(delta_map) free(delta_map), delta_map = nullptr;
+}
+
+bool updater_t::verify_base(partition_updater_t::update_type_t type)
+{
+    base_partition = partition_updater.current_partition_from_type(type);
+    if(!base_partition || header.base_len > base_partition->size ||
+        header.base_len % SPI_FLASH_SEC_SIZE != 0)
+    {
+        printf("OTA: Error: Invalid base partition.\n");
+        return false;
+    }
+
+    printf("OTA: Checking the base in '%s' ...\n", base_partition->label);
+    MD5Builder md5;
+    md5.begin();
+    for(uint32_t pos = 0; pos < header.base_len; pos += SPI_FLASH_SEC_SIZE)
+    {
+        if(!flash.read(base_partition->address + pos, out_buffer, SPI_FLASH_SEC_SIZE))
+        {
+            printf("OTA: Error: Failed to read a sector from %08lx.\n", (long)(base_partition->address + pos));
+            return false;
+        }
+        md5.add(out_buffer, (uint16_t)SPI_FLASH_SEC_SIZE);
+    }
+    md5.calculate();
+    uint8_t buf[16];
+    md5.getBytes(buf);
+    if(memcmp(buf, header.base_md5, sizeof(buf)))
+    {
+        printf("OTA: Error: The installed partition is not the base of this archive.\n");
+        return false;
+    }
+    return true;
 }
 
+bool updater_t::put_payload(const uint8_t *data, size_t size)
+{
+    while(size > 0)
+    {
+        if(delta_map && delta_map_pos < sector_count)
+        {
+            // the sector map comes first
+            size_t one = std::min<size_t>(size, sector_count - delta_map_pos);
+            memcpy(delta_map + delta_map_pos, data, one);
+            data += one;
+            size -= one;
+            delta_map_pos += one;
+            if(delta_map_pos == sector_count && !copy_base_sectors()) return false;
+            continue;
+        }
+
+        if(out_sector >= sector_count)
+        {
+            printf("\nOTA: Error: Too large content.\n");
+            return false;
+        }
+        size_t one = std::min<size_t>(size, SPI_FLASH_SEC_SIZE - out_pos);
+        memcpy(out_buffer + out_pos, data, one);
+        data += one;
+        size -= one;
+        out_pos += one;
+        if(out_pos == SPI_FLASH_SEC_SIZE)
+        {
+            queue_sector(out_buffer);
+            out_pos = 0;
+            ++ out_sector;
+            if(delta_map && !copy_base_sectors()) return false;
+        }
+    }
+    return true;
+}
+
+bool updater_t::copy_base_sectors()
+{
+    for(; out_sector < sector_count; ++ out_sector)
+    {
+        uint8_t kind = delta_map ? delta_map[out_sector] : 0;
+        if(kind == 1) break; // stored in the archive
+        uint32_t pos = out_sector * SPI_FLASH_SEC_SIZE;
+        if(kind != 0 || pos + SPI_FLASH_SEC_SIZE > header.base_len)
+        {
+            printf("\nOTA: Error: Invalid sector map.\n");
+            return false;
+        }
+        if(!flash.read(base_partition->address + pos, out_buffer, SPI_FLASH_SEC_SIZE))
+        {
+            printf("\nOTA: Error: Failed to read a sector from %08lx.\n", (long)(base_partition->address + pos));
+            return false;
+        }
+        queue_sector(out_buffer);
+    }
+    return true;
+}
+
+bool updater_t::inflate_block(const uint8_t *in, size_t in_len)
+{
+    if(inflate_done) return in_len == 0; // no data is expected after the end of the stream
+
+    for(;;)
+    {
+        size_t in_bytes = in_len;
+        size_t out_bytes = INFLATE_DICT_SIZE - inflate_dict_pos;
+        tinfl_status st = tinfl_decompress(inflator, in, &in_bytes,
+            inflate_dict, inflate_dict + inflate_dict_pos, &out_bytes,
+            stored_remaining ? TINFL_FLAG_HAS_MORE_INPUT : 0);
+        in += in_bytes;
+        in_len -= in_bytes;
+
+        if(!put_payload(inflate_dict + inflate_dict_pos, out_bytes)) return false;
+        inflate_dict_pos = (inflate_dict_pos + out_bytes) & (INFLATE_DICT_SIZE - 1);
+
+        if(st == TINFL_STATUS_DONE) { inflate_done = true; return true; }
+        if(st < 0)
+        {
+            printf("\nOTA: Error: Broken compressed data (%d).\n", (int)st);
+            return false;
+        }
+        if(st == TINFL_STATUS_NEEDS_MORE_INPUT) return true; // whole block consumed
+        // TINFL_STATUS_HAS_MORE_OUTPUT; the window is full, continue
+    }
+}
+
+bool updater_t::install_same()
+{
+    // the target slot may already have the image, e.g. it was installed
+    // before the current one
+    if(partition_updater.load_existing(out_buffer) && partition_updater.match_md5(header.md5))
+    {
+        printf("OTA: Already installed.\n");
+        out_sector = sector_count;
+        return true;
+    }
+    // reset the partition updater
+    if(!partition_updater.begin(partition_updater.get_type(), header.arc_len)) return false;
+    printf("OTA: Copying from '%s' ...\n", base_partition->label);
+    return copy_base_sectors();
+}
+
+void updater_t::finish_partition()
+{
+    if(out_buffer)
+    {
+        bool complete = out_sector == sector_count && stored_remaining == 0 &&
+            (!inflator || inflate_done) && (!delta_map || delta_map_pos == sector_count);
+        end_payload();
+        if(!complete)
+        {
+            printf("\nOTA: Error: Premature end of partition content.\n");
+            status = stCorrupted;
+            return;
+        }
+    }
+
+    // wait for the writer task, because the md5 is calculated
+    // by the writer task and the next partition header will begin
+    // the partition updater again
+    drain();
+    if(write_failed)
+    {
+        printf("\nOTA: Error: Failed at partition_updater.write_sector().\n");
+        status = stCorrupted;
+        return;
+    }
+    // all sector in the partition has been written
+    printf("\nOTA: All sectors written.\n");
+    skipped_sectors += partition_updater.get_skipped();
+    if(!partition_updater.match_md5(header.md5))
+    {
+        // md5 mismatch
+        printf("OTA: Error: MD5 mismatch.\n");
+        status = stCorrupted;
+        return;
+    }
+    // activate new code
+    partition_updater.activate_new_code();
+
+    // prepare to receive next header (if exists)
+    phase = phHeader;
+    save_checkpoint();
+}
+
+void updater_t::report_stats()
+{
+    uint32_t elapsed_ms = (micros() - start_us) / 1000;
+    uint32_t sectors = sectors_written;
+    printf("OTA: Received %u bytes in %u ms (%u KiB/s).\n",
+        (unsigned)received_bytes, (unsigned)elapsed_ms,
+        (unsigned)(elapsed_ms ? (uint64_t)received_bytes * 1000 / 1024 / elapsed_ms : 0));
+    printf("OTA: Flash: %u sectors, busy %u ms, sector avg %u us, max %u us.\n",
+        (unsigned)sectors, (unsigned)(flash_busy_us / 1000),
+        (unsigned)(sectors ? flash_busy_us / sectors : 0), (unsigned)max_sector_us);
+    printf("OTA: Sectors already up to date: %u.\n", (unsigned)skipped_sectors);
+    printf("OTA: Receiver waited for flash %u ms.\n", (unsigned)(stall_us / 1000));
+}
 
 void updater_t::process_block()
 {
     // process the block according to the buffer content and the phase
+    archive_pos += SPI_FLASH_SEC_SIZE;
     if(phase == phBegin)
     {
         // received block must be a header
         printf("OTA: Receiving archive header ...\n");
-        if(memcmp("MZ5 firmware archive 1.0\r\n\n\x1a    ", buffer, 32))
+        // version 1.1 archives may contain compressed partitions, and 1.2
+        // archives may contain delta partitions
+        if(memcmp("MZ5 firmware archive 1.", buffer, 23) ||
+            buffer[23] < '0' || buffer[23] > '2' ||
+            memcmp("\r\n\n\x1a    ", buffer + 24, 8))
         {
             // invalid header
             printf("OTA: Error: invalid archive header.\n");
@@ -176,6 +759,7 @@ void updater_t::process_block()
         }
         printf("OTA: Valid archive header.\n");
         phase = phHeader;
+        save_checkpoint();
     }
     else if(phase == phHeader)
     {
@@ -190,18 +774,31 @@ void updater_t::process_block()
         }
         memcpy(&header, buffer + 16, sizeof(header)); // take a copy of it
         header.label[sizeof(header.label)-1 ] = 0; // force terminate the label string
+        bool same = header.flags & PARTITION_FLAG_SAME;
 
         // print information
         printf("OTA: Partition label: '%s', Original size: %d, Archived size: %d\n",
             header.label, (int)header.orig_len, (int)header.arc_len);
+        if(header.flags & PARTITION_FLAG_DEFLATE)
+            printf("OTA:         Compressed: %d\n", (int)header.comp_len);
+        if(header.flags & PARTITION_FLAG_DELTA)
+            printf("OTA:              Delta: %d\n", (int)header.comp_len);
+        if(same)
+            printf("OTA: Same as the installed one\n");
         printf("OTA:            MD5 sum: ");
-        for(int i = 0; i < sizeof(header.md5); ++i)
+        for(size_t i = 0; i < sizeof(header.md5); ++i)
             printf("%02x", header.md5[i]);
         printf("\n");
 
         // some sanity checks
-        if(header.orig_len > header.arc_len ||
-            header.arc_len % SPI_FLASH_SEC_SIZE != 0)
+        if(header.arc_len == 0 || header.orig_len > header.arc_len ||
+            header.arc_len % SPI_FLASH_SEC_SIZE != 0 ||
+            header.comp_len > (uint64_t)header.arc_len + header.arc_len / SPI_FLASH_SEC_SIZE || // delta map and all sectors
+            header.base_len % SPI_FLASH_SEC_SIZE != 0 ||
+            (header.flags & ~(PARTITION_FLAG_DEFLATE | PARTITION_FLAG_DELTA | PARTITION_FLAG_SAME)) ||
+            (header.flags && !same && header.comp_len == 0) ||
+            (same && (header.flags != PARTITION_FLAG_SAME || header.comp_len != 0 ||
+                header.base_len != header.arc_len || memcmp(header.md5, header.base_md5, sizeof(header.md5)))))
         {
             printf("OTA: Error: Invalid partition size.\n");
             status = stCorrupted;
@@ -209,14 +806,8 @@ void updater_t::process_block()
         }
 
         // determin partition type and prepare to flash
-        partition_updater_t::update_type_t type = partition_updater_t::utUnknown;
-        if(!strcmp(header.label, "font"))
-            type = partition_updater_t::utFont;
-        else if(!strcmp(header.label, "spiffs"))
-            type = partition_updater_t::utSPIFFS;
-        else if(!strcmp(header.label, "app"))
-            type = partition_updater_t::utCode;
-        else
+        partition_updater_t::update_type_t type = type_from_label(header.label);
+        if(type == partition_updater_t::utUnknown)
         {
             // unknown label
             printf("OTA: Error: Unknown label.\n");
@@ -231,36 +822,68 @@ void updater_t::process_block()
             return;
         }
 
-        remaining_count = header.arc_len / SPI_FLASH_SEC_SIZE;
+        if(header.flags)
+        {
+            if(!begin_payload(type))
+            {
+                status = stCorrupted;
+                return;
+            }
+            remaining_count = (header.comp_len + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE;
+        }
+        else
+        {
+            remaining_count = header.arc_len / SPI_FLASH_SEC_SIZE;
+        }
+
+        if(same)
+        {
+            // no content follows
+            if(!install_same())
+            {
+                status = stCorrupted;
+                return;
+            }
+            finish_partition();
+            return;
+        }
         printf("OTA: Sector count: %d\n", (int)remaining_count);
         phase = phContent;
     }
     else if(phase == phContent)
     {
         printf(".");
-        if(!partition_updater.write_sector(buffer))
+        if(write_failed)
         {
             printf("\nOTA: Error: Failed at partition_updater.write_sector().\n");
             status = stCorrupted;
             return;
         }
-        -- remaining_count;
-        if(remaining_count == 0)
+        if(out_buffer)
         {
-            // all sector in the partition has been written
-            printf("\nOTA: All sectors written.\n");
-            if(!partition_updater.match_md5(header.md5))
+            // content not stored as is
+            size_t size = std::min<uint32_t>(stored_remaining, SPI_FLASH_SEC_SIZE); // rest is padding
+            stored_remaining -= size;
+            if(inflator ? !inflate_block(buffer, size) : !put_payload(buffer, size))
             {
-                // md5 mismatch
-                printf("OTA: Error: MD5 mismatch.\n");
                 status = stCorrupted;
                 return;
             }
-            // activate new code
-            partition_updater.activate_new_code();
-
-            // prepare to receive next header (if exists)
-            phase = phHeader;
+        }
+        else
+        {
+            queue_sector(buffer);
+        }
+        -- remaining_count;
+        if(remaining_count == 0)
+        {
+            finish_partition();
+        }
+        else if(!out_buffer && remaining_count % CHECKPOINT_SECTORS == 0)
+        {
+            // the checkpoint must not be ahead of the flash
+            drain();
+            if(!write_failed) save_checkpoint();
         }
     }
 }
@@ -278,6 +901,7 @@ void updater_t::write_data(const uint8_t * buf, size_t size)
         size -= one_size;
         buf += one_size;
         buffer_pos += one_size;
+        received_bytes += one_size;
         if(buffer_pos == SPI_FLASH_SEC_SIZE)
         {
             // one block has been filled
@@ -299,10 +923,14 @@ bool updater_t::finish()
     }
 
     printf("OTA: Success.\n");
+    save_checkpoint(true); // tell the client that it is done
 
     success = true; // no error found
 fin:
-    if(buffer) free(buffer), buffer = nullptr;
+    // broken data can not be resumed
+    if(status != stNoError) remove_checkpoint();
+    stop_pipeline();
+    report_stats();
     return success;
 }
 
@@ -319,6 +947,7 @@ void show_ota_status()
 
 void reboot(bool clear_settings)
 {
+    settings_flush();
     if(clear_settings)
     {
         // put all settings clear inidication file
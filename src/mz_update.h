@@ -5,6 +5,54 @@
 #include "esp_ota_ops.h"
 #include "esp_image_format.h"
 #include <MD5Builder.h>
+#include <freertos/queue.h>
+
+/**
+ * Flash and partition table access used by the updater.
+ * Addresses are absolute flash addresses. Giving the updater another
+ * implementation, e.g. an emulated flash, lets it run off the device.
+ * */
+class ota_flash_t
+{
+public:
+    virtual ~ota_flash_t() {;}
+
+    //! read from the flash
+    virtual bool read(uint32_t address, void *buf, size_t size) = 0;
+
+    //! write to the flash; the area must be erased beforehand
+    virtual bool write(uint32_t address, const void *buf, size_t size) = 0;
+
+    //! erase a sector; address must be sector aligned
+    virtual bool erase_sector(uint32_t address) = 0;
+
+    //! find a partition like esp_partition_find_first()
+    virtual const esp_partition_t *find_partition(esp_partition_type_t type,
+        esp_partition_subtype_t subtype, const char *label) = 0;
+
+    //! returns the partition of the running firmware
+    virtual const esp_partition_t *get_running_partition() = 0;
+
+    //! set the partition to boot from next time
+    virtual bool set_boot_partition(const esp_partition_t *partition) = 0;
+};
+
+/**
+ * ota_flash_t implementation on the SPI flash of the chip
+ * */
+class ota_spi_flash_t : public ota_flash_t
+{
+public:
+    bool read(uint32_t address, void *buf, size_t size) override;
+    bool write(uint32_t address, const void *buf, size_t size) override;
+    bool erase_sector(uint32_t address) override;
+    const esp_partition_t *find_partition(esp_partition_type_t type,
+        esp_partition_subtype_t subtype, const char *label) override;
+    const esp_partition_t *get_running_partition() override;
+    bool set_boot_partition(const esp_partition_t *partition) override;
+};
+
+extern ota_spi_flash_t ota_spi_flash;
 
 class partition_updater_t
 {
@@ -16,32 +64,93 @@ public:
         utSPIFFS,
         utFont,
     };
-    partition_updater_t() : _type(utUnknown), _size(0), _first_byte(0xff), _progress(0), _partition(nullptr) {}
+    partition_updater_t(ota_flash_t &flash) : _flash(flash), _type(utUnknown), _size(0), _first_byte(0xff), _progress(0), _skipped(0), _partition(nullptr) {}
     ~partition_updater_t() {}
 
     bool begin(update_type_t type, uint32_t size);
-    bool write_sector(const uint8_t *buf); //!< write a sector to current position
+    bool write_sector(uint8_t *buf); //!< write a sector to current position; buf is modified during the call
+    bool load_existing(uint8_t *buf); //!< take current content of the partition as written; buf is a sector sized work area
+    bool resume(update_type_t type, uint32_t size, uint32_t progress, uint8_t first_byte, uint8_t *buf); //!< continue writing after progress bytes already written
     bool match_md5(const uint8_t *md5);
     bool activate_new_code(); //!< activate newly written code (only for type == utCode)
+    uint32_t get_skipped() const { return _skipped; } //!< sectors not written because the content was the same
+    update_type_t get_type() const { return _type; }
+    uint32_t get_progress() const { return _progress; }
+    uint8_t get_first_byte() const { return _first_byte; }
 
-    static const esp_partition_t* next_partition_from_type(update_type_t _type);
+    const esp_partition_t* next_partition_from_type(update_type_t _type);
+    const esp_partition_t* current_partition_from_type(update_type_t _type);
+    int get_active_slot(); //!< partition number of the running firmware; 0 or 1
 
 private:
+    ota_flash_t &_flash;
     update_type_t _type;
     uint32_t _size;
     uint8_t _first_byte; //!< first byte of the partition (usually a magic number)
     uint32_t _progress;
+    uint32_t _skipped;
     const esp_partition_t* _partition;
     MD5Builder _md5;
+
+    bool same_as_flash(const uint8_t *buf); //!< whether the sector at current position already has the content
+    const esp_partition_t* partition_from_type(update_type_t _type, int slot);
 };
 
 int get_current_active_partition_number();
 
+struct tinfl_decompressor_tag;
+
+/**
+ * OTA archive receiver.
+ * Partition content is written by a dedicated flash-writer task, so that
+ * receiving the next sectors overlaps with erasing and writing the
+ * previous ones. Sectors are passed through a small pool of buffers
+ * allocated at begin(); the receiver waits only when all of them are
+ * still queued for writing.
+ *
+ * A partition may be stored deflate-compressed in the archive (see
+ * make_archive.py --compress). It is inflated block by block with the
+ * inflater in ROM, using a 4 KiB window; the compressor must not use a
+ * larger one.
+ *
+ * A partition may also be stored as the difference from the image in the
+ * currently active slot (see make_archive.py --base): either "the same",
+ * or a sector map followed by changed sectors only. The base is identified
+ * by its MD5. Unchanged sectors are copied from the active slot, and
+ * sectors which already have the content in the target slot are not
+ * erased nor written.
+ *
+ * Progress is saved in the settings as a checkpoint, at partition
+ * boundaries and every CHECKPOINT_SECTORS sectors of a partition stored
+ * as is, so that an interrupted upload can be continued by resume() from
+ * the offset returned by get_resume_offset(). Partitions not stored as is
+ * are resumed from their header.
+ * */
 class updater_t
 {
-    uint8_t *buffer;
+    static constexpr int POOL_SIZE = 3; //!< number of sector buffers in the pipeline
+
+    ota_flash_t &flash;
+
+    uint8_t *pool[POOL_SIZE]; //!< sector buffers
+    uint8_t *buffer; //!< the buffer being filled by write_data(); one of the pool
     partition_updater_t partition_updater;
 
+    QueueHandle_t free_queue; //!< buffers available for receiving
+    QueueHandle_t filled_queue; //!< buffers waiting for the writer task; nullptr stops the task
+    TaskHandle_t writer_task;
+    TaskHandle_t stopper_task; //!< task to be notified when the writer task exits
+    volatile bool write_failed; //!< set by the writer task
+
+    // statistics
+    uint32_t start_us; //!< micros() at begin()
+    uint32_t received_bytes; //!< bytes passed to write_data()
+    uint32_t stall_us; //!< time the receiver waited for the writer task
+    volatile uint32_t sectors_written; //!< sectors written by the writer task
+    volatile uint32_t flash_busy_us; //!< total time taken by write_sector()
+    volatile uint32_t max_sector_us; //!< the longest write_sector()
+    uint32_t skipped_sectors; //!< sectors which already had the content
+
 #pragma pack(push, 4)
     struct partition_header_t
     {
@@ -49,9 +158,37 @@ class updater_t
         uint32_t orig_len;
         uint32_t arc_len;
         uint8_t md5[16];
+        uint32_t flags; // PARTITION_FLAG_*; zero in version 1.0 archives
+        uint32_t comp_len; // stored content length in bytes, if flags are non-zero
+        uint8_t base_md5[16]; // MD5 of the base image, for PARTITION_FLAG_DELTA and PARTITION_FLAG_SAME
+        uint32_t base_len; // base image length in bytes
     };
 #pragma pack(pop)
 
+    static constexpr uint32_t PARTITION_FLAG_DEFLATE = 1; //!< content is raw deflate stream
+    static constexpr uint32_t PARTITION_FLAG_DELTA = 2; //!< content is a sector map and changed sectors
+    static constexpr uint32_t PARTITION_FLAG_SAME = 4; //!< no content; the same as the base
+    static constexpr size_t INFLATE_DICT_SIZE = 4096; //!< inflate window size; must be a power of 2
+    static constexpr uint32_t CHECKPOINT_SECTORS = 64; //!< checkpoint interval in a partition stored as is
+
+    // state of a partition whose content is not stored as is
+    uint32_t stored_remaining; //!< stored content bytes not yet received
+    uint32_t sector_count; //!< sectors to be written
+    uint32_t out_sector; //!< sectors passed to the writer task so far
+    uint8_t *out_buffer; //!< the buffer being assembled; one of the pool
+    size_t out_pos; //!< out_buffer writing position
+
+    // inflater state of a compressed partition
+    tinfl_decompressor_tag *inflator; //!< allocated while receiving a compressed partition
+    uint8_t *inflate_dict; //!< inflate window
+    size_t inflate_dict_pos; //!< next output position in the window
+    bool inflate_done; //!< end of the deflate stream was seen
+
+    // delta state
+    const esp_partition_t *base_partition; //!< the active slot
+    uint8_t *delta_map; //!< one byte per sector; 0 = copy from the base, 1 = stored
+    uint32_t delta_map_pos; //!< map bytes received so far
+
     enum phase_t
     {
         phBegin, // the begining, waiting for the first header
@@ -62,26 +199,65 @@ class updater_t
     size_t remaining_count; // remaining block count
     size_t buffer_pos; // buffer writing position
     partition_header_t header; // current partition header
+    uint32_t archive_pos; // archive bytes processed
+    String archive_id; // archive identifier given by the client; empty = not resumable
+
+    // progress saved in the settings
+    struct checkpoint_t
+    {
+        char id[64]; // archive identifier
+        uint32_t offset; // archive bytes processed
+        int8_t slot; // active partition number at the update
+        uint8_t phase; // phase_t
+        uint8_t first_byte; // first byte of the partition being written
+        uint8_t done; // whether the update has completed
+        uint32_t remaining_count; // remaining block count
+        uint32_t progress; // partition bytes written
+        partition_header_t header; // current partition header
+    };
 
 public:
     enum status_t
     {
         stNoError,
         stCorrupted, // data corrupted
+        stNoResource, // could not allocate the buffers or the writer task
     };
 private:
     status_t status;
     phase_t phase;
 
 public:
-    updater_t() {;}
+    updater_t(ota_flash_t &_flash = ota_spi_flash) : flash(_flash), pool{}, buffer(nullptr), partition_updater(_flash), free_queue(nullptr), filled_queue(nullptr),
+        writer_task(nullptr), stopper_task(nullptr), out_buffer(nullptr), inflator(nullptr),
+        inflate_dict(nullptr), delta_map(nullptr) {;}
+
+    void begin(const String &id = String()); // begin an update; non-empty id makes it resumable
+    bool resume(const String &id, uint32_t offset); // continue the update at the offset of the archive
+    void end(); // should be explicitly called because this method frees large(12kb) buffers
 
-    void begin();
-    void end(); // should be explicitly called because this method frees large(4kb) buffer
+    uint32_t get_resume_offset(const String &id); // archive offset to continue at; 0 = from the beginning
 
 
 private:
     void process_block(); // process one block
+    bool start_pipeline(); // allocate the buffers and start the writer task
+    void stop_pipeline(); // stop the writer task and free the buffers
+    void queue_sector(uint8_t *&buf); // pass the buffer to the writer task, and take a free one
+    bool begin_payload(partition_updater_t::update_type_t type); // prepare to receive content not stored as is
+    void end_payload(); // free the state of begin_payload()
+    bool verify_base(partition_updater_t::update_type_t type); // check the active slot has the base image
+    bool put_payload(const uint8_t *data, size_t size); // assemble sectors from the content
+    bool copy_base_sectors(); // queue sectors to be copied from the base, up to the next stored one
+    bool inflate_block(const uint8_t *in, size_t in_len); // inflate received content
+    bool install_same(); // install a partition which is the same as the base
+    void finish_partition(); // verify the written partition, and wait for the next
+    void reset(); // reset the state and start the pipeline
+    void save_checkpoint(bool done = false); // save the progress in the settings
+    static partition_updater_t::update_type_t type_from_label(const char *label);
+    void drain(); // wait for the writer task to write all queued sectors
+    void report_stats(); // show throughput and latency of the update
+    static void writer_task_entry(void *arg);
 
 public:
     void write_data(const uint8_t * buf, size_t size); // write a block
@@ -1,5 +1,6 @@
 #include <Arduino.h>
 #include <core_version.h>
+#include "mz_version.h"
 
 
 extern "C" {
@@ -25,3 +26,22 @@ String version_get_info_string()
         String("\"Build_date\": \"") + get_build_date() + "\""
          ;
 }
+
+/**
+ * Get version info for the web UI
+ * */
+version_info_t version_get_info()
+{
+    // the build date is "YYYY-MM-DD hh:mm:ss.ffffff"; see version.py
+    String build = get_build_date();
+    int space = build.indexOf(' ');
+    int dot = build.indexOf('.', space);
+
+    version_info_t info;
+    info.date = space == -1 ? build : build.substring(0, space);
+    info.time = space == -1 ? String() :
+        dot == -1 ? build.substring(space + 1) : build.substring(space + 1, dot);
+    info.src_version = get_git_rev();
+    info.env_version = String(ARDUINO_ESP32_RELEASE) + " (ESP-IDF " + esp_get_idf_version() + ")";
+    return info;
+}
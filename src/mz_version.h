@@ -1,3 +1,14 @@
 #pragma once
 
 String version_get_info_string();
+
+//! build information, as shown by the web UI
+struct version_info_t
+{
+    String date; //!< build date
+    String time; //!< build time
+    String src_version; //!< git revision of the source
+    String env_version; //!< versions of the Arduino core and ESP-IDF
+};
+
+version_info_t version_get_info();
@@ -130,6 +130,25 @@ static void WiFiEvent(WiFiEvent_t event, system_event_info_t info){
 
 
 static void wifi_init_settings();
+static bool radio_started = false;
+
+/**
+ * Bring up the WiFi radio in station mode, without connecting.
+ * This does not need settings, so it can run in another task during boot,
+ * before wifi_setup().
+ */
+void wifi_early_setup()
+{
+	// first, disconnect wifi
+	WiFi.mode(WIFI_OFF);
+	WiFi.setAutoReconnect(true);
+
+	// try to connect
+	WiFi.mode(WIFI_STA);
+
+	radio_started = true;
+}
+
 void wifi_setup()
 {
 	puts("WiFi initializing ...");
@@ -140,13 +159,7 @@ void wifi_setup()
 	// register event handler
 	WiFi.onEvent(WiFiEvent);
 
-	// first, disconnect wifi
-	WiFi.mode(WIFI_OFF);
-	WiFi.setAutoReconnect(true);
-
-	// try to connect
-	WiFi.mode(WIFI_STA);
-
+	if(!radio_started) wifi_early_setup();
 }
 
 
@@ -222,6 +235,49 @@ void wifi_start()
 	WiFi.config(i_ip_addr, i_ip_gateway, i_ip_mask, i_dns1, i_dns2);
 }
 
+//! IPv4 configuration as stored in the "ip_config" setting
+struct ip_config_record_t
+{
+	uint32_t ip_addr; //!< addresses in IPAddress' uint32_t form; 0 = automatic
+	uint32_t ip_gateway;
+	uint32_t ip_mask;
+	uint32_t dns1;
+	uint32_t dns2;
+};
+
+//! schema version of the "ip_config" setting; bump when ip_config_record_t changes
+static constexpr uint16_t IP_CONFIG_VERSION = 1;
+
+static uint32_t ip_to_u32(const String & str)
+{
+	IPAddress ip;
+	if(!ip.fromString(str)) return 0;
+	return (uint32_t)ip;
+}
+
+static String u32_to_ip(uint32_t v)
+{
+	return IPAddress(v).toString();
+}
+
+/**
+ * Read IPv4 settings stored as separate strings by older firmware,
+ * and move them to the "ip_config" setting.
+ */
+static void wifi_migrate_ip_settings()
+{
+	static const char * const keys[] = { "ip_addr", "ip_gateway", "ip_mask", "dns_1", "dns_2" };
+	String * const fields[] = { &ip_addr_settings.ip_addr, &ip_addr_settings.ip_gateway,
+		&ip_addr_settings.ip_mask, &ip_addr_settings.dns1, &ip_addr_settings.dns2 };
+
+	for(size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); ++i)
+	{
+		String value;
+		if(settings_read(keys[i], value)) *fields[i] = u32_to_ip(ip_to_u32(value));
+		settings_remove(keys[i]);
+	}
+}
+
 /**
  * Read settings. Initialize settings to factory state, if the settings key is invalid
  */
@@ -229,19 +285,26 @@ static void wifi_init_settings()
 {
 	settings_write(F("ap_name"), F(""), SETTINGS_NO_OVERWRITE);
 	settings_write(F("ap_pass"), F(""), SETTINGS_NO_OVERWRITE);
-	settings_write(F("ip_addr"), F("0.0.0.0"), SETTINGS_NO_OVERWRITE); // automatic ip configuration
-	settings_write(F("ip_gateway"), F("0.0.0.0"), SETTINGS_NO_OVERWRITE);
-	settings_write(F("ip_mask"), F("0.0.0.0"), SETTINGS_NO_OVERWRITE);
-	settings_write(F("dns_1"), F("0.0.0.0"), SETTINGS_NO_OVERWRITE);
-	settings_write(F("dns_2"), F("0.0.0.0"), SETTINGS_NO_OVERWRITE);
 
 	settings_read(F("ap_name"), ap_name);
 	settings_read(F("ap_pass"), ap_pass);
-	settings_read(F("ip_addr"),    ip_addr_settings.ip_addr);
-	settings_read(F("ip_gateway"), ip_addr_settings.ip_gateway);
-	settings_read(F("ip_mask"),    ip_addr_settings.ip_mask);
-	settings_read(F("dns_1"),      ip_addr_settings.dns1);
-	settings_read(F("dns_2"),      ip_addr_settings.dns2);
+
+	ip_config_record_t rec;
+	if(settings_get(F("ip_config"), rec, IP_CONFIG_VERSION))
+	{
+		ip_addr_settings.ip_addr    = u32_to_ip(rec.ip_addr);
+		ip_addr_settings.ip_gateway = u32_to_ip(rec.ip_gateway);
+		ip_addr_settings.ip_mask    = u32_to_ip(rec.ip_mask);
+		ip_addr_settings.dns1       = u32_to_ip(rec.dns1);
+		ip_addr_settings.dns2       = u32_to_ip(rec.dns2);
+	}
+	else
+	{
+		// not yet stored (automatic ip configuration), or stored by older firmware
+		ip_addr_settings.clear();
+		wifi_migrate_ip_settings();
+		wifi_write_settings();
+	}
 }
 
 /**
@@ -251,11 +314,14 @@ void wifi_write_settings()
 {
 	settings_write(F("ap_name"), ap_name);
 	settings_write(F("ap_pass"), ap_pass);
-	settings_write(F("ip_addr"),    ip_addr_settings.ip_addr);
-	settings_write(F("ip_gateway"), ip_addr_settings.ip_gateway);
-	settings_write(F("ip_mask"),    ip_addr_settings.ip_mask);
-	settings_write(F("dns_1"),      ip_addr_settings.dns1);
-	settings_write(F("dns_2"),      ip_addr_settings.dns2);
+
+	ip_config_record_t rec;
+	rec.ip_addr    = ip_to_u32(ip_addr_settings.ip_addr);
+	rec.ip_gateway = ip_to_u32(ip_addr_settings.ip_gateway);
+	rec.ip_mask    = ip_to_u32(ip_addr_settings.ip_mask);
+	rec.dns1       = ip_to_u32(ip_addr_settings.dns1);
+	rec.dns2       = ip_to_u32(ip_addr_settings.dns2);
+	settings_put(F("ip_config"), rec, IP_CONFIG_VERSION);
 }
 
 const String & wifi_get_ap_name()
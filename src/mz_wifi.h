@@ -3,6 +3,7 @@
 #include <WiFi.h>
 #include <limits.h>
 
+void wifi_early_setup();
 void wifi_setup();
 void wifi_check();
 void wifi_wps();
@@ -6,29 +6,97 @@
 
 /**
  * pendulum scheduling class
+ * pendulums are kept in a binary min-heap ordered by their next tick,
+ * so the check costs O(1) unless some events are due, and insertion
+ * and removal cost O(log n).
  * */
 class pendulum_scheduler_t
 {
-	std::vector<pendulum_t *> pendulums; // array of pendulums
+	std::vector<pendulum_t *> heap; // min-heap of scheduled pendulums
+	pendulum_t * firing = nullptr; // the pendulum whose handler is currently running
+
+	//! compare two pendulums' next tick. wrap-around safe.
+	static bool earlier(const pendulum_t * a, const pendulum_t * b)
+	{
+		return (int32_t)(a->next_tick - b->next_tick) < 0;
+	}
+
+	void place(size_t i, pendulum_t * pendulum)
+	{
+		heap[i] = pendulum;
+		pendulum->heap_index = (int)i;
+	}
+
+	void sift_up(size_t i)
+	{
+		pendulum_t * pendulum = heap[i];
+		while(i > 0)
+		{
+			size_t parent = (i - 1) / 2;
+			if(!earlier(pendulum, heap[parent])) break;
+			place(i, heap[parent]);
+			i = parent;
+		}
+		place(i, pendulum);
+	}
+
+	void sift_down(size_t i)
+	{
+		pendulum_t * pendulum = heap[i];
+		size_t size = heap.size();
+		while(true)
+		{
+			size_t child = i * 2 + 1;
+			if(child >= size) break;
+			if(child + 1 < size && earlier(heap[child + 1], heap[child])) ++ child;
+			if(!earlier(heap[child], pendulum)) break;
+			place(i, heap[child]);
+			i = child;
+		}
+		place(i, pendulum);
+	}
+
+	//! remove the pendulum at given heap index
+	void remove_at(size_t i)
+	{
+		pendulum_t * pendulum = heap[i];
+		pendulum_t * last = heap.back();
+		heap.pop_back();
+		pendulum->heap_index = -1;
+		if(last == pendulum) return; // it was the last one
+		place(i, last);
+		sift_down(i);
+		sift_up(last->heap_index);
+	}
+
 public:
 	/**
-	 * check all pendulum interval and fire event if the period is reached.
+	 * check the earliest pendulums and fire events if the period is reached.
 	 * this method should be called 1ms intervally.
 	 * */
 	void check()
 	{
-		size_t i;
-		// scan for all pendulums for the timeout.
-		// this is not optimal. but it works well if the total timer consumer
-		// is small.
 		uint32_t tick = millis();
-		for(i = 0; i < pendulums.size(); ++i)
+		while(heap.size())
 		{
-			pendulum_t * pen = pendulums[i];
-			// always use [] operator; not iterator.
-			// because the array will be changed during pen->check()
-			if(pen) pen->check(tick);
-		} 
+			pendulum_t * pen = heap[0];
+			if((int32_t)(pen->next_tick - tick) > 0) break; // the earliest one is not due yet
+
+			// take the pendulum out of the heap while its handler is running,
+			// so the handler can freely add, remove or restart any pendulum,
+			// including the pendulum itself.
+			remove_at(0);
+			firing = pen;
+			pen->callback();
+			if(firing != pen) continue; // stopped, restarted or deleted in the handler
+			firing = nullptr;
+
+			if(!pen->oneshot)
+			{
+				pen->advance(tick);
+				add(pen);
+			}
+		}
 	}
 
 protected:
@@ -38,14 +106,11 @@ protected:
 	void add(pendulum_t * pendulum)
 	{
 //		printf("pendulum add : %p\n", pendulum);
-		// search for nullptr slot
-		for(auto && v : pendulums)
-		{
-			if(v == nullptr) v = pendulum;
-			return;
-		}
-		// nullptr slot not found; append one
-		pendulums.push_back(pendulum);
+		if(pendulum == firing) firing = nullptr; // restarted from its own handler
+		if(pendulum->heap_index >= 0) remove_at(pendulum->heap_index); // already scheduled
+		heap.push_back(pendulum);
+		pendulum->heap_index = (int)heap.size() - 1;
+		sift_up(pendulum->heap_index);
 	}
 
 	/**
@@ -54,17 +119,8 @@ protected:
 	void remove(pendulum_t *pendulum)
 	{
 //		printf("pendulum remove : %p\n", pendulum);
-		// search for the pendulum;
-		// if found, do not erase, instead, put nullptr;
-		// because the instance will be removed during the iteration.
-		for(auto && v : pendulums)
-		{
-			if(v == pendulum)
-			{
-				v = nullptr;
-				return;
-			}
-		}
+		if(pendulum == firing) firing = nullptr; // removed from its own handler
+		if(pendulum->heap_index >= 0) remove_at(pendulum->heap_index);
 	}
 
 	friend class pendulum_t;
@@ -82,8 +138,9 @@ void poll_pendulum()
 	END_EVERY_MS
 }
 
-pendulum_t::pendulum_t(pendulum_t::callback_t _callback, uint32_t _interval_ms) :
-	 interval(_interval_ms), next_tick(millis() + _interval_ms), callback(_callback)
+pendulum_t::pendulum_t(pendulum_t::callback_t _callback, uint32_t _interval_ms, bool _oneshot) :
+	 interval(_interval_ms ? _interval_ms : 1), next_tick(millis() + interval),
+	 callback(_callback), oneshot(_oneshot)
 {
 	pendulum_scheduler.add(this);
 }
@@ -93,16 +150,23 @@ pendulum_t::~pendulum_t()
 	pendulum_scheduler.remove(this);
 }
 
-void pendulum_t::check(uint32_t tick)
+void pendulum_t::start()
+{
+	next_tick = millis() + interval;
+	pendulum_scheduler.add(this);
+}
+
+void pendulum_t::stop()
+{
+	pendulum_scheduler.remove(this);
+}
+
+void pendulum_t::advance(uint32_t tick)
 {
 //	printf("pendulum: id:%p interval:%lu, next_tick:%lu, tick:%lu\n",
 //		this, (unsigned long)interval, (unsigned long)next_tick, (unsigned long)tick);
-	if((int32_t)(next_tick - tick) <= 0)
-	{
-		// timed out
-		callback();
-		next_tick += interval;
-		while((int32_t)(next_tick - tick) <= 0) next_tick += interval; // handles next tick has already been past
-	}
+	// keep the phase; the next tick is always a multiple of the interval
+	// from the original start, skipping ticks that have already been past.
+	next_tick += interval;
+	while((int32_t)(next_tick - tick) <= 0) next_tick += interval;
 }
-
@@ -16,12 +16,29 @@ public:
 protected:
 	callback_t callback;
 
+private:
+	int heap_index = -1; //!< index in the scheduler's heap; -1 = not scheduled
+	bool oneshot; //!< true if the pendulum fires only once per start()
+
 public: // check pendulum handler does not call blocking functions
-	pendulum_t(callback_t _callback, uint32_t _interval_ms);
+	pendulum_t(callback_t _callback, uint32_t _interval_ms, bool _oneshot = false);
 	~pendulum_t();
 
+	//! (Re)start the pendulum; the next event will be fired after the interval.
+	//! This can safely be called from any pendulum handler, including its own.
+	void start();
+
+	//! Stop the pendulum. This can safely be called from any pendulum handler.
+	void stop();
+
+	//! Change the interval. The new interval is effective from the next start().
+	void set_interval(uint32_t _interval_ms) { interval = _interval_ms ? _interval_ms : 1; }
+
+	//! Returns whether the pendulum is waiting for its next event
+	bool is_pending() const { return heap_index >= 0; }
+
 private:
-	void check(uint32_t check);
+	void advance(uint32_t tick);
 
 	friend class pendulum_scheduler_t;
 };
@@ -0,0 +1,363 @@
+#include <Arduino.h>
+#include <lwip/sockets.h>
+#include <freertos/semphr.h>
+#include <new>
+#include "settings.h"
+#include "frame_stream.h"
+#include "remote_fb.h"
+
+static constexpr size_t FRAME_SIZE = sizeof(frame_buffer_t::array_t);
+static constexpr int JITTER_SLOTS = 4; //!< frames kept in the jitter buffer
+static constexpr int JITTER_DEPTH = 2; //!< complete frames to buffer before playing
+static constexpr uint32_t REMOTE_FB_TIMEOUT_MS = 3000; //!< silence to end a push
+static constexpr uint32_t REMOTE_FB_STACK_SIZE = 4096;
+static constexpr int RECEIVE_TIMEOUT_MS = 200; //!< to notice port changes
+
+static constexpr uint16_t REMOTE_FB_PORT_VERSION = 1;
+static const char REMOTE_FB_PORT_KEY[] = "remote_fb_port";
+
+//! a frame being received or waiting to be played
+struct jitter_slot_t
+{
+	bool used;
+	uint16_t seq;
+	uint8_t type;
+	uint8_t frag_count;
+	uint8_t frag_mask; //!< bit n is set when fragment n has been received
+	uint16_t len; //!< payload length
+	uint8_t data[REMOTE_FB_MAX_FRAGMENTS * REMOTE_FB_FRAGMENT_SIZE];
+
+	bool complete() const { return frag_mask == (1u << frag_count) - 1; }
+};
+
+static jitter_slot_t * slots; //!< JITTER_SLOTS slots; allocated when receiving is enabled
+static SemaphoreHandle_t lock; //!< protects slots and the playing state
+static volatile uint16_t requested_port;
+static volatile uint32_t last_packet_ms;
+static volatile bool receiving; //!< whether a push is going on
+static volatile bool dismissed; //!< whether the user closed the remote screen during this push
+
+// playing state; protected by lock
+static bool playing; //!< false while buffering
+static bool have_played;
+static uint16_t last_played_seq;
+static bool have_decoded; //!< whether the frame of last_played_seq is on the display
+static uint16_t last_decoded_seq;
+
+// statistics
+static uint32_t packets_received;
+static uint32_t bad_packets; //!< malformed packets or payloads
+static uint32_t frames_completed;
+static uint32_t frames_played;
+static uint32_t frames_lost; //!< sequence numbers never played
+static uint32_t frames_late; //!< arrived after a newer frame was played
+static uint32_t frames_overflowed; //!< evicted from the full jitter buffer
+static uint32_t frames_undecodable; //!< delta frames without the previous frame
+static uint32_t underruns; //!< jitter buffer ran dry while playing
+
+//! whether sequence number a is older than b
+static bool seq_before(uint16_t a, uint16_t b)
+{
+	return (int16_t)(a - b) < 0;
+}
+
+//! forget all frames and start buffering again; lock must be held
+static void reset_playing()
+{
+	for(int i = 0; i < JITTER_SLOTS; ++i) slots[i].used = false;
+	playing = false;
+	have_played = false;
+	have_decoded = false;
+}
+
+//! store a fragment in the jitter buffer
+static void receive_packet(const uint8_t * p, size_t size)
+{
+	++ packets_received;
+	if(size < REMOTE_FB_HEADER_SIZE || p[0] != 'P') { ++ bad_packets; return; }
+
+	uint8_t type = p[1];
+	uint16_t seq = p[2] | (p[3] << 8);
+	uint8_t index = p[4];
+	uint8_t count = p[5];
+	uint16_t len = p[6] | (p[7] << 8);
+	size_t frag_size = size - REMOTE_FB_HEADER_SIZE;
+	size_t offset = index * REMOTE_FB_FRAGMENT_SIZE;
+	if((type != FRAME_RAW && type != FRAME_DELTA) ||
+		count == 0 || count > REMOTE_FB_MAX_FRAGMENTS || index >= count ||
+		(type == FRAME_RAW && len != FRAME_SIZE) || len == 0 ||
+		(len + REMOTE_FB_FRAGMENT_SIZE - 1) / REMOTE_FB_FRAGMENT_SIZE != count ||
+		frag_size != (index == count - 1 ? len - offset : REMOTE_FB_FRAGMENT_SIZE))
+	{
+		++ bad_packets;
+		return;
+	}
+
+	xSemaphoreTake(lock, portMAX_DELAY);
+
+	uint32_t now = millis();
+	if(!receiving || now - last_packet_ms > REMOTE_FB_TIMEOUT_MS)
+	{
+		// a new push begins
+		reset_playing();
+		dismissed = false;
+	}
+	last_packet_ms = now;
+	receiving = true;
+
+	if(have_played && !seq_before(last_played_seq, seq))
+	{
+		++ frames_late;
+		xSemaphoreGive(lock);
+		return;
+	}
+
+	// find the slot of the frame, or take a free one or the oldest one
+	jitter_slot_t * slot = nullptr;
+	jitter_slot_t * oldest = nullptr;
+	for(int i = 0; i < JITTER_SLOTS; ++i)
+	{
+		jitter_slot_t & s = slots[i];
+		if(!s.used) { if(!slot) slot = &s; continue; }
+		if(s.seq == seq) { slot = &s; break; }
+		if(!oldest || seq_before(s.seq, oldest->seq)) oldest = &s;
+	}
+	if(!slot)
+	{
+		slot = oldest;
+		++ frames_overflowed;
+	}
+	if(!slot->used || slot->seq != seq)
+	{
+		slot->used = true;
+		slot->seq = seq;
+		slot->type = type;
+		slot->frag_count = count;
+		slot->frag_mask = 0;
+		slot->len = len;
+	}
+	else if(slot->type != type || slot->frag_count != count || slot->len != len)
+	{
+		++ bad_packets; // inconsistent with the other fragments
+		xSemaphoreGive(lock);
+		return;
+	}
+
+	if(!(slot->frag_mask & (1u << index)))
+	{
+		memcpy(slot->data + offset, p + REMOTE_FB_HEADER_SIZE, frag_size);
+		slot->frag_mask |= 1u << index;
+		if(slot->complete()) ++ frames_completed;
+	}
+
+	xSemaphoreGive(lock);
+}
+
+static int open_socket(uint16_t port)
+{
+	int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if(sock < 0) return -1;
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	struct timeval tv = { 0, RECEIVE_TIMEOUT_MS * 1000 };
+	if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
+	{
+		close(sock);
+		return -1;
+	}
+	printf("Remote frame buffer: listening at UDP port %u.\n", (unsigned)port);
+	return sock;
+}
+
+static void remote_fb_task(void *)
+{
+	// one more byte than the largest packet, to detect larger ones
+	static uint8_t packet[REMOTE_FB_HEADER_SIZE + REMOTE_FB_FRAGMENT_SIZE + 1];
+	int sock = -1;
+	uint16_t bound_port = 0;
+	for(;;)
+	{
+		uint16_t port = requested_port;
+		if(port != bound_port)
+		{
+			if(sock >= 0) close(sock);
+			sock = -1;
+			bound_port = 0;
+			if(port && slots) sock = open_socket(port);
+			if(sock >= 0) bound_port = port;
+		}
+		if(sock < 0)
+		{
+			vTaskDelay(pdMS_TO_TICKS(500));
+			continue;
+		}
+
+		int n = recv(sock, packet, sizeof(packet), 0);
+		if(n > 0) receive_packet(packet, n);
+		if(receiving && millis() - last_packet_ms > REMOTE_FB_TIMEOUT_MS)
+			receiving = false; // the push has ended
+	}
+}
+
+//! apply run-length encoded XOR delta to fb. returns false if malformed
+static bool apply_delta(uint8_t * fb, const uint8_t * p, size_t len)
+{
+	if(len % 2) return false;
+	size_t pos = 0;
+	for(size_t i = 0; i < len; i += 2)
+	{
+		size_t n = p[i];
+		uint8_t v = p[i + 1];
+		if(n == 0 || pos + n > FRAME_SIZE) return false;
+		while(n--) fb[pos++] ^= v;
+	}
+	return pos == FRAME_SIZE;
+}
+
+bool remote_fb_pull(frame_buffer_t & fb, frame_buffer_t & current)
+{
+	if(!slots) return false;
+	xSemaphoreTake(lock, portMAX_DELAY);
+
+	// find the oldest complete frame
+	jitter_slot_t * next = nullptr;
+	int complete = 0;
+	for(int i = 0; i < JITTER_SLOTS; ++i)
+	{
+		jitter_slot_t & s = slots[i];
+		if(!s.used || !s.complete()) continue;
+		++ complete;
+		if(!next || seq_before(s.seq, next->seq)) next = &s;
+	}
+
+	if(!playing)
+	{
+		// buffer some frames to absorb jitter
+		if(complete < JITTER_DEPTH) { xSemaphoreGive(lock); return false; }
+		playing = true;
+	}
+	if(!next)
+	{
+		++ underruns;
+		playing = false;
+		xSemaphoreGive(lock);
+		return false;
+	}
+
+	// incomplete frames older than this will never be played
+	for(int i = 0; i < JITTER_SLOTS; ++i)
+	{
+		jitter_slot_t & s = slots[i];
+		if(s.used && seq_before(s.seq, next->seq)) s.used = false;
+	}
+	if(have_played && next->seq != (uint16_t)(last_played_seq + 1))
+		frames_lost += (uint16_t)(next->seq - last_played_seq - 1);
+
+	bool drawn = false;
+	uint8_t * dst = &fb.array()[0][0];
+	if(next->type == FRAME_RAW)
+	{
+		memcpy(dst, next->data, FRAME_SIZE);
+		drawn = true;
+	}
+	else if(have_decoded && next->seq == (uint16_t)(last_decoded_seq + 1))
+	{
+		memcpy(dst, current.array(), FRAME_SIZE);
+		drawn = apply_delta(dst, next->data, next->len);
+		if(!drawn) ++ bad_packets;
+	}
+	else
+	{
+		++ frames_undecodable;
+	}
+
+	if(drawn)
+	{
+		have_decoded = true;
+		last_decoded_seq = next->seq;
+		++ frames_played;
+	}
+	else
+	{
+		have_decoded = false; // wait for a raw frame
+	}
+	have_played = true;
+	last_played_seq = next->seq;
+	next->used = false;
+
+	xSemaphoreGive(lock);
+	return drawn;
+}
+
+bool remote_fb_active()
+{
+	return receiving && !dismissed;
+}
+
+void remote_fb_dismiss()
+{
+	dismissed = true;
+}
+
+//! allocate the jitter buffer if not yet, and tell the receiver task the port
+static void listen_at(uint16_t port)
+{
+	if(port && !slots)
+	{
+		slots = new (std::nothrow) jitter_slot_t[JITTER_SLOTS];
+		if(!slots)
+		{
+			printf("Remote frame buffer: no memory for the jitter buffer.\n");
+			return;
+		}
+		xSemaphoreTake(lock, portMAX_DELAY);
+		reset_playing();
+		xSemaphoreGive(lock);
+	}
+	requested_port = port;
+}
+
+void remote_fb_set_port(uint16_t port)
+{
+	settings_put(REMOTE_FB_PORT_KEY, port, REMOTE_FB_PORT_VERSION);
+	listen_at(port);
+}
+
+uint16_t remote_fb_get_port()
+{
+	return requested_port;
+}
+
+void remote_fb_setup()
+{
+	lock = xSemaphoreCreateMutex();
+	uint16_t port = 0; // disabled unless configured
+	settings_get(REMOTE_FB_PORT_KEY, port, REMOTE_FB_PORT_VERSION);
+	listen_at(port);
+	xTaskCreateUniversal(remote_fb_task, "remote_fb", REMOTE_FB_STACK_SIZE, nullptr,
+		1, nullptr, CONFIG_ARDUINO_RUNNING_CORE);
+}
+
+void remote_fb_dump_stats()
+{
+	printf("--- remote frame buffer ---\n");
+	if(requested_port)
+		printf("UDP port       : %u\n", (unsigned)requested_port);
+	else
+		printf("UDP port       : (disabled)\n");
+	printf("Receiving      : %s\n", receiving ? (dismissed ? "yes (dismissed)" : "yes") : "no");
+	printf("Packets        : %lu\n", (unsigned long)packets_received);
+	printf("Bad packets    : %lu\n", (unsigned long)bad_packets);
+	printf("Frames         : %lu\n", (unsigned long)frames_completed);
+	printf("Played         : %lu\n", (unsigned long)frames_played);
+	printf("Lost           : %lu\n", (unsigned long)frames_lost);
+	printf("Late           : %lu\n", (unsigned long)frames_late);
+	printf("Overflowed     : %lu\n", (unsigned long)frames_overflowed);
+	printf("Undecodable    : %lu\n", (unsigned long)frames_undecodable);
+	printf("Underruns      : %lu\n", (unsigned long)underruns);
+}
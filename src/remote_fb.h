@@ -0,0 +1,62 @@
+#pragma once
+
+#include <Arduino.h>
+#include "frame_buffer.h"
+
+/**
+ * Frames pushed from the network by external content producers.
+ *
+ * A receiver task listens on a UDP port, reassembles frames from their
+ * fragments and keeps them in a small jitter buffer. The remote screen
+ * of the UI pulls one frame per draw (every 50ms) by remote_fb_pull(),
+ * so producers should not send more than 20 frames per second.
+ *
+ * Each datagram consists of an 8-byte header followed by a fragment:
+ *
+ *   u8  'P'
+ *   u8  type; FRAME_RAW or FRAME_DELTA (see frame_stream.h)
+ *   u16 sequence number, little endian; incremented by each frame
+ *   u8  fragment index
+ *   u8  fragment count; 1 to REMOTE_FB_MAX_FRAGMENTS
+ *   u16 frame payload length in bytes, little endian
+ *
+ * The fragment holds the frame payload from index * REMOTE_FB_FRAGMENT_SIZE;
+ * all fragments but the last are REMOTE_FB_FRAGMENT_SIZE bytes long.
+ * The payload is the same as of the frame stream: FRAME_RAW is 64 * 48
+ * levels, and FRAME_DELTA is the run-length encoded XOR with the frame of
+ * the previous sequence number. A delta frame can not be shown if the
+ * previous frame was lost; it is dropped until the next raw frame, so
+ * producers should send a raw frame every second or so.
+ *
+ * Receiving is disabled unless a port is set by remote_fb_set_port().
+ * */
+
+static constexpr size_t REMOTE_FB_HEADER_SIZE = 8;
+static constexpr size_t REMOTE_FB_FRAGMENT_SIZE = 1024; //!< fits in one ethernet frame
+static constexpr int REMOTE_FB_MAX_FRAGMENTS = 6; //!< a delta payload is 6144 bytes at most
+
+//! read the port from the settings and start the receiver task
+void remote_fb_setup();
+
+//! set the UDP port to receive frames at and save it; 0 disables receiving
+void remote_fb_set_port(uint16_t port);
+
+//! returns the UDP port; 0 = disabled
+uint16_t remote_fb_get_port();
+
+//! whether frames are being pushed and the remote screen is wanted
+bool remote_fb_active();
+
+//! stop showing the current push; it is shown again after the producer pauses
+void remote_fb_dismiss();
+
+/**
+ * decode the next frame from the jitter buffer into fb. current must be
+ * the frame on the display; delta frames are applied over it. returns
+ * whether fb has been written and should be shown.
+ * call from the main thread.
+ * */
+bool remote_fb_pull(frame_buffer_t & fb, frame_buffer_t & current);
+
+//! show receiving and jitter buffer statistics
+void remote_fb_dump_stats();
@@ -5,97 +5,454 @@
 #include "settings.h"
 #include "microtar.h"
 #include "spiffs_fs.h"
+#include "pendulum.h"
+#include "settings_store.h"
+#include "threadsync.h"
 #include <rom/crc.h>
+#include <map>
+#include <algorithm>
 
 static const String SETTINGS_PART_LABEL(F("conf")); // partition label
-static const String SETTINGS_MOUNT_POINT(F("/settings")); // mount point
+static const String SETTINGS_MOUNT_POINT(F("/settings")); // mount point of the old SPIFFS layout
+//! settings taken over from the old SPIFFS layout, kept on the main
+//! filesystem until they are in the store; see init_settings()
+static const String MIGRATION_STASH_NAME(F("/.settings_migration.tar"));
+static const String MIGRATION_STASH_TEMP_NAME(F("/.settings_migration.tmp"));
 
-fs::ANY_SPIFFSFS SETTINGS_SPIFFS;
+static constexpr size_t MAX_KEY_LEN = 30;
+static constexpr int CHECKSUM_SIZE = sizeof(uint32_t); // in bytes
 
-void init_settings()
+//! initial value for crc.
+//! 0x00000000 or 0xffffffff is not suitable because it is
+//! indistinguishable from all-cleared RAM or all-cleared FLASH ROM.
+static constexpr uint32_t INITIAL_CRC_VALUE = 0x12345678;
+
+//! delay from the last write to flushing dirty settings to the flash
+static constexpr uint32_t FLUSH_DELAY_MS = 3000;
+//! maximum delay from the first unflushed write to flushing
+static constexpr uint32_t MAX_FLUSH_DELAY_MS = 15000;
+//! values larger than this are not kept in RAM once written to the flash
+static constexpr size_t MAX_CACHED_VALUE_SIZE = 128;
+//! interval of erasing the standby half of the store in background
+static constexpr uint32_t PREPARE_INTERVAL_MS = 100;
+
+/**
+ * in-RAM index entry of a setting.
+ * value holds the payload followed by an extra '\0', so the value
+ * can be used as a C string. large values are not kept in RAM
+ * (value is empty) and are read from the store on demand.
+ * */
+struct settings_entry_t
 {
-	puts("Settings store initializing ...");
-    SETTINGS_SPIFFS.begin(true, SETTINGS_PART_LABEL.c_str(), SETTINGS_MOUNT_POINT.c_str(), 2);
+	std::vector<uint8_t> value; //!< payload + '\0', or empty if not in RAM
+	size_t size = 0; //!< payload size
+	uint32_t offset = 0; //!< value offset in the store; 0 = not yet written
+	bool dirty = false; //!< whether the value is not yet written to the store
+	bool removed = false; //!< removed but the removal is not yet written to the store
+
+	bool in_ram() const { return !value.empty(); }
+	const uint8_t * data() const { return value.data(); }
+	void assign(const void * ptr, size_t _size)
+	{
+		const uint8_t * p = reinterpret_cast<const uint8_t *>(ptr);
+		value.assign(p, p + _size);
+		value.push_back(0);
+		size = _size;
+	}
+	void release_large()
+	{
+		if(size > MAX_CACHED_VALUE_SIZE) std::vector<uint8_t>().swap(value);
+	}
+};
+
+//! header of a typed setting value; see settings_put()
+struct settings_schema_header_t
+{
+	uint16_t version; //!< schema version given by the writer
+	uint16_t size; //!< size of the value following this header
+};
+
+static settings_partition_flash_t settings_flash(SETTINGS_PART_LABEL.c_str());
+static settings_store_t store(settings_flash);
+
+//! all settings, indexed at init_settings()
+static std::map<String, settings_entry_t> cache;
+static pendulum_t * flush_pendulum;
+static pendulum_t * prepare_pendulum;
+static uint32_t first_dirty_millis; //!< millis() at the first unflushed write
+
+//! statistics
+static uint32_t flash_read_count; //!< values read from the store
+static uint32_t flash_write_count; //!< records appended to the store
+static uint32_t compaction_count; //!< compactions of the store
+static uint32_t read_count; //!< reads served from the cache
+static uint32_t write_count; //!< write requests
+static uint32_t unchanged_write_count; //!< write requests with unchanged value
+static uint32_t coalesced_write_count; //!< writes superseded before flushing
+
+
+//! find a live entry of the key, or nullptr
+static settings_entry_t * find_entry(const String & key)
+{
+	auto it = cache.find(key);
+	if(it == cache.end() || it->second.removed) return nullptr;
+	return &it->second;
 }
 
-void clear_settings()
+//! erase the standby half of the store in background, a sector at a time
+static void start_preparing_store()
 {
-	SETTINGS_SPIFFS.format(SETTINGS_PART_LABEL.c_str());
+	if(!prepare_pendulum)
+	{
+		prepare_pendulum = new pendulum_t([] () {
+			if(!store.prepare_step()) prepare_pendulum->stop();
+		}, PREPARE_INTERVAL_MS);
+		return;
+	}
+	if(!prepare_pendulum->is_pending()) prepare_pendulum->start();
 }
 
-static constexpr size_t MAX_KEY_LEN = 30;
-static constexpr int CHECKSUM_SIZE = sizeof(uint32_t); // in bytes
+//! write all settings into a fresh half of the store
+static bool compact_store()
+{
+	// removed entries are simply not carried over
+	for(auto it = cache.begin(); it != cache.end(); )
+	{
+		if(it->second.removed) it = cache.erase(it); else ++ it;
+	}
 
-//! initial value for crc.
-//! 0x00000000 or 0xffffffff is not suitable because it is
-//! indistinguishable from all-cleared RAM or all-cleared FLASH ROM.
-static constexpr uint32_t INITIAL_CRC_VALUE = 0x12345678;
+	std::vector<settings_store_t::live_t> entries;
+	entries.reserve(cache.size());
+	for(auto && it : cache)
+	{
+		settings_store_t::live_t e;
+		e.key = &it.first;
+		e.value = it.second.in_ram() ? it.second.data() : nullptr;
+		e.offset = it.second.offset;
+		e.size = it.second.size;
+		e.new_offset = 0;
+		entries.push_back(e);
+	}
+	if(!store.compact(entries))
+	{
+		puts("Settings: store compaction failed.");
+		start_preparing_store();
+		return false;
+	}
+
+	size_t i = 0;
+	for(auto && it : cache)
+	{
+		it.second.offset = entries[i++].new_offset;
+		it.second.dirty = false;
+		it.second.release_large();
+	}
+	++ compaction_count;
+	start_preparing_store();
+	return true;
+}
+
+//! index all settings in the store. returns false if the store is not formatted
+static bool load_cache()
+{
+	cache.clear();
+	return store.mount([] (const String & key, const uint8_t * value, size_t size, uint32_t offset) {
+		// later records supersede earlier ones
+		if(!value) { cache.erase(key); return; }
+		settings_entry_t & entry = cache[key];
+		entry.assign(value, size);
+		entry.offset = offset;
+		entry.release_large();
+	});
+}
+
+//! whether the name can be a setting key; hidden names are not settings
+static bool is_valid_key(const String & key)
+{
+	return key.length() != 0 && key.length() <= MAX_KEY_LEN && key[0] != '.';
+}
+
+//! whether all settings are written to the store
+static bool is_flushed()
+{
+	for(auto && it : cache)
+		if(it.second.dirty) return false;
+	return true;
+}
 
-//! check checksum for a setting.
-//! file pointer is set just after the setting checksum.
-//! returns whether the check sum is valid.
-static bool settings_check_crc(File & file)
+//! read a setting file of the old SPIFFS layout into the entry,
+//! verifying the checksum at its head in the same pass.
+//! returns whether the read succeeded and the check sum is valid.
+static bool read_crc_file(File & file, settings_entry_t & entry)
 {
 	uint32_t file_crc = 0;
 	if(file.read(reinterpret_cast<uint8_t *>(&file_crc), CHECKSUM_SIZE) != CHECKSUM_SIZE)
 		return false; // read error
 
-	uint8_t ibuf[64];
-	uint32_t crc = INITIAL_CRC_VALUE;
+	size_t size = file.size() - CHECKSUM_SIZE;
+	entry.value.resize(size + 1);
+	entry.size = size;
+	if(size != file.read(entry.value.data(), size)) return false; // read error
+	entry.value[size] = 0;
+
+	uint32_t crc = crc32_le(INITIAL_CRC_VALUE, entry.data(), size);
+//	printf("file checksum: %08x   computed checksum: %08x\r\n", file_crc, crc); 
+	return crc == file_crc;
+}
+
+/**
+ * read all settings from the old one-file-per-key SPIFFS layout, if the
+ * partition still has it. setting files have a checksum at their head;
+ * IR remote data under /rmt/ are raw. the console history is dropped.
+ * */
+static void read_spiffs_settings()
+{
+	const char rootstr[2] = { '/', 0 };
+	const String rmt_prefix(F("rmt/"));
 
-	while(true)
+	fs::ANY_SPIFFSFS spiffs;
+	if(!spiffs.begin(false, SETTINGS_PART_LABEL.c_str(), SETTINGS_MOUNT_POINT.c_str(), 2))
+		return; // not a SPIFFS; maybe a blank partition
+
+	puts("Settings: migrating from SPIFFS ...");
+	File dir = spiffs.open(rootstr);
+	File file;
+	while(dir && !!(file = dir.openNextFile()))
 	{
-		size_t isz = file.read(ibuf, sizeof(ibuf));
-		if(isz == 0) break;
-		crc = crc32_le(crc, ibuf, isz);
-	}
+		String key = file.name();
+		if(key.startsWith(rootstr)) key = key.substring(1);
+		bool raw = key.startsWith(rmt_prefix);
+		if(!is_valid_key(key) || (!raw && key.indexOf('/') != -1))
+		{
+			file.close();
+			continue;
+		}
 
-	file.seek(CHECKSUM_SIZE); // set file pointer just after the check sum
+		settings_entry_t & entry = cache[key];
+		entry.dirty = true;
+		bool success;
+		if(raw)
+		{
+			size_t size = file.size();
+			entry.value.resize(size + 1);
+			entry.size = size;
+			success = size == file.read(entry.value.data(), size);
+			entry.value[size] = 0;
+		}
+		else
+		{
+			success = read_crc_file(file, entry);
+		}
+		if(!success) cache.erase(key); // read error or broken
+		file.close();
+	}
+	spiffs.end();
+	printf("Settings: %d items read from SPIFFS.\n", (int)cache.size());
+}
 
-//	printf("file checksum: %08x   computed checksum: %08x\r\n", file_crc, crc); 
-	return crc == file_crc;
+//! stash the settings read from the old layout on the main filesystem.
+//! the stash is written under a temporary name first, so that a stash
+//! under the final name is always complete.
+static bool write_migration_stash()
+{
+	FS.remove(MIGRATION_STASH_TEMP_NAME);
+	if(!settings_export(MIGRATION_STASH_TEMP_NAME, String())) return false;
+	return FS.rename(MIGRATION_STASH_TEMP_NAME, MIGRATION_STASH_NAME);
 }
 
+void settings_flush()
+{
+	if(flush_pendulum) flush_pendulum->stop();
+	for(auto it = cache.begin(); it != cache.end(); )
+	{
+		settings_entry_t & entry = it->second;
+		if(!entry.dirty) { ++ it; continue; }
+
+		uint32_t offset = 0;
+		bool written;
+		if(entry.removed)
+			written = store.append_removal(it->first);
+		else
+			written = 0 != (offset = store.append(it->first, entry.data(), entry.size));
+		if(!written)
+		{
+			// the store is full or needs recovery; compaction writes
+			// all settings including this and the rest
+			if(!compact_store()) printf("Settings: writing '%s' failed.\n", it->first.c_str());
+			return;
+		}
+		++ flash_write_count;
+		if(entry.removed) { it = cache.erase(it); continue; }
+		entry.offset = offset;
+		entry.dirty = false;
+		entry.release_large();
+		++ it;
+	}
+}
 
-// write checksum 
+//! schedule flushing; the flush is postponed while writes continue,
+//! up to MAX_FLUSH_DELAY_MS.
+static void schedule_flush()
+{
+	if(!flush_pendulum)
+	{
+		first_dirty_millis = millis();
+		flush_pendulum = new pendulum_t(settings_flush, FLUSH_DELAY_MS, true);
+		return;
+	}
+	if(!flush_pendulum->is_pending())
+	{
+		first_dirty_millis = millis();
+		flush_pendulum->start();
+	}
+	else if(millis() - first_dirty_millis < MAX_FLUSH_DELAY_MS - FLUSH_DELAY_MS)
+	{
+		flush_pendulum->start(); // postpone
+	}
+}
 
-//! write a non-string setting to specified settings entry
-bool settings_write(const String & _key, const void * ptr, size_t size, settings_overwrite_t overwrite)
+void init_settings()
 {
-	if(_key.length()  > MAX_KEY_LEN) return false;
-	String key = String(F("/")) + _key;
+	puts("Settings store initializing ...");
+	if(!settings_flash.valid())
+	{
+		puts("Settings: partition not found.");
+		return;
+	}
 
-	if(overwrite.overwrite == false)
+	bool loaded = load_cache();
+	if(!loaded)
 	{
-		// check key existence
-		const char mode[2]  = { 'r',  0  };
-		File file = SETTINGS_SPIFFS.open(key, mode);
-		if(file)
+		// no valid store; take over the old layout if any, then format.
+		// the old layout shares the partition with the store, so the
+		// settings read from it are stashed on the main filesystem first
+		// and removed only once they are in the store. a stash found here
+		// is from a migration cut short; what is left of the old layout
+		// may already be erased.
+		if(!FS.exists(MIGRATION_STASH_NAME))
 		{
-			if(settings_check_crc(file))
+			read_spiffs_settings();
+			if(cache.size() && !write_migration_stash())
 			{
-				// valid key already exists; do not overwrite.
-				file.close();
-				return false;
+				// the old layout is kept intact; retried at the next boot
+				puts("Settings: stashing the old settings failed; running without the store.");
+				return;
 			}
 		}
-		file.close();	
+		cache.clear();
+		if(!store.format())
+		{
+			puts("Settings: formatting the store failed.");
+			return;
+		}
 	}
 
-	const char mode[2]  = { 'w',  0  };
-	File file = SETTINGS_SPIFFS.open(key, mode);
-	if(!file) return false;
+	if(FS.exists(MIGRATION_STASH_NAME))
+	{
+		puts("Settings: taking over the stashed settings ...");
+		if(settings_import(MIGRATION_STASH_NAME))
+			FS.remove(MIGRATION_STASH_NAME);
+		else
+			puts("Settings: taking over failed; retried at the next boot.");
+	}
+	else if(loaded && store.needs_compaction())
+	{
+		puts("Settings: broken record found; recovering ...");
+		compact_store();
+	}
+	else
+	{
+		start_preparing_store();
+	}
+	printf("Settings: %d items loaded.\n", (int)cache.size());
+}
+
+void clear_settings()
+{
+	if(flush_pendulum) flush_pendulum->stop();
+	cache.clear();
+	if(settings_flash.valid()) settings_flash.erase(0, settings_flash.size());
+	FS.remove(MIGRATION_STASH_NAME);
+}
 
-	uint32_t crc = INITIAL_CRC_VALUE;
-	crc = crc32_le(crc, reinterpret_cast<const uint8_t *>(ptr), size);
-	bool success;
-	success = CHECKSUM_SIZE == file.write(reinterpret_cast<const uint8_t *>(&crc), CHECKSUM_SIZE);
-	if(!success) { file.close(); return false; }
+int settings_get_size(const String & key)
+{
+	const settings_entry_t * entry = find_entry(key);
+	if(!entry) return -1;
+	return (int)entry->size;
+}
 
-	success = size == file.write(reinterpret_cast<const uint8_t *>(ptr), size);
+bool settings_remove(const String & key)
+{
+	settings_entry_t * entry = find_entry(key);
+	if(!entry) return false;
 
-	file.close();
-	return success;
+	++ write_count;
+	if(!entry->offset)
+	{
+		// never written to the store; just forget it
+		cache.erase(key);
+		return true;
+	}
+	std::vector<uint8_t>().swap(entry->value);
+	entry->size = 0;
+	entry->removed = true;
+	entry->dirty = true;
+	schedule_flush();
+	return true;
+}
+
+void settings_dump_stats()
+{
+	size_t dirty = 0, removed = 0;
+	for(auto && it : cache)
+	{
+		if(it.second.dirty) ++ dirty;
+		if(it.second.removed) ++ removed;
+	}
+	printf("--- settings cache ---\n");
+	printf("Cached items           : %d (%d not flushed)\n", (int)(cache.size() - removed), (int)dirty);
+	printf("Reads served from RAM  : %lu\n", (unsigned long)read_count);
+	printf("Write requests         : %lu\n", (unsigned long)write_count);
+	printf("  unchanged (skipped)  : %lu\n", (unsigned long)unchanged_write_count);
+	printf("  coalesced            : %lu\n", (unsigned long)coalesced_write_count);
+	printf("Flash value reads      : %lu\n", (unsigned long)flash_read_count);
+	printf("Flash record writes    : %lu\n", (unsigned long)flash_write_count);
+	printf("--- settings store ---\n");
+	printf("Generation             : %lu\n", (unsigned long)store.get_generation());
+	printf("Used                   : %lu / %lu bytes\n",
+		(unsigned long)store.get_used(), (unsigned long)store.get_capacity());
+	printf("Compactions            : %lu\n", (unsigned long)compaction_count);
+}
+
+
+//! write a non-string setting to specified settings entry
+bool settings_write(const String & key, const void * ptr, size_t size, settings_overwrite_t overwrite)
+{
+	if(key.length()  > MAX_KEY_LEN) return false;
+	if(size > settings_store_t::MAX_VALUE_SIZE) return false;
+
+	++ write_count;
+	auto it = cache.find(key);
+	if(it != cache.end())
+	{
+		settings_entry_t & entry = it->second;
+		if(!entry.removed)
+		{
+			// valid key already exists
+			if(overwrite.overwrite == false) return false; // do not overwrite.
+			if(entry.in_ram() && entry.size == size && !memcmp(entry.data(), ptr, size))
+				{ ++ unchanged_write_count; return true; }
+		}
+		if(entry.dirty) ++ coalesced_write_count;
+	}
+
+	settings_entry_t & entry = cache[key];
+	entry.assign(ptr, size);
+	entry.removed = false;
+	entry.dirty = true;
+	schedule_flush();
+	return true;
 }
 
 //! write a string setting to specified settings entry
@@ -107,55 +464,117 @@ bool settings_write(const String & key, const String & value, settings_overwrite
 
 
 //! read a non-string setting from specified settings entry
-bool settings_read(const String & _key, void *ptr, size_t size)
+bool settings_read(const String & key, void *ptr, size_t size)
 {
-	if(_key.length()  > MAX_KEY_LEN) return false;
-	String key = String(F("/")) + _key;
-
-	const char mode[2]  = { 'r',  0  };
-	File file = SETTINGS_SPIFFS.open(key, mode);
-	if(!file) return false;
-
-	if(!settings_check_crc(file)) { file.close(); return false; }
+	const settings_entry_t * p_entry = find_entry(key);
+	if(!p_entry) return false;
+	const settings_entry_t & entry = *p_entry;
+	if(entry.size < size) return false;
 
-	bool success = size == file.read(reinterpret_cast<uint8_t *>(ptr), size);
+	if(entry.in_ram())
+	{
+		++ read_count;
+		memcpy(ptr, entry.data(), size);
+		return true;
+	}
 
-	file.close();
-	return success;
+	// copy the first size bytes while the whole value is checked
+	++ flash_read_count;
+	uint8_t * dest = reinterpret_cast<uint8_t *>(ptr);
+	size_t pos = 0;
+	return store.read_value(key, entry.offset, entry.size,
+		[dest, size, &pos] (const uint8_t * data, size_t one) {
+			if(pos < size) memcpy(dest + pos, data, std::min(one, size - pos));
+			pos += one;
+		});
 }
 
 
 
 //! read a string setting from specified settings entry
-bool settings_read(const String & _key, String & value)
+bool settings_read(const String & key, String & value)
 {
-	if(_key.length()  > MAX_KEY_LEN) return false;
-	String key = String(F("/")) + _key;
-
-	const char mode[2]  = { 'r',  0  };
-	File file = SETTINGS_SPIFFS.open(key, mode);
-	if(!file) return false;
-
-	if(!settings_check_crc(file)) { file.close(); return false; }
+	const settings_entry_t * p_entry = find_entry(key);
+	if(!p_entry) return false;
+	const settings_entry_t & entry = *p_entry;
 
-	size_t size = file.size() - CHECKSUM_SIZE;
-	char *buf = new char[size + 1];
-	if(!buf)
+	if(entry.in_ram())
 	{
-		file.close();
-		return false; // no memory ?
+		++ read_count;
+		value = reinterpret_cast<const char *>(entry.data());
+		return true;
 	}
 
-	bool success = size == file.read(reinterpret_cast<uint8_t *>(buf), size);
-	if(success)
+	// build the string directly from the flash, allocating it only once
+	++ flash_read_count;
+	value = String();
+	value.reserve(entry.size);
+	if(store.read_value(key, entry.offset, entry.size,
+		[&value] (const uint8_t * data, size_t one) {
+			value += reinterpret_cast<const char *>(data);
+		})) return true;
+	value = String();
+	return false;
+}
+
+
+bool settings_write_typed(const String & key, const void * ptr, size_t size,
+	uint16_t version, settings_overwrite_t overwrite)
+{
+	if(size > 0xffff) return false;
+	std::vector<uint8_t> buf(sizeof(settings_schema_header_t) + size);
+	settings_schema_header_t h;
+	h.version = version;
+	h.size = size;
+	memcpy(buf.data(), &h, sizeof(h));
+	memcpy(buf.data() + sizeof(h), ptr, size);
+	return settings_write(key, buf.data(), buf.size(), overwrite);
+}
+
+bool settings_read_typed(const String & key, void * ptr, size_t size, uint16_t version)
+{
+	// check the header first, so that the destination is not touched
+	// if the stored value has another schema
+	const settings_entry_t * entry = find_entry(key);
+	if(!entry || entry->size != sizeof(settings_schema_header_t) + size) return false;
+
+	settings_schema_header_t h;
+	if(entry->in_ram())
+		memcpy(&h, entry->data(), sizeof(h));
+	else if(!store.read(entry->offset, &h, sizeof(h)))
+		return false;
+	if(h.version != version || h.size != size) return false;
+
+	if(entry->in_ram())
 	{
-		buf[size] = '\0';
-		value = buf;
+		++ read_count;
+		memcpy(ptr, entry->data() + sizeof(h), size);
+		return true;
 	}
 
-	delete [] buf;
-	file.close();
-	return success;
+	++ flash_read_count;
+	uint8_t * dest = reinterpret_cast<uint8_t *>(ptr);
+	size_t pos = 0;
+	return store.read_value(key, entry->offset, entry->size,
+		[dest, &pos] (const uint8_t * data, size_t one) {
+			for(size_t i = 0; i < one; ++i, ++pos)
+				if(pos >= sizeof(settings_schema_header_t))
+					dest[pos - sizeof(settings_schema_header_t)] = data[i];
+		});
+}
+
+int settings_get_version(const String & key)
+{
+	const settings_entry_t * entry = find_entry(key);
+	if(!entry || entry->size < sizeof(settings_schema_header_t)) return -1;
+
+	settings_schema_header_t h;
+	if(entry->in_ram())
+		memcpy(&h, entry->data(), sizeof(h));
+	else if(!store.read(entry->offset, &h, sizeof(h)))
+		return -1;
+	if(sizeof(h) + h.size != entry->size) return -1; // not a typed value
+	return h.version;
 }
 
 
@@ -187,30 +606,19 @@ bool settings_write_vector(const String & key, const string_vector & value, sett
 }
 
 //! Read string vector settings
-bool settings_read_vector(const String & _key, string_vector & value)
+bool settings_read_vector(const String & key, string_vector & value)
 {
-	if(_key.length()  > MAX_KEY_LEN) return false;
-	String key = String(F("/")) + _key;
-
 	value.clear();
 
-	const char mode[2]  = { 'r',  0  };
-	File file = SETTINGS_SPIFFS.open(key, mode);
-	if(!file) return false;
-
-	if(!settings_check_crc(file)) { file.close(); return false; }
-
-	size_t size = file.size() - CHECKSUM_SIZE;
-
-	char *ptr = new char[size + 1];
-	if(!ptr) return false; // memory error
+	int size = settings_get_size(key);
+	if(size < 0) return false;
 
-	bool success = size == file.read(reinterpret_cast<uint8_t *>(ptr), size);
-	if(!success) { delete [] ptr; file.close(); return false; /* read error*/ }
+	std::vector<char> buf(size + 1);
+	if(!settings_read(key, buf.data(), size)) return false;
+	buf[size] = 0; // force terminate at last
 
-	ptr[size] = 0; // force terminate at last
-
-	char *p = ptr;
+	const char *ptr = buf.data();
+	const char *p = ptr;
 
 	while(p < ptr + size)
 	{
@@ -220,153 +628,264 @@ bool settings_read_vector(const String & _key, string_vector & value)
 		value.push_back(t);
 	}
 
-	delete [] ptr;
-	file.close();
-	return success;
+	return true;
+}
 
+
+//! tar archive size in bytes of the settings exported by settings_export()
+size_t settings_get_export_size(const String & exclude_prefix)
+{
+	size_t size = 512 * 2; // two null records at the end
+	for(auto && it : cache)
+	{
+		if(it.second.removed) continue;
+		if(exclude_prefix.length() != 0 &&
+			it.first.startsWith(exclude_prefix)) continue;
+		size += 512 + ((it.second.size + 511) & ~511u); // header + padded content
+	}
+	return size;
 }
 
+//! copy the value of the setting. returns 1 if copied, 0 if the setting
+//! is gone, or -1 on a read error
+static int copy_value(const String & key, std::vector<uint8_t> & value)
+{
+	const settings_entry_t * entry = find_entry(key);
+	if(!entry) return 0;
+	if(entry->in_ram())
+	{
+		value.assign(entry->data(), entry->data() + entry->size);
+		return 1;
+	}
+	value.clear();
+	value.reserve(entry->size);
+	return store.read_value(key, entry->offset, entry->size,
+		[&value] (const uint8_t * data, size_t size) {
+			value.insert(value.end(), data, data + size);
+		}) ? 1 : -1;
+}
 
-//! Serialize settings to specified main fs partition filename
-bool settings_export(const String & target_name,
-	const String & exclude_prefix)
+//! Serialize settings to the stream as a tar archive. the keys are taken
+//! at the start, and each value is copied on the main thread as it is
+//! written, so a slow stream (e.g. an HTTP client) written from another
+//! thread does not block the main thread. settings removed meanwhile are
+//! left out.
+bool settings_export(Stream & stream, const String & exclude_prefix)
 {
 	const char wmode[2]  = { 'w',  0 };
-//	const char rmode[2]  = { 'r',  0 };
-	const char rootstr[2] = { '/', 0 };
-	String tar_dir_prefix = F("mazo3_settings");
-	File dir;
-    File in;
+	String tar_dir_prefix = F("mazo3_settings/");
+	uint32_t start_millis = millis();
+	unsigned total;
+	std::vector<String> keys;
+	std::vector<uint8_t> value;
+
+	run_in_main_thread([&keys, &exclude_prefix] () -> int {
+		for(auto && it : cache)
+		{
+			// skip excluded key
+			if(it.second.removed) continue;
+			if(exclude_prefix.length() != 0 &&
+				it.first.startsWith(exclude_prefix)) continue;
+			keys.push_back(it.first);
+		}
+		return 0;
+	});
 
 	// allocate mtar_t. use heap to reduce stack usage.
 	mtar_t *p_tar = new mtar_t;
 	if(!p_tar) return false;
 
 	// open tar archive for wriring
-	if(MTAR_ESUCCESS != mtar_open(p_tar, target_name.c_str(), wmode))
-		goto error_end; // open error
-
-	// scan settings directory
-	puts("Scanning dir ...");
-	dir = FS.open(rootstr);
-	while(!!(in = dir.openNextFile()))
+	if(MTAR_ESUCCESS != mtar_open_stream(p_tar, &stream, wmode))
 	{
-		// skip excluded file name
-		String filename = dir.name();
-		printf("Exporting setting %s ... \r\n", filename.c_str());
-		if(exclude_prefix.length() != 0 &&
-			filename.startsWith(exclude_prefix)) continue;
+		delete p_tar;
+		return false; // open error
+	}
 
-		// write content as base64
-		size_t size = in.size() - CHECKSUM_SIZE;
-		if(!settings_check_crc(in)) { in.close(); continue; }
+	for(auto && key : keys)
+	{
+		int copied = run_in_main_thread([&key, &value] () -> int { return copy_value(key, value); });
+		if(copied < 0) goto error_end; // read error
+		if(copied == 0) continue; // removed since
 
-		// write header
+		// write header and content
 		if(MTAR_ESUCCESS != mtar_write_file_header(p_tar,
-			(tar_dir_prefix + filename).c_str(), size))
+			(tar_dir_prefix + key).c_str(), value.size()))
+			goto error_end; // write error
+		if(MTAR_ESUCCESS != mtar_write_data(p_tar, value.data(), value.size()))
 			goto error_end; // write error
-
-		// write content
-		uint8_t buf[128];
-		while(true)
-		{
-			size_t isz = in.read(buf, sizeof(buf));
-			if(isz == 0) break;
-			if(MTAR_ESUCCESS != mtar_write_data(p_tar, buf, isz))
-				goto error_end; // write error
-		}
 	}
-	puts("Done scanning dir.");
 
-	mtar_finalize(p_tar);
-	mtar_close(p_tar);
+	if(MTAR_ESUCCESS != mtar_finalize(p_tar)) goto error_end;
+	if(MTAR_ESUCCESS != mtar_close(p_tar)) { delete p_tar; return false; }
 
+	total = p_tar->io_pos;
 	delete p_tar;
+	printf("Settings: %u bytes exported in %lu ms.\n", total,
+		(unsigned long)(millis() - start_millis));
 	return true;
 
 error_end:
+	mtar_close(p_tar);
 	delete p_tar;
 	return false;
 }
 
+//! Serialize settings to specified main fs partition filename
+bool settings_export(const String & target_name,
+	const String & exclude_prefix)
+{
+	File file = FS.open(target_name, "w");
+	if(!file) return false;
+	bool res = settings_export(file, exclude_prefix);
+	file.close();
+	return res;
+}
+
 
-//! import settings from specified main fs partition filename
-bool settings_import(const String & target_name)
+//! index the settings in the store again, once everything is written
+static void reload_cache()
 {
-	const char wmode[2]  = { 'w',  0 };
-	const char rmode[2]  = { 'r',  0 };
-//	const char nullstr[1] = { 0 };
-	int processed_files = 0;
-	int res;
-
-	// allocate mtar_t and its header. use heap to reduce stack usage.
-	mtar_t *p_tar;
-	mtar_header_t *p_h;
-
-	p_tar = new mtar_t;
-	p_h = new mtar_header_t;
-	if(!p_tar || !p_h) goto error_end; // memory error
-
-	// open archive for reading
-	res = mtar_open(p_tar, target_name.c_str(), rmode);
-	if(MTAR_ESUCCESS != res)
-	{
-		printf("mtar_open() failed. code=%d\r\n", res);
-		goto error_end; // open error
-	}
-
-	// read input archive
-	while( (mtar_read_header(p_tar, p_h)) != MTAR_ENULLRECORD)
-	{
-		// extract basename of the filename
-		String fn = p_h->name;
-		printf("Processing %s ...", fn.c_str());
-		int last_slash = fn.lastIndexOf('/');
-		if(last_slash != -1)
-			fn = fn.c_str() + last_slash + 1; // extract basename
-		fn = String(F("/")) + fn; // make it on the root directory
-
-		// open file
-		File out = SETTINGS_SPIFFS.open(fn.c_str(), wmode);
-
-		// reserve checksum space
-		uint32_t crc = 0xffffffff;
-		if(CHECKSUM_SIZE !=
-			out.write(reinterpret_cast<const uint8_t *>(&crc),
-				CHECKSUM_SIZE)) goto file_write_error; // file write error
-		crc = INITIAL_CRC_VALUE;
-
-		// copy value
-		uint8_t ibuf[128];
-		size_t size = p_h->size;
-		while(true)
+	if(!is_flushed()) return; // keep unwritten ones to retry
+	if(!load_cache()) return;
+	if(store.needs_compaction())
+		compact_store();
+	else
+		start_preparing_store();
+}
+
+settings_importer_t::settings_importer_t() : start_millis(millis())
+{
+	// write pending changes first, so that they are not taken for
+	// a part of the import
+	settings_flush();
+}
+
+//! decide what to do with the data following the header record just received
+void settings_importer_t::parse_header()
+{
+	mtar_header_t h;
+	int res = mtar_parse_header(record, &h);
+	if(res == MTAR_ENULLRECORD) { state = STATE_END; return; } // end of the archive
+	if(res != MTAR_ESUCCESS)
+	{
+		printf("Broken header; code=%d\r\n", res);
+		state = STATE_FAILED;
+		return;
+	}
+
+	// strip the top directory from the filename to make the key
+	key = h.name;
+	printf("Processing %s ...", key.c_str());
+	int first_slash = key.indexOf('/');
+	if(first_slash != -1)
+		key = key.c_str() + first_slash + 1;
+
+	accepted = false;
+	if((h.type != MTAR_TREG && h.type != 0) || key.length() == 0)
+	{
+		puts("Not a setting; skipped.");
+	}
+	else if(!is_valid_key(key))
+	{
+		puts("Invalid name; skipped.");
+		++ skipped_files;
+	}
+	else if(h.size > settings_store_t::MAX_VALUE_SIZE)
+	{
+		puts("Too large; skipped.");
+		++ skipped_files;
+	}
+	else
+	{
+		accepted = true;
+		value.clear();
+		value.reserve(h.size);
+	}
+	remaining = h.size;
+	padding = (MTAR_RECORD_SIZE - h.size % MTAR_RECORD_SIZE) % MTAR_RECORD_SIZE;
+	state = STATE_DATA;
+	if(remaining == 0 && !write_value()) state = STATE_FAILED;
+}
+
+//! write the value just received, and skip the padding after it
+bool settings_importer_t::write_value()
+{
+	if(accepted)
+	{
+		if(!settings_write(key, value.data(), value.size()))
+		{
+			puts("Settings write error.");
+			return false;
+		}
+		puts("done.");
+		++ processed_files;
+	}
+	remaining = padding;
+	state = remaining ? STATE_PADDING : STATE_HEADER;
+	return true;
+}
+
+bool settings_importer_t::write(const void * data, size_t size)
+{
+	const uint8_t * p = static_cast<const uint8_t *>(data);
+	total += size;
+	while(size && state != STATE_END && state != STATE_FAILED)
+	{
+		size_t n;
+		switch(state)
 		{
-			size_t one_size = sizeof(ibuf) < size ? sizeof(ibuf) : size;
-			if(one_size == 0) break;
-			if(MTAR_ESUCCESS != mtar_read_data(p_tar, ibuf, one_size))
+		case STATE_HEADER:
+			n = std::min(size, sizeof(record) - record_size);
+			memcpy(record + record_size, p, n);
+			record_size += n;
+			if(record_size == sizeof(record))
 			{
-				puts("File read error.");
-				goto error_end; // read error
+				record_size = 0;
+				parse_header();
 			}
-			crc = crc32_le(crc, ibuf, one_size);
-			if(one_size != out.write(ibuf, one_size)) goto file_write_error;
-			size -= one_size;
+			break;
+
+		case STATE_DATA:
+			n = std::min(size, remaining);
+			if(accepted) value.insert(value.end(), p, p + n);
+			remaining -= n;
+			if(remaining == 0 && !write_value()) state = STATE_FAILED;
+			break;
+
+		default: // STATE_PADDING
+			n = std::min(size, remaining);
+			remaining -= n;
+			if(remaining == 0) state = STATE_HEADER;
+			break;
 		}
+		p += n;
+		size -= n;
+	}
+	return state != STATE_FAILED;
+}
 
-		// write CRC back
-		out.seek(0);
-		if(CHECKSUM_SIZE !=
-			out.write(reinterpret_cast<const uint8_t *>(&crc),
-				CHECKSUM_SIZE)) goto file_write_error; // file write error
-		out.close();
-
-		// To the next file
-		++ processed_files;
-		if(mtar_next(p_tar) != MTAR_ESUCCESS) break; 
+bool settings_importer_t::end()
+{
+	// an item cut short is not imported
+	bool complete = state == STATE_HEADER || state == STATE_END;
+	if(state == STATE_DATA || state == STATE_PADDING) puts("File read error.");
+	std::vector<uint8_t>().swap(value);
+
+	// the values are in the cache; they reach the store only here
+	settings_flush();
+	bool flushed = is_flushed();
+	reload_cache();
+	printf("Settings: %u bytes imported in %lu ms; %d items skipped.\n", (unsigned)total,
+		(unsigned long)(millis() - start_millis), skipped_files);
+
+	if(!flushed)
+	{
+		puts("Settings write error.");
+		return false;
 	}
 
-	if(p_tar) delete p_tar;
-	if(p_h) delete p_h;
+	if(!complete) return false;
 
 	if(processed_files == 0)
 	{
@@ -375,15 +894,25 @@ bool settings_import(const String & target_name)
 	}
 
 	return true;
-
-file_write_error:
-	puts("File write error.");
-
-error_end:
-	if(p_tar) delete p_tar;
-	if(p_h) delete p_h;
-	return false;
-
 }
 
+//! import settings from the tar archive stream
+bool settings_import(Stream & stream)
+{
+	settings_importer_t importer;
+	uint8_t buf[256];
+	size_t size;
+	while((size = stream.readBytes(reinterpret_cast<char *>(buf), sizeof(buf))) != 0)
+		if(!importer.write(buf, size)) break;
+	return importer.end();
+}
 
+//! import settings from specified main fs partition filename
+bool settings_import(const String & target_name)
+{
+	File file = FS.open(target_name, "r");
+	if(!file) return false;
+	bool res = settings_import(file);
+	file.close();
+	return res;
+}
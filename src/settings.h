@@ -2,13 +2,12 @@
 #define SETTINGS_H__
 
 #include <vector>
+#include <type_traits>
 
 typedef std::vector<String> string_vector;
 
 const char CLEAR_SETTINGS_INDICATOR_FILE[] = "/spiffs/.clear"; // a file indicated by its existance, to clear all settings at boot
 
-static constexpr size_t MAX_SETTINGS_TAR_SIZE = 32*1024;
-
 struct settings_overwrite_t { bool overwrite;  };
 #define SETTINGS_NO_OVERWRITE settings_overwrite_t{false}
 #define SETTINGS_OVERWRITE settings_overwrite_t{true}
@@ -23,18 +22,135 @@ void init_settings();
  * */
 void clear_settings();
 
+/**
+ * Write all pending settings to the flash.
+ * Settings are cached in RAM and written some seconds after the last
+ * write, so call this before rebooting or powering off.
+ * */
+void settings_flush();
+
+/**
+ * Show settings cache statistics
+ * */
+void settings_dump_stats();
+
+/**
+ * Settings accessors. These work on the RAM cache and must be called from
+ * the main thread.
+ * */
 bool settings_write(const String & key, const void * ptr, size_t size, settings_overwrite_t overwrite = SETTINGS_OVERWRITE);
 bool settings_write(const String & key, const String & value, settings_overwrite_t overwrite = SETTINGS_OVERWRITE);
 bool settings_read(const String & key, void *ptr, size_t size);
 bool settings_read(const String & key, String & value);
 
+/**
+ * Returns the value size of the setting in bytes, or -1 if not found.
+ * */
+int settings_get_size(const String & key);
+
+/**
+ * Remove the setting. Returns false if not found.
+ * */
+bool settings_remove(const String & key);
+
+
+/**
+ * Typed settings. A value of trivially copyable type (a plain struct, an
+ * array or a scalar) is stored as is, prefixed by a small header holding
+ * the schema version and the value size. settings_get() fails unless both
+ * match, so the caller can fall back to an older schema and migrate.
+ * Bump the version whenever the layout of the type changes.
+ * */
+bool settings_write_typed(const String & key, const void * ptr, size_t size,
+	uint16_t version, settings_overwrite_t overwrite);
+bool settings_read_typed(const String & key, void * ptr, size_t size, uint16_t version);
+
+template <typename T>
+bool settings_put(const String & key, const T & value, uint16_t version,
+	settings_overwrite_t overwrite = SETTINGS_OVERWRITE)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
+	return settings_write_typed(key, &value, sizeof(T), version, overwrite);
+}
+
+template <typename T>
+bool settings_get(const String & key, T & value, uint16_t version)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
+	return settings_read_typed(key, &value, sizeof(T), version);
+}
+
+/**
+ * Returns the schema version of a typed setting, or -1 if not found or
+ * the value is not a typed one.
+ * */
+int settings_get_version(const String & key);
+
 
 bool settings_write_vector(const String & key, const string_vector & value, settings_overwrite_t overwrite = SETTINGS_OVERWRITE);
 bool settings_read_vector(const String & key, string_vector & value);
 
 
+/**
+ * Export settings as a tar archive, to a file on the main filesystem or
+ * directly to a stream (e.g. an HTTP response). Keys starting with
+ * exclude_prefix are not exported, unless it is empty. Unlike the other
+ * functions, these can be called from any thread; the values are copied
+ * on the main thread one at a time.
+ * */
 bool settings_export(const String & target_name,
 	const String & exclude_prefix);
+bool settings_export(Stream & stream, const String & exclude_prefix);
+
+/**
+ * Returns the size of the archive settings_export() would make now.
+ * Settings written before the export runs change the size.
+ * */
+size_t settings_get_export_size(const String & exclude_prefix);
+
+/**
+ * Import settings from a tar archive made by settings_export(), read from
+ * a file on the main filesystem or from a stream. The stream is read
+ * sequentially; it does not have to be seekable.
+ * */
 bool settings_import(const String & target_name);
+bool settings_import(Stream & stream);
+
+/**
+ * Import settings from a tar archive made by settings_export(), given in
+ * pieces as it arrives (e.g. an HTTP upload), so that the archive is
+ * never held as a whole. Pending settings are flushed on construction.
+ * Feed the archive to write(), then call end(). Each item is written as
+ * soon as it is complete. Use this from the main thread only.
+ * */
+class settings_importer_t
+{
+	enum state_t { STATE_HEADER, STATE_DATA, STATE_PADDING, STATE_END, STATE_FAILED };
+
+	state_t state = STATE_HEADER;
+	uint8_t record[512]; //!< header record being received; MTAR_RECORD_SIZE bytes
+	size_t record_size = 0; //!< bytes in record
+	size_t remaining = 0; //!< bytes left in the data or padding
+	size_t padding = 0; //!< padding after the data
+	bool accepted = false; //!< whether the data being received is a setting to import
+	String key; //!< key of the data being received
+	std::vector<uint8_t> value; //!< value being received
+	int processed_files = 0;
+	int skipped_files = 0;
+	uint32_t total = 0; //!< bytes fed
+	uint32_t start_millis;
+
+	void parse_header();
+	bool write_value();
+
+public:
+	settings_importer_t();
+
+	//! feed the next piece of the archive. returns false once the import has failed
+	bool write(const void * data, size_t size);
+
+	//! finish the import. returns whether any setting is imported and written to the flash
+	bool end();
+};
 
 #endif
@@ -0,0 +1,336 @@
+#include <Arduino.h>
+#include <esp_partition.h>
+#include <rom/crc.h>
+#include <stddef.h>
+#include "settings_store.h"
+
+
+static constexpr uint32_t HALF_MAGIC = 0x4c535a4d; // "MZSL"
+static constexpr uint16_t RECORD_MAGIC = 0x5352; // "RS"
+static constexpr uint8_t RECORD_FLAG_VALID = 0x01; //!< cleared for removal records
+
+//! initial value for crc; see settings.cpp
+static constexpr uint32_t INITIAL_CRC_VALUE = 0x12345678;
+
+//! header at the beginning of each half
+struct half_header_t
+{
+	uint32_t magic; //!< HALF_MAGIC
+	uint32_t generation; //!< incremented at each compaction; larger one is active
+	uint32_t reserved; //!< 0xffffffff
+	uint32_t crc; //!< crc of the fields above
+};
+
+//! record header, followed by the key and the value
+struct record_header_t
+{
+	uint16_t magic; //!< RECORD_MAGIC
+	uint8_t key_len; //!< key length in bytes
+	uint8_t flags; //!< RECORD_FLAG_*; unused bits are 1
+	uint16_t value_len; //!< value length in bytes
+	uint16_t reserved; //!< 0xffff
+	uint32_t seq; //!< record sequence number; increases monotonically in a half
+	uint32_t crc; //!< crc of the fields above, the key and the value
+};
+
+static_assert(sizeof(half_header_t) == 16, "half_header_t must be packed");
+static_assert(sizeof(record_header_t) == 16, "record_header_t must be packed");
+
+//! record size in the storage, including padding to 4 bytes
+static uint32_t record_size(size_t key_len, size_t value_len)
+{
+	return (sizeof(record_header_t) + key_len + value_len + 3) & ~3u;
+}
+
+//! returns whether all bytes are 0xff
+static bool all_ff(const void * ptr, size_t size)
+{
+	const uint8_t * p = reinterpret_cast<const uint8_t *>(ptr);
+	for(size_t i = 0; i < size; ++i) if(p[i] != 0xff) return false;
+	return true;
+}
+
+
+#define PARTITION (static_cast<const esp_partition_t *>(partition))
+
+settings_partition_flash_t::settings_partition_flash_t(const char * label) :
+	partition(esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label))
+{
+}
+
+uint32_t settings_partition_flash_t::size() const
+{
+	return PARTITION->size;
+}
+
+bool settings_partition_flash_t::read(uint32_t offset, void * buf, size_t size)
+{
+	return ESP_OK == esp_partition_read(PARTITION, offset, buf, size);
+}
+
+bool settings_partition_flash_t::write(uint32_t offset, const void * buf, size_t size)
+{
+	return ESP_OK == esp_partition_write(PARTITION, offset, buf, size);
+}
+
+bool settings_partition_flash_t::erase(uint32_t offset, uint32_t size)
+{
+	return ESP_OK == esp_partition_erase_range(PARTITION, offset, size);
+}
+
+#undef PARTITION
+
+
+settings_store_t::settings_store_t(settings_flash_t & _flash) : flash(_flash)
+{
+	half_size = flash.size() / 2 / flash.sector_size() * flash.sector_size();
+}
+
+bool settings_store_t::read_generation(int half, uint32_t & gen)
+{
+	half_header_t h;
+	if(!flash.read(half_base(half), &h, sizeof(h))) return false;
+	if(h.magic != HALF_MAGIC) return false;
+	if(h.crc != crc32_le(INITIAL_CRC_VALUE, reinterpret_cast<const uint8_t *>(&h),
+		offsetof(half_header_t, crc))) return false;
+	gen = h.generation;
+	return true;
+}
+
+bool settings_store_t::write_header(int half, uint32_t gen)
+{
+	half_header_t h;
+	h.magic = HALF_MAGIC;
+	h.generation = gen;
+	h.reserved = 0xffffffff;
+	h.crc = crc32_le(INITIAL_CRC_VALUE, reinterpret_cast<const uint8_t *>(&h),
+		offsetof(half_header_t, crc));
+	return flash.write(half_base(half), &h, sizeof(h));
+}
+
+bool settings_store_t::write_record(uint32_t pos, const String & key, const uint8_t * value,
+	uint32_t src_offset, size_t size, uint32_t seq, uint8_t flags)
+{
+	size_t key_len = key.length();
+	std::vector<uint8_t> rec(record_size(key_len, size), 0xff);
+	record_header_t * h = reinterpret_cast<record_header_t *>(rec.data());
+	uint8_t * p_key = rec.data() + sizeof(record_header_t);
+	uint8_t * p_value = p_key + key_len;
+
+	h->magic = RECORD_MAGIC;
+	h->key_len = key_len;
+	h->flags = flags;
+	h->value_len = size;
+	h->seq = seq;
+	memcpy(p_key, key.c_str(), key_len);
+	if(value)
+		memcpy(p_value, value, size);
+	else if(size && !flash.read(src_offset, p_value, size))
+		return false;
+
+	uint32_t crc = crc32_le(INITIAL_CRC_VALUE, rec.data(), offsetof(record_header_t, crc));
+	h->crc = crc32_le(crc, p_key, key_len + size);
+
+	// the record is written by one call, from lower address to upper;
+	// an interrupted write is detected by the crc on replay.
+	return flash.write(pos, rec.data(), rec.size());
+}
+
+bool settings_store_t::mount(replay_callback_t callback)
+{
+	active = -1;
+	recovered = false;
+	prepared = 0;
+
+	// choose the half with newer generation
+	uint32_t gens[2];
+	bool valid[2];
+	for(int i = 0; i < 2; ++i) valid[i] = read_generation(i, gens[i]);
+	if(!valid[0] && !valid[1]) return false;
+	int half = (!valid[1] || (valid[0] && (int32_t)(gens[0] - gens[1]) > 0)) ? 0 : 1;
+
+	// replay records
+	uint32_t base = half_base(half);
+	uint32_t pos = sizeof(half_header_t);
+	uint32_t last_seq = 0;
+	std::vector<uint8_t> buf;
+	while(pos + sizeof(record_header_t) <= half_size)
+	{
+		record_header_t h;
+		if(!flash.read(base + pos, &h, sizeof(h))) { recovered = true; break; }
+		if(all_ff(&h, sizeof(h))) break; // end of the log
+
+		uint32_t rsize = record_size(h.key_len, h.value_len);
+		if(h.magic != RECORD_MAGIC || h.key_len == 0 || h.key_len > MAX_KEY_LEN ||
+			h.value_len > MAX_VALUE_SIZE || pos + rsize > half_size ||
+			(last_seq && (int32_t)(h.seq - last_seq) <= 0))
+		{
+			recovered = true; // broken record; probably an interrupted write
+			break;
+		}
+
+		buf.resize(h.key_len + h.value_len + 1);
+		if(!flash.read(base + pos + sizeof(h), buf.data(), h.key_len + h.value_len))
+			{ recovered = true; break; }
+		uint32_t crc = crc32_le(INITIAL_CRC_VALUE, reinterpret_cast<const uint8_t *>(&h),
+			offsetof(record_header_t, crc));
+		crc = crc32_le(crc, buf.data(), h.key_len + h.value_len);
+		if(crc != h.crc) { recovered = true; break; }
+
+		uint8_t c = buf[h.key_len];
+		buf[h.key_len] = 0;
+		String key(reinterpret_cast<const char *>(buf.data()));
+		buf[h.key_len] = c;
+		if(h.flags & RECORD_FLAG_VALID)
+			callback(key, buf.data() + h.key_len, h.value_len, base + pos + sizeof(h) + h.key_len);
+		else
+			callback(key, nullptr, 0, 0); // removed
+
+		last_seq = h.seq;
+		pos += rsize;
+	}
+
+	active = half;
+	generation = gens[half];
+	write_pos = pos;
+	next_seq = last_seq + 1;
+	return true;
+}
+
+bool settings_store_t::read_value(const String & key, uint32_t offset, size_t size, sink_t sink)
+{
+	size_t key_len = key.length();
+	uint32_t pos = offset - key_len - sizeof(record_header_t);
+	record_header_t h;
+	if(!flash.read(pos, &h, sizeof(h))) return false;
+	if(h.magic != RECORD_MAGIC || h.key_len != key_len || h.value_len != size ||
+		!(h.flags & RECORD_FLAG_VALID)) return false;
+
+	uint32_t crc = crc32_le(INITIAL_CRC_VALUE, reinterpret_cast<const uint8_t *>(&h),
+		offsetof(record_header_t, crc));
+	crc = crc32_le(crc, reinterpret_cast<const uint8_t *>(key.c_str()), key_len);
+
+	uint8_t buf[256 + 1];
+	while(size)
+	{
+		size_t one = size < sizeof(buf) - 1 ? size : sizeof(buf) - 1;
+		if(!flash.read(offset, buf, one)) return false;
+		crc = crc32_le(crc, buf, one);
+		buf[one] = 0;
+		sink(buf, one);
+		offset += one;
+		size -= one;
+	}
+	return crc == h.crc;
+}
+
+bool settings_store_t::format()
+{
+	active = -1;
+	if(!flash.erase(0, half_size * 2)) return false;
+	if(!write_header(0, 1)) return false;
+	active = 0;
+	generation = 1;
+	write_pos = sizeof(half_header_t);
+	next_seq = 1;
+	prepared = half_size;
+	recovered = false;
+	return true;
+}
+
+uint32_t settings_store_t::append(const String & key, const void * value, size_t size)
+{
+	if(active < 0 || recovered) return 0; // need mount or compaction
+	if(key.length() == 0 || key.length() > MAX_KEY_LEN || size > MAX_VALUE_SIZE) return 0;
+
+	uint32_t rsize = record_size(key.length(), size);
+	if(write_pos + rsize > half_size) return 0; // full
+
+	uint32_t pos = half_base(active) + write_pos;
+	if(!write_record(pos, key, reinterpret_cast<const uint8_t *>(value), 0, size, next_seq))
+	{
+		recovered = true; // the tail may be dirty; compaction is needed
+		return 0;
+	}
+	write_pos += rsize;
+	++ next_seq;
+	return pos + sizeof(record_header_t) + key.length();
+}
+
+bool settings_store_t::append_removal(const String & key)
+{
+	if(active < 0 || recovered) return false; // need mount or compaction
+	if(key.length() == 0 || key.length() > MAX_KEY_LEN) return false;
+
+	uint32_t rsize = record_size(key.length(), 0);
+	if(write_pos + rsize > half_size) return false; // full
+
+	if(!write_record(half_base(active) + write_pos, key, nullptr, 0, 0, next_seq,
+		(uint8_t)~RECORD_FLAG_VALID))
+	{
+		recovered = true; // the tail may be dirty; compaction is needed
+		return false;
+	}
+	write_pos += rsize;
+	++ next_seq;
+	return true;
+}
+
+bool settings_store_t::compact(std::vector<live_t> & entries)
+{
+	if(active < 0) return false;
+	if(!prepare_all()) return false;
+
+	int target = 1 - active;
+	uint32_t base = half_base(target);
+	uint32_t pos = sizeof(half_header_t);
+	for(auto && e : entries)
+	{
+		uint32_t rsize = record_size(e.key->length(), e.size);
+		if(pos + rsize > half_size ||
+			!write_record(base + pos, *e.key, e.value, e.offset, e.size, next_seq))
+		{
+			prepared = 0; // the standby half needs erasing again
+			return false;
+		}
+		e.new_offset = base + pos + sizeof(record_header_t) + e.key->length();
+		pos += rsize;
+		++ next_seq;
+	}
+
+	// the new half gets valid only after its header is written
+	if(!write_header(target, generation + 1)) { prepared = 0; return false; }
+
+	active = target;
+	++ generation;
+	write_pos = pos;
+	recovered = false;
+	prepared = 0; // the old half is now standby and needs erasing
+	return true;
+}
+
+bool settings_store_t::prepare_step()
+{
+	if(active < 0 || prepared >= half_size) return false;
+
+	// skip sectors already erased, to reduce flash wear and time
+	uint32_t sector = flash.sector_size();
+	uint32_t addr = half_base(1 - active) + prepared;
+	bool erased = true;
+	uint32_t buf[64];
+	for(uint32_t i = 0; erased && i < sector; i += sizeof(buf))
+	{
+		if(!flash.read(addr + i, buf, sizeof(buf))) erased = false;
+		else erased = all_ff(buf, sizeof(buf));
+	}
+	if(!erased && !flash.erase(addr, sector)) return false;
+
+	prepared += sector;
+	return prepared < half_size;
+}
+
+bool settings_store_t::prepare_all()
+{
+	while(prepare_step()) /**/ ;
+	return prepared >= half_size;
+}
@@ -0,0 +1,172 @@
+#ifndef SETTINGS_STORE_H__
+#define SETTINGS_STORE_H__
+
+#include <Arduino.h>
+#include <vector>
+#include <functional>
+
+/**
+ * Raw flash access used by the settings store.
+ * Offsets are relative to the beginning of the storage area.
+ * */
+class settings_flash_t
+{
+public:
+	virtual ~settings_flash_t() {;}
+
+	//! returns the storage size in bytes; must be a multiple of the sector size
+	virtual uint32_t size() const = 0;
+
+	//! returns the erase unit size in bytes
+	virtual uint32_t sector_size() const { return 4096; }
+
+	//! read from the storage
+	virtual bool read(uint32_t offset, void * buf, size_t size) = 0;
+
+	//! write to the storage; the area must be erased beforehand
+	virtual bool write(uint32_t offset, const void * buf, size_t size) = 0;
+
+	//! erase the storage; offset and size must be sector aligned
+	virtual bool erase(uint32_t offset, uint32_t size) = 0;
+};
+
+/**
+ * settings_flash_t implementation on an ESP32 data partition
+ * */
+class settings_partition_flash_t : public settings_flash_t
+{
+	const void * partition; //!< esp_partition_t
+
+public:
+	//! find the partition by label; check valid() after construction
+	settings_partition_flash_t(const char * label);
+
+	bool valid() const { return partition != nullptr; }
+
+	uint32_t size() const override;
+	bool read(uint32_t offset, void * buf, size_t size) override;
+	bool write(uint32_t offset, const void * buf, size_t size) override;
+	bool erase(uint32_t offset, uint32_t size) override;
+};
+
+
+/**
+ * Append-only, log-structured key/value store.
+ *
+ * The storage is split into two halves; one is active and the other is
+ * standby. Each half begins with a header containing a generation number,
+ * followed by records. A record consists of a header (key length, value
+ * length, sequence number and CRC), the key and the value. Updating a key
+ * appends a new record; the last record of a key wins. Removing a key
+ * appends a removal record.
+ *
+ * When the active half is full, compact() writes only the live records to
+ * the standby half, then writes its header with the next generation. A
+ * crash at any point leaves at least one half with a valid header, and
+ * a torn record at the end of the log is detected by its CRC on replay.
+ *
+ * The standby half is erased in background by prepare_step() so that
+ * compaction does not have to wait for erasing.
+ * */
+class settings_store_t
+{
+public:
+	static constexpr size_t MAX_KEY_LEN = 63; //!< maximum key length in bytes
+	static constexpr size_t MAX_VALUE_SIZE = 8192; //!< maximum value size in bytes
+
+	//! called for each record on replay. value points the whole value
+	//! in RAM, and offset is the storage offset of the value.
+	//! value is nullptr for a removal record.
+	typedef std::function<void (const String & key, const uint8_t * value,
+		size_t size, uint32_t offset)> replay_callback_t;
+
+	//! receives a value in chunks from read_value(). data[size] is always '\0'.
+	typedef std::function<void (const uint8_t * data, size_t size)> sink_t;
+
+	//! a live entry to be written by compact()
+	struct live_t
+	{
+		const String * key;
+		const uint8_t * value; //!< value in RAM, or nullptr to copy it from offset
+		uint32_t offset; //!< current value offset in the storage
+		size_t size; //!< value size
+		uint32_t new_offset; //!< set by compact(); new value offset in the storage
+	};
+
+private:
+	settings_flash_t & flash;
+	uint32_t half_size; //!< size of a half
+	int active = -1; //!< active half index; -1 = not mounted
+	uint32_t generation = 0; //!< generation of the active half
+	uint32_t write_pos = 0; //!< next record offset in the active half
+	uint32_t next_seq = 1; //!< next record sequence number
+	uint32_t prepared = 0; //!< bytes of the standby half known to be erased
+	bool recovered = false; //!< whether a broken record was found on mount
+
+	uint32_t half_base(int half) const { return half * half_size; }
+	bool read_generation(int half, uint32_t & gen);
+	bool write_header(int half, uint32_t gen);
+	bool prepare_all();
+	bool write_record(uint32_t pos, const String & key, const uint8_t * value,
+		uint32_t src_offset, size_t size, uint32_t seq, uint8_t flags = 0xff);
+
+public:
+	settings_store_t(settings_flash_t & _flash);
+
+	/**
+	 * mount the store and replay all records through the callback, in
+	 * the order of writing. returns false if no valid half is found;
+	 * the store must be formatted then.
+	 * */
+	bool mount(replay_callback_t callback);
+
+	//! erase the whole storage and make an empty store
+	bool format();
+
+	//! whether broken records were found on mount; the caller should compact
+	bool needs_compaction() const { return recovered; }
+
+	/**
+	 * append a record. returns the storage offset of the value,
+	 * or 0 if the active half does not have enough space.
+	 * */
+	uint32_t append(const String & key, const void * value, size_t size);
+
+	//! append a removal record of the key. returns false if the active
+	//! half does not have enough space.
+	bool append_removal(const String & key);
+
+	/**
+	 * write all given live entries to the standby half, and make it active.
+	 * new_offset of each entry is set on success.
+	 * */
+	bool compact(std::vector<live_t> & entries);
+
+	//! read a value at the offset returned by append() or replay
+	bool read(uint32_t offset, void * buf, size_t size)
+		{ return flash.read(offset, buf, size); }
+
+	/**
+	 * read a whole value at the offset, passing it to the sink in chunks,
+	 * and verify the record CRC in the same pass. returns false if the
+	 * record is broken; the sink may have received data even then.
+	 * */
+	bool read_value(const String & key, uint32_t offset, size_t size, sink_t sink);
+
+	/**
+	 * erase one sector of the standby half, if not yet.
+	 * returns whether more work remains.
+	 * */
+	bool prepare_step();
+
+	//! bytes used in the active half
+	uint32_t get_used() const { return write_pos; }
+
+	//! size of a half
+	uint32_t get_capacity() const { return half_size; }
+
+	//! generation of the active half
+	uint32_t get_generation() const { return generation; }
+};
+
+#endif
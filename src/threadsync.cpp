@@ -1,77 +1,411 @@
 #include <Arduino.h>
 #include <freertos/semphr.h>
+#include <freertos/event_groups.h>
 #include <threadsync.h>
-#include <deque>
 
-// TODO: use FreeRTOS's native queue object
-static portMUX_TYPE queue_lock = portMUX_INITIALIZER_UNLOCKED;
-struct handler_queue_item_t;
-static std::deque<handler_queue_item_t *> queue;
+extern TaskHandle_t loopTaskHandle; // defined in main.cpp of Arduino core
 
-struct handler_queue_item_t
+using namespace threadsync_detail;
+
+/**
+ * fixed-capacity, lock-free multi-producer single-consumer queue of
+ * preallocated handler slots.
+ * each slot has a sequence number:
+ *   sequence == position            : the slot is free for the producer at the position
+ *   sequence == position + 1        : the slot is filled and ready for the consumer
+ *   sequence == position + capacity : the slot is consumed and free for the next round
+ * */
+class call_queue_t
 {
-    sync_handler_t handler;
-    SemaphoreHandle_t runsem;
-    int retval;
+public:
+    static constexpr uint32_t CAPACITY = 16; // must be a power of 2
+
+private:
+    slot_t slots[CAPACITY];
+    std::atomic<uint32_t> enqueue_pos;
+    uint32_t dequeue_pos; // only touched by the main thread
+
+public:
+    call_queue_t() : enqueue_pos(0), dequeue_pos(0)
+    {
+        for(uint32_t i = 0; i < CAPACITY; ++i)
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    slot_t * acquire()
+    {
+        for(;;)
+        {
+            uint32_t pos = enqueue_pos.load(std::memory_order_relaxed);
+            slot_t * slot = &slots[pos & (CAPACITY - 1)];
+            int32_t dif = (int32_t)(slot->sequence.load(std::memory_order_acquire) - pos);
+            if(dif == 0)
+            {
+                if(enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    slot->position = pos;
+                    return slot;
+                }
+            }
+            else if(dif < 0)
+            {
+                // the queue is full; wait for the main thread to consume
+                if(in_main_thread())
+                    poll_main_thread_queue();
+                else
+                    vTaskDelay(1);
+            }
+            // otherwise another producer has taken the slot; retry
+        }
+    }
+
+    void publish(slot_t * slot)
+    {
+        slot->queued_us = micros();
+        slot->sequence.store(slot->position + 1, std::memory_order_release);
+    }
 
-    handler_queue_item_t(sync_handler_t _handler) :
-        handler(_handler), runsem(xSemaphoreCreateMutex()), retval(-1)
+    /**
+     * take the next filled slot, or nullptr if the queue is empty.
+     * the slot must be released by release() after use.
+     * */
+    slot_t * peek()
     {
-        xSemaphoreTake(runsem, portMAX_DELAY);
+        slot_t * slot = &slots[dequeue_pos & (CAPACITY - 1)];
+        if(slot->sequence.load(std::memory_order_acquire) != dequeue_pos + 1) return nullptr;
+        return slot;
     }
 
-    ~handler_queue_item_t()
+    void release(slot_t * slot)
     {
-        vSemaphoreDelete(runsem);
+        slot->sequence.store(dequeue_pos + CAPACITY, std::memory_order_release);
+        ++ dequeue_pos;
     }
 };
 
+static call_queue_t queue;
+
+// binary semaphores for waiting callers. a caller takes one for the
+// duration of a call, so short-lived threads do not leave semaphores
+// behind. created on first use of each entry, and never deleted because
+// a completion may give the semaphore just after its waiter has gone.
+static constexpr int SEMAPHORE_POOL_SIZE = 16;
+static SemaphoreHandle_t semaphores[SEMAPHORE_POOL_SIZE];
+static bool semaphore_in_use[SEMAPHORE_POOL_SIZE];
+static portMUX_TYPE semaphore_lock = portMUX_INITIALIZER_UNLOCKED;
+
 
 /**
- * run specified handler in main thread
+ * promise pool for post_to_main_thread().
+ * the completion of promises[n] is signaled by bit n of promise_events,
+ * so a thread can wait for several promises at once.
  * */
-int run_in_main_thread(sync_handler_t handler)
+struct threadsync_detail::promise_t
+{
+    uint8_t refs; //!< references from futures and the queued handler; 0 = free
+    bool started; //!< whether the handler has started; started promises are not coalescible
+    uint32_t key; //!< coalescing key; 0 = never coalesced
+    int retval; //!< handler's return value
+};
+
+static constexpr int PROMISE_POOL_SIZE = 24; // must not exceed event group bits (24)
+static promise_t promises[PROMISE_POOL_SIZE];
+static std::atomic<EventGroupHandle_t> promise_events(nullptr);
+static portMUX_TYPE promise_lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+// queue statistics; latency_histogram[n] counts latencies in [2^n, 2^(n+1)) us
+static constexpr int LATENCY_BUCKETS = 16;
+static uint32_t latency_histogram[LATENCY_BUCKETS];
+static uint32_t max_latency_us;
+static uint32_t executed_count;
+static uint32_t coalesced_count;
+static uint32_t max_drained_count; // maximum count of items drained at once
+
+
+slot_t * threadsync_detail::acquire_slot()
+{
+    return queue.acquire();
+}
+
+void threadsync_detail::publish_slot(slot_t * slot)
+{
+    queue.publish(slot);
+}
+
+SemaphoreHandle_t threadsync_detail::acquire_semaphore()
+{
+    for(;;)
+    {
+        int found = -1;
+        portENTER_CRITICAL(&semaphore_lock);
+        for(int i = 0; i < SEMAPHORE_POOL_SIZE; ++i)
+        {
+            if(!semaphore_in_use[i]) { semaphore_in_use[i] = true; found = i; break; }
+        }
+        portEXIT_CRITICAL(&semaphore_lock);
+
+        if(found >= 0)
+        {
+            // only the taker touches the entry until it is released
+            if(!semaphores[found]) semaphores[found] = xSemaphoreCreateBinary();
+            return semaphores[found];
+        }
+
+        // all semaphores are in use; wait for some to be released
+        vTaskDelay(1);
+    }
+}
+
+static void release_semaphore(SemaphoreHandle_t sem)
+{
+    portENTER_CRITICAL(&semaphore_lock);
+    for(int i = 0; i < SEMAPHORE_POOL_SIZE; ++i)
+    {
+        if(semaphores[i] == sem) { semaphore_in_use[i] = false; break; }
+    }
+    portEXIT_CRITICAL(&semaphore_lock);
+}
+
+bool threadsync_detail::in_main_thread()
+{
+    return xTaskGetCurrentTaskHandle() == loopTaskHandle;
+}
+
+void threadsync_detail::wait(waiter_t & waiter)
+{
+    // the semaphore may have been left given by an earlier completion,
+    // so check the done flag each time we wake up.
+    while(!waiter.done.load(std::memory_order_acquire)) xSemaphoreTake(waiter.sem, portMAX_DELAY);
+
+    // the completion may still be about to give the semaphore; that is
+    // harmless for its next user, which also checks its own done flag.
+    release_semaphore(waiter.sem);
+    waiter.sem = nullptr;
+}
+
+void threadsync_detail::complete_waiter(void * context, int retval)
+{
+    // tell waiting thread that the handler has done.
+    // take the semaphore out first; the waiter may vanish as soon as
+    // done is set.
+    waiter_t * waiter = static_cast<waiter_t *>(context);
+    SemaphoreHandle_t sem = waiter->sem;
+    waiter->retval = retval;
+    waiter->done.store(true, std::memory_order_release);
+    xSemaphoreGive(sem);
+}
+
+
+static EventGroupHandle_t get_promise_events()
+{
+    EventGroupHandle_t events = promise_events.load();
+    if(events) return events;
+
+    // first use; create one. another thread may be doing the same thing
+    EventGroupHandle_t created = xEventGroupCreate();
+    if(promise_events.compare_exchange_strong(events, created)) return created;
+    vEventGroupDelete(created);
+    return events;
+}
+
+static EventBits_t promise_bit(const promise_t * promise)
+{
+    return (EventBits_t)1 << (promise - promises);
+}
+
+static void release_promise(promise_t * promise)
+{
+    portENTER_CRITICAL(&promise_lock);
+    -- promise->refs;
+    portEXIT_CRITICAL(&promise_lock);
+}
+
+promise_t * threadsync_detail::acquire_promise(uint32_t key, bool & coalesced)
+{
+    EventGroupHandle_t events = get_promise_events();
+    for(;;)
+    {
+        promise_t * found = nullptr;
+        coalesced = false;
+
+        portENTER_CRITICAL(&promise_lock);
+        if(key)
+        {
+            // search for a pending equivalent request
+            for(auto && p : promises)
+            {
+                if(p.refs && !p.started && p.key == key)
+                {
+                    ++ p.refs;
+                    ++ coalesced_count;
+                    found = &p;
+                    coalesced = true;
+                    break;
+                }
+            }
+        }
+        if(!found)
+        {
+            // take a free one
+            for(auto && p : promises)
+            {
+                if(!p.refs)
+                {
+                    p.refs = 2; // one for the future, one for the queued handler
+                    p.started = true; // not coalescible until the bit is cleared
+                    p.key = key;
+                    found = &p;
+                    break;
+                }
+            }
+        }
+        portEXIT_CRITICAL(&promise_lock);
+
+        if(found)
+        {
+            if(!coalesced)
+            {
+                // clear the completion bit left by the previous use, then
+                // allow others to coalesce. the handler is not queued yet,
+                // so nobody can set the bit in the meantime.
+                xEventGroupClearBits(events, promise_bit(found));
+                portENTER_CRITICAL(&promise_lock);
+                found->started = false;
+                portEXIT_CRITICAL(&promise_lock);
+            }
+            return found;
+        }
+
+        // all promises are in use; wait for some to be released
+        if(in_main_thread())
+            poll_main_thread_queue();
+        else
+            vTaskDelay(1);
+    }
+}
+
+static void start_promise(promise_t * promise)
+{
+    portENTER_CRITICAL(&promise_lock);
+    promise->started = true;
+    portEXIT_CRITICAL(&promise_lock);
+}
+
+void threadsync_detail::complete_promise(void * context, int retval)
+{
+    promise_t * promise = static_cast<promise_t *>(context);
+    promise->retval = retval;
+    xEventGroupSetBits(promise_events.load(), promise_bit(promise));
+    release_promise(promise); // the queued handler's reference
+}
+
+
+main_thread_future_t & main_thread_future_t::operator = (main_thread_future_t && rhs)
 {
-    // create queue item on heap
-    handler_queue_item_t * item = new handler_queue_item_t(handler);
+    if(this != &rhs)
+    {
+        reset();
+        promise = rhs.promise;
+        rhs.promise = nullptr;
+    }
+    return *this;
+}
 
-    // lock queue and push it back
-	portENTER_CRITICAL(&queue_lock);
-    queue.push_back(item);
-    portEXIT_CRITICAL(&queue_lock);
+EventBits_t main_thread_future_t::get_bit() const
+{
+    return promise ? promise_bit(promise) : 0;
+}
 
-    // wait for the handler execution done
-    // queue item is removed in anothor function
-    xSemaphoreTake(item->runsem, portMAX_DELAY);
-    xSemaphoreGive(item->runsem);
+bool main_thread_future_t::ready() const
+{
+    if(!promise) return false;
+    return (xEventGroupGetBits(promise_events.load()) & get_bit()) != 0;
+}
 
-    int retval = item->retval;
+int main_thread_future_t::get()
+{
+    if(!promise) return -1;
+    wait_main_thread_futures(this, 1);
+    return promise->retval;
+}
 
-    // delete handler item
-    delete item;
+void main_thread_future_t::reset()
+{
+    if(promise) release_promise(promise), promise = nullptr;
+}
 
-    return retval;
+void wait_main_thread_futures(main_thread_future_t * futures, size_t count)
+{
+    EventBits_t bits = 0;
+    for(size_t i = 0; i < count; ++i) bits |= futures[i].get_bit();
+    if(!bits) return;
+
+    EventGroupHandle_t events = promise_events.load();
+    if(in_main_thread())
+    {
+        // waiting here would block the handlers forever; run them instead
+        while((xEventGroupGetBits(events) & bits) != bits) poll_main_thread_queue();
+        return;
+    }
+    xEventGroupWaitBits(events, bits, pdFALSE, pdTRUE, portMAX_DELAY);
 }
 
+
 /**
- * poll queue for the next handler item, if exist, execute it
+ * poll queue for pending handler items, and execute all of them
  * */
 void poll_main_thread_queue()
 {
-    handler_queue_item_t *item = nullptr;
-	portENTER_CRITICAL(&queue_lock);
-    if(queue.size() > 0)
+    // bound the iteration count, in case handlers keep queuing
+    // new handlers from the main thread
+    uint32_t i;
+    for(i = 0; i < call_queue_t::CAPACITY; ++i)
     {
-        item = queue.front();
-        queue.pop_front();
-    }
-    portEXIT_CRITICAL(&queue_lock);
+        slot_t * slot = queue.peek();
+        if(!slot) break;
+
+        // record the queue-to-execution latency
+        uint32_t latency = micros() - slot->queued_us;
+        int bucket = 31 - __builtin_clz(latency | 1);
+        if(bucket >= LATENCY_BUCKETS) bucket = LATENCY_BUCKETS - 1;
+        ++ latency_histogram[bucket];
+        if(latency > max_latency_us) max_latency_us = latency;
+        ++ executed_count;
 
-    if(!item) return;
+        // move the handler out and release the slot before running it.
+        // the handler may poll the queue again (through a full queue,
+        // an exhausted promise pool or wait_main_thread_futures()), and
+        // the nested poll must not see this slot once more.
+        alignas(INLINE_HANDLER_ALIGN) uint8_t storage[INLINE_HANDLER_SIZE];
+        slot->relocate(storage, slot->storage);
+        int (*invoke)(void *) = slot->invoke;
+        complete_t complete = slot->complete;
+        void * context = slot->context;
+        if(complete == &complete_promise) start_promise(static_cast<promise_t *>(context));
+        queue.release(slot);
 
-    // run the handler
-    item->retval = item->handler();
+        int retval = invoke(storage);
+        if(complete) complete(context, retval);
+    }
+    if(i > max_drained_count) max_drained_count = i;
+}
 
-    // release semaphore to tell waiting thread that the handler has done
-    xSemaphoreGive(item->runsem);
-}
\ No newline at end of file
+void dump_main_thread_queue_stats()
+{
+    printf("--- main thread queue ---\n");
+    printf("Executed handlers   : %lu\n", (unsigned long)executed_count);
+    printf("Coalesced requests  : %lu\n", (unsigned long)coalesced_count);
+    printf("Max drained at once : %lu\n", (unsigned long)max_drained_count);
+    printf("Max latency         : %lu us\n", (unsigned long)max_latency_us);
+    printf("--- queue-to-execution latency ---\n");
+    for(int i = 0; i < LATENCY_BUCKETS; ++i)
+    {
+        if(!latency_histogram[i]) continue;
+        if(i == LATENCY_BUCKETS - 1)
+            printf("%7lu us -         : %lu\n", 1UL << i, (unsigned long)latency_histogram[i]);
+        else
+            printf("%7lu us - %7lu us : %lu\n", i ? 1UL << i : 0UL, (1UL << (i + 1)) - 1,
+                (unsigned long)latency_histogram[i]);
+    }
+}
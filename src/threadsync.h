@@ -1,10 +1,202 @@
 #pragma once
 
 
+#include <Arduino.h>
+#include <freertos/semphr.h>
+#include <freertos/event_groups.h>
+#include <atomic>
 #include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
 
 typedef std::function<int(void)> sync_handler_t;
 
-int run_in_main_thread(sync_handler_t handler);
+namespace threadsync_detail
+{
+    static constexpr size_t INLINE_HANDLER_SIZE = 24; //!< maximum handler object size in bytes
+    static constexpr size_t INLINE_HANDLER_ALIGN = 8; //!< maximum handler object alignment
+
+    typedef void (*complete_t)(void * context, int retval); //!< completion notifier
+
+    //! caller side waiting state; lives on the caller's stack
+    struct waiter_t
+    {
+        int retval = -1;
+        std::atomic<bool> done{false}; //!< set with release once retval is written
+        SemaphoreHandle_t sem = nullptr;
+    };
+
+    //! a preallocated queue slot holding a handler object inline
+    struct slot_t
+    {
+        std::atomic<uint32_t> sequence; //!< slot state; see threadsync.cpp
+        uint32_t position; //!< queue position this slot was acquired for
+        uint32_t queued_us; //!< micros() at the time the slot was published
+        int (*invoke)(void * storage); //!< calls then destroys the handler object
+        void (*relocate)(void * dst, void * src); //!< moves the handler object out of the slot
+        complete_t complete; //!< nullptr for fire-and-forget calls
+        void * context; //!< argument for complete
+        alignas(INLINE_HANDLER_ALIGN) uint8_t storage[INLINE_HANDLER_SIZE];
+    };
+
+    struct promise_t;
+
+    slot_t * acquire_slot(); //!< reserve a free slot; waits while the queue is full
+    void publish_slot(slot_t * slot); //!< pass the filled slot to the main thread
+    SemaphoreHandle_t acquire_semaphore(); //!< take a binary semaphore from the pool
+    bool in_main_thread(); //!< whether the caller is the main (Arduino loop) thread
+    void wait(waiter_t & waiter); //!< wait for the handler completion; returns the semaphore to the pool
+    void complete_waiter(void * context, int retval);
+
+    promise_t * acquire_promise(uint32_t key, bool & coalesced); //!< take a pooled promise
+    void complete_promise(void * context, int retval);
+
+    // H, not F; "~F()" would be expanded by the F() macro of Arduino
+    template <typename H>
+    int invoke_and_destroy(void * storage)
+    {
+        H * h = reinterpret_cast<H *>(storage);
+        int retval = (*h)();
+        h->~H();
+        return retval;
+    }
+
+    template <typename H>
+    int invoke_and_destroy_void(void * storage)
+    {
+        H * h = reinterpret_cast<H *>(storage);
+        (*h)();
+        h->~H();
+        return 0;
+    }
+
+    template <typename H>
+    void relocate(void * dst, void * src)
+    {
+        H * h = reinterpret_cast<H *>(src);
+        new (dst) H(std::move(*h));
+        h->~H();
+    }
+
+    template <typename F, int (*INVOKE)(void *)>
+    void enqueue(F && handler, complete_t complete, void * context)
+    {
+        typedef typename std::decay<F>::type handler_t;
+        static_assert(sizeof(handler_t) <= INLINE_HANDLER_SIZE,
+            "The handler is too large to be queued. Capture less, or capture by reference.");
+        static_assert(alignof(handler_t) <= INLINE_HANDLER_ALIGN,
+            "The handler requires too strict alignment.");
+
+        slot_t * slot = acquire_slot();
+        new (slot->storage) handler_t(std::forward<F>(handler));
+        slot->invoke = INVOKE;
+        slot->relocate = &relocate<handler_t>;
+        slot->complete = complete;
+        slot->context = context;
+        publish_slot(slot);
+    }
+}
+
+/**
+ * run specified handler in main thread, and wait for its completion.
+ * the handler is a callable returning int, stored in the queue without heap
+ * allocation. if called from the main thread, the handler is run immediately.
+ * */
+template <typename F>
+int run_in_main_thread(F && handler)
+{
+    if(threadsync_detail::in_main_thread()) return handler();
+
+    typedef typename std::decay<F>::type handler_t;
+    threadsync_detail::waiter_t waiter;
+    waiter.sem = threadsync_detail::acquire_semaphore();
+    threadsync_detail::enqueue<F, &threadsync_detail::invoke_and_destroy<handler_t> >(
+        std::forward<F>(handler), &threadsync_detail::complete_waiter, &waiter);
+    threadsync_detail::wait(waiter);
+    return waiter.retval;
+}
+
+/**
+ * run specified handler in main thread, without waiting for its completion.
+ * the handler's return value, if any, is discarded. this can also be called
+ * from the main thread to defer something to the next poll.
+ * */
+template <typename F>
+void run_in_main_thread_async(F && handler)
+{
+    typedef typename std::decay<F>::type handler_t;
+    threadsync_detail::enqueue<F, &threadsync_detail::invoke_and_destroy_void<handler_t> >(
+        std::forward<F>(handler), nullptr, nullptr);
+}
+
+
+/**
+ * a handle to the result of post_to_main_thread().
+ * futures refer to pooled promises, so they are cheap to make but
+ * are movable only. destroying a future before the handler completes
+ * is fine; the handler still runs and the result is discarded.
+ * */
+class main_thread_future_t
+{
+    threadsync_detail::promise_t * promise;
+
+public:
+    main_thread_future_t() : promise(nullptr) {}
+    explicit main_thread_future_t(threadsync_detail::promise_t * _promise) : promise(_promise) {}
+    main_thread_future_t(main_thread_future_t && rhs) : promise(rhs.promise) { rhs.promise = nullptr; }
+    main_thread_future_t & operator = (main_thread_future_t && rhs);
+    main_thread_future_t(const main_thread_future_t &) = delete;
+    main_thread_future_t & operator = (const main_thread_future_t &) = delete;
+    ~main_thread_future_t() { reset(); }
+
+    //! returns whether the future refers to a request
+    bool valid() const { return promise != nullptr; }
+
+    //! returns whether the handler has completed
+    bool ready() const;
+
+    //! wait for the handler completion and return its return value
+    int get();
+
+    //! release the reference to the request
+    void reset();
+
+private:
+    EventBits_t get_bit() const;
+
+    friend void wait_main_thread_futures(main_thread_future_t * futures, size_t count);
+};
+
+/**
+ * post specified handler to the main thread, returning a future of
+ * its return value. non-zero coalesce_key identifies equivalent requests;
+ * while a request with the same key is still waiting in the queue, the
+ * new request is not queued and shares the pending request's result.
+ * futures come from a small shared pool (24 entries); posting waits while
+ * the pool is exhausted, so do not keep many futures alive per thread.
+ * */
+template <typename F>
+main_thread_future_t post_to_main_thread(F && handler, uint32_t coalesce_key = 0)
+{
+    typedef typename std::decay<F>::type handler_t;
+    bool coalesced = false;
+    threadsync_detail::promise_t * promise =
+        threadsync_detail::acquire_promise(coalesce_key, coalesced);
+    if(!coalesced)
+        threadsync_detail::enqueue<F, &threadsync_detail::invoke_and_destroy<handler_t> >(
+            std::forward<F>(handler), &threadsync_detail::complete_promise, promise);
+    return main_thread_future_t(promise);
+}
+
+/**
+ * wait for all given futures to complete at once.
+ * */
+void wait_main_thread_futures(main_thread_future_t * futures, size_t count);
+
 void poll_main_thread_queue();
 
+/**
+ * show queue-to-execution latency histogram and queue statistics
+ * */
+void dump_main_thread_queue_stats();
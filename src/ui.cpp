@@ -15,6 +15,7 @@
 #include "calendar.h"
 #include "mz_bme.h"
 #include "ambient.h"
+#include "remote_fb.h"
 
 #include "fonts/font_5x5.h"
 #include "fonts/font_4x5.h"
@@ -33,18 +34,23 @@ enum transition_t { t_none };
 class screen_base_t
 {
 	bool erase_bg = true; //!< whether to erase background automatically before draw()
+	frame_buffer_t *layer = nullptr; //!< cached static content; allocated on first use
+	bool layer_valid = false; //!< whether the layer content is up to date
 
 public:
 	//! The constructor
 	screen_base_t() {;}
 
 	//! The destructor
-	virtual ~screen_base_t() {;}
+	virtual ~screen_base_t() { delete layer; }
 
 
 	void set_erase_bg(bool b) { erase_bg = b; }
 	bool get_erase_bg() const { return erase_bg; }
 
+	//! Returns the screen name, used for draw time statistics
+	virtual const char * get_name() const { return "screen"; }
+
 protected:
 
 	static constexpr int num_w_chars = 10; //!< maximum chars in a horizontal line
@@ -63,6 +69,17 @@ protected:
 	//! blocking function (like network, filesystem, serial)
 	virtual bool draw() {return false;}
 
+	//! Draw static content (labels, borders, lists) into the layer.
+	//! This is called only when the layer is invalidated; see composite_layer().
+	virtual void draw_layer(frame_buffer_t & layer) {;}
+
+	//! Call this when the static content drawn by draw_layer() has changed
+	void invalidate_layer() { layer_valid = false; }
+
+	//! Overlay the cached static content on the background frame buffer,
+	//! redrawing it by draw_layer() if invalidated. Call this from draw().
+	void composite_layer();
+
 	//! Call this when the screen content is written and need to be showed
 	void show(transition_t transition = t_none);
 
@@ -100,6 +117,16 @@ class screen_manager_t
 	uint32_t next_idle_millis; //!< next idle processing mills
 	bool processing = false; //!< whether processing is ongoing or not
 
+	//! draw time statistics per screen name
+	struct draw_stat_t
+	{
+		const char *name;
+		uint32_t count; //!< number of draws
+		uint32_t total_us; //!< total draw time in us
+		uint32_t max_us; //!< maximum draw time in us
+	};
+	std::vector<draw_stat_t> draw_stats;
+
 public:
 	screen_manager_t()
 	{
@@ -189,14 +216,33 @@ protected:
 
 				// dispatch draw event
 				// erase background
+				const char *name = top->get_name(); // top may vanish in draw()
+				uint32_t start = micros();
 				if(top->get_erase_bg())
 					get_bg_frame_buffer().fill(0, 0, LED_MAX_LOGICAL_COL, LED_MAX_LOGICAL_ROW, 0);
-				if(top->draw()) show(t_none);
+				bool drawn = top->draw();
+				record_draw_time(name, micros() - start);
+				if(drawn) show(t_none);
 			}
 		}
 		blink_intensity += 21;
 	}
 
+	void record_draw_time(const char *name, uint32_t us)
+	{
+		for(auto && st : draw_stats)
+		{
+			if(st.name == name)
+			{
+				++ st.count;
+				st.total_us += us;
+				if(st.max_us < us) st.max_us = us;
+				return;
+			}
+		}
+		draw_stats.push_back(draw_stat_t{name, 1, us, us});
+	}
+
 	void process_idle()
 	{
 		if(processing) return; // prevent reentrance
@@ -273,11 +319,42 @@ public:
 	{
 		blink_intensity = 128;
 	}
+
+	/**
+	 * Show draw time statistics
+	 */
+	void dump_draw_stats() const
+	{
+		printf("%-16s %8s %8s %8s\n", "screen", "draws", "avg us", "max us");
+		for(auto && st : draw_stats)
+			printf("%-16s %8lu %8lu %8lu\n", st.name, (unsigned long)st.count,
+				(unsigned long)(st.total_us / st.count), (unsigned long)st.max_us);
+	}
+
+	/**
+	 * Reset draw time statistics
+	 */
+	void reset_draw_stats()
+	{
+		draw_stats.clear();
+	}
 };
 
 static screen_manager_t screen_manager;
 
 
+void screen_base_t::composite_layer()
+{
+	if(!layer) layer = new frame_buffer_t();
+	if(!layer_valid)
+	{
+		layer->fill(0);
+		draw_layer(*layer);
+		layer_valid = true;
+	}
+	fb().composite(*layer);
+}
+
 void screen_base_t::show(transition_t transition)
 {
 	screen_manager.show(transition);
@@ -313,6 +390,8 @@ public:
 	{
 	}
 
+	const char * get_name() const override { return "message_box"; }
+
 	// TODO: scroll and text formatting
 
 protected:
@@ -362,6 +441,8 @@ public:
 		sensors_set_contrast_always_max(true); // always maximum contrast 
 	}
 
+	const char * get_name() const override { return "led_test"; }
+
 protected:
 	bool draw() override
 	{
@@ -442,6 +523,7 @@ protected:
 	int y = 0; //!< logical position in char_list or line; 0=line, 1=BS/DEL, 2~ = char_list
 	int x = 0; //!< logical position in char_list
 	int px = 0; //!< physical x position (where cursor blinks)
+	int layer_char_list_start = -1; //!< char_list_start the layer was drawn with
 
 public:
 
@@ -467,16 +549,38 @@ public:
 	{
 	}
 
+	const char * get_name() const override { return "ascii_editor"; }
+
 protected:
 	virtual bool validate(const String &line) { return true; }
 
-	bool draw() override
+	void draw_layer(frame_buffer_t & layer) override
 	{
 		// draw title
-		fb().draw_text(0, 0, 255, title.c_str(), font_5x5);
+		layer.draw_text(0, 0, 255, title.c_str(), font_5x5);
 
 		// draw line
-		fb().fill(0, 6, LED_MAX_LOGICAL_COL, 1, 128);
+		layer.fill(0, 6, LED_MAX_LOGICAL_COL, 1, 128);
+
+		// draw char_list
+		for(int i = 0; i < num_char_list_display_lines; ++i)
+		{
+			if(i+char_list_start < char_list.size())
+			{
+				layer.draw_text(0, i*6+char_list_start_y,
+					255, char_list[i+char_list_start].c_str(), font_5x5);
+			}
+		}
+	}
+
+	bool draw() override
+	{
+		// redraw the layer if the char list has been scrolled
+		if(layer_char_list_start != char_list_start)
+		{
+			layer_char_list_start = char_list_start;
+			invalidate_layer();
+		}
 
 		// draw line cursor
 		fb().fill((cursor - line_start) * 6, 7, 1, 5, get_blink_intensity()); 
@@ -497,19 +601,12 @@ protected:
 				get_blink_intensity());
 		}
 
+		// overlay title, line and char_list
+		composite_layer();
+
 		// draw edit line
 		fb().draw_text(1, 7, 255, line.c_str() + line_start, font_5x5);
 
-		// draw char_list
-		for(int i = 0; i < num_char_list_display_lines; ++i)
-		{
-			if(i+char_list_start < char_list.size())
-			{
-				fb().draw_text(0, i*6+char_list_start_y,
-					255, char_list[i+char_list_start].c_str(), font_5x5);
-			}
-		}
-
 		// show the drawn content
 		return true;
 	}
@@ -691,6 +788,8 @@ public:
 		char_list = { F("BS DEL"), F("56789."), F("01234") };
 	}
 
+	const char * get_name() const override { return "ip_editor"; }
+
 protected:
 	bool validate(const String &line) override
 	{
@@ -713,6 +812,8 @@ protected:
 	bool h_scroll = false; //!< whether to allow horizontal scroll
 	int title_line_y = 7; //!< title underline position in y axis
 	int list_start_y = 8; //!< menu item start position in y axis
+	int layer_x = -1; //!< x the layer was drawn with
+	int layer_y_top = -1; //!< y_top the layer was drawn with
 
 public:
 	screen_menu_t(const String &_title, const string_vector & _items) :
@@ -720,6 +821,8 @@ public:
 	{
 	}
 
+	const char * get_name() const override { return "menu"; }
+
 	void set_h_scroll(bool b)
 	{
 		h_scroll = b;
@@ -727,7 +830,8 @@ public:
 	}
 
 protected:
-	string_vector & get_items() { return items; }
+	//! Returns items; the caller may modify them
+	string_vector & get_items() { invalidate_layer(); return items; }
 
 	void set_selected(int i)
 	{
@@ -739,16 +843,13 @@ protected:
 		}
 	}
 
-	bool draw() override
+	void draw_layer(frame_buffer_t & layer) override
 	{
 		// draw the title
-		fb().draw_text(0, 0, 255, title.c_str(), font_5x5);
+		layer.draw_text(0, 0, 255, title.c_str(), font_5x5);
 
 		// draw line
-		fb().fill(0, title_line_y, LED_MAX_LOGICAL_COL, 1, 128);
-
-		// draw cursor
-		fb().fill(1, (y - y_top)*6 + list_start_y, LED_MAX_LOGICAL_COL - 1, 5, get_blink_intensity());
+		layer.fill(0, title_line_y, LED_MAX_LOGICAL_COL, 1, 128);
 
 		// draw items
 		for(int i = 0; i < max_lines; ++ i)
@@ -756,9 +857,26 @@ protected:
 			if(i + y_top < items.size())
 			{
 				if(x < items[i + y_top].length() - 1)
-					fb().draw_text(1, i * 6 + list_start_y, 255, items[i + y_top].c_str() + x, font_5x5);
+					layer.draw_text(1, i * 6 + list_start_y, 255, items[i + y_top].c_str() + x, font_5x5);
 			}
 		}
+	}
+
+	bool draw() override
+	{
+		// redraw the layer if the list has been scrolled
+		if(layer_x != x || layer_y_top != y_top)
+		{
+			layer_x = x;
+			layer_y_top = y_top;
+			invalidate_layer();
+		}
+
+		// draw cursor
+		fb().fill(1, (y - y_top)*6 + list_start_y, LED_MAX_LOGICAL_COL - 1, 5, get_blink_intensity());
+
+		// overlay title, line and items
+		composite_layer();
 
 		// show the drawn content
 		return true;
@@ -822,6 +940,8 @@ public:
 		set_marquee(_marquee);
 	}
 
+	const char * get_name() const override { return "menu_marquee"; }
+
 	void set_marquee(const String & m)
 	{
 		marquee = m + F(" ") + m + F(" ");
@@ -857,6 +977,8 @@ public:
 	screen_dns_2_editor_t(const ip_addr_settings_t & _settings) :
 		screen_ip_editor_t(F("DNS Srvr 2"), _settings.dns2), settings(_settings) {}
 
+	const char * get_name() const override { return "dns_2_editor"; }
+
 protected:
 	void on_ok(const String & line) override
 	{
@@ -882,6 +1004,8 @@ public:
 	screen_dns_1_editor_t(const ip_addr_settings_t & _settings) :
 		screen_ip_editor_t(F("DNS Srvr 1"), _settings.dns1), settings(_settings) {}
 
+	const char * get_name() const override { return "dns_1_editor"; }
+
 protected:
 	void on_ok(const String & line) override
 	{
@@ -905,6 +1029,8 @@ public:
 	screen_net_mask_editor_t(const ip_addr_settings_t & _settings) :
 		screen_ip_editor_t(F("Net Mask"), _settings.ip_mask), settings(_settings) {}
 
+	const char * get_name() const override { return "net_mask_editor"; }
+
 protected:
 	bool validate(const String &line) override
 	{
@@ -960,6 +1086,8 @@ public:
 	screen_ip_gateway_editor_t(const ip_addr_settings_t & _settings) :
 		screen_ip_editor_t(F("Gateway"), _settings.ip_gateway), settings(_settings) {}
 
+	const char * get_name() const override { return "ip_gateway_editor"; }
+
 protected:
 	void on_ok(const String & line) override
 	{
@@ -983,6 +1111,8 @@ public:
 	screen_ip_addr_editor_t(const ip_addr_settings_t & _settings) :
 		screen_ip_editor_t(F("IP Addr"), _settings.ip_addr), settings(_settings) {}
 
+	const char * get_name() const override { return "ip_addr_editor"; }
+
 protected:
 	void on_ok(const String & line) override
 	{
@@ -1007,6 +1137,8 @@ public:
 					F("Manual IP >"),
 				} ) {	}
 
+	const char * get_name() const override { return "dhcp_mode"; }
+
 protected:
 	void on_ok(int idx) override
 	{
@@ -1040,6 +1172,8 @@ public:
 	{
 	}
 
+	const char * get_name() const override { return "ap_pass_editor"; }
+
 protected:
 	void on_ok(const String & line) override
 	{
@@ -1065,6 +1199,8 @@ public:
 	{
 	}
 
+	const char * get_name() const override { return "ap_name_editor"; }
+
 protected:
 	void on_ok(const String & line) override
 	{
@@ -1108,6 +1244,8 @@ public:
 		WiFi.scanDelete();
 	}
 
+	const char * get_name() const override { return "ap_list"; }
+
 protected:
 	void on_ok(int idx) override
 	{
@@ -1143,6 +1281,8 @@ public:
 		WiFi.scanNetworks(/*async=*/true, /*show_hidden=*/false);
 	}
 
+	const char * get_name() const override { return "wifi_scanning"; }
+
 	bool draw() override
 	{
 		// draw the text
@@ -1185,6 +1325,8 @@ public:
 
 	}
 
+	const char * get_name() const override { return "wps_processing"; }
+
 	bool draw() override
 	{
 		// draw the text
@@ -1224,6 +1366,8 @@ public:
 					F("DHCP Mode >"),
 				} ) {	}
 
+	const char * get_name() const override { return "wifi_setting"; }
+
 protected:
 	void on_ok(int idx) override
 	{
@@ -1264,6 +1408,40 @@ protected:
 
 
 
+//! frames pushed from the network; see remote_fb.h
+class screen_remote_fb_t : public screen_base_t
+{
+public:
+	screen_remote_fb_t()
+	{
+		set_erase_bg(false); // frames are decoded over the previous one
+	}
+
+	const char * get_name() const override { return "remote_fb"; }
+
+protected:
+	bool draw() override
+	{
+		return remote_fb_pull(fb(), get_current_frame_buffer());
+	}
+
+	void on_button(uint32_t button) override
+	{
+		if(button == BUTTON_CANCEL)
+		{
+			// back to the clock, until the producer pauses
+			remote_fb_dismiss();
+			screen_manager.pop();
+		}
+	}
+
+	void on_idle_50() override
+	{
+		if(!remote_fb_active()) screen_manager.pop(); // the push has ended
+	}
+};
+
+
 //! main clock ui
 class screen_clock_t : public screen_base_t
 {
@@ -1282,6 +1460,8 @@ public:
 		_set_marquee(r) ;
 	}
 
+	const char * get_name() const override { return "clock"; }
+
 public:
 	void set_marquee(const String &s)
 	{
@@ -1294,9 +1474,21 @@ public:
 private:
 	void _set_marquee(const String &s)
 	{
-		if(!font_ft.get_available()) return;
 		marquee = s;
-		marquee_len = fb().get_text_width(s, font_ft);
+		if(!marquee.length() && font_ft.get_loaded())
+		{
+			// nothing else uses the TrueType font; give its memory back
+			font_ft.unload();
+		}
+		update_marquee_len();
+	}
+
+	//! measure the marquee. the width stays 0 until the font gets available,
+	//! which may be after this screen is made.
+	void update_marquee_len()
+	{
+		if(!font_ft.get_available()) { marquee_len = 0; return; }
+		marquee_len = fb().get_text_width(marquee.c_str(), font_ft);
 		if(marquee_x >= marquee_len) marquee_x = 0;
 	}
 
@@ -1363,6 +1555,7 @@ protected:
 		// draw marquee
 		if(font_ft.get_available())
 		{
+			if(!marquee_len && marquee.length()) update_marquee_len(); // font got ready
 			fb().draw_text(-marquee_x              , 35, 255, marquee, font_ft);
 			if(marquee_len > LED_MAX_LOGICAL_COL)
 				fb().draw_text(-marquee_x + marquee_len, 35, 255, marquee, font_ft);
@@ -1391,6 +1584,12 @@ protected:
 		}
 	}
 
+	void on_idle_50() override
+	{
+		// frames are being pushed from the network; show them
+		if(remote_fb_active()) screen_manager.push(new screen_remote_fb_t());
+	}
+
 	void on_idle_10() override
 	{
 		++ count;
@@ -1434,3 +1633,18 @@ void ui_process()
 String ui_get_marquee() { return screen_clock->get_marquee(); }
 void ui_set_marquee(const String &s) { screen_clock->set_marquee(s); }
 
+
+void ui_dump_draw_stats() { screen_manager.dump_draw_stats(); }
+void ui_reset_draw_stats() { screen_manager.reset_draw_stats(); }
+
+void ui_dump_frame()
+{
+	// plain PGM (P2) of the frame currently on the display
+	frame_buffer_t & fb = get_current_frame_buffer();
+	printf("P2\n%d %d\n255\n", fb.get_width(), fb.get_height());
+	for(int y = 0; y < fb.get_height(); ++y)
+	{
+		for(int x = 0; x < fb.get_width(); ++x)
+			printf("%d%c", fb.get_point(x, y), x == fb.get_width() - 1 ? '\n' : ' ');
+	}
+}
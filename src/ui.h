@@ -6,4 +6,8 @@ void ui_process();
 
 String ui_get_marquee();
 void ui_set_marquee(const String &s);
+
+void ui_dump_draw_stats(); //!< show per-screen draw time statistics
+void ui_reset_draw_stats(); //!< reset per-screen draw time statistics
+void ui_dump_frame(); //!< dump the displayed frame as plain PGM
 #endif
@@ -1,11 +1,217 @@
 #include <WebServer.h>
-#include <StreamString.h>
 #include "spiffs_fs.h"
 #include "mz_update.h"
+#include "settings.h"
+#include "threadsync.h"
+#include "web_server.h"
+#include "frame_stream.h"
+#include "json_writer.h"
+#include "calendar.h"
+#include "mz_wifi.h"
+#include "ambient.h"
+#include "matrix_drive.h"
+#include "mz_version.h"
+#include "ui.h"
+#include <rom/crc.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
 
 
-static WebServer server(80);
+/*
+	The server runs in its own tasks, so that a slow client does not block
+	the buttons and the UI. Everything owned by the main thread (settings,
+	reboot) must be accessed via run_in_main_thread().
+
+	The acceptor task polls the non-blocking listening socket, and hands
+	each connection to an idle worker of a fixed pool, as a stream is
+	handed to frame_stream_begin(). Connections beyond the pool wait in
+	the listen backlog. Each worker has its own WebServer, which holds the
+	state of the request being served, and all of them have the same
+	handlers, registered through web_server_on(). Handlers reach the
+	server of their worker by server().
+
+	A worker keeps serving requests on its connection while the client
+	keeps it alive, and at least one other worker is left idle for new
+	connections.
+*/
+static constexpr int WEB_MAX_CONNECTIONS = 4; //!< connection workers; connections served at once
+static constexpr uint32_t WEB_KEEP_ALIVE_TIMEOUT_MS = 2000; //!< idle time before a kept connection is closed
+static constexpr uint32_t WEB_ACCEPT_INTERVAL_MS = 5; //!< polling interval of the listening socket
+static constexpr uint32_t WEB_WORKER_STACK_SIZE = 8192;
+static constexpr uint32_t WEB_ACCEPTOR_STACK_SIZE = 2048;
+
+// request statistics; latency_histogram[n] counts latencies in [2^n, 2^(n+1)) us.
+// the workers update them concurrently; under web_stats_lock
+static constexpr int WEB_LATENCY_BUCKETS = 16;
+static portMUX_TYPE web_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t web_latency_histogram[WEB_LATENCY_BUCKETS];
+static uint32_t web_max_latency_us;
+static uint64_t web_total_latency_us;
+static uint32_t web_request_count; //!< requests dispatched to handlers
+static uint32_t web_not_modified_count; //!< requests answered by 304
+static uint32_t web_connection_count; //!< connections accepted
+static uint32_t web_reused_count; //!< requests on kept-alive connections
+static uint64_t web_bytes_sent; //!< body bytes of static files and exports
+static uint64_t web_bytes_received; //!< upload bytes
+
+//! add to a statistics counter
+template <typename T>
+static void web_count(T & counter, uint32_t n = 1)
+{
+	portENTER_CRITICAL(&web_stats_lock);
+	counter += n;
+	portEXIT_CRITICAL(&web_stats_lock);
+}
+
+static void web_count_latency(uint32_t latency)
+{
+	int bucket = 31 - __builtin_clz(latency | 1);
+	if(bucket >= WEB_LATENCY_BUCKETS) bucket = WEB_LATENCY_BUCKETS - 1;
+	portENTER_CRITICAL(&web_stats_lock);
+	++ web_latency_histogram[bucket];
+	if(latency > web_max_latency_us) web_max_latency_us = latency;
+	web_total_latency_us += latency;
+	portEXIT_CRITICAL(&web_stats_lock);
+}
+
+static int web_idle_workers();
+
+/**
+ * WebServer serving the connections handed to it, instead of those of
+ * its own listener
+ * */
+class web_connection_server_t : public WebServer
+{
+	bool keep_alive = false; //!< whether the connection is kept after the current response
+	bool head_sent = false; //!< whether the response head of the current request is sent
+	bool detached = false; //!< whether the connection has been handed over by a handler
+
+public:
+	/**
+	 * serve requests on the client until it closes the connection, asks
+	 * to close it, or stays idle for WEB_KEEP_ALIVE_TIMEOUT_MS
+	 * */
+	void serve(WiFiClient & client)
+	{
+		_currentClient = client;
+		detached = false;
+		bool reused = false;
+		uint32_t idle_since = millis();
+		while(_currentClient.connected())
+		{
+			if(!_currentClient.available())
+			{
+				if(millis() - idle_since >= WEB_KEEP_ALIVE_TIMEOUT_MS) break;
+				vTaskDelay(1);
+				continue;
+			}
+
+			// the time of a request includes receiving its body, as uploads
+			// are received by the handlers
+			uint32_t start = micros();
+			if(!_parseRequest(_currentClient)) break;
+			_currentClient.setTimeout(HTTP_MAX_SEND_WAIT);
+			_contentLength = CONTENT_LENGTH_NOT_SET;
+			keep_alive = _currentVersion == 1 && !header(F("Connection")).equalsIgnoreCase(F("close"));
+			head_sent = false;
+			if(reused) web_count(web_reused_count);
+			_handleRequest();
+			web_count_latency(micros() - start);
+
+			// a response without the head can not be delimited
+			if(detached || !head_sent || !keep_alive) break;
+			reused = true;
+			idle_since = millis();
+		}
+
+		if(!detached) _currentClient.stop();
+		_currentClient = WiFiClient();
+	}
 
+	//! the connection has been handed over, e.g. to a stream; it is neither read nor closed any more
+	void detach() { detached = true; }
+
+protected:
+	/**
+	 * WebServer always says "Connection: close" in the head. say
+	 * "keep-alive" instead when the connection is kept: the request
+	 * allows it, the handler did not add its own "Connection: close",
+	 * and another worker is idle
+	 * */
+	size_t _currentClientWrite(const char * b, size_t l) override
+	{
+		if(head_sent) return _currentClient.write(b, l);
+		head_sent = true;
+
+		static const char close_line[] = "Connection: close\r\n";
+		static const char keep_line[] = "Connection: keep-alive\r\n";
+		const char * end = b + l;
+		const char * line = std::search(b, end, close_line, close_line + sizeof(close_line) - 1);
+		keep_alive = keep_alive && line != end &&
+			std::search(line + 1, end, close_line, close_line + sizeof(close_line) - 1) == end &&
+			web_idle_workers() > 0;
+		if(!keep_alive) return _currentClient.write(b, l);
+
+		const char * rest = line + sizeof(close_line) - 1;
+		size_t n = _currentClient.write(b, line - b);
+		n += _currentClient.write(keep_line, sizeof(keep_line) - 1);
+		n += _currentClient.write(rest, end - rest);
+		return n == (size_t)(line - b) + sizeof(keep_line) - 1 + (end - rest) ? l : 0;
+	}
+};
+
+//! a connection worker
+struct web_worker_t
+{
+	web_connection_server_t server;
+	WiFiClient client; //!< connection handed over by the acceptor
+	std::atomic<bool> busy { false };
+	TaskHandle_t task = nullptr;
+};
+
+static WiFiServer listener(80);
+static web_worker_t web_workers[WEB_MAX_CONNECTIONS];
+
+static int web_idle_workers()
+{
+	int n = 0;
+	for(auto && w : web_workers) if(!w.busy) ++ n;
+	return n;
+}
+
+//! the server of the worker running the caller; handlers run only on the workers
+static web_connection_server_t & server()
+{
+	TaskHandle_t self = xTaskGetCurrentTaskHandle();
+	for(auto && w : web_workers)
+		if(w.task == self) return w.server;
+	abort();
+}
+
+/**
+ * the worker receiving an upload. uploads are large and go to a single
+ * place (the settings buffer or the updater), so one is received at a time
+ * */
+static std::atomic<web_connection_server_t *> upload_owner(nullptr);
+
+//! take the upload for the current request. false if another worker receives one
+static bool web_server_begin_upload()
+{
+	web_connection_server_t * none = nullptr;
+	return upload_owner.compare_exchange_strong(none, &server());
+}
+
+//! whether the current request has the upload
+static bool web_server_owns_upload() { return upload_owner == &server(); }
+
+//! release the upload of the worker, if it has it
+static void web_server_end_upload(web_connection_server_t & s)
+{
+	web_connection_server_t * owner = &s;
+	upload_owner.compare_exchange_strong(owner, nullptr);
+}
 
  
 static String updateIndex = // TODO: Error handling
@@ -18,10 +224,26 @@ static String updateIndex = // TODO: Error handling
  "<script>"
   "$('form').submit(function(e){"
   "e.preventDefault();"
-  "var form = $('#upload_form')[0];"
-  "var data = new FormData(form);"
+  "var file = $('#upload_form')[0].update.files[0];"
+  "if(!file) return;"
+  // the upload is continued from the last checkpoint on the device, when interrupted
+  "var id = encodeURIComponent(file.name + ':' + file.size + ':' + file.lastModified);"
+  "var retry = 0;"
+  "var resume = function() {"
+  "if(++retry > 20) { $('#prg').html('failed'); return; }"
+  "setTimeout(function() {"
+  "$.get('/update/resume?id=' + id).done(function(d) {"
+  "var offset = parseInt(d);"
+  "if(offset >= file.size) $('#prg').html('done');"
+  "else send(offset);"
+  "}).fail(resume);"
+  "}, 2000);"
+  "};"
+  "var send = function(offset) {"
+  "var data = new FormData();"
+  "data.append('update', file.slice(offset), file.name);"
   " $.ajax({"
-  "url: '/update',"
+  "url: '/update?id=' + id + '&offset=' + offset,"
   "type: 'POST',"
   "data: data,"
   "contentType: false,"
@@ -30,7 +252,7 @@ static String updateIndex = // TODO: Error handling
   "var xhr = new window.XMLHttpRequest();"
   "xhr.upload.addEventListener('progress', function(evt) {"
   "if (evt.lengthComputable) {"
-  "var per = evt.loaded / evt.total;"
+  "var per = (offset + evt.loaded * (file.size - offset) / evt.total) / file.size;"
   "$('#prg').html('progress: ' + Math.round(per*100) + '%');"
   "}"
   "}, false);"
@@ -40,8 +262,11 @@ static String updateIndex = // TODO: Error handling
   "console.log('success!')" 
  "},"
  "error: function (a, b, c) {"
+ "if(a.status == 500) $('#prg').html('failed'); else resume();"
  "}"
  "});"
+ "};"
+ "send(0);"
  "});"
  "</script>";
 
@@ -50,9 +275,9 @@ static bool send_common_header()
 	/*
 	if(!in_recovery)
 	{
-		if(!server.authenticate(user_name, password.c_str()))
+		if(!server().authenticate(user_name, password.c_str()))
 		{
-			server.requestAuthentication();
+			server().requestAuthentication();
 			return false;
 		}
 	}
@@ -61,38 +286,143 @@ static bool send_common_header()
 	return true;
 }
 
+//! a static file under /w, served by loadFromFS()
+struct web_asset_t
+{
+	String file_name; //!< file name in the filesystem
+	uint32_t size; //!< file size in bytes
+	bool gzip; //!< whether the file is gzip compressed
+	const char * content_type;
+	String etag; //!< entity tag from the content crc; made on the first request
+};
+
+//! URL path -> static file; built by build_asset_index()
+static std::map<String, web_asset_t> web_assets;
+static SemaphoreHandle_t web_assets_lock; //!< guards the entity tags made by the workers
+
+static constexpr size_t ASSET_STREAM_BUFFER_SIZE = 4096; //!< buffer size for streaming assets
+
+static const char * content_type_from_path(const String & path)
+{
+	static const struct { const char * ext; const char * type; } types[] = {
+		{ ".htm",  "text/html" },
+		{ ".html", "text/html" },
+		{ ".css",  "text/css" },
+		{ ".js",   "application/javascript" },
+		{ ".png",  "image/png" },
+		{ ".gif",  "image/gif" },
+		{ ".jpg",  "image/jpeg" },
+		{ ".ico",  "image/x-icon" },
+		{ ".xml",  "text/xml" },
+		{ ".pdf",  "application/pdf" },
+		{ ".zip",  "application/zip" },
+		{ ".txt",  "text/plain" },
+	};
+	for(auto && t : types)
+		if(path.endsWith(t.ext)) return t.type;
+	return "text/plain";
+}
+
+/**
+ * index all files under /w, so that a request is resolved by one lookup.
+ * "/w/foo.js" and "/w/foo.js.gz" are both served as "/foo.js"; the
+ * compressed one is preferred.
+ * */
+static void build_asset_index()
+{
+	const char rootstr[2] = { '/', 0 };
+	const String prefix(F("/w/")); // all contents must be under "w" directory
+	const String gz(F(".gz"));
+
+	web_assets.clear();
+	File dir = FS.open(rootstr);
+	File file;
+	while(dir && !!(file = dir.openNextFile()))
+	{
+		String name = file.name();
+		uint32_t size = file.size();
+		file.close();
+		if(!name.startsWith(prefix)) continue;
+
+		String path = name.substring(prefix.length() - 1); // keep leading '/'
+		bool gzip = path.endsWith(gz);
+		if(gzip) path = path.substring(0, path.length() - gz.length());
+
+		auto it = web_assets.find(path);
+		if(it != web_assets.end() && it->second.gzip) continue; // already have compressed one
+
+		web_asset_t & asset = web_assets[path];
+		asset.file_name = name;
+		asset.size = size;
+		asset.gzip = gzip;
+		asset.content_type = content_type_from_path(path);
+		asset.etag = String();
+	}
+	printf("Web server: %d static files indexed.\n", (int)web_assets.size());
+}
+
+//! make the entity tag of the asset from its content, if not yet
+static bool make_asset_etag(web_asset_t & asset)
+{
+	if(asset.etag.length()) return true;
+
+	File file = FS.open(asset.file_name.c_str(), "r");
+	if(!file) return false;
+	uint8_t buf[256];
+	uint32_t crc = 0;
+	size_t n;
+	while((n = file.read(buf, sizeof(buf))) > 0) crc = crc32_le(crc, buf, n);
+	file.close();
+
+	char etag[24];
+	snprintf(etag, sizeof(etag), "\"%08x-%x\"", (unsigned)crc, (unsigned)asset.size);
+	asset.etag = etag;
+	return true;
+}
+
 static bool loadFromFS(String path){
-	String dataType = F("text/plain");
 	if(path.endsWith("/")) path += F("index.html");
 
-	if(path.endsWith(".htm") || path.endsWith(".html")) dataType = F("text/html");
-	else if(path.endsWith(".css")) dataType = F("text/css");
-	else if(path.endsWith(".js"))  dataType = F("application/javascript");
-	else if(path.endsWith(".png")) dataType = F("image/png");
-	else if(path.endsWith(".gif")) dataType = F("image/gif");
-	else if(path.endsWith(".jpg")) dataType = F("image/jpeg");
-	else if(path.endsWith(".ico")) dataType = F("image/x-icon");
-	else if(path.endsWith(".xml")) dataType = F("text/xml");
-	else if(path.endsWith(".pdf")) dataType = F("application/pdf");
-	else if(path.endsWith(".zip")) dataType = F("application/zip");
-	else if(path.endsWith(".txt")) dataType = F("text/plain");
-
-	path = String(F("/w")) + path; // all contents must be under "w" directory
-		// TODO: path reverse-traversal check
-
-	if(FS.exists(path + F(".gz")))
-      path += String(F(".gz")); // handle gz
-
-	if (!FS.exists(path))
+	auto it = web_assets.find(path);
+	if(it == web_assets.end())
 	{
 		printf("Requested load form '%s' but file does not exist.\n", path.c_str());
 		return false;
 	}
+	web_asset_t & asset = it->second;
+	xSemaphoreTake(web_assets_lock, portMAX_DELAY);
+	bool has_etag = make_asset_etag(asset);
+	xSemaphoreGive(web_assets_lock);
+	if(!has_etag) return false;
+
+	// the browser may use its copy, but has to revalidate it each time,
+	// as the files change with firmware updates
+	server().sendHeader(F("Cache-Control"), F("no-cache"));
+	server().sendHeader(F("ETag"), asset.etag);
+	if(server().header(F("If-None-Match")) == asset.etag)
+	{
+		web_count(web_not_modified_count);
+		server().send(304);
+		return true;
+	}
 
-	File dataFile = FS.open(path.c_str(), "r");
-
+	File dataFile = FS.open(asset.file_name.c_str(), "r");
+	if(!dataFile) return false;
 
-	server.streamFile(dataFile, dataType);
+	if(asset.gzip) server().sendHeader(F("Content-Encoding"), F("gzip"));
+	server().setContentLength(asset.size);
+	server().send(200, asset.content_type, String());
+	if(server().method() != HTTP_HEAD)
+	{
+		WiFiClient client = server().client();
+		std::unique_ptr<uint8_t[]> buf(new uint8_t[ASSET_STREAM_BUFFER_SIZE]);
+		size_t n;
+		while((n = dataFile.read(buf.get(), ASSET_STREAM_BUFFER_SIZE)) > 0)
+		{
+			if(client.write(buf.get(), n) != n) break; // client has gone
+			web_count(web_bytes_sent, n);
+		}
+	}
 
 	dataFile.close();
 	return true;
@@ -101,110 +431,393 @@ static bool loadFromFS(String path){
 
 static void handleNotFound()
 {
+	web_count(web_request_count);
 	if(!send_common_header()) return;
-	if(loadFromFS(server.uri())) return;
+	if(loadFromFS(server().uri())) return;
 
-	if(server.uri() == "/")
+	if(server().uri() == "/")
 	{
 		// filesystem content missing or filesystem mount failed.
 		// show fallback message
 		printf("SPIFFS content missing or mount failed. Showing fallback message.\n");
-		server.send(200, F("text/html"), updateIndex);
+		server().send(200, F("text/html"), updateIndex);
 		return;
 	}
 
 	String message = F("Not Found\n\n");
 	message += String(F("URI: "));
-	message += server.uri();
+	message += server().uri();
 	message += String(F("\nMethod: "));
-	message += (server.method() == HTTP_GET)?F("GET"):F("POST");
+	message += (server().method() == HTTP_GET)?F("GET"):F("POST");
 	message += String(F("\nArguments: "));
-	message += server.args();
+	message += server().args();
 	message += String(F("\n"));
-	for (uint8_t i=0; i<server.args(); i++){
-		message += String(F(" NAME:"))+server.argName(i) + F("\n VALUE:") + server.arg(i) + F("\n");
+	for (uint8_t i=0; i<server().args(); i++){
+		message += String(F(" NAME:"))+server().argName(i) + F("\n VALUE:") + server().arg(i) + F("\n");
 	}
 	Serial.print(message);
-	server.send(404, F("text/plain"), message);
+	server().send(404, F("text/plain"), message);
 
 }
 
-static void string_json(const String &s, Stream & st)
+//! settings archive being uploaded; imported as it arrives
+static settings_importer_t * settings_importer;
+
+//! finish the settings import, if any. returns whether it succeeded
+static bool web_server_end_settings_import()
 {
-	st.print((char)'"'); // starting "
-	const char *p = s.c_str();
-	while(*p)
+	return run_in_main_thread([] () -> int {
+		if(!settings_importer) return false;
+		bool ok = settings_importer->end();
+		delete settings_importer;
+		settings_importer = nullptr;
+		return ok;
+	});
+}
+
+/**
+ * write-only Stream sending to the client as chunks of a chunked response.
+ * a Stream rather than a Print, for settings_export()
+ * */
+class chunked_print_t : public Stream
+{
+public:
+	int available() override { return 0; }
+	int read() override { return -1; }
+	int peek() override { return -1; }
+	void flush() override {}
+	size_t write(uint8_t c) override { return write(&c, 1); }
+	size_t write(const uint8_t * buffer, size_t size) override
 	{
-		char c = *p;
-
-		if(c < 0x20)
-			st.printf_P(PSTR("\\u%04d"), (int)c); // control characters
-		else if(c == '\\')
-			st.print(F("\\\\"));
-		else if(c == '"')
-			st.print(F("\\\""));
-		else
-			st.print(c); // other characters
+		server().sendContent_P(reinterpret_cast<PGM_P>(buffer), size);
+		web_count(web_bytes_sent, size);
+		return size;
+	}
+};
+
+static void web_server_export_settings()
+{
+	// the archive is made as it is sent; settings_export() copies each
+	// value on the main thread, so a slow client does not block it. the
+	// settings may change meanwhile, so the size is not known beforehand
+	server().setContentLength(CONTENT_LENGTH_UNKNOWN);
+	server().sendHeader(F("Content-Disposition"), F("attachment; filename=\"mazo3_settings.tar\""));
+	server().send(200, F("application/x-tar"), String());
+	chunked_print_t out;
+	if(!settings_export(out, String()))
+	{
+		// no last chunk; the client sees the archive is incomplete
+		puts("Settings: export to the client failed.");
+		server().client().stop();
+		return;
+	}
+	server().sendContent(String()); // end of the chunks
+}
 
-		++p;
+static void web_server_import_settings_upload()
+{
+	HTTPUpload& upload = server().upload();
+	if(upload.status == UPLOAD_FILE_START)
+	{
+		if(!web_server_begin_upload()) return; // the data is dropped; answered by 503
+		web_server_end_settings_import(); // left by a connection gone during an upload
+		run_in_main_thread([] () -> int { settings_importer = new settings_importer_t(); return 0; });
+	}
+	else if(upload.status == UPLOAD_FILE_WRITE && web_server_owns_upload())
+	{
+		// each piece is imported on the main thread as it arrives; the
+		// importer keeps the state, so failures are reported at the end
+		run_in_main_thread([&upload] () -> int {
+			return settings_importer->write(upload.buf, upload.currentSize);
+		});
+	}
+	else if(upload.status == UPLOAD_FILE_ABORTED && web_server_owns_upload())
+	{
+		web_server_end_settings_import(); // write what is complete
 	}
-	st.print((char)'"'); // ending "
 }
 
+static void web_server_import_settings()
+{
+	server().sendHeader(F("Connection"), F("close"));
+	if(!web_server_owns_upload())
+	{
+		server().send(503, F("text/plain"), F("Busy"));
+		return;
+	}
+	if(web_server_end_settings_import())
+		server().send(200, F("text/plain"), F("OK"));
+	else
+		server().send(400, F("text/plain"), F("Import failed"));
+	web_server_end_upload(server());
+}
+
+//! send the frame on the display as a binary PGM
+static void web_server_send_frame()
+{
+	static const char header[] = "P5\n64 48\n255\n";
+	static_assert(LED_MAX_LOGICAL_COL == 64 && LED_MAX_LOGICAL_ROW == 48, "fix the PGM header");
+	std::unique_ptr<uint8_t[]> buf(new uint8_t[sizeof(header) - 1 + sizeof(frame_buffer_t::array_t)]);
+	memcpy(buf.get(), header, sizeof(header) - 1);
+	frame_snapshot(*reinterpret_cast<frame_buffer_t::array_t *>(buf.get() + sizeof(header) - 1));
+
+	size_t size = sizeof(header) - 1 + sizeof(frame_buffer_t::array_t);
+	server().sendHeader(F("Cache-Control"), F("no-store"));
+	server().setContentLength(size);
+	server().send(200, F("image/x-portable-graymap"), String());
+	if(server().client().write(buf.get(), size) == size)
+		web_count(web_bytes_sent, size);
+}
+
+//! settings shown by the web UI; copied from the main thread
+struct ui_settings_t
+{
+	string_vector ntp_servers;
+	String time_zone;
+	String marquee;
+	String ap_name;
+	ip_addr_settings_t ip;
+	ambient_setpoint_t curve[AMBIENT_MAX_SETPOINTS];
+	int curve_count;
+	int led_gain;
+	version_info_t version;
+};
+
 static void web_server_export_json_for_ui(bool js)
 {
-	StreamString st;
-	if(js) st.print(F("window.settings="));
-	st.print(F("{\"result\":\"ok\",\"values\":{\n"));
-/*
-	string_vector v;
+	ui_settings_t st;
+	run_in_main_thread([&st] () -> int {
+		get_tz(st.ntp_servers, st.time_zone);
+		st.marquee = ui_get_marquee();
+		st.ap_name = wifi_get_ap_name();
+		st.ip = wifi_get_ip_addr_settings();
+		st.curve_count = ambient_get_setpoints(st.curve);
+		st.led_gain = matrix_drive_get_current_gain();
+		st.version = version_get_info();
+		return 0;
+	});
 
-	v = calendar_get_ntp_server();
-	st.print(F("\"cal_ntp_servers\":[\n"));
-	string_json(v[0], st); st.print((char)',');
-	string_json(v[1], st); st.print((char)',');
-	string_json(v[2], st); st.print((char)']');
+	// the document is written to the client as it is made
+	server().setContentLength(CONTENT_LENGTH_UNKNOWN);
+	server().sendHeader(F("Cache-Control"), F("no-store"));
+	server().send(200, js ? F("application/javascript") : F("application/json"), String());
 
-	st.print(F(",\n"));
-	st.print(F("\"cal_timezone\":"));
-	st.printf_P(PSTR("%d"), calendar_get_timezone());
+	chunked_print_t out;
+	if(js) out.print(F("window.settings="));
+	{
+		json_writer_t w(out);
+		w.begin_object();
+		w.member("result", "ok");
+		w.key("values");
+		w.begin_object();
+
+		w.key("cal_ntp_servers");
+		w.begin_array();
+		for(size_t i = 0; i < 3; ++i)
+			w.value(i < st.ntp_servers.size() ? st.ntp_servers[i].c_str() : "");
+		w.end_array();
+		w.member("cal_timezone", st.time_zone);
+		w.member("ui_marquee", st.marquee);
+
+		w.member("wifi_ap_name", st.ap_name); // the password is never shown
+		w.key("wifi_ip");
+		w.begin_object();
+		w.member("ip_addr", st.ip.ip_addr);
+		w.member("ip_gateway", st.ip.ip_gateway);
+		w.member("ip_mask", st.ip.ip_mask);
+		w.member("dns1", st.ip.dns1);
+		w.member("dns2", st.ip.dns2);
+		w.end_object();
+
+		w.key("ambient_curve"); // [ambient, brightness] pairs
+		w.begin_array();
+		for(int i = 0; i < st.curve_count; ++i)
+		{
+			w.begin_array();
+			w.value(st.curve[i].ambient);
+			w.value(st.curve[i].brightness);
+			w.end_array();
+		}
+		w.end_array();
+		w.member("led_gain", st.led_gain);
+		w.key("version_info");
+		w.begin_object();
+		w.member("date", st.version.date);
+		w.member("time", st.version.time);
+		w.member("src_version", st.version.src_version);
+		w.member("env_version", st.version.env_version);
+		w.end_object();
+
+		w.end_object();
+		w.end_object();
+	}
+	if(js) out.print((char)';');
+	server().sendContent(String()); // end of the chunks
+}
 
-	st.print(F(",\n"));
-	st.print(F("\"admin_pass\":"));
-	string_json(password, st);
+//! respond to a settings POST
+static void web_server_send_result(bool ok, const __FlashStringHelper * message = nullptr)
+{
+	server().send(ok ? 200 : 400, F("application/json"),
+		ok ? String(F("{\"result\":\"ok\"}")) :
+		String(F("{\"result\":\"error\",\"message\":\"")) + message + F("\"}"));
+}
 
-	st.print(F(",\n"));
-	st.print(F("\"ui_marquee\":"));
-	string_json(ui_get_marquee(), st);
+static void web_server_post_calendar()
+{
+	struct { string_vector servers; String tz; } arg;
+	for(const char * name : { "ntp1", "ntp2", "ntp3" })
+		if(server().hasArg(name) && server().arg(name).length()) arg.servers.push_back(server().arg(name));
+	arg.tz = server().arg(F("tz"));
+	if(!arg.tz.length()) { web_server_send_result(false, F("Empty time zone is invalid.")); return; }
+
+	run_in_main_thread([&arg] () -> int { set_tz(arg.servers, arg.tz); return 0; });
+	web_server_send_result(true);
+}
 
-	st.print(F(",\n"));
-	st.print(F("\"version_info\":{"));
+static void web_server_post_marquee()
+{
+	if(!server().hasArg(F("ui_marquee"))) { web_server_send_result(false, F("No marquee given.")); return; }
+	String marquee = server().arg(F("ui_marquee"));
+	run_in_main_thread([&marquee] () -> int { ui_set_marquee(marquee); return 0; });
+	web_server_send_result(true);
+}
+
+static void web_server_post_wifi()
+{
+	// fields not given are left unchanged
+	struct { String ap_name, ap_pass; ip_addr_settings_t ip; } arg;
+	run_in_main_thread([&arg] () -> int {
+		arg.ap_name = wifi_get_ap_name();
+		arg.ap_pass = wifi_get_ap_pass();
+		arg.ip = wifi_get_ip_addr_settings();
+		return 0;
+	});
+	if(server().hasArg(F("ap_name"))) arg.ap_name = server().arg(F("ap_name"));
+	if(server().hasArg(F("ap_pass"))) arg.ap_pass = server().arg(F("ap_pass"));
+	struct { const char * name; String * value; bool (*validator)(const String &); } fields[] = {
+		{ "ip_addr",    &arg.ip.ip_addr,    validate_ipv4_address },
+		{ "ip_gateway", &arg.ip.ip_gateway, validate_ipv4_address },
+		{ "ip_mask",    &arg.ip.ip_mask,    validate_ipv4_netmask },
+		{ "dns1",       &arg.ip.dns1,       validate_ipv4_address },
+		{ "dns2",       &arg.ip.dns2,       validate_ipv4_address },
+	};
+	for(auto && f : fields)
+	{
+		if(!server().hasArg(f.name)) continue;
+		*f.value = server().arg(f.name);
+		if(!f.validator(*f.value)) { web_server_send_result(false, F("Invalid IPv4 address.")); return; }
+	}
 
-	st.print(F("\"date\":"));
-	string_json(_BuildInfo.date, st);
-	st.print(F(",\n"));
+	// respond first; the connection may be lost by reconnecting
+	web_server_send_result(true);
+	run_in_main_thread([&arg] () -> int { wifi_set_ap_info(arg.ap_name, arg.ap_pass, arg.ip); return 0; });
+}
+
+static void web_server_post_ambient()
+{
+	// "ambient,brightness;ambient,brightness;..."
+	if(!server().hasArg(F("ambient_curve"))) { web_server_send_result(false, F("No curve given.")); return; }
+	ambient_setpoint_t points[AMBIENT_MAX_SETPOINTS];
+	int count = 0;
+	String curve = server().arg(F("ambient_curve"));
+	const char * p = curve.c_str();
+	while(*p)
+	{
+		int amb, bri, n = 0;
+		if(count == AMBIENT_MAX_SETPOINTS || 2 != sscanf(p, "%d,%d%n", &amb, &bri, &n))
+		{
+			web_server_send_result(false, F("Malformed curve."));
+			return;
+		}
+		// the range is checked by ambient_set_setpoints(); do not let a large value wrap into it
+		if(amb < INT16_MIN || amb > INT16_MAX || bri < INT16_MIN || bri > INT16_MAX)
+		{
+			web_server_send_result(false, F("Set point out of range."));
+			return;
+		}
+		points[count++] = { (int16_t)amb, (int16_t)bri };
+		p += n;
+		if(*p == ';') ++ p;
+	}
 
-	st.print(F("\"time\":"));
-	string_json(_BuildInfo.time, st);
-	st.print(F(",\n"));
+	struct { ambient_setpoint_t * points; int count; } arg = { points, count };
+	bool ok = run_in_main_thread([&arg] () -> int {
+		return ambient_set_setpoints(arg.points, arg.count);
+	});
+	web_server_send_result(ok, F("Set point out of range."));
+}
 
-	st.print(F("\"src_version\":"));
-	string_json(_BuildInfo.src_version, st);
-	st.print(F(",\n"));
+static void web_server_post_led_gain()
+{
+	// the gain is made a set point at the current ambient reading, so that
+	// the curve does not take it back at the next ambient poll
+	if(!server().hasArg(F("led_gain"))) { web_server_send_result(false, F("No gain given.")); return; }
+	String arg = server().arg(F("led_gain"));
+	char * end;
+	long gain = strtol(arg.c_str(), &end, 10);
+	if(!arg.length() || *end || gain < 0 || gain > LED_CURRENT_GAIN_MAX)
+	{
+		web_server_send_result(false, F("Gain out of range."));
+		return;
+	}
+	run_in_main_thread([gain] () -> int { sensors_set_current_contrast(gain); return 0; });
+	web_server_send_result(true);
+}
 
-	st.print(F("\"env_version\":"));
-	string_json(_BuildInfo.env_version, st);
+//! register a handler on every worker, counting the requests
+static void web_server_on(const String & uri, HTTPMethod method, WebServer::THandlerFunction fn)
+{
+	for(auto && w : web_workers)
+		w.server.on(uri, method, [fn] () { web_count(web_request_count); fn(); });
+}
 
-	st.print(F("}\n"));
+//! register a handler with an upload handler on every worker, counting the requests and the uploaded bytes
+static void web_server_on(const String & uri, HTTPMethod method, WebServer::THandlerFunction fn,
+	WebServer::THandlerFunction ufn)
+{
+	for(auto && w : web_workers)
+		w.server.on(uri, method, [fn] () { web_count(web_request_count); fn(); },
+			[ufn] () {
+				HTTPUpload& upload = server().upload();
+				if(upload.status == UPLOAD_FILE_WRITE) web_count(web_bytes_received, upload.currentSize);
+				ufn();
+			});
+}
 
-*/
-	st.print(F("}}\n"));
-	if(js) st.print((char)';');
+static void web_worker_task(void * arg)
+{
+	web_worker_t * w = static_cast<web_worker_t *>(arg);
+	for(;;)
+	{
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY); // until a connection is handed over
+		w->server.serve(w->client);
+		w->client = WiFiClient();
+		web_server_end_upload(w->server); // the connection may have gone during an upload
+		w->busy = false;
+	}
+}
 
-	if(js)
-		server.send(200, F("application/javascript"), st);
-	else
-		server.send(200, F("application/json"), st);
+static void web_acceptor_task(void *)
+{
+	for(;;)
+	{
+		// accept only when a worker can take the connection; others wait in the backlog
+		web_worker_t * idle = nullptr;
+		for(auto && w : web_workers)
+			if(!w.busy) { idle = &w; break; }
+
+		WiFiClient client;
+		if(idle && (client = listener.available()))
+		{
+			web_count(web_connection_count);
+			idle->client = client;
+			idle->busy = true;
+			xTaskNotifyGive(idle->task);
+			continue; // there may be more
+		}
+		vTaskDelay(pdMS_TO_TICKS(WEB_ACCEPT_INTERVAL_MS));
+	}
 }
 
 void web_server_setup()
@@ -212,33 +825,120 @@ void web_server_setup()
 	// setup handlers
 
 	// TODO: recovery mode
-	server.onNotFound(handleNotFound);
+	build_asset_index();
+	web_assets_lock = xSemaphoreCreateMutex();
+	static const char * collected_headers[] = { "If-None-Match", "Connection" };
+	for(auto && w : web_workers)
+	{
+		w.server.collectHeaders(collected_headers, 2);
+		w.server.onNotFound(handleNotFound);
+	}
 
-	server.on(F("/settings/settings.json"), HTTP_GET, []() {
+	web_server_on(F("/settings/settings.json"), HTTP_GET, []() {
 			if(!send_common_header()) return;
 			web_server_export_json_for_ui(false);
 		});
-	server.on(F("/settings/settings.js"), HTTP_GET, []() {
+	web_server_on(F("/settings/settings.js"), HTTP_GET, []() {
 			if(!send_common_header()) return;
 			web_server_export_json_for_ui(true);
 		});
 
-	server.on("/update", HTTP_GET, []() {
-		server.sendHeader("Connection", "close");
-		server.send(200, "text/html", updateIndex);
+	// form-encoded fields as returned by settings.json
+	web_server_on(F("/settings/calendar"), HTTP_POST, []() {
+			if(!send_common_header()) return;
+			web_server_post_calendar();
+		});
+	web_server_on(F("/settings/ui_marquee"), HTTP_POST, []() {
+			if(!send_common_header()) return;
+			web_server_post_marquee();
+		});
+	web_server_on(F("/settings/wifi"), HTTP_POST, []() {
+			if(!send_common_header()) return;
+			web_server_post_wifi();
+		});
+	web_server_on(F("/settings/ambient"), HTTP_POST, []() {
+			if(!send_common_header()) return;
+			web_server_post_ambient();
+		});
+
+	web_server_on(F("/settings/led_gain"), HTTP_POST, []() {
+			if(!send_common_header()) return;
+			web_server_post_led_gain();
+		});
+
+	web_server_on(F("/settings/export"), HTTP_GET, []() {
+			if(!send_common_header()) return;
+			web_server_export_settings();
+		});
+	web_server_on(F("/settings/import"), HTTP_POST, []() {
+			if(!send_common_header()) return;
+			web_server_import_settings();
+		}, web_server_import_settings_upload);
+
+	// the display, for remote monitoring; see frame_stream.h for the stream format
+	web_server_on(F("/frame.pgm"), HTTP_GET, []() {
+			if(!send_common_header()) return;
+			web_server_send_frame();
+		});
+	web_server_on(F("/frame/stream"), HTTP_GET, []() {
+			if(!send_common_header()) return;
+			int rate = server().hasArg(F("rate")) ? server().arg(F("rate")).toInt() : FRAME_STREAM_DEFAULT_RATE;
+			WiFiClient client = server().client();
+			if(frame_stream_begin(client, rate))
+				server().detach();
+			else
+				server().send(503, F("text/plain"), F("Too many streams"));
+		});
+
+	web_server_on("/update", HTTP_GET, []() {
+		server().sendHeader("Connection", "close");
+		server().send(200, "text/html", updateIndex);
+	});
+
+	// returns the archive offset to continue the interrupted update at
+	web_server_on("/update/resume", HTTP_GET, []() {
+		server().sendHeader("Connection", "close");
+		if(upload_owner.load())
+		{
+			// the interrupted upload may be still held by its worker, until it times out
+			server().send(503, "text/plain", "Busy");
+			return;
+		}
+		server().send(200, "text/plain", String(Updater.get_resume_offset(server().arg("id"))));
 	});
 
-	server.on("/update", HTTP_POST, []() {
-		server.sendHeader("Connection", "close");
-		server.send(200, "text/plain", /*(Update.hasError()) ? "FAIL" : */"OK");
-		// TODO: error handling
+	static bool update_ok;
+	web_server_on("/update", HTTP_POST, []() {
+		server().sendHeader("Connection", "close");
+		if(!web_server_owns_upload())
+		{
+			server().send(503, "text/plain", "Busy");
+			return;
+		}
+		server().send(update_ok ? 200 : 500, "text/plain", update_ok ? "OK" : "FAIL");
+		web_server_end_upload(server());
 
 	  }, []() {
-		HTTPUpload& upload = server.upload();
+		HTTPUpload& upload = server().upload();
 		if (upload.status == UPLOAD_FILE_START) {
+			if(!web_server_begin_upload()) return; // the data is dropped; answered by 503
 			printf("Update: %s\n", upload.filename.c_str());
 
-			Updater.begin();
+			// "id" identifies the archive and "offset" is where this upload begins
+			uint32_t offset = server().arg("offset").toInt();
+			if(offset)
+			{
+				update_ok = Updater.resume(server().arg("id"), offset);
+			}
+			else
+			{
+				Updater.begin(server().arg("id"));
+				update_ok = true;
+			}
+
+		} else if (!web_server_owns_upload()) {
+
+			return;
 
 		} else if (upload.status == UPLOAD_FILE_WRITE) {
 
@@ -246,22 +946,54 @@ void web_server_setup()
 
 		} else if (upload.status == UPLOAD_FILE_END) {
 
-			if(Updater.finish())
+			update_ok = Updater.finish();
+			if(update_ok)
 			{
-				reboot(); // reboot 
+				run_in_main_thread([] () -> int { reboot(); return 0; }); // never returns
 			}
 
+		} else if (upload.status == UPLOAD_FILE_ABORTED) {
+
+			Updater.end(); // stop the flash writer and free the buffers
+			update_ok = false;
+
 		}
 	  });
 
-	server.onNotFound(handleNotFound);
-
-	server.begin();
+	for(auto && w : web_workers)
+		xTaskCreateUniversal(web_worker_task, "web_worker", WEB_WORKER_STACK_SIZE, &w,
+			1, &w.task, CONFIG_ARDUINO_RUNNING_CORE);
+	listener.begin(); // the listening socket is non-blocking
+	listener.setNoDelay(true);
+	xTaskCreateUniversal(web_acceptor_task, "web_server", WEB_ACCEPTOR_STACK_SIZE, nullptr,
+		1, nullptr, CONFIG_ARDUINO_RUNNING_CORE);
 	puts("HTTP server started");
 
 }
 
-void web_server_handle_client()
+void web_server_dump_stats()
 {
-	server.handleClient();
+	printf("--- web server ---\n");
+	printf("Connections    : %lu (busy workers: %d/%d)\n", (unsigned long)web_connection_count,
+		WEB_MAX_CONNECTIONS - web_idle_workers(), WEB_MAX_CONNECTIONS);
+	printf("Requests       : %lu (on kept connections: %lu)\n", (unsigned long)web_request_count,
+		(unsigned long)web_reused_count);
+	printf("Not modified   : %lu\n", (unsigned long)web_not_modified_count);
+	printf("Bytes sent     : %llu\n", (unsigned long long)web_bytes_sent);
+	printf("Bytes received : %llu\n", (unsigned long long)web_bytes_received);
+	if(web_request_count)
+		printf("Avg latency    : %lu us\n",
+			(unsigned long)(web_total_latency_us / web_request_count));
+	printf("Max latency    : %lu us\n", (unsigned long)web_max_latency_us);
+	printf("--- request latency ---\n");
+	for(int i = 0; i < WEB_LATENCY_BUCKETS; ++i)
+	{
+		if(!web_latency_histogram[i]) continue;
+		if(i == WEB_LATENCY_BUCKETS - 1)
+			printf("%7lu us -         : %lu\n", 1UL << i, (unsigned long)web_latency_histogram[i]);
+		else
+			printf("%7lu us - %7lu us : %lu\n", i ? 1UL << i : 0UL, (1UL << (i + 1)) - 1,
+				(unsigned long)web_latency_histogram[i]);
+	}
+	frame_stream_dump_stats();
 }
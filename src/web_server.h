@@ -1,4 +1,7 @@
 #pragma once
 
+//! set up the handlers and start the web server task
 void web_server_setup();
-void web_server_handle_client();
+
+//! show request count, latency histogram and throughput
+void web_server_dump_stats();
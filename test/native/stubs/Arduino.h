@@ -0,0 +1,205 @@
+#pragma once
+
+// Host stand-in of the Arduino core for native tests. Only what the
+// firmware sources under test use is provided.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <string>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_err.h"
+
+/**
+ * The clock. It runs with the real time unless a test sets it by
+ * native_set_micros(); then it stays there until set again.
+ * */
+namespace native_clock
+{
+	inline const std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+	inline std::atomic<bool> manual(false);
+	inline std::atomic<uint64_t> manual_us(0);
+}
+
+inline void native_set_micros(uint64_t us) { native_clock::manual_us = us; native_clock::manual = true; }
+inline void native_set_millis(uint64_t ms) { native_set_micros(ms * 1000); }
+inline void native_release_clock() { native_clock::manual = false; }
+
+inline uint32_t micros()
+{
+	if(native_clock::manual) return (uint32_t)native_clock::manual_us;
+	return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - native_clock::origin).count();
+}
+
+inline uint32_t millis()
+{
+	if(native_clock::manual) return (uint32_t)(native_clock::manual_us / 1000);
+	return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now() - native_clock::origin).count();
+}
+
+inline void delay(uint32_t ms) { vTaskDelay(ms); }
+inline void yield() { std::this_thread::yield(); }
+
+
+class __FlashStringHelper;
+#define F(s) (reinterpret_cast<const __FlashStringHelper *>(s))
+#define PROGMEM
+#define PSTR(s) (s)
+#define PGM_P const char *
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_dword(p) (*(const uint32_t *)(p))
+#define sprintf_P sprintf
+
+//! Arduino String on std::string
+class String
+{
+	std::string s;
+
+public:
+	String() {}
+	String(const char * p) : s(p ? p : "") {}
+	String(const __FlashStringHelper * p) : s(reinterpret_cast<const char *>(p)) {}
+	String(const std::string & _s) : s(_s) {}
+	explicit String(char c) : s(1, c) {}
+	explicit String(int v) : s(std::to_string(v)) {}
+	explicit String(unsigned int v) : s(std::to_string(v)) {}
+	explicit String(long v) : s(std::to_string(v)) {}
+	explicit String(unsigned long v) : s(std::to_string(v)) {}
+
+	unsigned int length() const { return s.length(); }
+	const char * c_str() const { return s.c_str(); }
+	bool reserve(unsigned int size) { s.reserve(size); return true; }
+	char operator [] (unsigned int i) const { return i < s.length() ? s[i] : 0; }
+	char & operator [] (unsigned int i) { return s[i]; }
+	char charAt(unsigned int i) const { return (*this)[i]; }
+
+	String & operator += (const String & rhs) { s += rhs.s; return *this; }
+	String & operator += (const char * rhs) { s += rhs; return *this; }
+	String & operator += (char rhs) { s += rhs; return *this; }
+	String & operator += (int rhs) { s += std::to_string(rhs); return *this; }
+	bool concat(const String & rhs) { s += rhs.s; return true; }
+	bool concat(const char * rhs) { s += rhs; return true; }
+	bool concat(char rhs) { s += rhs; return true; }
+
+	friend String operator + (const String & a, const String & b) { return String(a.s + b.s); }
+	friend String operator + (const String & a, const char * b) { return String(a.s + b); }
+	friend String operator + (const char * a, const String & b) { return String(a + b.s); }
+	friend String operator + (const String & a, char b) { return String(a.s + b); }
+
+	bool operator == (const String & rhs) const { return s == rhs.s; }
+	bool operator == (const char * rhs) const { return s == rhs; }
+	bool operator != (const String & rhs) const { return s != rhs.s; }
+	bool operator != (const char * rhs) const { return s != rhs; }
+	bool operator < (const String & rhs) const { return s < rhs.s; }
+	bool equals(const String & rhs) const { return s == rhs.s; }
+
+	int indexOf(char c, unsigned int from = 0) const
+	{
+		size_t p = s.find(c, from);
+		return p == std::string::npos ? -1 : (int)p;
+	}
+	int indexOf(const String & str, unsigned int from = 0) const
+	{
+		size_t p = s.find(str.s, from);
+		return p == std::string::npos ? -1 : (int)p;
+	}
+	int lastIndexOf(char c) const
+	{
+		size_t p = s.rfind(c);
+		return p == std::string::npos ? -1 : (int)p;
+	}
+	String substring(unsigned int from) const
+	{
+		return from >= s.length() ? String() : String(s.substr(from));
+	}
+	String substring(unsigned int from, unsigned int to) const
+	{
+		if(to > s.length()) to = s.length();
+		return from >= to ? String() : String(s.substr(from, to - from));
+	}
+	bool startsWith(const String & prefix) const { return s.compare(0, prefix.s.length(), prefix.s) == 0; }
+	bool endsWith(const String & suffix) const
+	{
+		return s.length() >= suffix.s.length() &&
+			s.compare(s.length() - suffix.s.length(), suffix.s.length(), suffix.s) == 0;
+	}
+	long toInt() const { return atol(s.c_str()); }
+	void trim()
+	{
+		size_t b = s.find_first_not_of(" \t\r\n");
+		size_t e = s.find_last_not_of(" \t\r\n");
+		s = b == std::string::npos ? std::string() : s.substr(b, e - b + 1);
+	}
+	void toLowerCase() { for(auto && c : s) c = tolower(c); }
+	void toUpperCase() { for(auto && c : s) c = toupper(c); }
+};
+
+
+//! Arduino Print
+class Print
+{
+public:
+	virtual ~Print() {}
+	virtual size_t write(uint8_t c) = 0;
+	virtual size_t write(const uint8_t * buf, size_t size)
+	{
+		size_t n = 0;
+		while(size--) n += write(*buf++);
+		return n;
+	}
+	size_t write(const char * str) { return write(reinterpret_cast<const uint8_t *>(str), strlen(str)); }
+	size_t print(const char * str) { return write(str); }
+	size_t print(const String & str) { return write(str.c_str()); }
+	size_t print(char c) { return write((uint8_t)c); }
+	size_t print(int v) { return print(String(v)); }
+	size_t println(const char * str = "") { return print(str) + print("\r\n"); }
+	size_t println(const String & str) { return print(str) + print("\r\n"); }
+	virtual void flush() {}
+};
+
+//! Arduino Stream; readBytes() returns early at the end of the input
+class Stream : public Print
+{
+public:
+	virtual int available() = 0;
+	virtual int read() = 0;
+	virtual int peek() = 0;
+
+	virtual size_t readBytes(char * buf, size_t size)
+	{
+		size_t n = 0;
+		while(n < size)
+		{
+			int c = read();
+			if(c < 0) break;
+			buf[n++] = (char)c;
+		}
+		return n;
+	}
+	size_t readBytes(uint8_t * buf, size_t size) { return readBytes(reinterpret_cast<char *>(buf), size); }
+};
+
+
+//! the ESP object; the flash is not available on the host
+class EspClass
+{
+public:
+	bool flashRead(uint32_t offset, uint32_t * data, size_t size) { return false; }
+	bool flashWrite(uint32_t offset, uint32_t * data, size_t size) { return false; }
+	bool flashEraseSector(uint32_t sector) { return false; }
+	uint32_t getFreeHeap() { return 0; }
+	void restart() { abort(); }
+};
+
+inline EspClass ESP;
+
+inline uint32_t esp_random() { return (uint32_t)rand() ^ ((uint32_t)rand() << 16); }
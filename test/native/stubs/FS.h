@@ -0,0 +1,153 @@
+#pragma once
+
+// In-memory file system standing in for the Arduino FS. Files live in
+// fs::FS::files of each file system object, keyed by the path.
+
+#include <Arduino.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace fs
+{
+
+enum SeekMode { SeekSet = 0, SeekCur = 1, SeekEnd = 2 };
+
+//! an open file. the content is shared with the file system, as on SPIFFS
+class FileImpl
+{
+public:
+	std::string path;
+	std::shared_ptr<std::vector<uint8_t>> data;
+	size_t pos = 0;
+	bool writable = false;
+	std::vector<std::string> children; //!< directory entries left for openNextFile()
+	std::map<std::string, std::shared_ptr<std::vector<uint8_t>>> * files = nullptr;
+};
+
+class File : public Stream
+{
+	std::shared_ptr<FileImpl> p;
+
+public:
+	File() {}
+	explicit File(std::shared_ptr<FileImpl> _p) : p(_p) {}
+
+	size_t write(uint8_t c) override { return write(&c, 1); }
+	size_t write(const uint8_t * buf, size_t size) override
+	{
+		if(!p || !p->writable || !p->data) return 0;
+		std::vector<uint8_t> & d = *p->data;
+		if(d.size() < p->pos + size) d.resize(p->pos + size);
+		memcpy(d.data() + p->pos, buf, size);
+		p->pos += size;
+		return size;
+	}
+	using Print::write;
+
+	int available() override { return p && p->data ? (int)(p->data->size() - p->pos) : 0; }
+	int read() override { uint8_t c; return read(&c, 1) == 1 ? c : -1; }
+	int peek() override { return available() ? (*p->data)[p->pos] : -1; }
+	size_t read(uint8_t * buf, size_t size)
+	{
+		size_t n = std::min(size, (size_t)available());
+		if(n) memcpy(buf, p->data->data() + p->pos, n);
+		if(p) p->pos += n;
+		return n;
+	}
+	size_t readBytes(char * buf, size_t size) override { return read(reinterpret_cast<uint8_t *>(buf), size); }
+
+	bool seek(uint32_t pos, SeekMode mode = SeekSet)
+	{
+		if(!p || !p->data) return false;
+		size_t base = mode == SeekSet ? 0 : mode == SeekCur ? p->pos : p->data->size();
+		if(base + pos > p->data->size()) return false;
+		p->pos = base + pos;
+		return true;
+	}
+	size_t position() const { return p ? p->pos : 0; }
+	size_t size() const { return p && p->data ? p->data->size() : 0; }
+	void close() { p.reset(); }
+	operator bool() const { return (bool)p; }
+	const char * name() const { return p ? p->path.c_str() : ""; }
+	bool isDirectory() const { return p && !p->data; }
+
+	File openNextFile()
+	{
+		while(p && !p->data && p->children.size())
+		{
+			std::string path = p->children.front();
+			p->children.erase(p->children.begin());
+			auto it = p->files->find(path);
+			if(it == p->files->end()) continue;
+			auto f = std::make_shared<FileImpl>();
+			f->path = path;
+			f->data = it->second;
+			return File(f);
+		}
+		return File();
+	}
+};
+
+class FS
+{
+public:
+	std::map<std::string, std::shared_ptr<std::vector<uint8_t>>> files;
+
+	void end() {}
+
+	File open(const char * path, const char * mode = "r")
+	{
+		std::string s = path;
+		auto f = std::make_shared<FileImpl>();
+		f->path = s;
+		f->files = &files;
+		auto it = files.find(s);
+		if(*mode == 'w')
+		{
+			f->data = files[s] = std::make_shared<std::vector<uint8_t>>();
+			f->writable = true;
+		}
+		else if(*mode == 'a')
+		{
+			if(it == files.end()) it = files.emplace(s, std::make_shared<std::vector<uint8_t>>()).first;
+			f->data = it->second;
+			f->pos = f->data->size();
+			f->writable = true;
+		}
+		else if(it != files.end())
+		{
+			f->data = it->second;
+		}
+		else
+		{
+			// a directory, if any file is under it
+			std::string dir = s.size() && s.back() == '/' ? s : s + "/";
+			for(auto && e : files)
+				if(e.first.compare(0, dir.size(), dir) == 0) f->children.push_back(e.first);
+			if(f->children.empty()) return File();
+		}
+		return File(f);
+	}
+	File open(const String & path, const char * mode = "r") { return open(path.c_str(), mode); }
+
+	bool exists(const char * path) { return files.count(path) != 0; }
+	bool exists(const String & path) { return exists(path.c_str()); }
+	bool remove(const char * path) { return files.erase(path) != 0; }
+	bool remove(const String & path) { return remove(path.c_str()); }
+	bool rename(const char * from, const char * to)
+	{
+		auto it = files.find(from);
+		if(it == files.end()) return false;
+		auto data = it->second;
+		files.erase(it);
+		files[to] = data;
+		return true;
+	}
+	bool rename(const String & from, const String & to) { return rename(from.c_str(), to.c_str()); }
+};
+
+}
+
+using fs::File;
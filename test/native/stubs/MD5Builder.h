@@ -0,0 +1,88 @@
+#pragma once
+
+// MD5 of RFC 1321, with the interface of the Arduino core.
+
+#include <Arduino.h>
+
+class MD5Builder
+{
+	uint32_t state[4];
+	uint64_t length; //!< bytes added
+	uint8_t block[64];
+	uint8_t digest[16];
+
+	static uint32_t rotl(uint32_t x, int n) { return (x << n) | (x >> (32 - n)); }
+
+	void transform(const uint8_t * p)
+	{
+		static const uint32_t k[64] = {
+			0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+			0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+			0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+			0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+			0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+			0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+			0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+			0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391 };
+		static const int r[16] = { 7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21 };
+		uint32_t m[16];
+		for(int i = 0; i < 16; ++i)
+			m[i] = p[i * 4] | (p[i * 4 + 1] << 8) | (p[i * 4 + 2] << 16) | ((uint32_t)p[i * 4 + 3] << 24);
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+		for(int i = 0; i < 64; ++i)
+		{
+			uint32_t f;
+			int g;
+			switch(i / 16)
+			{
+			case 0: f = (b & c) | (~b & d); g = i; break;
+			case 1: f = (d & b) | (~d & c); g = (5 * i + 1) % 16; break;
+			case 2: f = b ^ c ^ d; g = (3 * i + 5) % 16; break;
+			default: f = c ^ (b | ~d); g = (7 * i) % 16; break;
+			}
+			uint32_t t = d;
+			d = c;
+			c = b;
+			b = b + rotl(a + f + k[i] + m[g], r[i / 16 * 4 + i % 4]);
+			a = t;
+		}
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	}
+
+public:
+	void begin()
+	{
+		state[0] = 0x67452301; state[1] = 0xefcdab89; state[2] = 0x98badcfe; state[3] = 0x10325476;
+		length = 0;
+	}
+
+	void add(const uint8_t * data, uint16_t size)
+	{
+		while(size--)
+		{
+			block[length++ % 64] = *data++;
+			if(length % 64 == 0) transform(block);
+		}
+	}
+
+	void calculate()
+	{
+		uint64_t bits = length * 8;
+		static const uint8_t pad[64] = { 0x80 };
+		size_t n = length % 64 < 56 ? 56 - length % 64 : 120 - length % 64;
+		add(pad, n);
+		uint8_t len[8];
+		for(int i = 0; i < 8; ++i) len[i] = (uint8_t)(bits >> (i * 8));
+		add(len, 8);
+		for(int i = 0; i < 16; ++i) digest[i] = (uint8_t)(state[i / 4] >> (i % 4 * 8));
+	}
+
+	void getBytes(uint8_t * out) const { memcpy(out, digest, sizeof(digest)); }
+
+	String toString() const
+	{
+		char s[33];
+		for(int i = 0; i < 16; ++i) sprintf(s + i * 2, "%02x", digest[i]);
+		return String(s);
+	}
+};
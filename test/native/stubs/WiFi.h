@@ -0,0 +1,84 @@
+#pragma once
+
+#include <Arduino.h>
+#include <vector>
+
+typedef int WiFiEvent_t;
+
+typedef enum
+{
+	WIFI_AUTH_OPEN = 0,
+	WIFI_AUTH_WEP,
+	WIFI_AUTH_WPA_PSK,
+	WIFI_AUTH_WPA2_PSK,
+	WIFI_AUTH_WPA_WPA2_PSK,
+} wifi_auth_mode_t;
+
+#define WIFI_SCAN_RUNNING (-1)
+#define WIFI_SCAN_FAILED (-2)
+
+//! an IPv4 address
+class IPAddress
+{
+	uint8_t octets[4] = {};
+
+public:
+	IPAddress() {}
+	IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : octets { a, b, c, d } {}
+
+	bool fromString(const char * s)
+	{
+		int n = 0;
+		for(int i = 0; i < 4; ++i)
+		{
+			if(i && *s++ != '.') return false;
+			int v = 0, digits = 0;
+			while(*s >= '0' && *s <= '9')
+			{
+				v = v * 10 + (*s++ - '0');
+				if(++ digits > 3 || v > 255) return false;
+			}
+			if(!digits) return false;
+			octets[n++] = v;
+		}
+		return *s == 0;
+	}
+	bool fromString(const String & s) { return fromString(s.c_str()); }
+
+	uint8_t operator [] (int i) const { return octets[i]; }
+	uint8_t & operator [] (int i) { return octets[i]; }
+
+	String toString() const
+	{
+		char buf[16];
+		snprintf(buf, sizeof(buf), "%u.%u.%u.%u", octets[0], octets[1], octets[2], octets[3]);
+		return String(buf);
+	}
+};
+
+/**
+ * the WiFi object; only scanning is emulated. tests set the scan result
+ * by native_scan_result and native_scan_state.
+ * */
+class WiFiClass
+{
+public:
+	struct station_t
+	{
+		String ssid;
+		int32_t rssi;
+	};
+	std::vector<station_t> native_scan_result;
+	int native_scan_state = WIFI_SCAN_FAILED; //!< scanComplete() after scanNetworks()
+
+	int16_t scanNetworks(bool async = false, bool show_hidden = false)
+	{
+		return async ? WIFI_SCAN_RUNNING : (int16_t)native_scan_result.size();
+	}
+	int16_t scanComplete() { return native_scan_state; }
+	void scanDelete() { native_scan_result.clear(); native_scan_state = WIFI_SCAN_FAILED; }
+	String SSID(uint8_t i) { return i < native_scan_result.size() ? native_scan_result[i].ssid : String(); }
+	int32_t RSSI(uint8_t i) { return i < native_scan_result.size() ? native_scan_result[i].rssi : 0; }
+};
+
+inline WiFiClass WiFi;
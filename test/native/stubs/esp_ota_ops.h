@@ -0,0 +1,20 @@
+#pragma once
+
+// OTA boot selection on the emulated partitions of esp_partition.h.
+
+#include "esp_partition.h"
+
+namespace native_esp
+{
+	inline const esp_partition_t * running_partition; //!< the partition the firmware runs from
+	inline const esp_partition_t * boot_partition; //!< the partition to boot from next time
+}
+
+inline const esp_partition_t * esp_ota_get_running_partition() { return native_esp::running_partition; }
+
+inline esp_err_t esp_ota_set_boot_partition(const esp_partition_t * p)
+{
+	if(!p || p->type != ESP_PARTITION_TYPE_APP) return ESP_ERR_INVALID_ARG;
+	native_esp::boot_partition = p;
+	return ESP_OK;
+}
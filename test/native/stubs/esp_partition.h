@@ -0,0 +1,96 @@
+#pragma once
+
+// Partitions on an emulated flash. Tests add partitions to
+// native_esp::partitions; their content is in native_esp::flash.
+// The power can be cut after a given number of written bytes; the write
+// in progress then stops halfway, and every access fails until restore().
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "esp_err.h"
+
+typedef enum
+{
+	ESP_PARTITION_TYPE_APP = 0x00,
+	ESP_PARTITION_TYPE_DATA = 0x01,
+	ESP_PARTITION_TYPE_ANY = 0xff,
+} esp_partition_type_t;
+
+typedef enum
+{
+	ESP_PARTITION_SUBTYPE_APP_FACTORY = 0x00,
+	ESP_PARTITION_SUBTYPE_APP_OTA_0 = 0x10,
+	ESP_PARTITION_SUBTYPE_APP_OTA_1 = 0x11,
+	ESP_PARTITION_SUBTYPE_DATA_OTA = 0x00,
+	ESP_PARTITION_SUBTYPE_DATA_PHY = 0x01,
+	ESP_PARTITION_SUBTYPE_DATA_NVS = 0x02,
+	ESP_PARTITION_SUBTYPE_DATA_SPIFFS = 0x82,
+	ESP_PARTITION_SUBTYPE_ANY = 0xff,
+} esp_partition_subtype_t;
+
+typedef struct
+{
+	esp_partition_type_t type;
+	esp_partition_subtype_t subtype;
+	uint32_t address;
+	uint32_t size;
+	char label[17];
+	bool encrypted;
+} esp_partition_t;
+
+namespace native_esp
+{
+	inline std::vector<uint8_t> flash; //!< the whole flash; erased bytes are 0xff
+	inline std::vector<esp_partition_t> partitions;
+	inline long budget = -1; //!< bytes to write before the power is cut; -1 = unlimited
+	inline bool cut = false; //!< whether the power is cut
+
+	//! the power is back; the content stays as it was at the cut
+	inline void restore() { cut = false; budget = -1; }
+}
+
+inline const esp_partition_t * esp_partition_find_first(esp_partition_type_t type,
+	esp_partition_subtype_t subtype, const char * label)
+{
+	for(auto && p : native_esp::partitions)
+	{
+		if(type != ESP_PARTITION_TYPE_ANY && p.type != type) continue;
+		if(subtype != ESP_PARTITION_SUBTYPE_ANY && p.subtype != subtype) continue;
+		if(label && strcmp(label, p.label)) continue;
+		return &p;
+	}
+	return nullptr;
+}
+
+inline esp_err_t esp_partition_read(const esp_partition_t * p, size_t offset, void * dst, size_t size)
+{
+	if(native_esp::cut) return ESP_FAIL;
+	if(offset + size > p->size) return ESP_ERR_INVALID_SIZE;
+	memcpy(dst, native_esp::flash.data() + p->address + offset, size);
+	return ESP_OK;
+}
+
+//! NOR flash; writing can only clear bits
+inline esp_err_t esp_partition_write(const esp_partition_t * p, size_t offset, const void * src, size_t size)
+{
+	if(offset + size > p->size) return ESP_ERR_INVALID_SIZE;
+	const uint8_t * s = static_cast<const uint8_t *>(src);
+	uint8_t * d = native_esp::flash.data() + p->address + offset;
+	if(native_esp::cut) return ESP_FAIL;
+	for(size_t i = 0; i < size; ++i)
+	{
+		if(native_esp::budget == 0) { native_esp::cut = true; return ESP_FAIL; }
+		if(native_esp::budget > 0) -- native_esp::budget;
+		d[i] &= s[i];
+	}
+	return ESP_OK;
+}
+
+inline esp_err_t esp_partition_erase_range(const esp_partition_t * p, size_t offset, size_t size)
+{
+	if(native_esp::cut) return ESP_FAIL;
+	if(offset % 4096 || size % 4096 || offset + size > p->size) return ESP_ERR_INVALID_ARG;
+	memset(native_esp::flash.data() + p->address + offset, 0xff, size);
+	return ESP_OK;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+typedef uint32_t spi_flash_mmap_handle_t;
+
+#define SPI_FLASH_SEC_SIZE 4096
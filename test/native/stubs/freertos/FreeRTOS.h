@@ -0,0 +1,60 @@
+#pragma once
+
+// Host emulation of the FreeRTOS subset used by the firmware, for native
+// tests. Tasks are std::threads; blocking calls wait on condition variables.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdFAIL 0
+#define pdPASS 1
+#define errQUEUE_FULL 0
+#define errQUEUE_EMPTY 0
+
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define configNUM_THREAD_LOCAL_STORAGE_POINTERS 4
+
+#ifndef CONFIG_ARDUINO_RUNNING_CORE
+#define CONFIG_ARDUINO_RUNNING_CORE 1
+#endif
+
+#define IRAM_ATTR
+#define DRAM_ATTR
+
+//! critical sections are one process-wide recursive lock
+typedef struct { int dummy; } portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED { 0 }
+
+namespace native_freertos
+{
+	inline std::recursive_mutex critical_lock;
+
+	//! wait on the condition variable until pred() holds or the ticks pass.
+	//! returns pred()
+	template <typename Pred>
+	bool wait_for(std::unique_lock<std::mutex> & lock, std::condition_variable & cv,
+		TickType_t ticks, Pred pred)
+	{
+		if(ticks == portMAX_DELAY) { cv.wait(lock, pred); return true; }
+		return cv.wait_for(lock, std::chrono::milliseconds(ticks), pred);
+	}
+}
+
+#define portENTER_CRITICAL(mux) ((void)(mux), native_freertos::critical_lock.lock())
+#define portEXIT_CRITICAL(mux) ((void)(mux), native_freertos::critical_lock.unlock())
+#define portENTER_CRITICAL_ISR(mux) portENTER_CRITICAL(mux)
+#define portEXIT_CRITICAL_ISR(mux) portEXIT_CRITICAL(mux)
+#define portYIELD_FROM_ISR() do {} while(0)
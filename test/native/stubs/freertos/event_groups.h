@@ -0,0 +1,50 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+typedef uint32_t EventBits_t;
+
+struct native_event_group_t
+{
+	std::mutex lock;
+	std::condition_variable cv;
+	EventBits_t bits = 0;
+};
+
+typedef native_event_group_t * EventGroupHandle_t;
+
+inline EventGroupHandle_t xEventGroupCreate() { return new native_event_group_t; }
+inline void vEventGroupDelete(EventGroupHandle_t group) { delete group; }
+
+inline EventBits_t xEventGroupGetBits(EventGroupHandle_t group)
+{
+	std::lock_guard<std::mutex> lock(group->lock);
+	return group->bits;
+}
+
+inline EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits)
+{
+	std::lock_guard<std::mutex> lock(group->lock);
+	group->bits |= bits;
+	group->cv.notify_all();
+	return group->bits;
+}
+
+inline EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits)
+{
+	std::lock_guard<std::mutex> lock(group->lock);
+	EventBits_t old = group->bits;
+	group->bits &= ~bits;
+	return old;
+}
+
+inline EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits,
+	BaseType_t clear_on_exit, BaseType_t wait_for_all, TickType_t ticks)
+{
+	std::unique_lock<std::mutex> lock(group->lock);
+	native_freertos::wait_for(lock, group->cv, ticks, [&] {
+		return wait_for_all ? (group->bits & bits) == bits : (group->bits & bits) != 0; });
+	EventBits_t value = group->bits;
+	if(clear_on_exit) group->bits &= ~bits;
+	return value;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include <string.h>
+#include <deque>
+#include <vector>
+
+//! an emulated queue; semaphores are queues of zero-sized items, as in FreeRTOS
+struct native_queue_t
+{
+	std::mutex lock;
+	std::condition_variable cv;
+	UBaseType_t length;
+	UBaseType_t item_size;
+	std::deque<std::vector<uint8_t>> items;
+};
+
+typedef native_queue_t * QueueHandle_t;
+
+namespace native_freertos
+{
+	inline std::atomic<int> live_queues(0); //!< queues and semaphores not yet deleted
+}
+
+inline QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+	native_queue_t * q = new native_queue_t;
+	q->length = length;
+	q->item_size = item_size;
+	++ native_freertos::live_queues;
+	return q;
+}
+
+inline void vQueueDelete(QueueHandle_t q)
+{
+	-- native_freertos::live_queues;
+	delete q;
+}
+
+inline BaseType_t xQueueSend(QueueHandle_t q, const void * item, TickType_t ticks)
+{
+	std::unique_lock<std::mutex> lock(q->lock);
+	if(!native_freertos::wait_for(lock, q->cv, ticks, [q] { return q->items.size() < q->length; }))
+		return errQUEUE_FULL;
+	const uint8_t * p = static_cast<const uint8_t *>(item);
+	q->items.emplace_back(p, p + (p ? q->item_size : 0));
+	q->cv.notify_all();
+	return pdPASS;
+}
+
+inline BaseType_t xQueueSendToBack(QueueHandle_t q, const void * item, TickType_t ticks)
+{
+	return xQueueSend(q, item, ticks);
+}
+
+inline BaseType_t xQueueSendFromISR(QueueHandle_t q, const void * item, BaseType_t * woken)
+{
+	if(woken) *woken = pdFALSE;
+	return xQueueSend(q, item, 0);
+}
+
+inline BaseType_t xQueueReceive(QueueHandle_t q, void * item, TickType_t ticks)
+{
+	std::unique_lock<std::mutex> lock(q->lock);
+	if(!native_freertos::wait_for(lock, q->cv, ticks, [q] { return !q->items.empty(); }))
+		return errQUEUE_EMPTY;
+	if(item && q->item_size) memcpy(item, q->items.front().data(), q->item_size);
+	q->items.pop_front();
+	q->cv.notify_all();
+	return pdPASS;
+}
+
+inline UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q)
+{
+	std::lock_guard<std::mutex> lock(q->lock);
+	return q->items.size();
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "freertos/queue.h"
+
+typedef QueueHandle_t SemaphoreHandle_t;
+
+inline SemaphoreHandle_t xSemaphoreCreateBinary() { return xQueueCreate(1, 0); }
+
+inline SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+	SemaphoreHandle_t sem = xQueueCreate(1, 0);
+	xQueueSend(sem, nullptr, 0);
+	return sem;
+}
+
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t sem) { return xQueueSend(sem, nullptr, 0); }
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks) { return xQueueReceive(sem, nullptr, ticks); }
+inline void vSemaphoreDelete(SemaphoreHandle_t sem) { vQueueDelete(sem); }
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+typedef void (*TaskFunction_t)(void *);
+typedef void (*TlsDeleteCallbackFunction_t)(int, void *);
+
+//! an emulated task
+struct native_task_t
+{
+	std::mutex lock;
+	std::condition_variable cv;
+	uint32_t notify = 0; //!< notification value
+	void * tls[configNUM_THREAD_LOCAL_STORAGE_POINTERS] = {};
+	TlsDeleteCallbackFunction_t tls_delete[configNUM_THREAD_LOCAL_STORAGE_POINTERS] = {};
+};
+
+typedef native_task_t * TaskHandle_t;
+
+namespace native_freertos
+{
+	inline thread_local native_task_t * current_task = nullptr;
+	inline std::atomic<int> live_tasks(0); //!< tasks started and not yet ended
+
+	//! the task of the calling thread; threads not made by xTaskCreate*() get one on demand
+	inline native_task_t * self()
+	{
+		if(!current_task) current_task = new native_task_t;
+		return current_task;
+	}
+
+	//! call the TLS deletion callbacks, as vTaskDelete() does
+	inline void delete_tls(native_task_t * task)
+	{
+		for(int i = 0; i < configNUM_THREAD_LOCAL_STORAGE_POINTERS; ++i)
+		{
+			if(task->tls_delete[i]) task->tls_delete[i](i, task->tls[i]);
+			task->tls[i] = nullptr;
+			task->tls_delete[i] = nullptr;
+		}
+	}
+}
+
+inline BaseType_t xTaskCreatePinnedToCore(TaskFunction_t func, const char * name, uint32_t stack,
+	void * arg, UBaseType_t priority, TaskHandle_t * handle, BaseType_t core)
+{
+	native_task_t * task = new native_task_t;
+	if(handle) *handle = task;
+	++ native_freertos::live_tasks;
+	std::thread([func, arg, task] () {
+		native_freertos::current_task = task;
+		func(arg);
+		// returning from a task function is not allowed in FreeRTOS
+		abort();
+	}).detach();
+	return pdPASS;
+}
+
+inline BaseType_t xTaskCreate(TaskFunction_t func, const char * name, uint32_t stack,
+	void * arg, UBaseType_t priority, TaskHandle_t * handle)
+{
+	return xTaskCreatePinnedToCore(func, name, stack, arg, priority, handle, 0);
+}
+
+inline BaseType_t xTaskCreateUniversal(TaskFunction_t func, const char * name, uint32_t stack,
+	void * arg, UBaseType_t priority, TaskHandle_t * handle, BaseType_t core)
+{
+	return xTaskCreatePinnedToCore(func, name, stack, arg, priority, handle, core);
+}
+
+//! only deleting the calling task itself is supported
+inline void vTaskDelete(TaskHandle_t task)
+{
+	if(task && task != native_freertos::self()) abort();
+	native_task_t * self = native_freertos::self();
+	native_freertos::delete_tls(self);
+	native_freertos::current_task = nullptr;
+	delete self;
+	-- native_freertos::live_tasks;
+	pthread_exit(nullptr);
+}
+
+inline TaskHandle_t xTaskGetCurrentTaskHandle() { return native_freertos::self(); }
+
+inline void vTaskDelay(TickType_t ticks)
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+}
+
+inline void taskYIELD() { std::this_thread::yield(); }
+
+inline uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks)
+{
+	native_task_t * self = native_freertos::self();
+	std::unique_lock<std::mutex> lock(self->lock);
+	native_freertos::wait_for(lock, self->cv, ticks, [self] { return self->notify != 0; });
+	uint32_t value = self->notify;
+	if(value) self->notify = clear_on_exit ? 0 : value - 1;
+	return value;
+}
+
+inline BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+	std::lock_guard<std::mutex> lock(task->lock);
+	++ task->notify;
+	task->cv.notify_all();
+	return pdPASS;
+}
+
+inline void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t * woken)
+{
+	xTaskNotifyGive(task);
+	if(woken) *woken = pdFALSE;
+}
+
+inline void vTaskSetThreadLocalStoragePointerAndDelCallback(TaskHandle_t task, BaseType_t index,
+	void * value, TlsDeleteCallbackFunction_t callback)
+{
+	if(!task) task = native_freertos::self();
+	task->tls[index] = value;
+	task->tls_delete[index] = callback;
+}
+
+inline void vTaskSetThreadLocalStoragePointer(TaskHandle_t task, BaseType_t index, void * value)
+{
+	if(!task) task = native_freertos::self();
+	task->tls[index] = value;
+}
+
+inline void * pvTaskGetThreadLocalStoragePointer(TaskHandle_t task, BaseType_t index)
+{
+	if(!task) task = native_freertos::self();
+	return task->tls[index];
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+typedef struct FT_FaceRec_ * FT_Face;
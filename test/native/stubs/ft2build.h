@@ -0,0 +1,5 @@
+#pragma once
+
+// FreeType is not built for the host; only the types named by the
+// firmware headers are provided.
+#define FT_FREETYPE_H <freetype/freetype.h>
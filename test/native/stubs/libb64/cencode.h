@@ -0,0 +1,3 @@
+#pragma once
+
+// included by the firmware sources but not used on the host
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdint.h>
+
+//! the CRC-32 of the ROM; the same as of zlib
+inline uint32_t crc32_le(uint32_t crc, const uint8_t * buf, uint32_t len)
+{
+	crc = ~crc;
+	while(len--)
+	{
+		crc ^= *buf++;
+		for(int i = 0; i < 8; ++i) crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+	}
+	return ~crc;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+// The inflater in the ROM (miniz tinfl), on zlib. Only the streaming
+// interface with a wrapping output buffer is provided; the size of that
+// buffer is taken as the window size, so streams made with a larger
+// window fail as they would on the device.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <zlib.h>
+
+#define TINFL_FLAG_HAS_MORE_INPUT 2
+
+typedef enum
+{
+	TINFL_STATUS_BAD_PARAM = -3,
+	TINFL_STATUS_ADLER32_MISMATCH = -2,
+	TINFL_STATUS_FAILED = -1,
+	TINFL_STATUS_DONE = 0,
+	TINFL_STATUS_NEEDS_MORE_INPUT = 1,
+	TINFL_STATUS_HAS_MORE_OUTPUT = 2,
+} tinfl_status;
+
+/**
+ * the decompressor state. it is malloc()ed and free()d without any clean
+ * up, as the real one is; zlib allocates from the arena in it.
+ * */
+typedef struct tinfl_decompressor_tag
+{
+	z_stream z;
+	bool started; //!< whether inflateInit2() was done
+	size_t arena_used;
+	alignas(16) uint8_t arena[16384];
+} tinfl_decompressor;
+
+inline voidpf native_tinfl_alloc(voidpf opaque, uInt items, uInt size)
+{
+	tinfl_decompressor * r = static_cast<tinfl_decompressor *>(opaque);
+	size_t n = ((size_t)items * size + 15) & ~(size_t)15;
+	if(r->arena_used + n > sizeof(r->arena)) return Z_NULL;
+	void * p = r->arena + r->arena_used;
+	r->arena_used += n;
+	return p;
+}
+
+inline void native_tinfl_free(voidpf opaque, voidpf address) {}
+
+inline void tinfl_init(tinfl_decompressor * r)
+{
+	r->started = false;
+}
+
+inline tinfl_status tinfl_decompress(tinfl_decompressor * r, const uint8_t * in, size_t * in_size,
+	uint8_t * out_start, uint8_t * out_next, size_t * out_size, uint32_t flags)
+{
+	size_t window = out_next - out_start + *out_size;
+	if(window & (window - 1)) { *in_size = *out_size = 0; return TINFL_STATUS_BAD_PARAM; }
+	if(!r->started)
+	{
+		int bits = 0;
+		while((1u << bits) < window) ++ bits;
+		memset(&r->z, 0, sizeof(r->z));
+		r->z.zalloc = native_tinfl_alloc;
+		r->z.zfree = native_tinfl_free;
+		r->z.opaque = r;
+		r->arena_used = 0;
+		if(bits < 9 || bits > 15 || inflateInit2(&r->z, -bits) != Z_OK)
+		{
+			*in_size = *out_size = 0;
+			return TINFL_STATUS_BAD_PARAM;
+		}
+		r->started = true;
+	}
+
+	r->z.next_in = const_cast<uint8_t *>(in);
+	r->z.avail_in = *in_size;
+	r->z.next_out = out_next;
+	r->z.avail_out = *out_size;
+	int res = inflate(&r->z, Z_NO_FLUSH);
+	*in_size -= r->z.avail_in;
+	*out_size -= r->z.avail_out;
+
+	if(res == Z_STREAM_END) return TINFL_STATUS_DONE;
+	if(res != Z_OK && res != Z_BUF_ERROR) return TINFL_STATUS_FAILED;
+	if(r->z.avail_out == 0) return TINFL_STATUS_HAS_MORE_OUTPUT;
+	return (flags & TINFL_FLAG_HAS_MORE_INPUT) ? TINFL_STATUS_NEEDS_MORE_INPUT : TINFL_STATUS_FAILED;
+}
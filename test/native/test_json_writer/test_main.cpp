@@ -0,0 +1,252 @@
+#include <Arduino.h>
+#include <unity.h>
+#include <new>
+#include <string>
+#include "json_writer.cpp"
+
+// every heap allocation of the program is counted
+static size_t allocations;
+static size_t allocated_bytes;
+
+void * operator new(size_t size)
+{
+	++ allocations;
+	allocated_bytes += size;
+	if(void * p = malloc(size ? size : 1)) return p;
+	throw std::bad_alloc();
+}
+void operator delete(void * p) noexcept { free(p); }
+void operator delete(void * p, size_t) noexcept { free(p); }
+
+//! allocations made by the function
+template <typename F>
+static size_t count_allocations(F f)
+{
+	size_t before = allocations;
+	f();
+	return allocations - before;
+}
+
+
+/**
+ * Print into a fixed buffer, as the client socket is: it does not
+ * allocate, and records how the text is passed
+ * */
+class fixed_print_t : public Print
+{
+public:
+	char data[64 * 1024];
+	size_t size = 0;
+	size_t writes = 0; //!< write() calls
+	size_t max_write = 0; //!< largest write() in bytes
+
+	size_t write(uint8_t c) override { return write(&c, 1); }
+	size_t write(const uint8_t * buf, size_t n) override
+	{
+		TEST_ASSERT_TRUE(size + n <= sizeof(data));
+		memcpy(data + size, buf, n);
+		size += n;
+		++ writes;
+		if(n > max_write) max_write = n;
+		return n;
+	}
+
+	std::string str() const { return std::string(data, size); }
+};
+
+//! Print into a growing String; the response was made this way before
+class string_print_t : public Print
+{
+public:
+	String s;
+
+	size_t write(uint8_t c) override { s += (char)c; return 1; }
+};
+
+//! settings shown by the web UI, as web_server.cpp copies them from the main thread
+struct ui_settings_t
+{
+	String ntp_servers[3];
+	String time_zone;
+	String marquee;
+	String ap_name;
+	String ip[5];
+	int curve[16][2];
+	int curve_count;
+	int led_gain;
+	String version[4]; // date, time, src_version and env_version
+};
+
+static ui_settings_t make_settings()
+{
+	ui_settings_t st;
+	st.ntp_servers[0] = "ntp.nict.jp";
+	st.ntp_servers[1] = "pool.ntp.org";
+	st.time_zone = "JST-9";
+	st.marquee = "a marquee long enough to spill over the buffer of the writer "
+		"several times, with \"quotes\", a \\ and\ta tab. "
+		"0123456789012345678901234567890123456789012345678901234567890123456789 "
+		"0123456789012345678901234567890123456789012345678901234567890123456789 "
+		"0123456789012345678901234567890123456789012345678901234567890123456789";
+	st.ap_name = "home";
+	st.ip[0] = "192.168.1.10";
+	st.ip[1] = "192.168.1.1";
+	st.ip[2] = "255.255.255.0";
+	st.ip[3] = "192.168.1.1";
+	st.ip[4] = "8.8.8.8";
+	st.curve_count = 16;
+	for(int i = 0; i < st.curve_count; ++i) { st.curve[i][0] = i * 64; st.curve[i][1] = i * 6; }
+	st.led_gain = 60;
+	st.version[0] = "2026-10-18";
+	st.version[1] = "12:34:56";
+	st.version[2] = "v1.2.3-4-gabcdef0";
+	st.version[3] = "1.0.4 (ESP-IDF v3.3.5)";
+	return st;
+}
+
+//! write the document of the settings.json request
+static void write_settings(Print & out, const ui_settings_t & st)
+{
+	json_writer_t w(out);
+	w.begin_object();
+	w.member("result", "ok");
+	w.key("values");
+	w.begin_object();
+	w.key("cal_ntp_servers");
+	w.begin_array();
+	for(auto && s : st.ntp_servers) w.value(s);
+	w.end_array();
+	w.member("cal_timezone", st.time_zone);
+	w.member("ui_marquee", st.marquee);
+	w.member("wifi_ap_name", st.ap_name);
+	w.key("wifi_ip");
+	w.begin_object();
+	static const char * const ip_names[] = { "ip_addr", "ip_gateway", "ip_mask", "dns1", "dns2" };
+	for(int i = 0; i < 5; ++i) w.member(ip_names[i], st.ip[i]);
+	w.end_object();
+	w.key("ambient_curve");
+	w.begin_array();
+	for(int i = 0; i < st.curve_count; ++i)
+	{
+		w.begin_array();
+		w.value(st.curve[i][0]);
+		w.value(st.curve[i][1]);
+		w.end_array();
+	}
+	w.end_array();
+	w.member("led_gain", st.led_gain);
+	w.key("version_info");
+	w.begin_object();
+	static const char * const version_names[] = { "date", "time", "src_version", "env_version" };
+	for(int i = 0; i < 4; ++i) w.member(version_names[i], st.version[i]);
+	w.end_object();
+	w.end_object();
+	w.end_object();
+}
+
+
+void setUp() {}
+void tearDown() {}
+
+
+static void test_document()
+{
+	fixed_print_t out;
+	{
+		json_writer_t w(out);
+		w.begin_object();
+		w.member("s", "a\"b\\c\nd\re\tf\x01g\x1fh");
+		w.member("n", -12);
+		w.member("l", 2147483647L);
+		w.member("t", true);
+		w.member("f", false);
+		w.key("z");
+		w.null_value();
+		w.key("a");
+		w.begin_array();
+		w.begin_array();
+		w.end_array();
+		w.begin_object();
+		w.end_object();
+		w.value("x");
+		w.value(0);
+		w.end_array();
+		w.member("u", "\xe6\x97\xa5");
+		w.end_object();
+	}
+	TEST_ASSERT_EQUAL_STRING(
+		"{\"s\":\"a\\\"b\\\\c\\nd\\re\\tf\\u0001g\\u001fh\",\"n\":-12,\"l\":2147483647,"
+		"\"t\":true,\"f\":false,\"z\":null,\"a\":[[],{},\"x\",0],\"u\":\"\xe6\x97\xa5\"}",
+		out.str().c_str());
+}
+
+static void test_output_is_passed_in_buffer_sized_writes()
+{
+	ui_settings_t st = make_settings();
+	fixed_print_t out;
+	write_settings(out, st);
+	TEST_ASSERT_TRUE(out.size > 3 * json_writer_t::BUFFER_SIZE);
+	TEST_ASSERT_EQUAL(json_writer_t::BUFFER_SIZE, out.max_write);
+	TEST_ASSERT_EQUAL((out.size + json_writer_t::BUFFER_SIZE - 1) / json_writer_t::BUFFER_SIZE, out.writes);
+
+	// the same text as through a String
+	string_print_t str;
+	write_settings(str, st);
+	TEST_ASSERT_EQUAL_STRING(str.s.c_str(), out.str().c_str());
+}
+
+static void test_allocations_per_request()
+{
+	ui_settings_t st = make_settings();
+	static fixed_print_t out; // not on the heap, nor too large for the stack
+	string_print_t str;
+
+	// the document is written to the client without any allocation
+	size_t writer = count_allocations([&] { out.size = 0; write_settings(out, st); });
+	TEST_ASSERT_EQUAL(0, writer);
+
+	// and so are further requests
+	size_t repeated = count_allocations([&] {
+		for(int i = 0; i < 100; ++i) { out.size = 0; write_settings(out, st); }
+	});
+	TEST_ASSERT_EQUAL(0, repeated);
+
+	// building it in a String first allocates, and grows with the document
+	size_t before_bytes = allocated_bytes;
+	size_t string = count_allocations([&] { write_settings(str, st); });
+	TEST_ASSERT_TRUE(string > 0);
+	TEST_ASSERT_TRUE(allocated_bytes - before_bytes >= out.size);
+
+	char message[120];
+	snprintf(message, sizeof(message),
+		"%u bytes: %u allocations by json_writer_t, %u (%u bytes) through a String",
+		(unsigned)out.size, (unsigned)writer, (unsigned)string,
+		(unsigned)(allocated_bytes - before_bytes));
+	TEST_MESSAGE(message);
+}
+
+static void test_deep_nesting()
+{
+	// beyond MAX_DEPTH the commas are no longer tracked, but nothing breaks
+	fixed_print_t out;
+	{
+		json_writer_t w(out);
+		for(int i = 0; i < json_writer_t::MAX_DEPTH + 4; ++i) w.begin_array();
+		for(int i = 0; i < json_writer_t::MAX_DEPTH + 4; ++i) w.end_array();
+		w.end_array(); // unpaired
+	}
+	std::string expected(json_writer_t::MAX_DEPTH + 4, '[');
+	expected += std::string(json_writer_t::MAX_DEPTH + 5, ']');
+	TEST_ASSERT_EQUAL_STRING(expected.c_str(), out.str().c_str());
+}
+
+
+int main(int argc, char ** argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_document);
+	RUN_TEST(test_output_is_passed_in_buffer_sized_writes);
+	RUN_TEST(test_allocations_per_request);
+	RUN_TEST(test_deep_nesting);
+	return UNITY_END();
+}
@@ -0,0 +1,272 @@
+#include <Arduino.h>
+#include <unity.h>
+#include <string>
+#include <vector>
+#include "microtar.cpp"
+
+// the main file system the archives are opened on
+fs::ANY_SPIFFSFS::ANY_SPIFFSFS() {}
+bool fs::ANY_SPIFFSFS::begin(bool formatOnFail, const char * label, const char * basePath, uint8_t maxOpenFiles) { return true; }
+bool fs::ANY_SPIFFSFS::format(const char * label) { return true; }
+fs::ANY_SPIFFSFS FS;
+
+static const char ARCHIVE[] = "/test.tar";
+
+
+//! a sequential stream on memory, which can not seek
+class memory_stream_t : public Stream
+{
+public:
+	std::vector<uint8_t> data;
+	size_t pos = 0;
+
+	size_t write(uint8_t c) override { data.push_back(c); return 1; }
+	size_t write(const uint8_t * buf, size_t size) override
+	{
+		data.insert(data.end(), buf, buf + size);
+		return size;
+	}
+	using Print::write;
+
+	int available() override { return data.size() - pos; }
+	int read() override { return pos < data.size() ? data[pos++] : -1; }
+	int peek() override { return pos < data.size() ? data[pos] : -1; }
+	size_t readBytes(char * buf, size_t size) override
+	{
+		size_t n = std::min(size, data.size() - pos);
+		if(n) memcpy(buf, data.data() + pos, n);
+		pos += n;
+		return n;
+	}
+};
+
+struct entry_t
+{
+	std::string name;
+	std::string data;
+};
+
+//! entries of various sizes, around the 512-byte records and the 4 KiB blocks
+static std::vector<entry_t> make_entries(int count)
+{
+	static const unsigned sizes[] = { 0, 1, 511, 512, 513, 4095, 4096, 4097, 100, 3000 };
+	std::vector<entry_t> entries;
+	for(int i = 0; i < count; ++i)
+	{
+		entry_t e;
+		e.name = "dir/entry" + std::to_string(i);
+		e.data.resize(sizes[i % 10] + i % 7);
+		for(size_t j = 0; j < e.data.size(); ++j) e.data[j] = (char)(i + j * 13);
+		entries.push_back(e);
+	}
+	return entries;
+}
+
+//! write the entries; the data in chunks of the given size
+static void write_entries(mtar_t & tar, const std::vector<entry_t> & entries, size_t chunk)
+{
+	TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_write_dir_header(&tar, "dir/"));
+	for(auto && e : entries)
+	{
+		TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_write_file_header(&tar, e.name.c_str(), e.data.size()));
+		for(size_t done = 0; done < e.data.size(); done += chunk)
+		{
+			size_t one = std::min(chunk, e.data.size() - done);
+			TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_write_data(&tar, e.data.data() + done, one));
+		}
+	}
+	TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_finalize(&tar));
+	TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_close(&tar));
+}
+
+static void write_file(const std::vector<entry_t> & entries, size_t chunk = 1000)
+{
+	mtar_t tar;
+	TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_open(&tar, ARCHIVE, "w"));
+	write_entries(tar, entries, chunk);
+}
+
+//! read the entry the archive is at, and compare it
+static void assert_entry(mtar_t & tar, const mtar_header_t & h, const entry_t & e)
+{
+	TEST_ASSERT_EQUAL_STRING(e.name.c_str(), h.name);
+	TEST_ASSERT_EQUAL(e.data.size(), h.size);
+	std::string data(h.size, '\0');
+	if(h.size) TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_read_data(&tar, &data[0], h.size));
+	TEST_ASSERT_TRUE_MESSAGE(data == e.data, e.name.c_str());
+}
+
+//! read all the entries in order
+static void assert_entries(mtar_t & tar, const std::vector<entry_t> & entries)
+{
+	mtar_header_t h;
+	TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_read_header(&tar, &h));
+	TEST_ASSERT_EQUAL_STRING("dir/", h.name);
+	TEST_ASSERT_EQUAL(MTAR_TDIR, h.type);
+	for(auto && e : entries)
+	{
+		TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_next(&tar));
+		TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_read_header(&tar, &h));
+		assert_entry(tar, h, e);
+	}
+	TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_next(&tar));
+	TEST_ASSERT_EQUAL(MTAR_ENULLRECORD, mtar_read_header(&tar, &h));
+}
+
+static const std::vector<uint8_t> & archive_bytes()
+{
+	return *FS.files[ARCHIVE];
+}
+
+
+void setUp()
+{
+	FS.files.clear();
+}
+
+void tearDown() {}
+
+
+static void test_file_round_trip()
+{
+	std::vector<entry_t> entries = make_entries(300);
+	write_file(entries);
+
+	size_t size = 512;
+	for(auto && e : entries) size += 512 + (e.data.size() + 511) / 512 * 512;
+	TEST_ASSERT_EQUAL(size + 1024, archive_bytes().size());
+
+	mtar_t tar;
+	TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_open(&tar, ARCHIVE, "r"));
+	assert_entries(tar, entries);
+	TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_close(&tar));
+}
+
+static void test_output_does_not_depend_on_chunks()
+{
+	std::vector<entry_t> entries = make_entries(40);
+	write_file(entries, 1);
+	std::vector<uint8_t> bytewise = archive_bytes();
+	write_file(entries, 5000);
+	TEST_ASSERT_TRUE(bytewise == archive_bytes());
+
+	// the stream mode writes the same archive
+	memory_stream_t stream;
+	mtar_t tar;
+	TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_open_stream(&tar, &stream, "w"));
+	write_entries(tar, entries, 777);
+	TEST_ASSERT_TRUE(stream.data == archive_bytes());
+	TEST_ASSERT_EQUAL(stream.data.size(), tar.io_pos);
+}
+
+static void test_find()
+{
+	std::vector<entry_t> entries = make_entries(300);
+	write_file(entries);
+
+	mtar_t tar;
+	mtar_header_t h;
+	TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_open(&tar, ARCHIVE, "r"));
+
+	// in any order, and the same entry again
+	for(int i : { 150, 299, 0, 7, 150, 298, 1 })
+	{
+		TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_find(&tar, entries[i].name.c_str(), &h));
+		assert_entry(tar, h, entries[i]);
+	}
+	TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_find(&tar, "dir/", &h));
+	TEST_ASSERT_EQUAL(MTAR_ENOTFOUND, mtar_find(&tar, "dir/entry300", &h));
+	TEST_ASSERT_EQUAL(MTAR_ENOTFOUND, mtar_find(&tar, "entry1", &h));
+
+	// lookups use the index instead of scanning from the start: they find
+	// entries past a header that can no longer be read
+	std::vector<uint8_t> & bytes = *FS.files[ARCHIVE];
+	memset(bytes.data(), 0, 512); // the "dir/" header
+	for(int i : { 200, 3, 100 })
+	{
+		TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_find(&tar, entries[i].name.c_str(), &h));
+		assert_entry(tar, h, entries[i]);
+	}
+	TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_close(&tar));
+
+	// a broken archive has no index
+	TEST_ASSERT_EQUAL(MTAR_ENULLRECORD, mtar_open(&tar, ARCHIVE, "r"));
+}
+
+static void test_stream_read()
+{
+	std::vector<entry_t> entries = make_entries(100);
+	write_file(entries);
+
+	memory_stream_t stream;
+	stream.data = archive_bytes();
+	mtar_t tar;
+	TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_open_stream(&tar, &stream, "r"));
+	assert_entries(tar, entries);
+	TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_close(&tar));
+
+	// entries can be skipped without reading their data
+	stream.pos = 0;
+	mtar_header_t h;
+	TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_open_stream(&tar, &stream, "r"));
+	for(int i = 0; i <= 50; ++i) TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_next(&tar));
+	TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_read_header(&tar, &h));
+	assert_entry(tar, h, entries[50]);
+
+	// but not read back once passed
+	TEST_ASSERT_EQUAL(MTAR_ESEEKFAIL, mtar_find(&tar, entries[10].name.c_str(), &h));
+	TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_close(&tar));
+
+	// a truncated archive
+	stream.data.resize(stream.data.size() / 2);
+	stream.pos = 0;
+	TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_open_stream(&tar, &stream, "r"));
+	int err;
+	while((err = mtar_next(&tar)) == MTAR_ESUCCESS) {}
+	TEST_ASSERT_EQUAL(MTAR_EREADFAIL, err);
+	TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_close(&tar));
+}
+
+static void test_benchmark()
+{
+	std::vector<entry_t> entries = make_entries(500);
+
+	uint32_t start = micros();
+	write_file(entries, 256);
+	uint32_t write_us = micros() - start;
+
+	mtar_t tar;
+	mtar_header_t h;
+	start = micros();
+	TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_open(&tar, ARCHIVE, "r"));
+	assert_entries(tar, entries);
+	uint32_t read_us = micros() - start;
+
+	start = micros();
+	for(size_t i = 0; i < entries.size(); ++i)
+	{
+		const entry_t & e = entries[(i * 7) % entries.size()];
+		TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_find(&tar, e.name.c_str(), &h));
+	}
+	uint32_t find_us = micros() - start;
+	TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_close(&tar));
+
+	char message[160];
+	snprintf(message, sizeof(message),
+		"%u entries, %u bytes: write %u us, read %u us, %u lookups %u us",
+		(unsigned)entries.size(), (unsigned)archive_bytes().size(),
+		(unsigned)write_us, (unsigned)read_us, (unsigned)entries.size(), (unsigned)find_us);
+	TEST_MESSAGE(message);
+}
+
+
+int main(int argc, char ** argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_file_round_trip);
+	RUN_TEST(test_output_does_not_depend_on_chunks);
+	RUN_TEST(test_find);
+	RUN_TEST(test_stream_read);
+	RUN_TEST(test_benchmark);
+	return UNITY_END();
+}
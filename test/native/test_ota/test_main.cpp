@@ -0,0 +1,773 @@
+#include <Arduino.h>
+#include <unity.h>
+#include <functional>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include "threadsync.cpp"
+#include "mz_update.cpp"
+
+TaskHandle_t loopTaskHandle; // the main thread; the test runner's thread
+
+// the OTA checkpoint is kept in the settings
+static std::map<std::string, std::pair<uint16_t, std::string>> settings;
+bool settings_write_typed(const String & key, const void * ptr, size_t size,
+	uint16_t version, settings_overwrite_t overwrite)
+{
+	if(!overwrite.overwrite && settings.count(key.c_str())) return false;
+	settings[key.c_str()] = { version, std::string((const char *)ptr, size) };
+	return true;
+}
+bool settings_read_typed(const String & key, void * ptr, size_t size, uint16_t version)
+{
+	auto it = settings.find(key.c_str());
+	if(it == settings.end() || it->second.first != version || it->second.second.size() != size) return false;
+	memcpy(ptr, it->second.second.data(), size);
+	return true;
+}
+bool settings_remove(const String & key) { return settings.erase(key.c_str()) != 0; }
+void settings_flush() {}
+
+
+/**
+ * the flash in RAM, with the partition table of src/custom.csv. writing
+ * only clears bits, as on the real flash. writes can be made to fail, and
+ * writes outside the partitions of the inactive slot are counted.
+ * */
+class ram_ota_flash_t : public ota_flash_t
+{
+public:
+	std::vector<uint8_t> data;
+	std::vector<esp_partition_t> partitions;
+	const esp_partition_t * running = nullptr;
+	const esp_partition_t * boot = nullptr;
+	uint32_t erases = 0; //!< sectors erased
+	long write_budget = -1; //!< writes and erases to succeed before failing; -1 = unlimited
+	uint32_t stray_writes = 0; //!< writes and erases outside the inactive slot
+
+	explicit ram_ota_flash_t(const char * csv)
+	{
+		FILE * f = fopen(csv, "r");
+		TEST_ASSERT_TRUE_MESSAGE(f, csv);
+		char line[256];
+		uint32_t end = 0;
+		while(fgets(line, sizeof(line), f))
+		{
+			char name[32], type[16], subtype[16];
+			unsigned offset, size;
+			if(line[0] == '#' ||
+				sscanf(line, " %31[^, ] , %15[^, ] , %15[^, ] , %x , %x", name, type, subtype, &offset, &size) != 5)
+				continue;
+			esp_partition_t p = {};
+			strncpy(p.label, name, sizeof(p.label) - 1);
+			p.type = (esp_partition_type_t)(!strcmp(type, "app") ? ESP_PARTITION_TYPE_APP :
+				!strcmp(type, "data") ? ESP_PARTITION_TYPE_DATA : strtol(type, nullptr, 0));
+			p.subtype = (esp_partition_subtype_t)(
+				!strcmp(subtype, "ota_0") ? ESP_PARTITION_SUBTYPE_APP_OTA_0 :
+				!strcmp(subtype, "ota_1") ? ESP_PARTITION_SUBTYPE_APP_OTA_1 :
+				!strcmp(subtype, "ota") ? ESP_PARTITION_SUBTYPE_DATA_OTA :
+				!strcmp(subtype, "nvs") ? ESP_PARTITION_SUBTYPE_DATA_NVS :
+				!strcmp(subtype, "spiffs") ? ESP_PARTITION_SUBTYPE_DATA_SPIFFS : strtol(subtype, nullptr, 0));
+			p.address = offset;
+			p.size = size;
+			partitions.push_back(p);
+			end = std::max(end, offset + size);
+		}
+		fclose(f);
+		data.assign(end, 0xff);
+		running = find("app0");
+	}
+
+	//! whether the access can go ahead
+	bool access(uint32_t address, size_t size)
+	{
+		if(address + size > data.size()) return false;
+		bool inactive = false;
+		for(const char * label : { "app1", "spiffs1", "font1" })
+		{
+			const esp_partition_t * p = find(label);
+			if(address >= p->address && address + size <= p->address + p->size) inactive = true;
+		}
+		if(!inactive) ++ stray_writes;
+		if(write_budget == 0) return false;
+		if(write_budget > 0) -- write_budget;
+		return true;
+	}
+
+	const esp_partition_t * find(const char * label) const
+	{
+		for(auto && p : partitions)
+			if(!strcmp(p.label, label)) return &p;
+		return nullptr;
+	}
+
+	//! the content of the partition
+	std::vector<uint8_t> content(const char * label, size_t size) const
+	{
+		const esp_partition_t * p = find(label);
+		return std::vector<uint8_t>(data.begin() + p->address, data.begin() + p->address + size);
+	}
+
+	bool read(uint32_t address, void * buf, size_t size) override
+	{
+		if(address + size > data.size()) return false;
+		memcpy(buf, data.data() + address, size);
+		return true;
+	}
+
+	bool write(uint32_t address, const void * buf, size_t size) override
+	{
+		if(!access(address, size)) return false;
+		const uint8_t * s = static_cast<const uint8_t *>(buf);
+		for(size_t i = 0; i < size; ++i) data[address + i] &= s[i];
+		return true;
+	}
+
+	bool erase_sector(uint32_t address) override
+	{
+		if(address % SPI_FLASH_SEC_SIZE || !access(address, SPI_FLASH_SEC_SIZE)) return false;
+		memset(data.data() + address, 0xff, SPI_FLASH_SEC_SIZE);
+		++ erases;
+		return true;
+	}
+
+	const esp_partition_t * find_partition(esp_partition_type_t type,
+		esp_partition_subtype_t subtype, const char * label) override
+	{
+		for(auto && p : partitions)
+		{
+			if(type != ESP_PARTITION_TYPE_ANY && p.type != type) continue;
+			if(subtype != ESP_PARTITION_SUBTYPE_ANY && p.subtype != subtype) continue;
+			if(label && strcmp(label, p.label)) continue;
+			return &p;
+		}
+		return nullptr;
+	}
+
+	const esp_partition_t * get_running_partition() override { return running; }
+
+	bool set_boot_partition(const esp_partition_t * partition) override
+	{
+		boot = partition;
+		return true;
+	}
+};
+
+typedef std::vector<uint8_t> bytes_t;
+
+// the archive layout; see make_archive.py
+static const size_t PARTITION_HEADER = SPI_FLASH_SEC_SIZE; //!< the first partition header, after the archive header
+static const size_t ARC_LEN_OFFSET = 28; //!< archived (padded) size in a partition header
+static const size_t FLAGS_OFFSET = 48; //!< flags in a partition header
+static const size_t COMP_LEN_OFFSET = 52; //!< stored content length in a partition header
+
+struct image_t
+{
+	const char * label;
+	bytes_t data;
+};
+
+static std::string work_dir;
+
+static std::string write_file(const std::string & name, const bytes_t & data)
+{
+	std::string path = work_dir + "/" + name;
+	FILE * f = fopen(path.c_str(), "wb");
+	TEST_ASSERT_TRUE_MESSAGE(f, path.c_str());
+	fwrite(data.data(), 1, data.size(), f);
+	fclose(f);
+	return path;
+}
+
+static bytes_t read_file(const std::string & path)
+{
+	bytes_t data;
+	FILE * f = fopen(path.c_str(), "rb");
+	if(!f) return data;
+	uint8_t buf[4096];
+	size_t n;
+	while((n = fread(buf, 1, sizeof(buf), f)) > 0) data.insert(data.end(), buf, buf + n);
+	fclose(f);
+	return data;
+}
+
+//! make an archive of the images by make_archive.py, with the options
+static bytes_t make_archive(const std::vector<image_t> & images, const char * options = "")
+{
+	static const char * python = nullptr;
+	if(!python)
+	{
+		python = system("python3 -c '' 2>/dev/null") == 0 ? "python3" : "python";
+		if(system((std::string(python) + " -c '' 2>/dev/null").c_str()))
+			TEST_IGNORE_MESSAGE("python is needed to run make_archive.py");
+	}
+	std::string command = std::string(python) + " make_archive.py " + options;
+	for(auto && i : images)
+		command += std::string(" --input ") + i.label + "=" + write_file(i.label, i.data);
+	std::string output = work_dir + "/archive.bin";
+	command += " --output " + output + " > /dev/null";
+	TEST_ASSERT_EQUAL(0, system(command.c_str()));
+	return read_file(output);
+}
+
+//! feed the archive to the updater in chunks of sizes given by the function
+static bool update(ram_ota_flash_t & flash, const bytes_t & archive, std::function<size_t ()> chunk)
+{
+	updater_t updater(flash);
+	updater.begin();
+	for(size_t pos = 0, one; pos < archive.size(); pos += one)
+	{
+		one = std::min(chunk(), archive.size() - pos);
+		updater.write_data(archive.data() + pos, one);
+	}
+	return updater.finish();
+}
+
+//! feed the archive to the updater in chunks of the size
+static bool update(ram_ota_flash_t & flash, const bytes_t & archive, size_t chunk)
+{
+	return update(flash, archive, [chunk] () { return chunk; });
+}
+
+//! the offset of the partition header following the one at the offset
+static size_t next_partition_header(const bytes_t & archive, size_t offset)
+{
+	uint32_t arc_len, flags, comp_len;
+	memcpy(&arc_len, archive.data() + offset + ARC_LEN_OFFSET, 4);
+	memcpy(&flags, archive.data() + offset + FLAGS_OFFSET, 4);
+	memcpy(&comp_len, archive.data() + offset + COMP_LEN_OFFSET, 4);
+	uint32_t stored = flags ? comp_len : arc_len;
+	return offset + SPI_FLASH_SEC_SIZE + (stored + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+}
+
+//! the image as written to a partition: padded to sectors
+static bytes_t padded(const bytes_t & image)
+{
+	bytes_t p = image;
+	p.resize((image.size() + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE);
+	return p;
+}
+
+static void assert_installed(const ram_ota_flash_t & flash, const char * partition, const bytes_t & image)
+{
+	bytes_t expected = padded(image);
+	TEST_ASSERT_TRUE_MESSAGE(flash.content(partition, expected.size()) == expected, partition);
+}
+
+/**
+ * images standing in for the build outputs: a font with long runs of
+ * similar glyph data, a file system image mostly erased, and a firmware
+ * of less compressible code. sizes are not multiples of sectors.
+ * */
+static std::vector<image_t> make_images(uint32_t seed = 1)
+{
+	bytes_t font(300 * 1024 + 123);
+	for(size_t i = 0; i < font.size(); ++i) font[i] = (uint8_t)((i % 97) * (i / 2048 + seed));
+
+	bytes_t spiffs(64 * 1024, 0xff);
+	for(size_t i = 0; i < 5000; ++i) spiffs[8192 + i] = (uint8_t)(i * seed);
+
+	bytes_t app(200 * 1024 + 5);
+	uint32_t x = seed * 2654435761u;
+	for(size_t i = 0; i < app.size(); ++i)
+	{
+		x = x * 1103515245 + 12345;
+		app[i] = (i % 16 < 10) ? (uint8_t)(x >> 16) : (uint8_t)i; // partly random
+	}
+	app[0] = 0xe9; // image magic
+
+	return { { "font", font }, { "spiffs", spiffs }, { "app", app } };
+}
+
+//! a raw deflate stream of the data, with the window of the given bits
+static bytes_t deflate(const bytes_t & data, int window_bits)
+{
+	z_stream z = {};
+	TEST_ASSERT_EQUAL(Z_OK, deflateInit2(&z, 9, Z_DEFLATED, -window_bits, 9, Z_DEFAULT_STRATEGY));
+	bytes_t out(deflateBound(&z, data.size()));
+	z.next_in = const_cast<uint8_t *>(data.data());
+	z.avail_in = data.size();
+	z.next_out = out.data();
+	z.avail_out = out.size();
+	TEST_ASSERT_EQUAL(Z_STREAM_END, ::deflate(&z, Z_FINISH));
+	out.resize(z.total_out);
+	deflateEnd(&z);
+	return out;
+}
+
+
+void setUp()
+{
+	settings.clear();
+}
+
+void tearDown() {}
+
+
+static void test_compressed_archive()
+{
+	std::vector<image_t> images = make_images();
+	bytes_t plain = make_archive(images);
+	bytes_t archive = make_archive(images, "--compress");
+	TEST_ASSERT_EQUAL(0, memcmp(archive.data(), "MZ5 firmware archive 1.1", 24));
+	TEST_ASSERT_TRUE(archive.size() < plain.size() / 2);
+
+	ram_ota_flash_t flash("src/custom.csv");
+	uint32_t start = micros();
+	TEST_ASSERT_TRUE(update(flash, archive, 1460)); // a TCP segment each
+	uint32_t elapsed = micros() - start;
+
+	// written to the inactive slot, which boots next time
+	assert_installed(flash, "font1", images[0].data);
+	assert_installed(flash, "spiffs1", images[1].data);
+	assert_installed(flash, "app1", images[2].data);
+	TEST_ASSERT_TRUE(flash.boot == flash.find("app1"));
+
+	char message[120];
+	snprintf(message, sizeof(message), "%u bytes inflated to %u in %u us",
+		(unsigned)archive.size(), (unsigned)plain.size(), (unsigned)elapsed);
+	TEST_MESSAGE(message);
+}
+
+static void test_archive_is_inflated_with_4k_window()
+{
+	// data repeating at 8 KiB, which a larger window would refer back to.
+	// of 16 symbols, so that it compresses within 4 KiB too
+	bytes_t app(64 * 1024);
+	for(size_t i = 0; i < app.size(); ++i) app[i] = (uint8_t)((i % 8192) * 2654435761u >> 13 & 0x0f);
+	app[0] = 0xe9;
+	bytes_t archive = make_archive({ { "app", app } }, "--compress");
+
+	ram_ota_flash_t flash("src/custom.csv");
+	TEST_ASSERT_TRUE(update(flash, archive, 4096));
+	assert_installed(flash, "app1", app);
+
+	// the same archive with the content compressed with a 32 KiB window
+	// can not be inflated on the device
+	uint8_t * header = archive.data() + PARTITION_HEADER;
+	uint32_t flags, comp_len;
+	memcpy(&flags, header + FLAGS_OFFSET, 4);
+	TEST_ASSERT_EQUAL(1, flags); // PARTITION_FLAG_DEFLATE
+	bytes_t wide = deflate(padded(app), 15);
+	const size_t content = PARTITION_HEADER + SPI_FLASH_SEC_SIZE;
+	bytes_t broken(archive.begin(), archive.begin() + content);
+	comp_len = wide.size();
+	memcpy(broken.data() + PARTITION_HEADER + COMP_LEN_OFFSET, &comp_len, 4);
+	broken.insert(broken.end(), wide.begin(), wide.end());
+	broken.resize(content + (wide.size() + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE);
+
+	ram_ota_flash_t flash2("src/custom.csv");
+	TEST_ASSERT_FALSE(update(flash2, broken, 4096));
+	TEST_ASSERT_TRUE(flash2.boot == nullptr);
+}
+
+static void test_arbitrary_chunks()
+{
+	std::vector<image_t> images = make_images(2);
+	for(const char * options : { "", "--compress" })
+	{
+		bytes_t archive = make_archive(images, options);
+		std::vector<std::function<size_t ()>> chunks;
+		for(size_t size : { 1, 7, 511, 512, 4095, 4096, 4097, 65536 })
+			chunks.push_back([size] () { return size; });
+		std::mt19937 random(1);
+		chunks.push_back([&random] () { return std::uniform_int_distribution<size_t>(1, 9000)(random); });
+
+		for(auto && chunk : chunks)
+		{
+			ram_ota_flash_t flash("src/custom.csv");
+			TEST_ASSERT_TRUE_MESSAGE(update(flash, archive, chunk), options);
+			assert_installed(flash, "font1", images[0].data);
+			assert_installed(flash, "spiffs1", images[1].data);
+			assert_installed(flash, "app1", images[2].data);
+			TEST_ASSERT_TRUE(flash.boot == flash.find("app1"));
+			TEST_ASSERT_EQUAL(0, flash.stray_writes);
+		}
+	}
+}
+
+static void test_corrupted_archives()
+{
+	std::vector<image_t> images = make_images(3);
+	for(const char * options : { "", "--compress" })
+	{
+		bytes_t archive = make_archive(images, options);
+		struct { const char * what; size_t offset; } corruptions[] = {
+			{ "archive magic", 0 },
+			{ "archive version", 23 },
+			{ "partition boundary", PARTITION_HEADER },
+			{ "label", PARTITION_HEADER + 16 },
+			{ "archived size", PARTITION_HEADER + ARC_LEN_OFFSET },
+			{ "MD5", PARTITION_HEADER + 32 },
+			{ "flags", PARTITION_HEADER + FLAGS_OFFSET },
+			{ "first content", PARTITION_HEADER + SPI_FLASH_SEC_SIZE + 10 },
+			{ "last content", archive.size() - SPI_FLASH_SEC_SIZE + 10 },
+		};
+		for(auto && c : corruptions)
+		{
+			bytes_t broken = archive;
+			broken[c.offset] ^= 0x55;
+			ram_ota_flash_t flash("src/custom.csv");
+			TEST_ASSERT_FALSE_MESSAGE(update(flash, broken, 1460), c.what);
+			TEST_ASSERT_TRUE_MESSAGE(flash.boot == nullptr, c.what);
+			TEST_ASSERT_EQUAL(0, flash.stray_writes);
+		}
+
+		for(size_t size : { (size_t)0, (size_t)100, archive.size() / 2,
+			archive.size() - SPI_FLASH_SEC_SIZE, archive.size() - 1 })
+		{
+			bytes_t truncated(archive.begin(), archive.begin() + size);
+			ram_ota_flash_t flash("src/custom.csv");
+			TEST_ASSERT_FALSE(update(flash, truncated, 1460));
+			TEST_ASSERT_TRUE(flash.boot == nullptr);
+		}
+
+		// trailing data after the last partition is not a partition header
+		bytes_t longer = archive;
+		longer.resize(archive.size() + SPI_FLASH_SEC_SIZE, 0xff);
+		ram_ota_flash_t flash("src/custom.csv");
+		TEST_ASSERT_FALSE(update(flash, longer, 1460));
+	}
+}
+
+static void test_flash_failures()
+{
+	std::vector<image_t> images = make_images(4);
+	bytes_t archive = make_archive(images, "--compress");
+	for(long budget : { 0, 1, 2, 50, 150 })
+	{
+		ram_ota_flash_t flash("src/custom.csv");
+		flash.write_budget = budget;
+		TEST_ASSERT_FALSE(update(flash, archive, 1460));
+		TEST_ASSERT_TRUE(flash.boot == nullptr);
+	}
+}
+
+static void test_throughput()
+{
+	bytes_t font(1024 * 1024), app(1024 * 1024);
+	uint32_t x = 1;
+	for(size_t i = 0; i < font.size(); ++i)
+	{
+		x = x * 1103515245 + 12345;
+		font[i] = (uint8_t)((i % 61) ^ (x >> 28)); // compresses to about a half
+		app[i] = (uint8_t)(x >> 16);
+	}
+	app[0] = 0xe9;
+	std::vector<image_t> images = { { "font", font }, { "app", app } };
+
+	for(const char * options : { "", "--compress" })
+	{
+		bytes_t archive = make_archive(images, options);
+		ram_ota_flash_t flash("src/custom.csv");
+		char message[160];
+		for(int round = 0; round < 2; ++round)
+		{
+			flash.erases = 0;
+			uint32_t start = micros();
+			TEST_ASSERT_TRUE(update(flash, archive, 1460));
+			uint32_t elapsed = micros() - start;
+			snprintf(message, sizeof(message), "%-10s %s: %u bytes in %u us, %u KiB/s, %u sectors erased",
+				*options ? options : "plain", round ? "again" : "first",
+				(unsigned)archive.size(), (unsigned)elapsed,
+				(unsigned)(elapsed ? (uint64_t)archive.size() * 1000000 / 1024 / elapsed : 0),
+				(unsigned)flash.erases);
+			TEST_MESSAGE(message);
+		}
+		// installing the same again only rewrites the first sector of each partition
+		TEST_ASSERT_EQUAL(2, flash.erases);
+	}
+}
+
+/**
+ * mutate the archive and partition headers at random. the updater must
+ * neither crash nor write outside the inactive slot, and whatever it
+ * accepts must have been installed intact.
+ * */
+static void test_fuzz_headers()
+{
+	bytes_t app(3 * SPI_FLASH_SEC_SIZE + 100);
+	for(size_t i = 0; i < app.size(); ++i) app[i] = (uint8_t)(i * 7 / 3);
+	app[0] = 0xe9;
+	bytes_t font(2 * SPI_FLASH_SEC_SIZE, 0x5a);
+	bytes_t archives[] = {
+		make_archive({ { "font", font }, { "app", app } }),
+		make_archive({ { "font", font }, { "app", app } }, "--compress"),
+	};
+
+	for(auto && a : archives)
+		TEST_ASSERT_EQUAL(0, memcmp(a.data() + next_partition_header(a, PARTITION_HEADER), "-file boundary--", 16));
+
+	static const uint32_t interesting[] = { 0, 1, 0xfff, 0x1000, 0x1001, 0x7fffffff, 0x80000000, 0xffffffff };
+	std::mt19937 random(44);
+	ram_ota_flash_t flash("src/custom.csv");
+	int accepted = 0;
+	for(int i = 0; i < 2000; ++i)
+	{
+		bytes_t archive = archives[i % 2];
+		int mutations = std::uniform_int_distribution<int>(1, 4)(random);
+		for(int m = 0; m < mutations; ++m)
+		{
+			// the archive header, or either partition header
+			size_t headers[] = { 0, PARTITION_HEADER, next_partition_header(archives[i % 2], PARTITION_HEADER) };
+			size_t base = headers[std::uniform_int_distribution<int>(0, 2)(random)];
+			if(random() % 2)
+			{
+				size_t offset = base + std::uniform_int_distribution<size_t>(0, 95)(random);
+				archive[offset] = (uint8_t)random();
+			}
+			else
+			{
+				size_t offset = base + 16 + std::uniform_int_distribution<size_t>(0, 18)(random) * 4;
+				uint32_t v = interesting[random() % (sizeof(interesting) / sizeof(interesting[0]))];
+				memcpy(archive.data() + offset, &v, 4);
+			}
+		}
+
+		flash.boot = nullptr;
+		flash.stray_writes = 0;
+		bool ok = update(flash, archive, std::uniform_int_distribution<size_t>(1, 8192)(random));
+		TEST_ASSERT_EQUAL(0, flash.stray_writes);
+		if(!ok) continue;
+		++ accepted;
+		TEST_ASSERT_TRUE(flash.boot == flash.find("app1"));
+		assert_installed(flash, "app1", app);
+	}
+	char message[80];
+	snprintf(message, sizeof(message), "%d of 2000 mutated archives accepted", accepted);
+	TEST_MESSAGE(message);
+}
+
+//! put the images in the active slot, as an earlier update installed them
+static void install_base(ram_ota_flash_t & flash, const std::vector<image_t> & images)
+{
+	for(auto && i : images)
+	{
+		std::string label = std::string(i.label) + "0";
+		const esp_partition_t * p = flash.find(label.c_str());
+		bytes_t image = padded(i.data);
+		std::copy(image.begin(), image.end(), flash.data.begin() + p->address);
+	}
+}
+
+//! the flags of the partition header at the offset
+static uint32_t partition_flags(const bytes_t & archive, size_t offset)
+{
+	uint32_t flags;
+	memcpy(&flags, archive.data() + offset + FLAGS_OFFSET, 4);
+	return flags;
+}
+
+//! make the archive with --base, against an archive of the base images
+static bytes_t make_delta_archive(const std::vector<image_t> & images,
+	const std::vector<image_t> & base, const char * options = "")
+{
+	std::string base_archive = write_file("base.bin", make_archive(base));
+	return make_archive(images, (std::string(options) + " --base " + base_archive).c_str());
+}
+
+/**
+ * images changed from the base: a few sectors of the font, which also
+ * grows past the base, none of the file system, and every sector of the
+ * firmware
+ * */
+static std::vector<image_t> make_changed_images(const std::vector<image_t> & base)
+{
+	std::vector<image_t> images = base;
+	for(size_t sector : { 0, 5, 6, 40 }) images[0].data[sector * SPI_FLASH_SEC_SIZE + 100] ^= 0xff;
+	images[0].data.resize(images[0].data.size() + 2 * SPI_FLASH_SEC_SIZE, 0x33);
+	for(size_t i = 1; i < images[2].data.size(); i += 1000) images[2].data[i] ^= 0x5a;
+	images[2].data.back() ^= 0x5a;
+	return images;
+}
+
+static void test_delta_archive()
+{
+	std::vector<image_t> base = make_images(5);
+	std::vector<image_t> images = make_changed_images(base);
+	for(const char * options : { "", "--compress" })
+	{
+		bytes_t archive = make_delta_archive(images, base, options);
+		TEST_ASSERT_EQUAL(0, memcmp(archive.data(), "MZ5 firmware archive 1.2", 24));
+		size_t font = PARTITION_HEADER;
+		size_t spiffs = next_partition_header(archive, font);
+		size_t app = next_partition_header(archive, spiffs);
+		TEST_ASSERT_TRUE(partition_flags(archive, font) & 2); // PARTITION_FLAG_DELTA
+		TEST_ASSERT_EQUAL(4, partition_flags(archive, spiffs)); // PARTITION_FLAG_SAME
+		TEST_ASSERT_EQUAL(0, partition_flags(archive, app) & 6); // as is, or compressed
+		TEST_ASSERT_EQUAL(spiffs + SPI_FLASH_SEC_SIZE, app); // no content for spiffs
+
+		ram_ota_flash_t flash("src/custom.csv");
+		install_base(flash, base);
+		TEST_ASSERT_TRUE_MESSAGE(update(flash, archive, 1460), options);
+		assert_installed(flash, "font1", images[0].data);
+		assert_installed(flash, "spiffs1", images[1].data);
+		assert_installed(flash, "app1", images[2].data);
+		TEST_ASSERT_TRUE(flash.boot == flash.find("app1"));
+		TEST_ASSERT_EQUAL(0, flash.stray_writes);
+
+		// the target slot has them all now. the same partition is found
+		// installed, and others rewrite only their first sector
+		flash.erases = 0;
+		flash.boot = nullptr;
+		TEST_ASSERT_TRUE(update(flash, archive, 4096));
+		TEST_ASSERT_EQUAL(2, flash.erases);
+		assert_installed(flash, "spiffs1", images[1].data);
+		TEST_ASSERT_TRUE(flash.boot == flash.find("app1"));
+	}
+}
+
+static void test_delta_archive_against_another_base()
+{
+	std::vector<image_t> base = make_images(6);
+	std::vector<image_t> images = make_changed_images(base);
+	bytes_t archive = make_delta_archive(images, base, "--compress");
+
+	// the font (a delta) or the file system (the same) differs from the base,
+	// or nothing is installed
+	for(const char * label : { "font0", "spiffs0", "" })
+	{
+		ram_ota_flash_t flash("src/custom.csv");
+		if(*label)
+		{
+			install_base(flash, base);
+			flash.data[flash.find(label)->address + 9000] ^= 1;
+		}
+		TEST_ASSERT_FALSE_MESSAGE(update(flash, archive, 1460), label);
+		TEST_ASSERT_TRUE(flash.boot == nullptr);
+		TEST_ASSERT_EQUAL(0, flash.stray_writes);
+	}
+
+	// a sector map referring to a sector past the base
+	size_t font = PARTITION_HEADER;
+	TEST_ASSERT_TRUE(partition_flags(archive, font) == 2 || partition_flags(archive, font) == 3);
+	bytes_t plain_delta = make_delta_archive(images, base);
+	size_t map = font + SPI_FLASH_SEC_SIZE;
+	size_t sectors = padded(images[0].data).size() / SPI_FLASH_SEC_SIZE;
+	TEST_ASSERT_EQUAL(1, plain_delta[map + sectors - 1]); // grown past the base
+	plain_delta[map + sectors - 1] = 0;
+	ram_ota_flash_t flash("src/custom.csv");
+	install_base(flash, base);
+	TEST_ASSERT_FALSE(update(flash, plain_delta, 1460));
+	TEST_ASSERT_TRUE(flash.boot == nullptr);
+}
+
+//! feed a part of the archive to the updater
+static void feed(updater_t & updater, const bytes_t & archive, size_t from, size_t to, size_t chunk)
+{
+	for(size_t pos = from, one; pos < to; pos += one)
+	{
+		one = std::min(chunk, to - pos);
+		updater.write_data(archive.data() + pos, one);
+	}
+}
+
+static void test_resume_after_cut()
+{
+	std::vector<image_t> base = make_images(7);
+	std::vector<image_t> images = make_changed_images(base);
+	struct { const char * name; bytes_t archive; } archives[] = {
+		{ "plain", make_archive(images) },
+		{ "compressed", make_archive(images, "--compress") },
+		{ "delta", make_delta_archive(images, base, "--compress") },
+	};
+	static const char * const labels[] = { "font1", "spiffs1", "app1" };
+
+	for(auto && a : archives)
+	{
+		const bytes_t & archive = a.archive;
+
+		// the result of a clean install; whole partitions, beyond the images too
+		ram_ota_flash_t clean("src/custom.csv");
+		install_base(clean, base);
+		TEST_ASSERT_TRUE(update(clean, archive, 1460));
+
+		size_t font = PARTITION_HEADER;
+		size_t spiffs = next_partition_header(archive, font);
+		size_t app = next_partition_header(archive, spiffs);
+		size_t cuts[] = {
+			100, // in the archive header
+			SPI_FLASH_SEC_SIZE + 10, // in the first partition header
+			font + SPI_FLASH_SEC_SIZE * 21 + 100, // in the font, past a checkpoint if stored as is
+			spiffs, // at a partition boundary
+			spiffs + 300,
+			app + SPI_FLASH_SEC_SIZE * 3 + 1,
+			archive.size() - 1, // in the last sector
+		};
+		for(size_t cut : cuts)
+		{
+			char message[80];
+			snprintf(message, sizeof(message), "%s archive cut at %u", a.name, (unsigned)cut);
+
+			ram_ota_flash_t flash("src/custom.csv");
+			install_base(flash, base);
+			{
+				// the connection is gone in the middle of the upload
+				updater_t updater(flash);
+				updater.begin("archive-id");
+				feed(updater, archive, 0, cut, 1460);
+				updater.end();
+			}
+
+			// the client asks where to continue, and uploads the rest
+			updater_t updater(flash);
+			uint32_t offset = updater.get_resume_offset("archive-id");
+			TEST_ASSERT_TRUE_MESSAGE(offset <= cut && offset % SPI_FLASH_SEC_SIZE == 0, message);
+			TEST_ASSERT_EQUAL_MESSAGE(0, updater.get_resume_offset("another-id"), message);
+			if(!strcmp(a.name, "plain") && cut == cuts[2])
+			{
+				// continued in the middle of the partition, at the checkpoint
+				TEST_ASSERT_TRUE_MESSAGE(offset > font + SPI_FLASH_SEC_SIZE, message);
+			}
+			if(offset)
+			{
+				TEST_ASSERT_FALSE_MESSAGE(updater.resume("archive-id", offset + SPI_FLASH_SEC_SIZE), message);
+				TEST_ASSERT_TRUE_MESSAGE(updater.resume("archive-id", offset), message);
+			}
+			else
+			{
+				updater.begin("archive-id");
+			}
+			feed(updater, archive, offset, archive.size(), 1460);
+			TEST_ASSERT_TRUE_MESSAGE(updater.finish(), message);
+
+			for(const char * label : labels)
+			{
+				size_t size = flash.find(label)->size;
+				TEST_ASSERT_TRUE_MESSAGE(flash.content(label, size) == clean.content(label, size), message);
+			}
+			TEST_ASSERT_TRUE_MESSAGE(flash.boot == flash.find("app1"), message);
+			TEST_ASSERT_EQUAL_MESSAGE(0, flash.stray_writes, message);
+
+			// the client is told that the whole archive is there
+			TEST_ASSERT_EQUAL_MESSAGE(archive.size(), updater.get_resume_offset("archive-id"), message);
+		}
+	}
+}
+
+
+int main(int argc, char ** argv)
+{
+	loopTaskHandle = xTaskGetCurrentTaskHandle();
+	char dir[] = "/tmp/test_ota_XXXXXX";
+	if(!mkdtemp(dir)) return 1;
+	work_dir = dir;
+
+	UNITY_BEGIN();
+	RUN_TEST(test_compressed_archive);
+	RUN_TEST(test_archive_is_inflated_with_4k_window);
+	RUN_TEST(test_arbitrary_chunks);
+	RUN_TEST(test_corrupted_archives);
+	RUN_TEST(test_flash_failures);
+	RUN_TEST(test_throughput);
+	RUN_TEST(test_fuzz_headers);
+	RUN_TEST(test_delta_archive);
+	RUN_TEST(test_delta_archive_against_another_base);
+	RUN_TEST(test_resume_after_cut);
+	int res = UNITY_END();
+
+	system(("rm -rf " + work_dir).c_str());
+	return res;
+}
@@ -0,0 +1,196 @@
+#include <Arduino.h>
+#include <unity.h>
+#include <vector>
+#include "pendulum.cpp"
+
+// the clock is driven by the test, and the scheduler is checked every
+// millisecond as poll_pendulum() does
+static uint64_t now_ms;
+
+static void run_until(uint64_t ms)
+{
+	while(now_ms < ms)
+	{
+		++ now_ms;
+		native_set_millis(now_ms);
+		pendulum_scheduler.check();
+	}
+}
+
+struct event_t
+{
+	int id;
+	uint32_t tick;
+	bool operator == (const event_t & rhs) const { return id == rhs.id && tick == rhs.tick; }
+};
+
+static std::vector<event_t> events;
+
+static void record(int id) { events.push_back({ id, millis() }); }
+
+void setUp()
+{
+	now_ms = 1000;
+	native_set_millis(now_ms);
+	events.clear();
+}
+
+void tearDown() {}
+
+
+static void test_fires_in_tick_order()
+{
+	pendulum_t a([] { record(1); }, 30, true);
+	pendulum_t b([] { record(2); }, 10, true);
+	pendulum_t c([] { record(3); }, 20, true);
+	run_until(1100);
+
+	TEST_ASSERT_EQUAL(3, (int)events.size());
+	TEST_ASSERT_EQUAL(2, events[0].id);
+	TEST_ASSERT_EQUAL(1010, events[0].tick);
+	TEST_ASSERT_EQUAL(3, events[1].id);
+	TEST_ASSERT_EQUAL(1020, events[1].tick);
+	TEST_ASSERT_EQUAL(1, events[2].id);
+	TEST_ASSERT_EQUAL(1030, events[2].tick);
+	TEST_ASSERT_FALSE(a.is_pending());
+}
+
+static void test_periodic_keeps_phase()
+{
+	int count5 = 0, count7 = 0;
+	pendulum_t p5([&] { ++ count5; record(5); }, 5);
+	pendulum_t p7([&] { ++ count7; record(7); }, 7);
+	run_until(1035);
+
+	TEST_ASSERT_EQUAL(7, count5);
+	TEST_ASSERT_EQUAL(5, count7);
+	for(size_t i = 1; i < events.size(); ++i)
+		TEST_ASSERT_TRUE(events[i - 1].tick <= events[i].tick);
+	for(auto && e : events)
+		TEST_ASSERT_EQUAL(0, (e.tick - 1000) % e.id);
+
+	// a late poll skips the missed ticks, but keeps the phase
+	events.clear();
+	now_ms = 1052;
+	native_set_millis(now_ms);
+	pendulum_scheduler.check();
+	TEST_ASSERT_EQUAL(2, (int)events.size()); // one for each, not a burst
+	run_until(1055);
+	TEST_ASSERT_EQUAL(3, (int)events.size());
+	TEST_ASSERT_EQUAL(5, events[2].id);
+	TEST_ASSERT_EQUAL(1055, events[2].tick);
+}
+
+static void test_wraps_around()
+{
+	now_ms = 0xfffffff0ull;
+	native_set_millis(now_ms);
+	pendulum_t late([] { record(2); }, 40, true);
+	pendulum_t early([] { record(1); }, 10, true);
+	run_until(0x100000000ull + 100);
+
+	TEST_ASSERT_EQUAL(2, (int)events.size());
+	TEST_ASSERT_EQUAL(1, events[0].id);
+	TEST_ASSERT_EQUAL(0xfffffffa, events[0].tick);
+	TEST_ASSERT_EQUAL(2, events[1].id);
+	TEST_ASSERT_EQUAL(0x18, events[1].tick);
+}
+
+static void test_restarts_itself_from_handler()
+{
+	// a oneshot pendulum restarting itself with another interval
+	int count = 0;
+	pendulum_t * self = nullptr;
+	pendulum_t p([&] {
+		record(1);
+		if(++ count < 3)
+		{
+			self->set_interval(count * 10);
+			self->start();
+		}
+	}, 5, true);
+	self = &p;
+	run_until(1100);
+
+	TEST_ASSERT_EQUAL(3, (int)events.size());
+	TEST_ASSERT_EQUAL(1005, events[0].tick);
+	TEST_ASSERT_EQUAL(1015, events[1].tick);
+	TEST_ASSERT_EQUAL(1035, events[2].tick);
+	TEST_ASSERT_FALSE(p.is_pending());
+
+	// a periodic pendulum restarting itself is scheduled only once
+	events.clear();
+	pendulum_t * periodic = nullptr;
+	pendulum_t q([&] { record(2); periodic->start(); }, 10);
+	periodic = &q;
+	run_until(1150);
+	TEST_ASSERT_EQUAL(5, (int)events.size());
+	for(size_t i = 0; i < events.size(); ++i)
+		TEST_ASSERT_EQUAL(1110 + 10 * i, events[i].tick);
+}
+
+static void test_stops_while_firing()
+{
+	// a periodic pendulum stopping itself
+	pendulum_t * self = nullptr;
+	pendulum_t p([&] { record(1); self->stop(); }, 10);
+	self = &p;
+
+	// a pendulum stopping another one due at the same tick
+	pendulum_t * victim = nullptr;
+	pendulum_t stopper([&] { record(2); victim->stop(); }, 20, true);
+	pendulum_t v([] { record(3); }, 20, true);
+	victim = &v;
+
+	// a pendulum deleting another one
+	pendulum_t * doomed = new pendulum_t([] { record(5); }, 30, true);
+	pendulum_t killer([&] { record(4); delete doomed; doomed = nullptr; }, 25, true);
+
+	run_until(1100);
+
+	TEST_ASSERT_FALSE(p.is_pending());
+	TEST_ASSERT_NULL(doomed);
+	std::vector<event_t> expected;
+	expected.push_back({ 1, 1010 });
+	expected.push_back({ 2, 1020 });
+	expected.push_back({ 4, 1025 });
+	TEST_ASSERT_EQUAL((int)expected.size(), (int)events.size());
+	for(size_t i = 0; i < expected.size(); ++i)
+		TEST_ASSERT_TRUE(expected[i] == events[i]);
+}
+
+static void test_many_pendulums()
+{
+	// a pseudo random set; every pendulum fires at its own ticks, in order
+	std::vector<pendulum_t *> pendulums;
+	std::vector<int> counts(200);
+	std::vector<uint32_t> intervals(200);
+	srand(1);
+	for(int i = 0; i < 200; ++i)
+	{
+		intervals[i] = 1 + rand() % 97;
+		pendulums.push_back(new pendulum_t([i, &counts] { ++ counts[i]; record(i); }, intervals[i]));
+	}
+	// stop a half of them
+	for(int i = 0; i < 200; i += 2) pendulums[i]->stop();
+	run_until(2000);
+
+	for(int i = 0; i < 200; ++i)
+		TEST_ASSERT_EQUAL(i % 2 ? 1000 / intervals[i] : 0, counts[i]);
+	for(size_t i = 1; i < events.size(); ++i)
+		TEST_ASSERT_TRUE(events[i - 1].tick <= events[i].tick);
+	for(auto && p : pendulums) delete p;
+}
+
+
+int main(int argc, char ** argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_fires_in_tick_order);
+	RUN_TEST(test_periodic_keeps_phase);
+	RUN_TEST(test_wraps_around);
+	RUN_TEST(test_restarts_itself_from_handler);
+	RUN_TEST(test_stops_while_firing);
+	RUN_TEST(test_many_pendulums);
+	return UNITY_END();
+}
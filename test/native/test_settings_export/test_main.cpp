@@ -0,0 +1,323 @@
+#include <Arduino.h>
+#include <unity.h>
+#include <esp_partition.h>
+#include <map>
+#include <string>
+
+// the settings partition of custom.csv on an emulated flash. it has to
+// exist before settings.cpp constructs its store
+static struct conf_partition_t
+{
+	conf_partition_t()
+	{
+		esp_partition_t p = {};
+		p.type = ESP_PARTITION_TYPE_DATA;
+		p.subtype = ESP_PARTITION_SUBTYPE_DATA_SPIFFS;
+		p.address = 0;
+		p.size = 0x80000;
+		strcpy(p.label, "conf");
+		native_esp::partitions.reserve(4); // keep the pointers to them valid
+		native_esp::partitions.push_back(p);
+		native_esp::flash.assign(p.size, 0xff);
+	}
+} conf_partition;
+
+#include "pendulum.cpp"
+#include "threadsync.cpp"
+#include "settings.cpp"
+
+TaskHandle_t loopTaskHandle; // the main thread; the test runner's thread
+
+// the main file system; there is no old SPIFFS layout to migrate from
+fs::ANY_SPIFFSFS::ANY_SPIFFSFS() {}
+bool fs::ANY_SPIFFSFS::begin(bool formatOnFail, const char * label, const char * basePath, uint8_t maxOpenFiles) { return false; }
+bool fs::ANY_SPIFFSFS::format(const char * label) { return false; }
+fs::ANY_SPIFFSFS FS;
+
+
+/**
+ * a stream on memory, as an HTTP request or response is: it is read
+ * sequentially, and can not seek.
+ * */
+class memory_stream_t : public Stream
+{
+public:
+	std::vector<uint8_t> data;
+	size_t pos = 0;
+
+	size_t write(uint8_t c) override { data.push_back(c); return 1; }
+	size_t write(const uint8_t * buf, size_t size) override
+	{
+		data.insert(data.end(), buf, buf + size);
+		return size;
+	}
+	using Print::write;
+
+	int available() override { return data.size() - pos; }
+	int read() override { return pos < data.size() ? data[pos++] : -1; }
+	int peek() override { return pos < data.size() ? data[pos] : -1; }
+	size_t readBytes(char * buf, size_t size) override
+	{
+		size_t n = std::min(size, data.size() - pos);
+		if(n) memcpy(buf, data.data() + pos, n);
+		pos += n;
+		return n;
+	}
+};
+
+typedef std::map<std::string, std::string> values_t;
+
+static void write_values(const values_t & values)
+{
+	for(auto && v : values)
+		TEST_ASSERT_TRUE_MESSAGE(settings_write(v.first.c_str(), v.second.data(), v.second.size()),
+			v.first.c_str());
+}
+
+static void assert_values(const values_t & values)
+{
+	for(auto && v : values)
+	{
+		TEST_ASSERT_EQUAL_MESSAGE((int)v.second.size(), settings_get_size(v.first.c_str()), v.first.c_str());
+		std::string read(v.second.size(), '\0');
+		TEST_ASSERT_TRUE_MESSAGE(settings_read(v.first.c_str(), &read[0], read.size()), v.first.c_str());
+		TEST_ASSERT_TRUE_MESSAGE(read == v.second, v.first.c_str());
+	}
+}
+
+//! settings of various sizes; those over MAX_CACHED_VALUE_SIZE are read from the store
+static values_t make_values(int count)
+{
+	values_t values;
+	for(int i = 0; i < count; ++i)
+	{
+		size_t size = i % 10 == 0 ? 1500 + i : i % 10 == 1 ? 200 : i % 50;
+		std::string value(size, '\0');
+		for(size_t j = 0; j < size; ++j) value[j] = (char)(i * 7 + j);
+		values["key" + std::to_string(i)] = value;
+	}
+	return values;
+}
+
+//! make an archive as settings_export() does, with the given names
+static void make_archive(memory_stream_t & stream, const values_t & files)
+{
+	mtar_t tar;
+	TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_open_stream(&tar, &stream, "w"));
+	TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_write_dir_header(&tar, "mazo3_settings/"));
+	for(auto && f : files)
+	{
+		TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_write_file_header(&tar, f.first.c_str(), f.second.size()));
+		TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_write_data(&tar, f.second.data(), f.second.size()));
+	}
+	TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_finalize(&tar));
+	TEST_ASSERT_EQUAL(MTAR_ESUCCESS, mtar_close(&tar));
+}
+
+//! reboot: index the store again
+static void reboot()
+{
+	settings_flush();
+	init_settings();
+}
+
+
+void setUp()
+{
+	clear_settings();
+	init_settings();
+}
+
+void tearDown() {}
+
+
+static void test_export_import_round_trip()
+{
+	values_t values = make_values(200);
+	write_values(values);
+
+	memory_stream_t stream;
+	uint32_t start = micros();
+	TEST_ASSERT_TRUE(settings_export(stream, ""));
+	uint32_t export_us = micros() - start;
+	TEST_ASSERT_EQUAL(settings_get_export_size(""), stream.data.size());
+
+	clear_settings();
+	init_settings();
+	TEST_ASSERT_EQUAL(-1, settings_get_size("key0"));
+
+	start = micros();
+	TEST_ASSERT_TRUE(settings_import(stream));
+	uint32_t import_us = micros() - start;
+	assert_values(values);
+
+	reboot();
+	assert_values(values);
+
+	char message[120];
+	snprintf(message, sizeof(message), "%u bytes: export %u us, import %u us",
+		(unsigned)stream.data.size(), (unsigned)export_us, (unsigned)import_us);
+	TEST_MESSAGE(message);
+}
+
+static void test_export_excludes_prefix()
+{
+	write_values({ { "wifi_pass", "secret" }, { "wifi_name", "home" }, { "clock_mode", "1" } });
+
+	memory_stream_t stream;
+	TEST_ASSERT_TRUE(settings_export(stream, "wifi_"));
+	TEST_ASSERT_EQUAL(settings_get_export_size("wifi_"), stream.data.size());
+	TEST_ASSERT_EQUAL(512 + 512 + 1024, stream.data.size()); // header, content and the end
+
+	clear_settings();
+	init_settings();
+	TEST_ASSERT_TRUE(settings_import(stream));
+	assert_values({ { "clock_mode", "1" } });
+	TEST_ASSERT_EQUAL(-1, settings_get_size("wifi_pass"));
+}
+
+static void test_import_skips_invalid_entries()
+{
+	std::string too_long(MAX_KEY_LEN + 1, 'k');
+	memory_stream_t stream;
+	make_archive(stream, {
+		{ "mazo3_settings/good", "1" },
+		{ "mazo3_settings/.hidden", "2" },
+		{ "mazo3_settings/" + too_long, "3" },
+		{ "mazo3_settings/large", std::string(settings_store_t::MAX_VALUE_SIZE + 1, 'x') },
+		{ "mazo3_settings/last", "4" },
+	});
+
+	TEST_ASSERT_TRUE(settings_import(stream));
+	assert_values({ { "good", "1" }, { "last", "4" } });
+	TEST_ASSERT_EQUAL(-1, settings_get_size(".hidden"));
+	TEST_ASSERT_EQUAL(-1, settings_get_size(too_long.c_str()));
+	TEST_ASSERT_EQUAL(-1, settings_get_size("large"));
+}
+
+static void test_pending_writes_survive_import()
+{
+	write_values({ { "written", "1" } });
+	settings_flush();
+	write_values({ { "pending", "2" } }); // not yet flushed
+
+	memory_stream_t stream;
+	make_archive(stream, { { "mazo3_settings/imported", "3" } });
+	TEST_ASSERT_TRUE(settings_import(stream));
+	TEST_ASSERT_TRUE(is_flushed());
+
+	reboot();
+	assert_values({ { "written", "1" }, { "pending", "2" }, { "imported", "3" } });
+}
+
+static void test_import_of_broken_archive()
+{
+	write_values({ { "kept", "1" } });
+
+	memory_stream_t stream;
+	make_archive(stream, { { "mazo3_settings/a", "2" } });
+	stream.data[100] ^= 1; // break the header checksum
+	TEST_ASSERT_FALSE(settings_import(stream));
+
+	memory_stream_t empty;
+	TEST_ASSERT_FALSE(settings_import(empty));
+
+	reboot();
+	assert_values({ { "kept", "1" } });
+	TEST_ASSERT_EQUAL(-1, settings_get_size("a"));
+}
+
+static void test_import_in_pieces()
+{
+	values_t values = make_values(60);
+	write_values(values);
+	memory_stream_t stream;
+	TEST_ASSERT_TRUE(settings_export(stream, ""));
+
+	// uploads arrive in pieces of any size, not aligned to the records
+	static const size_t sizes[] = { 1, 7, 511, 512, 513, 1460, 4096 };
+	for(size_t piece : sizes)
+	{
+		clear_settings();
+		init_settings();
+		settings_importer_t importer;
+		for(size_t pos = 0; pos < stream.data.size(); pos += piece)
+			TEST_ASSERT_TRUE(importer.write(stream.data.data() + pos,
+				std::min(piece, stream.data.size() - pos)));
+		TEST_ASSERT_TRUE(importer.end());
+		assert_values(values);
+	}
+}
+
+static void test_import_of_truncated_archive()
+{
+	memory_stream_t stream;
+	make_archive(stream, { { "mazo3_settings/a", "1" }, { "mazo3_settings/b", std::string(1000, 'b') } });
+
+	// cut in the middle of the value of b; a is complete
+	settings_importer_t importer;
+	TEST_ASSERT_TRUE(importer.write(stream.data.data(), 512 * 4 + 100));
+	TEST_ASSERT_FALSE(importer.end());
+
+	reboot();
+	assert_values({ { "a", "1" } });
+	TEST_ASSERT_EQUAL(-1, settings_get_size("b"));
+}
+
+static memory_stream_t thread_stream;
+static std::atomic<bool> thread_done;
+static bool thread_ok;
+
+static void export_task(void *)
+{
+	thread_ok = settings_export(thread_stream, "");
+	thread_done = true;
+	vTaskDelete(nullptr);
+}
+
+static void test_export_from_another_thread()
+{
+	values_t values = make_values(50);
+	write_values(values);
+	settings_flush();
+
+	// the web server exports from its own task; the main thread keeps
+	// polling its queue meanwhile, and may change the settings
+	thread_stream = memory_stream_t();
+	thread_done = false;
+	xTaskCreate(export_task, "export", 8192, nullptr, 1, nullptr);
+	vTaskDelay(20);
+	poll_main_thread_queue(); // takes the keys, if the task has asked already
+	TEST_ASSERT_TRUE(settings_remove("key9")); // the last one in the archive
+	values.erase("key9");
+	uint32_t start = millis();
+	while(!thread_done)
+	{
+		TEST_ASSERT_TRUE(millis() - start < 5000);
+		poll_main_thread_queue();
+		vTaskDelay(1);
+	}
+	TEST_ASSERT_TRUE(thread_ok);
+
+	clear_settings();
+	init_settings();
+	TEST_ASSERT_TRUE(settings_import(thread_stream));
+	assert_values(values);
+	TEST_ASSERT_EQUAL(-1, settings_get_size("key9"));
+}
+
+
+int main(int argc, char ** argv)
+{
+	loopTaskHandle = xTaskGetCurrentTaskHandle();
+	UNITY_BEGIN();
+	RUN_TEST(test_export_import_round_trip);
+	RUN_TEST(test_export_excludes_prefix);
+	RUN_TEST(test_import_skips_invalid_entries);
+	RUN_TEST(test_pending_writes_survive_import);
+	RUN_TEST(test_import_of_broken_archive);
+	RUN_TEST(test_import_in_pieces);
+	RUN_TEST(test_import_of_truncated_archive);
+	RUN_TEST(test_export_from_another_thread);
+	return UNITY_END();
+}
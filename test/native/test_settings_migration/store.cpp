@@ -0,0 +1,3 @@
+// built apart from test_main.cpp; its constants share names with those of
+// settings.cpp
+#include "settings_store.cpp"
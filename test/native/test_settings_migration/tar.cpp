@@ -0,0 +1,2 @@
+// built apart from test_main.cpp, as on the device
+#include "microtar.cpp"
@@ -0,0 +1,182 @@
+#include <Arduino.h>
+#include <unity.h>
+#include <esp_partition.h>
+#include <map>
+#include <string>
+
+// the settings partition of custom.csv on an emulated flash. it has to
+// exist before settings.cpp constructs its store
+static struct conf_partition_t
+{
+	conf_partition_t()
+	{
+		esp_partition_t p = {};
+		p.type = ESP_PARTITION_TYPE_DATA;
+		p.subtype = ESP_PARTITION_SUBTYPE_DATA_SPIFFS;
+		p.address = 0;
+		p.size = 0x80000;
+		strcpy(p.label, "conf");
+		native_esp::partitions.reserve(4); // keep the pointers to them valid
+		native_esp::partitions.push_back(p);
+		native_esp::flash.assign(p.size, 0xff);
+	}
+} conf_partition;
+
+#include "pendulum.cpp"
+#include "threadsync.cpp"
+#include "settings.cpp"
+
+TaskHandle_t loopTaskHandle; // the main thread; the test runner's thread
+
+typedef std::map<std::string, std::string> values_t;
+
+/**
+ * files of the old SPIFFS layout in the settings partition. the layout
+ * is there while the partition starts with SPIFFS_MARK, so formatting
+ * the store erases it, as it does on the device.
+ * */
+static values_t old_layout;
+static const char SPIFFS_MARK[] = "SPIFFS";
+
+fs::ANY_SPIFFSFS::ANY_SPIFFSFS() {}
+bool fs::ANY_SPIFFSFS::begin(bool formatOnFail, const char * label, const char * basePath, uint8_t maxOpenFiles)
+{
+	if(!label || strcmp(label, "conf") ||
+		memcmp(native_esp::flash.data(), SPIFFS_MARK, sizeof(SPIFFS_MARK))) return false;
+	files.clear();
+	for(auto && f : old_layout)
+		files[f.first] = std::make_shared<std::vector<uint8_t>>(f.second.begin(), f.second.end());
+	return true;
+}
+bool fs::ANY_SPIFFSFS::format(const char * label) { return false; }
+fs::ANY_SPIFFSFS FS; // the main file system
+
+
+//! a setting file of the old layout; the checksum is at its head
+static std::string crc_file(const std::string & value)
+{
+	uint32_t crc = crc32_le(INITIAL_CRC_VALUE, reinterpret_cast<const uint8_t *>(value.data()), value.size());
+	return std::string(reinterpret_cast<const char *>(&crc), sizeof(crc)) + value;
+}
+
+//! put the old layout into a blank settings partition
+static void make_old_layout()
+{
+	native_esp::flash.assign(native_esp::flash.size(), 0xff);
+	memcpy(native_esp::flash.data(), SPIFFS_MARK, sizeof(SPIFFS_MARK));
+	old_layout = {
+		{ "/clock_mode", crc_file("1") },
+		{ "/wifi_ap_name", crc_file("home") },
+		{ "/ui_marquee", crc_file(std::string(300, 'm')) },
+		{ "/broken", crc_file("x").replace(0, 1, "?") },
+		{ "/rmt/power", std::string("\x01\x02\x03", 3) },
+	};
+}
+
+//! the settings migrated from make_old_layout()
+static const values_t migrated = {
+	{ "clock_mode", "1" },
+	{ "wifi_ap_name", "home" },
+	{ "ui_marquee", std::string(300, 'm') },
+	{ "rmt/power", std::string("\x01\x02\x03", 3) },
+};
+
+static void assert_values(const values_t & values)
+{
+	for(auto && v : values)
+	{
+		TEST_ASSERT_EQUAL_MESSAGE((int)v.second.size(), settings_get_size(v.first.c_str()), v.first.c_str());
+		std::string read(v.second.size(), '\0');
+		TEST_ASSERT_TRUE_MESSAGE(settings_read(v.first.c_str(), &read[0], read.size()), v.first.c_str());
+		TEST_ASSERT_TRUE_MESSAGE(read == v.second, v.first.c_str());
+	}
+	TEST_ASSERT_EQUAL(-1, settings_get_size("broken"));
+}
+
+
+void setUp()
+{
+	native_esp::restore();
+	FS.files.clear();
+	make_old_layout();
+}
+
+void tearDown() {}
+
+
+static void test_migration_from_spiffs()
+{
+	init_settings();
+	assert_values(migrated);
+	TEST_ASSERT_FALSE(FS.exists(MIGRATION_STASH_NAME));
+	TEST_ASSERT_FALSE(FS.exists(MIGRATION_STASH_TEMP_NAME));
+
+	// the old layout is gone; the settings are in the store
+	init_settings();
+	assert_values(migrated);
+	TEST_ASSERT_TRUE(memcmp(native_esp::flash.data(), SPIFFS_MARK, sizeof(SPIFFS_MARK)) != 0);
+}
+
+static void test_power_cut_during_migration()
+{
+	// cut the power at every few bytes written to the partition, until
+	// the migration completes. no setting is lost at any point.
+	bool completed = false;
+	int cuts = 0;
+	for(long cut = 0; !completed; cut += 5)
+	{
+		setUp();
+		native_esp::budget = cut;
+		init_settings();
+		completed = !native_esp::cut;
+		if(!completed) ++ cuts;
+		native_esp::restore();
+
+		// boot again
+		init_settings();
+		assert_values(migrated);
+		TEST_ASSERT_FALSE(FS.exists(MIGRATION_STASH_NAME));
+		init_settings();
+		assert_values(migrated);
+	}
+	TEST_ASSERT_TRUE(cuts > 10);
+}
+
+static void test_stash_is_taken_over()
+{
+	// a stash left by a migration cut short, after the old layout was erased
+	init_settings();
+	values_t values = migrated;
+	values["clock_mode"] = "2";
+	TEST_ASSERT_TRUE(settings_write("clock_mode", "2", 1));
+	TEST_ASSERT_TRUE(settings_export(MIGRATION_STASH_NAME, String()));
+	native_esp::flash.assign(native_esp::flash.size(), 0xff);
+
+	init_settings();
+	assert_values(values);
+	TEST_ASSERT_FALSE(FS.exists(MIGRATION_STASH_NAME));
+}
+
+static void test_clear_settings_drops_stash()
+{
+	init_settings();
+	TEST_ASSERT_TRUE(settings_export(MIGRATION_STASH_NAME, String()));
+	clear_settings();
+	TEST_ASSERT_FALSE(FS.exists(MIGRATION_STASH_NAME));
+
+	old_layout.clear();
+	init_settings();
+	TEST_ASSERT_EQUAL(-1, settings_get_size("clock_mode"));
+}
+
+
+int main(int argc, char ** argv)
+{
+	loopTaskHandle = xTaskGetCurrentTaskHandle();
+	UNITY_BEGIN();
+	RUN_TEST(test_migration_from_spiffs);
+	RUN_TEST(test_power_cut_during_migration);
+	RUN_TEST(test_stash_is_taken_over);
+	RUN_TEST(test_clear_settings_drops_stash);
+	return UNITY_END();
+}
@@ -0,0 +1,282 @@
+#include <Arduino.h>
+#include <unity.h>
+#include <map>
+#include <string>
+#include "settings_store.cpp"
+
+/**
+ * NOR flash in RAM. writing only clears bits, as the real flash does.
+ * the power can be cut after a given number of written bytes; the write
+ * in progress then stops halfway, and every access fails until restore().
+ * */
+class ram_flash_t : public settings_flash_t
+{
+public:
+	std::vector<uint8_t> data;
+	long budget = -1; //!< bytes to write before the power is cut; -1 = unlimited
+	bool cut = false; //!< whether the power is cut
+
+	ram_flash_t(uint32_t size) : data(size, 0xff) {}
+
+	uint32_t size() const override { return data.size(); }
+
+	bool read(uint32_t offset, void * buf, size_t size) override
+	{
+		if(cut || offset + size > data.size()) return false;
+		memcpy(buf, data.data() + offset, size);
+		return true;
+	}
+
+	bool write(uint32_t offset, const void * buf, size_t size) override
+	{
+		if(cut || offset + size > data.size()) return false;
+		const uint8_t * s = static_cast<const uint8_t *>(buf);
+		for(size_t i = 0; i < size; ++i)
+		{
+			if(budget == 0) { cut = true; return false; }
+			if(budget > 0) -- budget;
+			data[offset + i] &= s[i];
+		}
+		return true;
+	}
+
+	bool erase(uint32_t offset, uint32_t size) override
+	{
+		if(cut || offset % sector_size() || size % sector_size() || offset + size > data.size())
+			return false;
+		memset(data.data() + offset, 0xff, size);
+		return true;
+	}
+
+	//! the power is back; the content stays as it was at the cut
+	void restore() { cut = false; budget = -1; }
+};
+
+typedef std::map<std::string, std::string> values_t;
+
+//! value offsets found by replay, to compact from the flash
+static std::map<std::string, uint32_t> offsets;
+
+//! mount the store and return the live values
+static values_t mount(settings_store_t & store)
+{
+	values_t values;
+	offsets.clear();
+	TEST_ASSERT_TRUE(store.mount([&values] (const String & key, const uint8_t * value,
+		size_t size, uint32_t offset) {
+			if(!value) { values.erase(key.c_str()); offsets.erase(key.c_str()); return; }
+			values[key.c_str()] = std::string(reinterpret_cast<const char *>(value), size);
+			offsets[key.c_str()] = offset;
+		}));
+	return values;
+}
+
+static uint32_t append(settings_store_t & store, const std::string & key, const std::string & value)
+{
+	return store.append(String(key.c_str()), value.data(), value.size());
+}
+
+/**
+ * compact the store with the values. every other value is copied from
+ * its current place in the flash instead of RAM, as the settings cache
+ * does for large values.
+ * */
+static bool compact(settings_store_t & store, const values_t & values)
+{
+	std::vector<String> keys;
+	for(auto && v : values) keys.push_back(String(v.first.c_str()));
+	std::vector<settings_store_t::live_t> entries;
+	size_t i = 0;
+	for(auto && v : values)
+	{
+		settings_store_t::live_t e;
+		e.key = &keys[i];
+		bool from_flash = (i & 1) && offsets.count(v.first);
+		e.value = from_flash ? nullptr : reinterpret_cast<const uint8_t *>(v.second.data());
+		e.offset = from_flash ? offsets[v.first] : 0;
+		e.size = v.second.size();
+		e.new_offset = 0;
+		entries.push_back(e);
+		++ i;
+	}
+	return store.compact(entries);
+}
+
+static void assert_values(const values_t & expected, const values_t & actual)
+{
+	TEST_ASSERT_EQUAL(expected.size(), actual.size());
+	for(auto && v : expected)
+	{
+		auto it = actual.find(v.first);
+		TEST_ASSERT_TRUE_MESSAGE(it != actual.end(), v.first.c_str());
+		TEST_ASSERT_TRUE_MESSAGE(it->second == v.second, v.first.c_str());
+	}
+}
+
+void setUp() {}
+void tearDown() {}
+
+
+static void test_append_and_replay()
+{
+	ram_flash_t flash(4 * 4096);
+	{
+		settings_store_t store(flash);
+		TEST_ASSERT_FALSE(store.mount([] (const String &, const uint8_t *, size_t, uint32_t) {}));
+		TEST_ASSERT_TRUE(store.format());
+		TEST_ASSERT_TRUE(append(store, "a", "1"));
+		TEST_ASSERT_TRUE(append(store, "b", "2"));
+		TEST_ASSERT_TRUE(append(store, "a", "3"));
+		TEST_ASSERT_TRUE(append(store, "empty", ""));
+		TEST_ASSERT_TRUE(store.append_removal("b"));
+	}
+
+	// as after a reboot
+	settings_store_t store(flash);
+	values_t values = mount(store);
+	assert_values({ { "a", "3" }, { "empty", "" } }, values);
+	TEST_ASSERT_FALSE(store.needs_compaction());
+
+	// a value is read back with its CRC checked
+	std::string read;
+	TEST_ASSERT_TRUE(store.read_value("a", offsets["a"], 1,
+		[&read] (const uint8_t * data, size_t size) { read.append((const char *)data, size); }));
+	TEST_ASSERT_TRUE(read == "3");
+	TEST_ASSERT_FALSE(store.read_value("b", offsets["a"], 1, [] (const uint8_t *, size_t) {}));
+}
+
+static void test_torn_record_is_dropped()
+{
+	ram_flash_t flash(4 * 4096);
+	{
+		settings_store_t store(flash);
+		TEST_ASSERT_TRUE(store.format());
+		TEST_ASSERT_TRUE(append(store, "a", "1"));
+		TEST_ASSERT_TRUE(append(store, "b", "2"));
+	}
+	std::vector<uint8_t> before = flash.data;
+
+	// 16 bytes of the header, the key and the value; no padding, so
+	// every cut leaves the record incomplete
+	const uint32_t record = 16 + 1 + 3;
+	for(long cut = 0; cut < (long)record; ++cut)
+	{
+		flash.data = before;
+		{
+			settings_store_t store(flash);
+			mount(store);
+			flash.budget = cut;
+			TEST_ASSERT_EQUAL(0, append(store, "c", "333"));
+			flash.restore();
+		}
+
+		// the torn record is dropped on replay, and asks for compaction
+		settings_store_t store(flash);
+		values_t values = mount(store);
+		assert_values({ { "a", "1" }, { "b", "2" } }, values);
+		TEST_ASSERT_EQUAL(cut != 0, store.needs_compaction());
+		if(!store.needs_compaction()) continue;
+
+		// nothing is appended after a broken record until compacted
+		TEST_ASSERT_EQUAL(0, append(store, "c", "333"));
+		TEST_ASSERT_TRUE(compact(store, values));
+		TEST_ASSERT_FALSE(store.needs_compaction());
+		TEST_ASSERT_TRUE(append(store, "c", "333"));
+
+		settings_store_t again(flash);
+		assert_values({ { "a", "1" }, { "b", "2" }, { "c", "333" } }, mount(again));
+		TEST_ASSERT_FALSE(again.needs_compaction());
+		TEST_ASSERT_EQUAL(2, again.get_generation());
+	}
+}
+
+static void test_compaction_when_full()
+{
+	ram_flash_t flash(2 * 4096); // a sector in each half
+	settings_store_t store(flash);
+	TEST_ASSERT_TRUE(store.format());
+
+	values_t values;
+	offsets.clear();
+	for(int round = 0; round < 3; ++round)
+	{
+		// fill the active half
+		int i = 0;
+		for(;;)
+		{
+			std::string key = "key" + std::to_string(i % 8);
+			std::string value(100 + i % 5, 'a' + (i + round) % 26);
+			uint32_t offset = append(store, key, value);
+			if(!offset) break;
+			values[key] = value;
+			offsets[key] = offset;
+			++ i;
+		}
+		TEST_ASSERT_TRUE(i > 8);
+		uint32_t used = store.get_used();
+
+		TEST_ASSERT_TRUE(compact(store, values));
+		TEST_ASSERT_EQUAL(2 + round, store.get_generation());
+		TEST_ASSERT_TRUE(store.get_used() < used);
+
+		settings_store_t again(flash);
+		assert_values(values, mount(again));
+		TEST_ASSERT_EQUAL(2 + round, again.get_generation());
+		TEST_ASSERT_EQUAL(store.get_used(), again.get_used());
+		mount(store); // take the offsets in the new half
+	}
+}
+
+static void test_power_cut_during_compaction()
+{
+	ram_flash_t flash(2 * 4096);
+	values_t values;
+	{
+		settings_store_t store(flash);
+		TEST_ASSERT_TRUE(store.format());
+		for(int i = 0; i < 20; ++i)
+		{
+			std::string key = "k" + std::to_string(i % 6);
+			std::string value(50, 'a' + i);
+			TEST_ASSERT_TRUE(append(store, key, value));
+			values[key] = value;
+		}
+	}
+	std::vector<uint8_t> before = flash.data;
+
+	// cut the power at every few bytes of the compaction, until it completes
+	bool completed = false;
+	for(long cut = 0; !completed; cut += 7)
+	{
+		flash.data = before;
+		{
+			settings_store_t store(flash);
+			mount(store);
+			flash.budget = cut;
+			completed = compact(store, values);
+			flash.restore();
+		}
+
+		// either half is valid, and holds the same settings
+		settings_store_t store(flash);
+		assert_values(values, mount(store));
+		TEST_ASSERT_FALSE(store.needs_compaction());
+		TEST_ASSERT_EQUAL(completed ? 2 : 1, store.get_generation());
+
+		// compacting again works
+		TEST_ASSERT_TRUE(compact(store, values));
+		settings_store_t again(flash);
+		assert_values(values, mount(again));
+	}
+}
+
+
+int main(int argc, char ** argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_append_and_replay);
+	RUN_TEST(test_torn_record_is_dropped);
+	RUN_TEST(test_compaction_when_full);
+	RUN_TEST(test_power_cut_during_compaction);
+	return UNITY_END();
+}
@@ -0,0 +1,174 @@
+#include <Arduino.h>
+#include <unity.h>
+#include "threadsync.cpp"
+
+TaskHandle_t loopTaskHandle; // the main thread; the test runner's thread
+
+void setUp()
+{
+	loopTaskHandle = xTaskGetCurrentTaskHandle();
+}
+
+void tearDown()
+{
+	poll_main_thread_queue(); // leave nothing queued
+}
+
+//! poll the queue on the main thread until the predicate holds
+template <typename P>
+static bool poll_until(P pred, uint32_t timeout_ms = 5000)
+{
+	uint32_t start = millis();
+	while(!pred())
+	{
+		if(millis() - start > timeout_ms) return false;
+		poll_main_thread_queue();
+		vTaskDelay(1);
+	}
+	return true;
+}
+
+
+static std::atomic<int> finished_tasks;
+static int main_thread_counter;
+
+static void caller_task(void * arg)
+{
+	int * result = static_cast<int *>(arg);
+	*result = run_in_main_thread([] () -> int {
+		return ++ main_thread_counter; // only the main thread touches this
+	});
+	++ finished_tasks;
+	vTaskDelete(nullptr);
+}
+
+static void test_short_lived_callers_do_not_leak()
+{
+	finished_tasks = 0;
+	main_thread_counter = 0;
+	static int results[200];
+
+	int queues = native_freertos::live_queues;
+
+	// many tasks which come and go, at most 4 at a time; they need
+	// no more semaphores than that
+	for(int round = 0; round < 50; ++round)
+	{
+		for(int i = 0; i < 4; ++i)
+			xTaskCreate(caller_task, "caller", 4096, &results[round * 4 + i], 1, nullptr);
+		int expected = 4 + round * 4;
+		TEST_ASSERT_TRUE(poll_until([expected] { return finished_tasks == expected; }));
+	}
+
+	TEST_ASSERT_EQUAL(200, main_thread_counter);
+	TEST_ASSERT_TRUE(native_freertos::live_queues - queues <= 4);
+
+	// every call got its own result
+	bool seen[201] = {};
+	for(int r : results)
+	{
+		TEST_ASSERT_TRUE(r >= 1 && r <= 200);
+		TEST_ASSERT_FALSE(seen[r]);
+		seen[r] = true;
+	}
+}
+
+static void test_more_callers_than_semaphores()
+{
+	finished_tasks = 0;
+	main_thread_counter = 0;
+	static int results[SEMAPHORE_POOL_SIZE * 2];
+	int n = SEMAPHORE_POOL_SIZE * 2;
+	for(int i = 0; i < n; ++i) xTaskCreate(caller_task, "caller", 4096, &results[i], 1, nullptr);
+	TEST_ASSERT_TRUE(poll_until([n] { return finished_tasks == n; }));
+	TEST_ASSERT_EQUAL(n, main_thread_counter);
+}
+
+static void test_main_thread_async_on_full_queue()
+{
+	// only the main thread drains the queue; queuing from the main
+	// thread more than the queue can hold must not block forever
+	int count = 0;
+	for(uint32_t i = 0; i < call_queue_t::CAPACITY * 3; ++i)
+		run_in_main_thread_async([&count] { ++ count; });
+	poll_main_thread_queue();
+	poll_main_thread_queue();
+	poll_main_thread_queue();
+	TEST_ASSERT_EQUAL(call_queue_t::CAPACITY * 3, count);
+}
+
+//! a handler counting its live instances and its calls
+struct counted_handler_t
+{
+	static int live;
+	static int calls;
+	int id;
+
+	explicit counted_handler_t(int _id) : id(_id) { ++ live; }
+	counted_handler_t(const counted_handler_t & rhs) : id(rhs.id) { ++ live; }
+	counted_handler_t(counted_handler_t && rhs) : id(rhs.id) { ++ live; }
+	~counted_handler_t() { -- live; }
+	void operator ()() { ++ calls; }
+};
+
+int counted_handler_t::live;
+int counted_handler_t::calls;
+
+static void test_handler_queuing_on_full_queue()
+{
+	// a handler which fills the queue polls it from inside itself;
+	// every handler must run and be destroyed exactly once
+	counted_handler_t::live = 0;
+	counted_handler_t::calls = 0;
+	int outer = 0;
+	run_in_main_thread_async([&outer] {
+		++ outer;
+		for(uint32_t i = 0; i < call_queue_t::CAPACITY * 2; ++i)
+			run_in_main_thread_async(counted_handler_t(i));
+	});
+	for(uint32_t i = 0; i < call_queue_t::CAPACITY - 1; ++i)
+		run_in_main_thread_async(counted_handler_t(i));
+	TEST_ASSERT_TRUE(poll_until([] {
+		return counted_handler_t::calls == (int)call_queue_t::CAPACITY * 3 - 1; }));
+	poll_main_thread_queue();
+
+	TEST_ASSERT_EQUAL(1, outer);
+	TEST_ASSERT_EQUAL(call_queue_t::CAPACITY * 3 - 1, counted_handler_t::calls);
+	TEST_ASSERT_EQUAL(0, counted_handler_t::live);
+}
+
+static void test_handler_waiting_for_futures()
+{
+	// a handler waiting for futures runs the rest of the queue itself
+	counted_handler_t::live = 0;
+	counted_handler_t::calls = 0;
+	int outer = 0, sum = 0;
+	run_in_main_thread_async([&outer, &sum] {
+		++ outer;
+		main_thread_future_t futures[4];
+		for(int i = 0; i < 4; ++i)
+			futures[i] = post_to_main_thread([i] { return i + 1; });
+		wait_main_thread_futures(futures, 4);
+		for(auto && f : futures) sum += f.get();
+	});
+	for(int i = 0; i < 8; ++i) run_in_main_thread_async(counted_handler_t(i));
+	poll_main_thread_queue();
+	poll_main_thread_queue();
+
+	TEST_ASSERT_EQUAL(1, outer);
+	TEST_ASSERT_EQUAL(10, sum);
+	TEST_ASSERT_EQUAL(8, counted_handler_t::calls);
+	TEST_ASSERT_EQUAL(0, counted_handler_t::live);
+}
+
+
+int main(int argc, char ** argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_short_lived_callers_do_not_leak);
+	RUN_TEST(test_more_callers_than_semaphores);
+	RUN_TEST(test_main_thread_async_on_full_queue);
+	RUN_TEST(test_handler_queuing_on_full_queue);
+	RUN_TEST(test_handler_waiting_for_futures);
+	return UNITY_END();
+}
@@ -0,0 +1,3 @@
+// built apart from test_main.cpp; its _b literal operator clashes with
+// that of font_5x5.cpp
+#include "fonts/font_4x5.cpp"
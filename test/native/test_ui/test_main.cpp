@@ -0,0 +1,358 @@
+#include <Arduino.h>
+#include <unity.h>
+#include <functional>
+#include <map>
+#include <set>
+#include <vector>
+#include <time.h>
+
+// the wall clock shown by the clock screen
+static time_t wall_clock;
+static time_t native_time(time_t * t) { if(t) *t = wall_clock; return wall_clock; }
+#define time(t) native_time(t)
+
+// the UI runs on the manual clock, while draw times are taken from the real one
+static uint32_t native_real_micros()
+{
+	return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - native_clock::origin).count();
+}
+
+#include "pendulum.cpp"
+#include "frame_buffer.cpp"
+#include "fonts/font_5x5.cpp"
+#include "fonts/font_aa.cpp"
+#define micros() native_real_micros()
+#include "ui.cpp"
+#undef micros
+
+#undef time
+
+// Screens are rendered through the screen manager as on the device, and
+// the displayed frame is compared with the golden image of the screen:
+// test/native/test_ui/golden/<get_name()>.pgm. Set UPDATE_GOLDEN=1 to
+// write the images instead, then review and commit them. The images were
+// made with ui.cpp as it was before the offscreen layer of screens, so
+// compositing is checked against the output of direct drawing.
+static const char GOLDEN_DIR[] = "test/native/test_ui/golden/";
+
+
+// stand-ins of the modules the UI talks to
+
+static uint32_t pushed_buttons;
+uint8_t buttons[MAX_BUTTONS];
+void button_update() {}
+uint32_t button_get() { uint32_t b = pushed_buttons; pushed_buttons = 0; return b; }
+void button_push(uint32_t button) { pushed_buttons |= button; }
+uint32_t button_get_scan_bits() { return 0; }
+void button_check_physical_buttons_are_sane() {}
+
+static std::map<std::string, String> settings;
+bool settings_write(const String & key, const String & value, settings_overwrite_t overwrite)
+{
+	if(!overwrite.overwrite && settings.count(key.c_str())) return false;
+	settings[key.c_str()] = value;
+	return true;
+}
+bool settings_read(const String & key, String & value)
+{
+	auto it = settings.find(key.c_str());
+	if(it == settings.end()) return false;
+	value = it->second;
+	return true;
+}
+
+static String ap_name = "home";
+static String ap_pass = "secret";
+ip_addr_settings_t::ip_addr_settings_t() {}
+const String & wifi_get_ap_name() { return ap_name; }
+const String & wifi_get_ap_pass() { return ap_pass; }
+ip_addr_settings_t wifi_get_ip_addr_settings(bool use_current_config)
+{
+	ip_addr_settings_t s;
+	s.ip_addr = "192.168.1.10";
+	s.ip_gateway = "192.168.1.1";
+	s.ip_mask = "255.255.255.0";
+	s.dns1 = "192.168.1.1";
+	s.dns2 = "8.8.8.8";
+	return s;
+}
+void wifi_set_ap_info(const String & _ap_name, const String & _ap_pass) { ap_name = _ap_name; ap_pass = _ap_pass; }
+void wifi_manual_ip_info(const ip_addr_settings_t & ip) {}
+String wifi_get_connection_info_string() { return "Connected"; }
+void wifi_wps() {}
+
+bme280_result_t bme280_result = { 235, 1013, 45 };
+void sensors_set_contrast_always_max(bool b) {}
+void sensors_change_current_contrast(int amount) {}
+
+bool remote_fb_active() { return false; }
+void remote_fb_dismiss() {}
+bool remote_fb_pull(frame_buffer_t & fb, frame_buffer_t & current) { return false; }
+
+bool bad_apple() { return false; }
+
+// the TrueType font needs the font partition; it is never available here
+ft_font_t::ft_font_t() : face(nullptr), map_handle(0), cache(nullptr), load_failed(true),
+	load_count(0), unload_count(0), last_load_us(0), last_load_heap(0),
+	load_start_us(0), first_glyph_us(0) {}
+ft_font_t::~ft_font_t() {}
+bool ft_font_t::begin() const { return false; }
+void ft_font_t::unload() {}
+font_base_t::metrics_t ft_font_t::get_metrics(int32_t chr) const { return { 0, 0, false }; }
+void ft_font_t::put(int32_t chr, int level, int x, int y, frame_buffer_t & fb) const {}
+ft_font_t font_ft;
+
+
+// driving the UI
+
+static uint64_t now_ms = 1000;
+
+//! advance the clock by the milliseconds, running the scheduler and the UI every millisecond
+static void run_ms(uint32_t ms)
+{
+	while(ms--)
+	{
+		native_set_millis(++ now_ms);
+		pendulum_scheduler.check();
+		ui_process();
+	}
+}
+
+//! run until the next frame is shown. the blink intensity is reset first,
+//! so cursors are drawn at full level
+static void run_until_shown()
+{
+	screen_manager.reset_blink_intensity();
+	frame_buffer_t * shown = current_frame_buffer;
+	for(int i = 0; i < 200 && shown == current_frame_buffer; ++i) run_ms(1);
+	TEST_ASSERT_TRUE_MESSAGE(shown != current_frame_buffer, "no frame shown");
+}
+
+//! push the button, and wait for the UI to take it
+static void press(uint32_t button)
+{
+	button_push(button);
+	for(int i = 0; i < 20 && pushed_buttons; ++i) run_ms(1);
+	TEST_ASSERT_EQUAL(0, pushed_buttons);
+}
+
+static void close_all_screens()
+{
+	for(int i = 0; i < 16; ++i) screen_manager.pop();
+	screen_clock = nullptr;
+}
+
+static String to_pgm(frame_buffer_t & fb)
+{
+	// the same format as ui_dump_frame()
+	String s = "P2\n" + String(fb.get_width()) + " " + String(fb.get_height()) + "\n255\n";
+	for(int y = 0; y < fb.get_height(); ++y)
+	{
+		for(int x = 0; x < fb.get_width(); ++x)
+		{
+			s += String(fb.get_point(x, y));
+			s += x == fb.get_width() - 1 ? '\n' : ' ';
+		}
+	}
+	return s;
+}
+
+static String read_file(const String & name)
+{
+	String s;
+	FILE * f = fopen(name.c_str(), "rb");
+	if(!f) return s;
+	char buf[1024];
+	size_t n;
+	while((n = fread(buf, 1, sizeof(buf) - 1, f)) > 0) { buf[n] = 0; s += buf; }
+	fclose(f);
+	return s;
+}
+
+//! compare the displayed frame with the golden image of the screen
+static void assert_golden(const char * name)
+{
+	String path = String(GOLDEN_DIR) + name + ".pgm";
+	String actual = to_pgm(get_current_frame_buffer());
+	if(getenv("UPDATE_GOLDEN"))
+	{
+		FILE * f = fopen(path.c_str(), "wb");
+		TEST_ASSERT_TRUE_MESSAGE(f, path.c_str());
+		fwrite(actual.c_str(), 1, actual.length(), f);
+		fclose(f);
+		return;
+	}
+	String expected = read_file(path);
+	TEST_ASSERT_TRUE_MESSAGE(expected.length(), ("missing " + path).c_str());
+	if(expected == actual) return;
+
+	// report the first differing row
+	int row = 0;
+	for(const char * e = expected.c_str(), * a = actual.c_str(); *e && *e == *a; ++e, ++a)
+		if(*e == '\n') ++ row;
+	char message[160];
+	snprintf(message, sizeof(message), "%s differs at row %d", path.c_str(), row - 3); // 3 header lines
+	TEST_FAIL_MESSAGE(message);
+}
+
+//! show the screen, and compare it with its golden image
+static void assert_screen(screen_base_t * screen, std::function<void ()> operate = nullptr)
+{
+	const char * name = screen->get_name();
+	screen_manager.push(screen);
+	run_until_shown();
+	if(operate) operate();
+	run_until_shown();
+	assert_golden(name);
+}
+
+
+void setUp()
+{
+	pushed_buttons = 0;
+	WiFi.scanDelete();
+}
+
+void tearDown()
+{
+	close_all_screens();
+}
+
+
+static void test_screen_names_are_distinct()
+{
+	ip_addr_settings_t ip = wifi_get_ip_addr_settings();
+	std::vector<screen_base_t *> screens = {
+		new screen_message_box_t("Title", { "line" }),
+		new screen_led_test_t(),
+		new screen_ascii_editor_t("Title"),
+		new screen_ip_editor_t("Title"),
+		new screen_menu_t("Title", { "item" }),
+		new screen_menu_with_marquee_t("Title", "marquee", { "item" }),
+		new screen_dns_2_editor_t(ip),
+		new screen_dns_1_editor_t(ip),
+		new screen_net_mask_editor_t(ip),
+		new screen_ip_gateway_editor_t(ip),
+		new screen_ip_addr_editor_t(ip),
+		new screen_dhcp_mode_t(),
+		new screen_ap_pass_editor_t("home"),
+		new screen_ap_name_editor_t(),
+		new screen_ap_list_t(0),
+		new screen_wifi_scanning_t(),
+		new screen_wps_processing_t(),
+		new screen_wifi_setting_t(),
+		new screen_remote_fb_t(),
+		new screen_clock_t(),
+	};
+	std::set<std::string> names;
+	for(auto s : screens)
+	{
+		TEST_ASSERT_TRUE_MESSAGE(names.insert(s->get_name()).second, s->get_name());
+		delete s;
+	}
+}
+
+static void test_clock()
+{
+	wall_clock = 1700000000; // Tue Nov 14 22:13:20 2023 UTC
+	screen_clock = new screen_clock_t();
+	assert_screen(screen_clock);
+}
+
+static void test_message_box()
+{
+	assert_screen(new screen_message_box_t("Notice", { "Line one", "Line two" }));
+}
+
+static void test_wifi_setting()
+{
+	assert_screen(new screen_wifi_setting_t(), [] { press(BUTTON_DOWN); });
+}
+
+static void test_dhcp_mode()
+{
+	assert_screen(new screen_dhcp_mode_t(), [] { press(BUTTON_DOWN); });
+}
+
+static void test_wifi_scanning_then_ap_list()
+{
+	WiFi.native_scan_result = { { "cafe", -70 }, { "home", -40 }, { "a_very_long_network_name", -55 } };
+	assert_screen(new screen_wifi_scanning_t());
+
+	// the scan completes; the list replaces the screen, strongest first
+	WiFi.native_scan_state = WiFi.native_scan_result.size();
+	run_ms(60);
+	run_until_shown();
+	press(BUTTON_DOWN);
+	press(BUTTON_DOWN);
+	press(BUTTON_RIGHT); // scroll horizontally
+	run_until_shown();
+	assert_golden("ap_list");
+}
+
+static void test_ap_name_editor()
+{
+	assert_screen(new screen_ap_name_editor_t(), [] {
+		// move into the char list and insert "e"
+		press(BUTTON_DOWN);
+		press(BUTTON_DOWN);
+		press(BUTTON_DOWN);
+		press(BUTTON_RIGHT);
+		press(BUTTON_RIGHT);
+		press(BUTTON_OK);
+	});
+}
+
+static void test_ap_pass_editor()
+{
+	assert_screen(new screen_ap_pass_editor_t("home"), [] {
+		// scroll the char list to its end
+		for(int i = 0; i < 12; ++i) press(BUTTON_DOWN);
+	});
+}
+
+static void test_ip_editors()
+{
+	ip_addr_settings_t ip = wifi_get_ip_addr_settings();
+	assert_screen(new screen_ip_addr_editor_t(ip), [] {
+		press(BUTTON_DOWN);
+		press(BUTTON_RIGHT); // DEL
+	});
+	close_all_screens();
+	assert_screen(new screen_ip_gateway_editor_t(ip));
+	close_all_screens();
+	assert_screen(new screen_net_mask_editor_t(ip));
+	close_all_screens();
+	assert_screen(new screen_dns_1_editor_t(ip));
+	close_all_screens();
+	assert_screen(new screen_dns_2_editor_t(ip));
+}
+
+static void test_wps_processing()
+{
+	assert_screen(new screen_wps_processing_t());
+}
+
+
+int main(int argc, char ** argv)
+{
+	setenv("TZ", "UTC0", 1);
+	tzset();
+	native_set_millis(now_ms);
+	screen_manager.begin();
+
+	UNITY_BEGIN();
+	RUN_TEST(test_screen_names_are_distinct);
+	RUN_TEST(test_clock);
+	RUN_TEST(test_message_box);
+	RUN_TEST(test_wifi_setting);
+	RUN_TEST(test_dhcp_mode);
+	RUN_TEST(test_wifi_scanning_then_ap_list);
+	RUN_TEST(test_ap_name_editor);
+	RUN_TEST(test_ap_pass_editor);
+	RUN_TEST(test_ip_editors);
+	RUN_TEST(test_wps_processing);
+	ui_dump_draw_stats(); // draw time of each screen through the run
+	return UNITY_END();
+}